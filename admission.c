@@ -0,0 +1,242 @@
+/**
+ *  connection admission control and deadlines, see admission.h
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include "admission.h"
+#include "metrics.h"
+#include "logger.h"
+
+// the wheel and the counters, shared by the workers and the timer thread
+static pthread_mutex_t admission_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t wheel_changed;
+static timer_wheel wheel;
+static uint64_t wake_ns = UINT64_MAX; // < when the timer thread wakes up next
+static int admitted = 0;
+// connections per address, hashed: addresses sharing a bucket share the cap
+static int per_address[ADMISSION_BUCKETS];
+
+/*
+ *	Schedules the deadline of conn, waking the timer thread if it sleeps past it.
+ *	Called with the lock held.
+ */
+static void schedule(connection* conn, uint64_t deadline_ns)
+{
+	wheel_schedule(&wheel, &conn->timer, deadline_ns);
+	if (deadline_ns < wake_ns)
+	{
+		pthread_cond_signal(&wheel_changed);
+	}
+}
+
+/*
+ *	Sleeps until the next deadline or cascade of the wheel and runs what expired.
+ */
+static void* timer_main(void* arg)
+{
+	(void) arg;
+	pthread_mutex_lock(&admission_lock);
+	while (1)
+	{
+		wheel_advance(&wheel, metrics_now_ns());
+		wake_ns = wheel_next_expiry(&wheel);
+		if (wake_ns == UINT64_MAX)
+		{
+			pthread_cond_wait(&wheel_changed, &admission_lock);
+			continue;
+		}
+		struct timespec until = { wake_ns / 1000000000ull, wake_ns % 1000000000ull };
+		pthread_cond_timedwait(&wheel_changed, &admission_lock, &until);
+	}
+	return NULL;
+}
+
+int admission_start(void)
+{
+	// the deadlines are on the monotonic clock of metrics_now_ns()
+	pthread_condattr_t attr;
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&wheel_changed, &attr);
+	pthread_condattr_destroy(&attr);
+
+	wheel_init(&wheel, ADMISSION_TICK_NS, metrics_now_ns());
+	pthread_t thread;
+	int err = pthread_create(&thread, NULL, timer_main, NULL);
+	if (err != 0)
+	{
+		errno = err;
+		return -1;
+	}
+	pthread_detach(thread);
+	return 0;
+}
+
+/*
+ *	Shuts the connection down, the worker serving it gives up.
+ */
+static void evict(connection* conn, enum metrics_counter counter, const char* reason)
+{
+	metrics_add(counter, 1);
+	log_warn_limited("Evicting connection from %s: %s", conn->peer, reason);
+	shutdown(conn->fd, SHUT_RDWR);
+}
+
+/*
+ *	Runs on the timer thread, with the lock held.
+ */
+static void deadline_expired(wheel_timer* timer, uint64_t now_ns)
+{
+	connection* conn = (connection*) timer;
+	const server_config* config = conn->config;
+	if (conn->phase != CONN_TRANSFER)
+	{
+		evict(conn, M_EVICT_DEADLINE, conn->phase == CONN_HEADER ? "no request header in time" : "request not complete in time");
+		return;
+	}
+
+	uint64_t sent = atomic_load_explicit(&conn->sent, memory_order_relaxed);
+	if (sent != conn->checked_sent)
+	{
+		conn->checked_sent = sent;
+		conn->progress_ns = now_ns;
+	}
+	if (config->progress_timeout > 0 && now_ns - conn->progress_ns >= (uint64_t) config->progress_timeout * 1000000000ull)
+	{
+		evict(conn, M_EVICT_DEADLINE, "no transfer progress in time");
+		return;
+	}
+	if (config->min_rate > 0 && now_ns - conn->window_ns >= ADMISSION_RATE_WINDOW_NS)
+	{
+		double rate = (double) (sent - conn->window_sent) * 1e9 / (now_ns - conn->window_ns);
+		if (rate < config->min_rate)
+		{
+			evict(conn, M_EVICT_SLOW, "transfer under the minimum rate");
+			return;
+		}
+		conn->window_sent = sent;
+		conn->window_ns = now_ns;
+	}
+	// the timer thread computes its next wake up after this batch
+	wheel_schedule(&wheel, timer, now_ns + ADMISSION_CHECK_NS);
+}
+
+/*
+ *	Returns the counter bucket of the peer of fd, -1 if it has no IP address.
+ */
+static int address_bucket(int fd, char* peer)
+{
+	struct sockaddr_storage address;
+	socklen_t len = sizeof(address);
+	const unsigned char* bytes = NULL;
+	size_t count = 0;
+	strcpy(peer, "local");
+	if (getpeername(fd, (struct sockaddr*) &address, &len) == -1)
+	{
+		return -1;
+	}
+	if (address.ss_family == AF_INET)
+	{
+		struct sockaddr_in* v4 = (struct sockaddr_in*) &address;
+		inet_ntop(AF_INET, &v4->sin_addr, peer, INET6_ADDRSTRLEN);
+		bytes = (const unsigned char*) &v4->sin_addr;
+		count = sizeof(v4->sin_addr);
+	}
+	else if (address.ss_family == AF_INET6)
+	{
+		struct sockaddr_in6* v6 = (struct sockaddr_in6*) &address;
+		inet_ntop(AF_INET6, &v6->sin6_addr, peer, INET6_ADDRSTRLEN);
+		bytes = (const unsigned char*) &v6->sin6_addr;
+		count = sizeof(v6->sin6_addr);
+	}
+	else
+	{
+		return -1;
+	}
+
+	// FNV-1a
+	uint32_t hash = 2166136261u;
+	for (size_t i = 0; i < count; i++)
+	{
+		hash = (hash ^ bytes[i]) * 16777619u;
+	}
+	return (int) (hash % ADMISSION_BUCKETS);
+}
+
+int conn_admit(connection* conn, int fd, const server_config* config)
+{
+	memset(conn, 0, sizeof(connection));
+	wheel_timer_init(&conn->timer, deadline_expired);
+	conn->fd = fd;
+	conn->config = config;
+	conn->phase = CONN_HEADER;
+	conn->accepted_ns = metrics_now_ns();
+	conn->bucket = address_bucket(fd, conn->peer);
+
+	pthread_mutex_lock(&admission_lock);
+	if (config->max_connections > 0 && admitted >= config->max_connections)
+	{
+		pthread_mutex_unlock(&admission_lock);
+		metrics_add(M_REJECT_LIMIT, 1);
+		log_warn_limited("Rejecting connection from %s: %d connections already", conn->peer, config->max_connections);
+		return -1;
+	}
+	if (conn->bucket != -1 && config->per_ip > 0 && per_address[conn->bucket] >= config->per_ip)
+	{
+		pthread_mutex_unlock(&admission_lock);
+		metrics_add(M_REJECT_PER_IP, 1);
+		log_warn_limited("Rejecting connection from %s: %d connections from it already", conn->peer, config->per_ip);
+		return -1;
+	}
+	admitted++;
+	if (conn->bucket != -1)
+	{
+		per_address[conn->bucket]++;
+	}
+	if (config->header_timeout > 0)
+	{
+		schedule(conn, conn->accepted_ns + (uint64_t) config->header_timeout * 1000000000ull);
+	}
+	pthread_mutex_unlock(&admission_lock);
+	return 0;
+}
+
+void conn_enter(connection* conn, enum conn_phase phase)
+{
+	const server_config* config = conn->config;
+	uint64_t now = metrics_now_ns();
+	pthread_mutex_lock(&admission_lock);
+	conn->phase = phase;
+	wheel_cancel(&wheel, &conn->timer);
+	if (phase == CONN_REQUEST && config->request_timeout > 0)
+	{
+		schedule(conn, conn->accepted_ns + (uint64_t) config->request_timeout * 1000000000ull);
+	}
+	else if (phase == CONN_TRANSFER && (config->progress_timeout > 0 || config->min_rate > 0))
+	{
+		conn->checked_sent = atomic_load_explicit(&conn->sent, memory_order_relaxed);
+		conn->progress_ns = now;
+		conn->window_sent = conn->checked_sent;
+		conn->window_ns = now;
+		schedule(conn, now + ADMISSION_CHECK_NS);
+	}
+	pthread_mutex_unlock(&admission_lock);
+}
+
+void conn_release(connection* conn)
+{
+	pthread_mutex_lock(&admission_lock);
+	wheel_cancel(&wheel, &conn->timer);
+	admitted--;
+	if (conn->bucket != -1)
+	{
+		per_address[conn->bucket]--;
+	}
+	pthread_mutex_unlock(&admission_lock);
+}
@@ -0,0 +1,94 @@
+/**
+ *  connection admission control and deadlines
+ *
+ *  an accepted connection is admitted, or closed at once when the server
+ *  already serves limits.max_connections connections or limits.per_ip
+ *  connections from the same address. a worker only accepts once it is
+ *  free, so no more than server.workers connections are ever open: both
+ *  limits are at most the worker count, and only set below it do they keep
+ *  workers free for other clients. per_ip = 0 lets one address take every
+ *  worker. an admitted connection then has deadlines: its request header
+ *  must arrive within limits.header_timeout and the whole request within
+ *  limits.request_timeout, and a transfer is evicted once it made no
+ *  progress for limits.progress_timeout or fell under limits.min_rate over
+ *  ADMISSION_RATE_WINDOW_NS.
+ *
+ *  the deadlines live in a timing wheel (see timerwheel.h) run by a single
+ *  timer thread, which sleeps until the next one is due. evicting shuts the
+ *  socket down, which wakes the worker blocked on it; the worker then fails
+ *  the request and closes it as usual.
+ *  the transfer loops only add their sent bytes to the connection, the timer
+ *  thread notices the progress itself.
+ */
+
+#ifndef ADMISSION_H
+#define ADMISSION_H
+
+#include <stdint.h>
+#include <stdatomic.h>
+#include <arpa/inet.h>
+#include "timerwheel.h"
+#include "config.h"
+
+#define ADMISSION_TICK_NS 10000000ull // < resolution of the deadlines
+#define ADMISSION_CHECK_NS 1000000000ull // < how often a transfer is checked
+#define ADMISSION_RATE_WINDOW_NS 10000000000ull // < limits.min_rate is averaged over this
+#define ADMISSION_BUCKETS 4096 // < per address connection counters
+
+enum conn_phase
+{
+	CONN_HEADER, // < waiting for the request header
+	CONN_REQUEST, // < waiting for the rest of the request
+	CONN_TRANSFER // < replying
+};
+
+typedef struct
+{
+	wheel_timer timer;
+	int fd;
+	int bucket; // < per address counter, -1 for Unix domain peers
+	enum conn_phase phase;
+	const server_config* config; // < the limits the connection was admitted with
+	uint64_t accepted_ns;
+	_Atomic uint64_t sent; // < written by the worker only
+	// timer thread only
+	uint64_t checked_sent;
+	uint64_t progress_ns;
+	uint64_t window_sent;
+	uint64_t window_ns;
+	char peer[INET6_ADDRSTRLEN];
+} connection;
+
+/*
+ *	Starts the timer thread.
+ *	Returns 0 on success, -1 on error.
+ */
+int admission_start(void);
+
+/*
+ *	Admits the accepted connection fd under the limits of config and starts its header deadline.
+ *	Returns 0 if admitted, -1 if the caller should close it right away.
+ */
+int conn_admit(connection* conn, int fd, const server_config* config);
+
+/*
+ *	Moves conn on to phase, with the deadline of that phase.
+ */
+void conn_enter(connection* conn, enum conn_phase phase);
+
+/*
+ *	Records bytes more sent on conn.
+ */
+static inline void conn_progress(connection* conn, uint64_t bytes)
+{
+	uint64_t sent = atomic_load_explicit(&conn->sent, memory_order_relaxed);
+	atomic_store_explicit(&conn->sent, sent + bytes, memory_order_relaxed);
+}
+
+/*
+ *	Cancels the deadlines of conn and gives its place back. Must come before closing fd,
+ *		the timer thread may shut it down until then.
+ */
+void conn_release(connection* conn);
+
+#endif
@@ -0,0 +1,1203 @@
+/**
+ *  loopback benchmark driver
+ *  1. generate synthetic files of the requested sizes in a scratch directory
+ *  2. start the server in that directory
+ *  3. for every file size, run CLIENTS threads that download the files
+ *     back to back, timing every request (connect to last byte)
+ *  4. print the results as JSON on stdout, one object per file size
+ *
+ *  usage: bench [-s SIZES] [-t TRANSPORTS] [-M MODES] [-p PROFILES] [-N NETEM] [-c CLIENTS] [-n REQUESTS] [-f FILES] [-S SERVER] [-C] [-B SIZE] [-w WRITE] [-y POLICY] [-U MS] [-P] [-k]
+ *      SIZES       comma separated file sizes in bytes, K/M/G suffixes allowed
+ *      TRANSPORTS  comma separated list of tcp (loopback), unix (Unix domain socket),
+ *                  fd (file descriptor passing over the Unix socket)
+ *                  and stream (unframed stream with a digest trailer, over loopback)
+ *      MODES       comma separated server serving modes (read, mmap, sendfile),
+ *                  the server is restarted for each one. a mode may be followed by
+ *                  more server arguments, separated by spaces ("read -R 0")
+ *      PROFILES    comma separated socket profiles (see socktune.h) of both ends of
+ *                  the TCP connections, the server is restarted for each one
+ *      NETEM       impairs the loopback interface for the run with
+ *                  "tc qdisc replace dev lo root netem NETEM" ("delay 25ms loss 0.1%"),
+ *                  removed again at the end. needs root, see make bench_netem
+ *      CLIENTS     concurrent client threads
+ *      REQUESTS    requests per client thread for every size
+ *      FILES       distinct files generated for every size
+ *      SERVER      server binary to start
+ *      -C          cold cache: evict every file from the page cache before it is
+ *                  requested (outside the timed part)
+ *      -B SIZE     background load: one more client streams a file of SIZE bytes,
+ *                  evicted before every pass, for the whole of every phase.
+ *                  cache_hit_ratio then shows how much of the measured files it
+ *                  pushed out of the page cache
+ *      -w WRITE    none (default) discards the received data, inline writes it to
+ *                  disk on the receiving thread, pipeline through the client
+ *                  write-behind pipeline. write_overlap is the share of the disk
+ *                  time hidden behind the network reads
+ *      -y POLICY   fsync policy of the written files: none (default), end, periodic
+ *      -U MS       hot restarts: every MS milliseconds of every phase, a new server takes
+ *                  the listeners over from the running one (server -T), which drains and
+ *                  exits. errors must stay at 0 across the restarts
+ *      -P          pack: the files are generated below bench/ and packed into bench.pack
+ *                  (packbuild, next to SERVER). a mode with "-o pack.files=bench.pack"
+ *                  serves them from the archive, one without from the loose files, under
+ *                  the same names. -C only evicts the loose files
+ *      -k          keep the scratch directory
+ */
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <limits.h>
+#include <stdbool.h>
+#include <signal.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/resource.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/un.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "message.h"
+#include "metrics.h"
+#include "netio.h"
+#include "digest.h"
+#include "pool.h"
+#include "writebehind.h"
+#include "outfile.h"
+#include "socktune.h"
+
+#define SERVER_IP "127.0.0.1"
+#define SERVER_PORT 8080
+#define DIVISOR 32
+#define MAX_SIZES 16
+#define SOCKET_NAME "pad.sock"
+#define HANDOFF_NAME "pad.handoff"
+#define MAX_MODES 8
+#define MAX_PROFILES 8
+#define MAX_SERVER_ARGS 16
+#define BACKGROUND_NAME "bench_background"
+#define PACK_DIR "bench"
+#define PACK_NAME "bench.pack"
+
+enum transport
+{
+	T_TCP,
+	T_UNIX,
+	T_FD,
+	T_STREAM,
+	T_COUNT
+};
+
+static const char* transport_names[T_COUNT] = { "tcp", "unix", "fd", "stream" };
+
+// Unix socket and handoff control socket of the server, inside the scratch directory
+static char unix_path[sizeof(((struct sockaddr_un*) 0)->sun_path)];
+static char handoff_path[sizeof(((struct sockaddr_un*) 0)->sun_path)];
+static char scratch_dir[] = "/tmp/pad-bench-XXXXXX";
+static bool cold_cache = false;
+static bool packed = false;
+static uint64_t background_size = 0;
+static _Atomic bool background_running = false;
+
+enum write_mode
+{
+	W_NONE,
+	W_INLINE,
+	W_PIPELINE,
+	W_COUNT
+};
+
+static const char* write_mode_names[W_COUNT] = { "none", "inline", "pipeline" };
+static enum write_mode write_mode = W_NONE;
+static enum fsync_policy fsync_policy = FSYNC_NONE;
+static const char* fsync_policy_names[] = { "none", "end", "periodic" };
+static buffer_pool* block_pool = NULL;
+
+// socket options of the benchmark TCP connections, the server gets the same profile
+static socket_profile tcp_profile = { .name = "default" };
+
+// loopback impairment of the run (-N), NULL = none
+static const char* netem = NULL;
+
+// hot restarts during the phases (-U), 0 = none
+static int restart_interval_ms = 0;
+static _Atomic bool restarts_running = false;
+
+/*
+ *	The server of the current mode. A restarter replaces pid during a phase,
+ *		the other threads only read it once the restarter is joined.
+ */
+typedef struct
+{
+	const char* path;
+	const char* dir;
+	const char* mode;
+	pid_t pid;
+	int restarts;
+	int failures;
+} server_process;
+
+typedef struct
+{
+	char** files;
+	int file_count;
+	int requests;
+	int id;
+	enum transport transport;
+	histogram* latency;
+	uint64_t bytes;
+	uint64_t errors;
+	uint64_t resident_pages; // < of the requested files, sampled before each request
+	uint64_t total_pages;
+	write_stats writes; // < summed over every request
+} worker;
+
+/*
+ *	Parses a byte count with an optional K/M/G suffix.
+ *	Returns 0 on error.
+ */
+static uint64_t parse_size(const char* text)
+{
+	char* end = NULL;
+	uint64_t value = strtoull(text, &end, 10);
+	switch (*end)
+	{
+		case 'G': case 'g': value <<= 10; // fall through
+		case 'M': case 'm': value <<= 10; // fall through
+		case 'K': case 'k': value <<= 10; end++; break;
+		case '\0': break;
+		default: return 0;
+	}
+	return *end == '\0' ? value : 0;
+}
+
+/*
+ *	Writes size bytes of pseudo random data in path.
+ *	Returns 0 on success, -1 on error.
+ */
+static int generate_file(const char* path, uint64_t size, uint64_t seed)
+{
+	FILE* file = fopen(path, "w");
+	if (file == NULL)
+	{
+		perror("Could not create benchmark file");
+		return -1;
+	}
+
+	uint64_t state = seed * 0x9E3779B97F4A7C15ull + 1;
+	uint64_t chunk[512];
+	while (size > 0)
+	{
+		for (int i = 0; i < 512; i++)
+		{
+			// xorshift64
+			state ^= state << 13;
+			state ^= state >> 7;
+			state ^= state << 17;
+			chunk[i] = state;
+		}
+		size_t len = size < sizeof(chunk) ? size : sizeof(chunk);
+		if (fwrite(chunk, 1, len, file) != len)
+		{
+			perror("Could not write benchmark file");
+			fclose(file);
+			return -1;
+		}
+		size -= len;
+	}
+	// dirty pages cannot be evicted, cold cache runs need the data on disk
+	if (cold_cache && (fflush(file) != 0 || fdatasync(fileno(file)) == -1))
+	{
+		perror("Could not flush benchmark file");
+		fclose(file);
+		return -1;
+	}
+	return fclose(file);
+}
+
+static int connect_server(enum transport transport)
+{
+	if (transport == T_UNIX || transport == T_FD)
+	{
+		struct sockaddr_un unix_addr;
+		bzero(&unix_addr, sizeof(struct sockaddr_un));
+		unix_addr.sun_family = AF_UNIX;
+		strcpy(unix_addr.sun_path, unix_path);
+
+		int socket_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+		if (socket_fd != -1 && connect(socket_fd, (struct sockaddr*) &unix_addr, sizeof(unix_addr)) == -1)
+		{
+			close(socket_fd);
+			return -1;
+		}
+		return socket_fd;
+	}
+
+	struct sockaddr_in server_addr;
+	bzero(&server_addr, sizeof(struct sockaddr_in));
+	server_addr.sin_family = AF_INET;
+	server_addr.sin_port = htons(SERVER_PORT);
+	inet_aton(SERVER_IP, &server_addr.sin_addr);
+
+	int socket_fd = socket(AF_INET, SOCK_STREAM, 0);
+	if (socket_fd == -1)
+	{
+		return -1;
+	}
+	// an option the kernel refuses is left at its default, the profile still names the run
+	const char* failed = NULL;
+	socket_tune(socket_fd, &tcp_profile, &failed);
+	if (connect(socket_fd, (struct sockaddr*) &server_addr, sizeof(server_addr)) == -1)
+	{
+		close(socket_fd);
+		return -1;
+	}
+	return socket_fd;
+}
+
+/*
+ *	Receives a passed file descriptor and reads the whole file through it.
+ *	Returns the number of bytes read, or -1 on error.
+ */
+static int64_t read_passed_file(int socket_fd, char* buffer)
+{
+	message_header header;
+	struct iovec iov = { &header, sizeof(message_header) };
+	union
+	{
+		char buffer[CMSG_SPACE(sizeof(int))];
+		struct cmsghdr align;
+	} control;
+	struct msghdr msg;
+	bzero(&msg, sizeof(msg));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control.buffer;
+	msg.msg_controllen = sizeof(control.buffer);
+
+	struct cmsghdr* cmsg;
+	if (recvmsg(socket_fd, &msg, MSG_CMSG_CLOEXEC) != sizeof(message_header)
+		|| header.message_size == 0 || (cmsg = CMSG_FIRSTHDR(&msg)) == NULL || cmsg->cmsg_type != SCM_RIGHTS)
+	{
+		return -1;
+	}
+	int file_fd;
+	memcpy(&file_fd, CMSG_DATA(cmsg), sizeof(int));
+
+	uint64_t received_size = 0;
+	while (received_size < header.message_size)
+	{
+		ssize_t read_size = read(file_fd, buffer, MAX_SEGMENT_SIZE);
+		if (read_size <= 0)
+		{
+			close(file_fd);
+			return -1;
+		}
+		received_size += read_size;
+	}
+	close(file_fd);
+	return received_size;
+}
+
+/*
+ *	Reads an unframed stream of filesize bytes and checks it against the digest trailer.
+ *	Returns the number of bytes read, or -1 on error.
+ */
+static int64_t read_stream(int socket_fd, char* buffer, uint64_t filesize, write_behind* writer)
+{
+	digest_state digest;
+	digest_init(&digest, 0);
+	uint64_t received_size = 0;
+	while (received_size < filesize)
+	{
+		size_t len = filesize - received_size < MAX_SEGMENT_SIZE ? filesize - received_size : MAX_SEGMENT_SIZE;
+		char* target = writer != NULL ? wb_reserve(writer, len) : buffer;
+		ssize_t read_size = target != NULL ? read(socket_fd, target, len) : -1;
+		if (read_size <= 0)
+		{
+			return -1;
+		}
+		digest_update(&digest, target, read_size);
+		if (writer != NULL)
+		{
+			wb_commit(writer, read_size);
+		}
+		received_size += read_size;
+	}
+
+	message_header header;
+	uint64_t expected;
+	if (read_full(socket_fd, &header, sizeof(header)) <= 0 || header.message_type != MSG_STREAM
+		|| header.message_size != DIGEST_TRAILER_SIZE || read_full(socket_fd, &expected, DIGEST_TRAILER_SIZE) <= 0
+		|| expected != digest_final(&digest))
+	{
+		return -1;
+	}
+	return received_size;
+}
+
+/*
+ *	Downloads one file, verifying the checksum of every block.
+ *	The data goes to writer, or is discarded if writer is NULL (always for T_FD).
+ *	Returns the number of bytes received, or -1 on error.
+ */
+static int64_t fetch_file(const char* filename, char* buffer, enum transport transport, write_behind* writer)
+{
+	int socket_fd = connect_server(transport);
+	if (socket_fd == -1)
+	{
+		return -1;
+	}
+
+	message_header header;
+	header.message_type = transport == T_FD ? MSG_FD : transport == T_STREAM ? MSG_STREAM : MSG_FILE;
+	header.message_size = strlen(filename) + 1;
+	if (write_full(socket_fd, &header, sizeof(header)) == -1
+		|| write_full(socket_fd, filename, header.message_size) == -1)
+	{
+		close(socket_fd);
+		return -1;
+	}
+	if (transport == T_FD)
+	{
+		int64_t received = read_passed_file(socket_fd, buffer);
+		close(socket_fd);
+		return received;
+	}
+	if (read_full(socket_fd, &header, sizeof(header)) <= 0
+		|| header.message_type != MSG_FILE || header.message_size == 0)
+	{
+		close(socket_fd);
+		return -1;
+	}
+
+	uint64_t filesize = header.message_size;
+	if (transport == T_STREAM)
+	{
+		int64_t received = read_stream(socket_fd, buffer, filesize, writer);
+		close(socket_fd);
+		return received;
+	}
+
+	uint64_t received_size = 0;
+	while (received_size < filesize)
+	{
+		if (read_full(socket_fd, &header, sizeof(header)) <= 0
+			|| header.message_size == 0 || header.message_size > MAX_SEGMENT_SIZE)
+		{
+			close(socket_fd);
+			return -1;
+		}
+		char* segment = writer != NULL ? wb_reserve(writer, header.message_size + 1) : buffer;
+		if (segment == NULL || read_full(socket_fd, segment, header.message_size + 1) <= 0)
+		{
+			close(socket_fd);
+			return -1;
+		}
+
+		int checksum = 0;
+		for (uint32_t i = 0; i < header.message_size; i++)
+		{
+			checksum += (int) segment[i];
+		}
+		checksum = checksum % DIVISOR;
+		if (checksum != (int) segment[header.message_size])
+		{
+			close(socket_fd);
+			return -1;
+		}
+		if (writer != NULL)
+		{
+			wb_commit(writer, header.message_size);
+		}
+		received_size += header.message_size;
+	}
+
+	close(socket_fd);
+	return received_size;
+}
+
+/*
+ *	Drops the clean pages of a scratch file from the page cache.
+ */
+static void evict_file(const char* filename)
+{
+	char path[PATH_MAX];
+	snprintf(path, sizeof(path), "%s/%s", scratch_dir, filename);
+	int fd = open(path, O_RDONLY);
+	if (fd != -1)
+	{
+		posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+		close(fd);
+	}
+}
+
+/*
+ *	Adds the number of pages of a scratch file and how many of them are in the page cache.
+ */
+static void count_resident_pages(const char* filename, uint64_t* resident, uint64_t* total)
+{
+	char path[PATH_MAX];
+	snprintf(path, sizeof(path), "%s/%s", scratch_dir, filename);
+	int fd = open(path, O_RDONLY);
+	struct stat statbuf;
+	if (fd == -1 || fstat(fd, &statbuf) == -1 || statbuf.st_size == 0)
+	{
+		if (fd != -1)
+		{
+			close(fd);
+		}
+		return;
+	}
+
+	// mincore() on a mapping that is never touched does not fault anything in
+	long page = sysconf(_SC_PAGESIZE);
+	size_t pages = (statbuf.st_size + page - 1) / page;
+	void* mapping = mmap(NULL, statbuf.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	unsigned char* vec = (unsigned char*) malloc(pages);
+	if (mapping != MAP_FAILED && vec != NULL && mincore(mapping, statbuf.st_size, vec) == 0)
+	{
+		for (size_t i = 0; i < pages; i++)
+		{
+			*resident += vec[i] & 1;
+		}
+		*total += pages;
+	}
+	free(vec);
+	if (mapping != MAP_FAILED)
+	{
+		munmap(mapping, statbuf.st_size);
+	}
+	close(fd);
+}
+
+/*
+ *	Downloads one file into the output file of the worker, through a write pipeline
+ *		of the benchmark write mode, published with the benchmark fsync policy,
+ *		and adds the pipeline statistics to the worker.
+ *	Returns the number of bytes received, or -1 on error.
+ */
+static int64_t fetch_and_write(worker* self, const char* filename, char* buffer)
+{
+	char name[32];
+	snprintf(name, sizeof(name), "out_%d", self->id);
+	output_file out;
+	if (output_open(&out, scratch_dir, name) == -1)
+	{
+		return -1;
+	}
+
+	// the size is only known after the request, so this does not preallocate
+	write_behind* writer = wb_open(out.fd, 0, block_pool, write_mode == W_PIPELINE,
+		fsync_policy == FSYNC_PERIODIC ? FSYNC_PERIOD : 0);
+	if (writer == NULL)
+	{
+		output_discard(&out);
+		return -1;
+	}
+	int64_t received = fetch_file(filename, buffer, self->transport, writer);
+	write_stats stats;
+	if (wb_close(writer, &stats) == -1)
+	{
+		received = -1;
+	}
+
+	// the final sync is part of the disk time, the receiver waits for it
+	uint64_t publish_start = metrics_now_ns();
+	if (received == -1)
+	{
+		output_discard(&out);
+	}
+	else if (output_publish(&out, fsync_policy, false) == -1)
+	{
+		received = -1;
+	}
+	uint64_t publish_ns = metrics_now_ns() - publish_start;
+
+	self->writes.bytes += stats.bytes;
+	self->writes.wall_ns += stats.wall_ns + publish_ns;
+	self->writes.disk_ns += stats.disk_ns + publish_ns;
+	self->writes.stall_ns += stats.stall_ns;
+	self->writes.drain_ns += stats.drain_ns + publish_ns;
+	return received;
+}
+
+static void* run_worker(void* arg)
+{
+	worker* self = (worker*) arg;
+	char* buffer = (char*) malloc(MAX_SEGMENT_SIZE + 1);
+	if (buffer == NULL)
+	{
+		self->errors = self->requests;
+		return NULL;
+	}
+
+	for (int i = 0; i < self->requests; i++)
+	{
+		const char* filename = self->files[(self->id + i) % self->file_count];
+		if (cold_cache)
+		{
+			evict_file(filename);
+		}
+		count_resident_pages(filename, &self->resident_pages, &self->total_pages);
+		uint64_t start = metrics_now_ns();
+		int64_t received = write_mode != W_NONE && self->transport != T_FD
+			? fetch_and_write(self, filename, buffer)
+			: fetch_file(filename, buffer, self->transport, NULL);
+		if (received == -1)
+		{
+			self->errors++;
+			continue;
+		}
+		hist_record(self->latency, metrics_now_ns() - start);
+		self->bytes += received;
+	}
+
+	free(buffer);
+	return NULL;
+}
+
+/*
+ *	Streams the background file over and over, from disk every time, until the phase ends.
+ */
+static void* run_background(void* arg)
+{
+	char* buffer = (char*) malloc(MAX_SEGMENT_SIZE + 1);
+	while (buffer != NULL && atomic_load(&background_running))
+	{
+		evict_file(BACKGROUND_NAME);
+		fetch_file(BACKGROUND_NAME, buffer, T_STREAM, NULL);
+	}
+	free(buffer);
+	return NULL;
+}
+
+/*
+ *	Returns the user + system CPU seconds consumed so far by process pid, or -1 on error.
+ */
+static double process_cpu_seconds(pid_t pid)
+{
+	char path[64];
+	snprintf(path, sizeof(path), "/proc/%d/stat", (int) pid);
+	FILE* file = fopen(path, "r");
+	if (file == NULL)
+	{
+		return -1;
+	}
+	char line[1024];
+	char* ok = fgets(line, sizeof(line), file);
+	fclose(file);
+	if (ok == NULL)
+	{
+		return -1;
+	}
+
+	// fields after the command name, which may itself contain spaces
+	char* rest = strrchr(line, ')');
+	unsigned long utime = 0, stime = 0;
+	if (rest == NULL || sscanf(rest + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu", &utime, &stime) != 2)
+	{
+		return -1;
+	}
+	return (double) (utime + stime) / sysconf(_SC_CLK_TCK);
+}
+
+static double self_cpu_seconds()
+{
+	struct rusage usage;
+	getrusage(RUSAGE_SELF, &usage);
+	return usage.ru_utime.tv_sec + usage.ru_utime.tv_usec / 1e6
+		+ usage.ru_stime.tv_sec + usage.ru_stime.tv_usec / 1e6;
+}
+
+/*
+ *	Sets the netem qdisc of the loopback interface to impairment, or removes it if NULL.
+ *	Returns 0 on success, -1 on error.
+ */
+static int set_netem(const char* impairment)
+{
+	char copy[256];
+	snprintf(copy, sizeof(copy), "%s", impairment != NULL ? impairment : "");
+	char* args[MAX_SERVER_ARGS + 8] = { "tc", "qdisc", impairment != NULL ? "replace" : "del", "dev", "lo", "root" };
+	int arg_count = 6;
+	if (impairment != NULL)
+	{
+		args[arg_count++] = "netem";
+		char* save = NULL;
+		for (char* token = strtok_r(copy, " ", &save); token != NULL && arg_count < MAX_SERVER_ARGS + 7; token = strtok_r(NULL, " ", &save))
+		{
+			args[arg_count++] = token;
+		}
+	}
+	args[arg_count] = NULL;
+
+	pid_t pid = fork();
+	if (pid == -1)
+	{
+		perror("fork failed");
+		return -1;
+	}
+	if (pid == 0)
+	{
+		execvp("tc", args);
+		_exit(EXIT_FAILURE);
+	}
+	int status;
+	if (waitpid(pid, &status, 0) == -1 || !WIFEXITED(status) || WEXITSTATUS(status) != 0)
+	{
+		fprintf(stderr, "tc could not %s the netem qdisc of lo\n", impairment != NULL ? "set" : "remove");
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ *	Packs dir/PACK_DIR into dir/PACK_NAME with the packbuild next to server_path.
+ *	Returns 0 on success, -1 on error.
+ */
+static int build_pack(const char* server_path, const char* dir)
+{
+	char packbuild[PATH_MAX], source[PATH_MAX], output[PATH_MAX];
+	// server_path is absolute, see realpath() in main
+	snprintf(packbuild, sizeof(packbuild), "%.*s/packbuild", (int) (strrchr(server_path, '/') - server_path), server_path);
+	snprintf(source, sizeof(source), "%s/%s", dir, PACK_DIR);
+	snprintf(output, sizeof(output), "%s/%s", dir, PACK_NAME);
+	char* args[] = { packbuild, source, output, NULL };
+
+	pid_t pid = fork();
+	if (pid == -1)
+	{
+		perror("fork failed");
+		return -1;
+	}
+	if (pid == 0)
+	{
+		// stdout carries the results
+		dup2(STDERR_FILENO, STDOUT_FILENO);
+		execv(packbuild, args);
+		_exit(EXIT_FAILURE);
+	}
+	int status;
+	if (waitpid(pid, &status, 0) == -1 || !WIFEXITED(status) || WEXITSTATUS(status) != 0)
+	{
+		fprintf(stderr, "%s could not build the pack\n", packbuild);
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ *	Forks the server inside dir in serving mode mode, with its output discarded.
+ *	mode may carry more server arguments after the mode name.
+ *	take_over starts it as the replacement of the running one.
+ *	Returns the pid of the server, or -1 on error.
+ */
+static pid_t spawn_server(const char* server_path, const char* dir, const char* mode, bool take_over)
+{
+	char mode_copy[512];
+	snprintf(mode_copy, sizeof(mode_copy), "%s", mode);
+	char* args[MAX_SERVER_ARGS + 9];
+	int arg_count = 0;
+	args[arg_count++] = (char*) server_path;
+	args[arg_count++] = "-u";
+	args[arg_count++] = unix_path;
+	args[arg_count++] = "-H";
+	args[arg_count++] = handoff_path;
+	if (take_over)
+	{
+		args[arg_count++] = "-T";
+	}
+	args[arg_count++] = "-M";
+	char* save = NULL;
+	for (char* token = strtok_r(mode_copy, " ", &save); token != NULL && arg_count < MAX_SERVER_ARGS + 8; token = strtok_r(NULL, " ", &save))
+	{
+		args[arg_count++] = token;
+	}
+	args[arg_count] = NULL;
+
+	pid_t pid = fork();
+	if (pid == -1)
+	{
+		perror("fork failed");
+		return -1;
+	}
+	if (pid == 0)
+	{
+		int devnull = open("/dev/null", O_WRONLY);
+		if (chdir(dir) == -1 || devnull == -1)
+		{
+			_exit(EXIT_FAILURE);
+		}
+		dup2(devnull, STDOUT_FILENO);
+		dup2(devnull, STDERR_FILENO);
+		execv(server_path, args);
+		_exit(EXIT_FAILURE);
+	}
+	return pid;
+}
+
+/*
+ *	Starts the server inside dir in serving mode mode, see spawn_server().
+ *	Returns the pid of the server once it answers requests, or -1 on error.
+ */
+static pid_t start_server(const char* server_path, const char* dir, const char* mode)
+{
+	pid_t pid = spawn_server(server_path, dir, mode, false);
+	if (pid == -1)
+	{
+		return -1;
+	}
+
+	// wait until the server answers a metrics request
+	for (int attempt = 0; attempt < 200; attempt++)
+	{
+		if (waitpid(pid, NULL, WNOHANG) == pid)
+		{
+			fprintf(stderr, "Server exited during startup (is port %d in use?)\n", SERVER_PORT);
+			return -1;
+		}
+		int socket_fd = connect_server(T_UNIX);
+		if (socket_fd != -1)
+		{
+			message_header header = { MSG_METRICS, 0 };
+			int ready = write_full(socket_fd, &header, sizeof(header)) == 0
+				&& read_full(socket_fd, &header, sizeof(header)) > 0;
+			close(socket_fd);
+			if (ready)
+			{
+				return pid;
+			}
+		}
+		usleep(10000);
+	}
+
+	fprintf(stderr, "Server did not come up\n");
+	kill(pid, SIGKILL);
+	waitpid(pid, NULL, 0);
+	return -1;
+}
+
+/*
+ *	Replaces the server every restart_interval_ms until the phase ends: the new one takes
+ *		the listeners over, the old one must then drain and exit on its own.
+ */
+static void* run_restarts(void* arg)
+{
+	server_process* server = (server_process*) arg;
+	while (atomic_load(&restarts_running))
+	{
+		usleep(restart_interval_ms * 1000);
+		pid_t next = spawn_server(server->path, server->dir, server->mode, true);
+		if (next == -1)
+		{
+			server->failures++;
+			continue;
+		}
+
+		// whichever exits first tells how it went, a failed replacement leaves the old one serving
+		int status = 0;
+		while (1)
+		{
+			if (waitpid(next, &status, WNOHANG) == next)
+			{
+				server->failures++;
+				break;
+			}
+			if (waitpid(server->pid, &status, WNOHANG) == server->pid)
+			{
+				server->failures += !WIFEXITED(status) || WEXITSTATUS(status) != 0;
+				server->restarts++;
+				server->pid = next;
+				break;
+			}
+			usleep(1000);
+		}
+	}
+	return NULL;
+}
+
+/*
+ *	Runs one benchmark phase and prints its JSON object.
+ *	Returns 0 on success, -1 on error.
+ */
+static int run_phase(uint64_t size, enum transport transport, const char* mode, char** files, int file_count, int clients, int requests, server_process* server, bool first)
+{
+	worker* workers = (worker*) calloc(clients, sizeof(worker));
+	pthread_t* threads = (pthread_t*) calloc(clients, sizeof(pthread_t));
+	histogram* total = (histogram*) calloc(1, sizeof(histogram));
+	if (workers == NULL || threads == NULL || total == NULL)
+	{
+		fprintf(stderr, "Not enough memory for the benchmark workers\n");
+		free(workers);
+		free(threads);
+		free(total);
+		return -1;
+	}
+
+	pthread_t background;
+	bool background_started = false;
+	if (background_size > 0)
+	{
+		atomic_store(&background_running, true);
+		background_started = pthread_create(&background, NULL, run_background, NULL) == 0;
+	}
+
+	pid_t server_pid = server->pid;
+	int restarts_start = server->restarts;
+	int failures_start = server->failures;
+	pthread_t restarter;
+	bool restarter_started = false;
+	if (restart_interval_ms > 0)
+	{
+		atomic_store(&restarts_running, true);
+		restarter_started = pthread_create(&restarter, NULL, run_restarts, server) == 0;
+	}
+
+	double server_cpu_start = process_cpu_seconds(server_pid);
+	double client_cpu_start = self_cpu_seconds();
+	uint64_t start = metrics_now_ns();
+
+	int started = 0;
+	for (int i = 0; i < clients; i++)
+	{
+		workers[i].files = files;
+		workers[i].file_count = file_count;
+		workers[i].requests = requests;
+		workers[i].id = i;
+		workers[i].transport = transport;
+		workers[i].latency = (histogram*) calloc(1, sizeof(histogram));
+		if (workers[i].latency == NULL || pthread_create(&threads[i], NULL, run_worker, &workers[i]) != 0)
+		{
+			free(workers[i].latency);
+			break;
+		}
+		started++;
+	}
+
+	uint64_t bytes = 0, errors = 0, completed = 0, resident_pages = 0, total_pages = 0;
+	write_stats writes = { 0 };
+	for (int i = 0; i < started; i++)
+	{
+		pthread_join(threads[i], NULL);
+		hist_merge(total, workers[i].latency);
+		bytes += workers[i].bytes;
+		errors += workers[i].errors;
+		resident_pages += workers[i].resident_pages;
+		total_pages += workers[i].total_pages;
+		writes.disk_ns += workers[i].writes.disk_ns;
+		writes.stall_ns += workers[i].writes.stall_ns;
+		writes.drain_ns += workers[i].writes.drain_ns;
+		free(workers[i].latency);
+	}
+	completed = atomic_load(&total->count);
+
+	double seconds = (metrics_now_ns() - start) / 1e9;
+	double client_cpu = self_cpu_seconds() - client_cpu_start;
+	double gigabytes = bytes / 1e9;
+
+	if (restarter_started)
+	{
+		atomic_store(&restarts_running, false);
+		pthread_join(restarter, NULL);
+	}
+	// the CPU time of replaced servers is gone with them
+	double server_cpu = server->pid == server_pid ? process_cpu_seconds(server_pid) - server_cpu_start : 0.0;
+
+	if (background_started)
+	{
+		atomic_store(&background_running, false);
+		pthread_join(background, NULL);
+	}
+	if (write_mode != W_NONE && fsync_policy != FSYNC_NONE)
+	{
+		output_sync_dir(scratch_dir);
+	}
+
+	printf("%s    {\"transport\": \"%s\", \"server_mode\": \"%s\", \"file_size\": %llu, \"clients\": %d, \"requests\": %llu, \"errors\": %llu,"
+		" \"seconds\": %.6f, \"mb_per_second\": %.3f, \"requests_per_second\": %.3f,"
+		" \"latency_us\": {\"p50\": %.3f, \"p99\": %.3f, \"p999\": %.3f, \"max\": %.3f},"
+		" \"server_cpu_seconds_per_gb\": %.6f, \"client_cpu_seconds_per_gb\": %.6f, \"cache_hit_ratio\": %.4f,"
+		" \"write_mode\": \"%s\", \"fsync_policy\": \"%s\", \"disk_seconds\": %.6f, \"write_stall_seconds\": %.6f, \"write_overlap\": %.4f,"
+		" \"restarts\": %d, \"restart_failures\": %d, \"socket_profile\": \"%s\", \"netem\": \"%s\"}",
+		first ? "" : ",\n", transport_names[transport], mode,
+		(unsigned long long) size, started, (unsigned long long) completed, (unsigned long long) errors,
+		seconds, bytes / 1e6 / seconds, completed / seconds,
+		hist_percentile(total, 50) / 1e3, hist_percentile(total, 99) / 1e3,
+		hist_percentile(total, 99.9) / 1e3, atomic_load(&total->max) / 1e3,
+		gigabytes > 0 ? server_cpu / gigabytes : 0.0, gigabytes > 0 ? client_cpu / gigabytes : 0.0,
+		total_pages > 0 ? (double) resident_pages / total_pages : 0.0,
+		write_mode_names[write_mode], fsync_policy_names[fsync_policy], writes.disk_ns / 1e9, (writes.stall_ns + writes.drain_ns) / 1e9, wb_overlap(&writes),
+		server->restarts - restarts_start, server->failures - failures_start, tcp_profile.name, netem != NULL ? netem : "none");
+	fflush(stdout);
+
+	free(workers);
+	free(threads);
+	free(total);
+	return started == clients ? 0 : -1;
+}
+
+int main(int argc, char* argv[])
+{
+	char sizes_arg[256] = "4K,64K,1M";
+	char transports_arg[64] = "tcp";
+	char modes_arg[256] = "read";
+	char profiles_arg[256] = "default";
+	int clients = 4;
+	int requests = 100;
+	int file_count = 4;
+	const char* server_arg = "./server";
+	bool keep = false;
+
+	int opt;
+	while ((opt = getopt(argc, argv, "s:t:M:p:N:c:n:f:S:CB:w:y:U:Pk")) != -1)
+	{
+		switch (opt)
+		{
+			case 't': snprintf(transports_arg, sizeof(transports_arg), "%s", optarg); break;
+			case 'M': snprintf(modes_arg, sizeof(modes_arg), "%s", optarg); break;
+			case 'p': snprintf(profiles_arg, sizeof(profiles_arg), "%s", optarg); break;
+			case 'N': netem = optarg; break;
+			case 's': snprintf(sizes_arg, sizeof(sizes_arg), "%s", optarg); break;
+			case 'c': clients = atoi(optarg); break;
+			case 'n': requests = atoi(optarg); break;
+			case 'f': file_count = atoi(optarg); break;
+			case 'S': server_arg = optarg; break;
+			case 'C': cold_cache = true; break;
+			case 'y':
+				if ((opt = fsync_parse_policy(optarg)) == -1)
+				{
+					fprintf(stderr, "Invalid fsync policy: %s\n", optarg);
+					exit(EXIT_FAILURE);
+				}
+				fsync_policy = opt;
+				break;
+			case 'w':
+				for (write_mode = W_NONE; write_mode < W_COUNT && strcmp(optarg, write_mode_names[write_mode]) != 0; write_mode++)
+				{
+				}
+				if (write_mode == W_COUNT)
+				{
+					fprintf(stderr, "Invalid write mode: %s\n", optarg);
+					exit(EXIT_FAILURE);
+				}
+				break;
+			case 'B':
+				if ((background_size = parse_size(optarg)) == 0)
+				{
+					fprintf(stderr, "Invalid background file size: %s\n", optarg);
+					exit(EXIT_FAILURE);
+				}
+				break;
+			case 'U': restart_interval_ms = atoi(optarg); break;
+			case 'P': packed = true; break;
+			case 'k': keep = true; break;
+			default:
+				fprintf(stderr, "usage: bench [-s SIZES] [-t TRANSPORTS] [-M MODES] [-p PROFILES] [-N NETEM] [-c CLIENTS] [-n REQUESTS] [-f FILES] [-S SERVER] [-C] [-B SIZE] [-w WRITE] [-y POLICY] [-U MS] [-P] [-k]\n");
+				exit(EXIT_FAILURE);
+		}
+	}
+	if (clients < 1 || requests < 1 || file_count < 1)
+	{
+		fprintf(stderr, "CLIENTS, REQUESTS and FILES must be positive\n");
+		exit(EXIT_FAILURE);
+	}
+
+	uint64_t sizes[MAX_SIZES];
+	int size_count = 0;
+	for (char* token = strtok(sizes_arg, ","); token != NULL && size_count < MAX_SIZES; token = strtok(NULL, ","))
+	{
+		if ((sizes[size_count++] = parse_size(token)) == 0)
+		{
+			fprintf(stderr, "Invalid file size: %s\n", token);
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	enum transport transports[T_COUNT];
+	int transport_count = 0;
+	for (char* token = strtok(transports_arg, ","); token != NULL && transport_count < T_COUNT; token = strtok(NULL, ","))
+	{
+		int t = 0;
+		while (t < T_COUNT && strcmp(token, transport_names[t]) != 0)
+		{
+			t++;
+		}
+		if (t == T_COUNT)
+		{
+			fprintf(stderr, "Invalid transport: %s\n", token);
+			exit(EXIT_FAILURE);
+		}
+		transports[transport_count++] = t;
+	}
+
+	// the server validates the names
+	char* modes[MAX_MODES];
+	int mode_count = 0;
+	for (char* token = strtok(modes_arg, ","); token != NULL && mode_count < MAX_MODES; token = strtok(NULL, ","))
+	{
+		modes[mode_count++] = token;
+	}
+
+	char* profiles[MAX_PROFILES];
+	int profile_count = 0;
+	for (char* token = strtok(profiles_arg, ","); token != NULL && profile_count < MAX_PROFILES; token = strtok(NULL, ","))
+	{
+		if (socket_profile_load(&tcp_profile, token) == -1)
+		{
+			fprintf(stderr, "Invalid socket profile: %s\n", token);
+			exit(EXIT_FAILURE);
+		}
+		profiles[profile_count++] = token;
+	}
+
+	block_pool = pool_create("block", MAX_SEGMENT_SIZE + 1, 4);
+	if (block_pool == NULL)
+	{
+		perror("Could not create the buffer pool");
+		exit(EXIT_FAILURE);
+	}
+
+	char server_path[PATH_MAX];
+	if (realpath(server_arg, server_path) == NULL)
+	{
+		perror("Could not find the server binary");
+		exit(EXIT_FAILURE);
+	}
+
+	char* dir = scratch_dir;
+	if (mkdtemp(dir) == NULL)
+	{
+		perror("Could not create the scratch directory");
+		exit(EXIT_FAILURE);
+	}
+	snprintf(unix_path, sizeof(unix_path), "%s/%s", dir, SOCKET_NAME);
+	snprintf(handoff_path, sizeof(handoff_path), "%s/%s", dir, HANDOFF_NAME);
+
+	// the server serves names relative to its working directory
+	char** files = (char**) calloc(size_count * file_count, sizeof(char*));
+	char path[PATH_MAX];
+	int status = files == NULL ? -1 : 0;
+	snprintf(path, sizeof(path), "%s/%s", dir, PACK_DIR);
+	if (status == 0 && packed && mkdir(path, 0755) == -1)
+	{
+		perror("Could not create the pack directory");
+		status = -1;
+	}
+	for (int s = 0; s < size_count && status == 0; s++)
+	{
+		for (int f = 0; f < file_count && status == 0; f++)
+		{
+			char* name = (char*) malloc(64);
+			files[s * file_count + f] = name;
+			if (name == NULL)
+			{
+				status = -1;
+				break;
+			}
+			snprintf(name, 64, "%sbench_%llu_%d", packed ? PACK_DIR "/" : "", (unsigned long long) sizes[s], f);
+			snprintf(path, sizeof(path), "%s/%s", dir, name);
+			status = generate_file(path, sizes[s], s * file_count + f);
+		}
+	}
+	snprintf(path, sizeof(path), "%s/%s", dir, BACKGROUND_NAME);
+	if (status == 0 && background_size > 0)
+	{
+		// on disk, so it can be evicted and read again on every pass
+		bool cold = cold_cache;
+		cold_cache = true;
+		status = generate_file(path, background_size, UINT32_MAX);
+		cold_cache = cold;
+	}
+	if (status == 0 && packed)
+	{
+		status = build_pack(server_path, dir);
+	}
+
+	signal(SIGPIPE, SIG_IGN);
+	bool impaired = status == 0 && netem != NULL;
+	if (impaired && set_netem(netem) == -1)
+	{
+		impaired = false;
+		status = -1;
+	}
+	bool started = status == 0;
+	if (started)
+	{
+		printf("{\"results\": [\n");
+	}
+	for (int p = 0; p < profile_count && status == 0; p++)
+	{
+		socket_profile_load(&tcp_profile, profiles[p]);
+		for (int m = 0; m < mode_count && status == 0; m++)
+		{
+			char server_args[512];
+			snprintf(server_args, sizeof(server_args), "%s -o socket.profile=%s", modes[m], profiles[p]);
+			server_process server = { server_path, dir, server_args, start_server(server_path, dir, server_args), 0, 0 };
+			if (server.pid == -1)
+			{
+				status = -1;
+				break;
+			}
+			for (int t = 0; t < transport_count && status == 0; t++)
+			{
+				for (int s = 0; s < size_count && status == 0; s++)
+				{
+					status = run_phase(sizes[s], transports[t], modes[m], &files[s * file_count], file_count,
+						clients, requests, &server, p == 0 && m == 0 && t == 0 && s == 0);
+				}
+			}
+
+			kill(server.pid, SIGTERM);
+			waitpid(server.pid, NULL, 0);
+			unlink(unix_path);
+			unlink(handoff_path);
+		}
+	}
+	if (started)
+	{
+		printf("\n]}\n");
+	}
+	if (impaired)
+	{
+		set_netem(NULL);
+	}
+
+	for (int i = 0; files != NULL && i < size_count * file_count; i++)
+	{
+		if (files[i] != NULL && !keep)
+		{
+			snprintf(path, sizeof(path), "%s/%s", dir, files[i]);
+			unlink(path);
+		}
+		free(files[i]);
+	}
+	free(files);
+	for (int i = 0; i < clients; i++)
+	{
+		snprintf(path, sizeof(path), "%s/out_%d", dir, i);
+		unlink(path);
+	}
+	if (!keep)
+	{
+		snprintf(path, sizeof(path), "%s/%s", dir, BACKGROUND_NAME);
+		unlink(path);
+		snprintf(path, sizeof(path), "%s/%s", dir, PACK_NAME);
+		unlink(path);
+		snprintf(path, sizeof(path), "%s/%s", dir, PACK_DIR);
+		rmdir(path);
+		unlink(unix_path);
+		unlink(handoff_path);
+		rmdir(dir);
+	}
+
+	return status == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
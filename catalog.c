@@ -0,0 +1,1316 @@
+/**
+ *  catalog of the document root, see catalog.h
+ */
+
+#define _GNU_SOURCE // qsort_r
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/inotify.h>
+#include <sys/mman.h>
+#include <sys/eventfd.h>
+#include <sys/random.h>
+#include "catalog.h"
+#include "dirindex.h"
+#include "metrics.h"
+#include "logger.h"
+
+#define CATALOG_MAGIC "PADCAT02"
+#define CATALOG_INITIAL_BUCKETS 4096
+// removals remembered for catalog_changes(), older ones raise the floor of the change log
+#define CATALOG_MAX_TOMBSTONES (1024 * 1024)
+// skipped by a loaded catalog: the generations its server handed out after the save
+// may have reached clients, the new ones must come after them
+#define CATALOG_GENERATION_GAP (1ull << 32)
+#define CATALOG_WATCH_MASK (IN_CREATE | IN_DELETE | IN_MODIFY | IN_CLOSE_WRITE | IN_ATTRIB | IN_MOVED_FROM | IN_MOVED_TO | IN_ONLYDIR)
+#define CATALOG_EVENT_BUFFER 65536
+
+typedef struct catalog_entry catalog_entry;
+
+struct catalog_entry
+{
+	catalog_entry* next; // < hash chain
+	uint64_t hash;
+	uint64_t dev;
+	uint64_t ino;
+	uint64_t size;
+	struct timespec mtime;
+	struct timespec ctime;
+	uint32_t mode;
+	uint32_t epoch; // < last walk or scan that saw it
+	uint32_t scanned; // < directories: last walk or scan that read them
+	bool has_digest;
+	uint64_t digest;
+	uint64_t generation; // < of its last change
+	char path[]; // < "" for the root
+};
+
+// a removed path, for the change log
+typedef struct
+{
+	uint64_t generation; // < of the removal
+	char* path;
+	bool directory;
+} tombstone;
+
+// the catalog file: the header, then count entries and tombstone_count tombstones,
+// each followed by its path padded to 8 bytes
+typedef struct
+{
+	char magic[8];
+	uint64_t root_dev;
+	uint64_t root_ino;
+	uint64_t count;
+	uint64_t generation;
+	uint64_t log_id;
+	uint64_t log_floor;
+	uint64_t tombstone_count;
+} stored_header;
+
+typedef struct
+{
+	uint64_t dev;
+	uint64_t ino;
+	uint64_t size;
+	int64_t mtime_sec;
+	int64_t mtime_nsec;
+	int64_t ctime_sec;
+	int64_t ctime_nsec;
+	uint64_t digest;
+	uint64_t generation;
+	uint32_t mode;
+	uint32_t has_digest;
+	uint32_t path_len;
+	uint32_t padding;
+} stored_entry;
+
+typedef struct
+{
+	uint64_t generation;
+	uint32_t path_len;
+	uint32_t directory;
+} stored_tombstone;
+
+// a walk of part of the tree, shared by its threads
+typedef struct
+{
+	char** paths; // < directories left to read
+	size_t count;
+	size_t capacity;
+	int busy; // < threads reading a directory, which may push more
+	bool every_directory; // < read the known subdirectories again too
+	pthread_mutex_t lock;
+	pthread_cond_t changed;
+} walk_queue;
+
+static pthread_rwlock_t table_lock = PTHREAD_RWLOCK_INITIALIZER;
+static catalog_entry** buckets = NULL;
+static uint64_t bucket_count = 0;
+static uint64_t entry_count = 0;
+static uint64_t generation = 0;
+static uint32_t epoch = 0;
+
+// the change log: the removals since log_floor, oldest first. log_id changes
+// whenever the generations start over, with a catalog walked from scratch
+static tombstone* tombstones = NULL;
+static size_t tombstone_first = 0;
+static size_t tombstone_end = 0;
+static size_t tombstone_capacity = 0;
+static uint64_t log_id = 0;
+static uint64_t log_floor = 0;
+
+static atomic_bool ready = false; // < complete and watched, lookups hit
+static atomic_bool stopped = false;
+static char* catalog_file = NULL;
+static int save_interval_s = 0;
+// the periodic save of the catalog thread and the one of a handoff share the temporary file
+static pthread_mutex_t save_lock = PTHREAD_MUTEX_INITIALIZER;
+static int walk_threads = 1;
+
+// the directory each inotify watch descriptor stands for
+static int inotify_fd = -1;
+static int stop_fd = -1;
+static pthread_mutex_t watch_lock = PTHREAD_MUTEX_INITIALIZER;
+static char** watch_paths = NULL;
+static int watch_size = 0;
+static atomic_bool watch_failed = false;
+// directories removed by the current batch of events, their trees go in one pass (see flush_removed())
+static char** removed_dirs = NULL;
+static size_t removed_count = 0;
+static size_t removed_capacity = 0;
+
+static uint64_t hash_path_len(const char* path, size_t len)
+{
+	// FNV-1a
+	uint64_t hash = 14695981039346656037ull;
+	for (size_t i = 0; i < len; i++)
+	{
+		hash = (hash ^ (unsigned char) path[i]) * 1099511628211ull;
+	}
+	return hash;
+}
+
+static uint64_t hash_path(const char* path)
+{
+	return hash_path_len(path, strlen(path));
+}
+
+static const char* dir_name(const char* path)
+{
+	return path[0] != '\0' ? path : ".";
+}
+
+/*
+ *	Writes directory/name to path.
+ *	Returns 0 on success, -1 if it is too long.
+ */
+static int join_path(char* path, const char* directory, const char* name)
+{
+	int len = snprintf(path, PATH_MAX, "%s%s%s", directory, directory[0] != '\0' ? "/" : "", name);
+	return len < PATH_MAX ? 0 : -1;
+}
+
+static catalog_entry* find_locked(const char* path, uint64_t hash)
+{
+	for (catalog_entry* entry = buckets[hash & (bucket_count - 1)]; entry != NULL; entry = entry->next)
+	{
+		if (entry->hash == hash && strcmp(entry->path, path) == 0)
+		{
+			return entry;
+		}
+	}
+	return NULL;
+}
+
+/*
+ *	Doubles the hash table. Called with the write lock held.
+ */
+static void grow_locked(void)
+{
+	uint64_t count = bucket_count * 2;
+	catalog_entry** grown = (catalog_entry**) calloc(count, sizeof(catalog_entry*));
+	if (grown == NULL)
+	{
+		// longer chains, still correct
+		return;
+	}
+	for (uint64_t i = 0; i < bucket_count; i++)
+	{
+		catalog_entry* entry = buckets[i];
+		while (entry != NULL)
+		{
+			catalog_entry* next = entry->next;
+			entry->next = grown[entry->hash & (count - 1)];
+			grown[entry->hash & (count - 1)] = entry;
+			entry = next;
+		}
+	}
+	free(buckets);
+	buckets = grown;
+	bucket_count = count;
+}
+
+/*
+ *	Adds a blank entry for path. Called with the write lock held.
+ *	Returns the entry, NULL if out of memory.
+ */
+static catalog_entry* insert_locked(const char* path, size_t len, uint64_t hash)
+{
+	if (entry_count >= bucket_count)
+	{
+		grow_locked();
+	}
+	catalog_entry* entry = (catalog_entry*) calloc(1, sizeof(catalog_entry) + len + 1);
+	if (entry == NULL)
+	{
+		return NULL;
+	}
+	memcpy(entry->path, path, len);
+	entry->path[len] = '\0';
+	entry->hash = hash;
+	entry->next = buckets[hash & (bucket_count - 1)];
+	buckets[hash & (bucket_count - 1)] = entry;
+	entry_count++;
+	return entry;
+}
+
+static bool same_metadata(const catalog_entry* entry, const struct stat* st)
+{
+	return entry->dev == (uint64_t) st->st_dev && entry->ino == (uint64_t) st->st_ino && entry->size == (uint64_t) st->st_size
+		&& entry->mode == st->st_mode
+		&& entry->mtime.tv_sec == st->st_mtim.tv_sec && entry->mtime.tv_nsec == st->st_mtim.tv_nsec
+		&& entry->ctime.tv_sec == st->st_ctim.tv_sec && entry->ctime.tv_nsec == st->st_ctim.tv_nsec;
+}
+
+/*
+ *	Records path with the metadata st, seen in the current epoch. Called with the write lock held.
+ *	Returns the entry, with *added telling if it is new, or NULL if out of memory.
+ */
+static catalog_entry* upsert_locked(const char* path, const struct stat* st, bool* added)
+{
+	uint64_t hash = hash_path(path);
+	catalog_entry* entry = find_locked(path, hash);
+	*added = entry == NULL;
+	if (entry == NULL && (entry = insert_locked(path, strlen(path), hash)) == NULL)
+	{
+		return NULL;
+	}
+	if (*added || !same_metadata(entry, st))
+	{
+		entry->dev = st->st_dev;
+		entry->ino = st->st_ino;
+		entry->size = st->st_size;
+		entry->mode = st->st_mode;
+		entry->mtime = st->st_mtim;
+		entry->ctime = st->st_ctim;
+		entry->has_digest = false;
+		entry->generation = ++generation;
+	}
+	entry->epoch = epoch;
+	return entry;
+}
+
+/*
+ *	Appends the removal of path at generation removed to the change log,
+ *		forgetting the oldest removal when it is full. Called with the write lock held.
+ */
+static void add_tombstone(const char* path, bool directory, uint64_t removed)
+{
+	if (tombstone_end - tombstone_first >= CATALOG_MAX_TOMBSTONES)
+	{
+		log_floor = tombstones[tombstone_first].generation;
+		free(tombstones[tombstone_first++].path);
+	}
+	if (tombstone_end == tombstone_capacity && tombstone_first > 0)
+	{
+		memmove(tombstones, tombstones + tombstone_first, (tombstone_end - tombstone_first) * sizeof(tombstone));
+		tombstone_end -= tombstone_first;
+		tombstone_first = 0;
+	}
+	if (tombstone_end == tombstone_capacity)
+	{
+		size_t capacity = tombstone_capacity > 0 ? 2 * tombstone_capacity : 1024;
+		tombstone* grown = (tombstone*) realloc(tombstones, capacity * sizeof(tombstone));
+		if (grown != NULL)
+		{
+			tombstones = grown;
+			tombstone_capacity = capacity;
+		}
+	}
+	char* copy = tombstone_end < tombstone_capacity ? strdup(path) : NULL;
+	if (copy == NULL)
+	{
+		// a removal the log cannot tell: nothing older can be answered
+		log_floor = removed;
+		return;
+	}
+	tombstones[tombstone_end++] = (tombstone) { removed, copy, directory };
+}
+
+/*
+ *	Unlinks and frees the entry *link points to, logging its removal. Called with the write lock held.
+ */
+static void unlink_locked(catalog_entry** link)
+{
+	catalog_entry* entry = *link;
+	*link = entry->next;
+	add_tombstone(entry->path, S_ISDIR(entry->mode), ++generation);
+	free(entry);
+	entry_count--;
+}
+
+static int compare_paths(const void* a, const void* b)
+{
+	return strcmp(*(char* const*) a, *(char* const*) b);
+}
+
+/*
+ *	Returns true if path is below one of the count directories in paths, sorted.
+ */
+static bool below_any(const char* path, char* const* paths, size_t count)
+{
+	for (const char* slash = strchr(path, '/'); slash != NULL; slash = strchr(slash + 1, '/'))
+	{
+		size_t len = slash - path;
+		size_t low = 0, high = count;
+		while (low < high)
+		{
+			size_t middle = low + (high - low) / 2;
+			int order = strncmp(paths[middle], path, len);
+			if (order == 0 && paths[middle][len] != '\0')
+			{
+				order = 1;
+			}
+			if (order == 0)
+			{
+				return true;
+			}
+			if (order < 0)
+			{
+				low = middle + 1;
+			}
+			else
+			{
+				high = middle;
+			}
+		}
+	}
+	return false;
+}
+
+/*
+ *	Forgets every entry below the count directories in paths, sorted, in a single pass.
+ *	Called with the write lock held.
+ */
+static void remove_below_locked(char* const* paths, size_t count)
+{
+	for (uint64_t i = 0; i < bucket_count; i++)
+	{
+		catalog_entry** link = &buckets[i];
+		while (*link != NULL)
+		{
+			if (below_any((*link)->path, paths, count))
+			{
+				unlink_locked(link);
+			}
+			else
+			{
+				link = &(*link)->next;
+			}
+		}
+	}
+}
+
+/*
+ *	Forgets path. The tree below a directory goes with the other directories the batch removes,
+ *		in flush_removed(). Called with the write lock held.
+ */
+static void remove_locked(const char* path)
+{
+	uint64_t hash = hash_path(path);
+	catalog_entry** link = &buckets[hash & (bucket_count - 1)];
+	while (*link != NULL && ((*link)->hash != hash || strcmp((*link)->path, path) != 0))
+	{
+		link = &(*link)->next;
+	}
+	if (*link == NULL)
+	{
+		return;
+	}
+	bool directory = S_ISDIR((*link)->mode);
+	unlink_locked(link);
+	if (!directory)
+	{
+		return;
+	}
+
+	if (removed_count == removed_capacity)
+	{
+		size_t capacity = removed_capacity > 0 ? 2 * removed_capacity : 64;
+		char** grown = (char**) realloc(removed_dirs, capacity * sizeof(char*));
+		if (grown != NULL)
+		{
+			removed_dirs = grown;
+			removed_capacity = capacity;
+		}
+	}
+	char* copy = removed_count < removed_capacity ? strdup(path) : NULL;
+	if (copy == NULL)
+	{
+		// out of memory: a pass for this one alone
+		char* const alone[1] = { (char*) path };
+		remove_below_locked(alone, 1);
+		return;
+	}
+	removed_dirs[removed_count++] = copy;
+}
+
+/*
+ *	Forgets the trees below the directories removed since the last call, in one pass over the table
+ *		for a whole batch of events instead of one per directory. Called before anything could add
+ *		entries below them again, and at the end of each batch.
+ */
+static void flush_removed(void)
+{
+	if (removed_count == 0)
+	{
+		return;
+	}
+	qsort(removed_dirs, removed_count, sizeof(char*), compare_paths);
+	pthread_rwlock_wrlock(&table_lock);
+	remove_below_locked(removed_dirs, removed_count);
+	pthread_rwlock_unlock(&table_lock);
+	for (size_t i = 0; i < removed_count; i++)
+	{
+		free(removed_dirs[i]);
+	}
+	removed_count = 0;
+}
+
+/*
+ *	Forgets the entries the current epoch should have seen but did not: every one with all,
+ *		otherwise those of the directories read in this epoch, and those whose directory is gone.
+ *	Called with the write lock held.
+ */
+static void sweep_locked(bool all)
+{
+	bool removed = true;
+	while (removed)
+	{
+		removed = false;
+		for (uint64_t i = 0; i < bucket_count; i++)
+		{
+			catalog_entry** link = &buckets[i];
+			while (*link != NULL)
+			{
+				catalog_entry* entry = *link;
+				bool gone = false;
+				if (entry->path[0] != '\0' && all)
+				{
+					gone = entry->epoch != epoch;
+				}
+				else if (entry->path[0] != '\0')
+				{
+					char parent_path[PATH_MAX];
+					const char* slash = strrchr(entry->path, '/');
+					size_t len = slash != NULL ? (size_t) (slash - entry->path) : 0;
+					memcpy(parent_path, entry->path, len);
+					parent_path[len] = '\0';
+					catalog_entry* parent = find_locked(parent_path, hash_path(parent_path));
+					gone = parent == NULL || !S_ISDIR(parent->mode) || (parent->scanned == epoch && entry->epoch != epoch);
+				}
+				if (gone)
+				{
+					unlink_locked(link);
+					removed = true;
+				}
+				else
+				{
+					link = &entry->next;
+				}
+			}
+		}
+	}
+}
+
+/*
+ *	Watches the directory path. A refused watch turns the catalog off.
+ *	Returns 0 on success, -1 on error.
+ */
+static int watch_directory(const char* path)
+{
+	int wd = inotify_add_watch(inotify_fd, dir_name(path), CATALOG_WATCH_MASK);
+	if (wd == -1)
+	{
+		// a directory gone since it was listed is not a problem, its parent has an event
+		if (errno != ENOENT && errno != ENOTDIR && !atomic_exchange(&watch_failed, true))
+		{
+			log_errno("Could not watch %s, the catalog is off (see fs.inotify.max_user_watches)", dir_name(path));
+			atomic_store(&ready, false);
+		}
+		return -1;
+	}
+
+	pthread_mutex_lock(&watch_lock);
+	if (wd >= watch_size)
+	{
+		int size = wd + 1 > 2 * watch_size ? wd + 1 : 2 * watch_size;
+		char** paths = (char**) realloc(watch_paths, size * sizeof(char*));
+		if (paths == NULL)
+		{
+			pthread_mutex_unlock(&watch_lock);
+			return -1;
+		}
+		memset(paths + watch_size, 0, (size - watch_size) * sizeof(char*));
+		watch_paths = paths;
+		watch_size = size;
+	}
+	// a directory moved elsewhere keeps its watch descriptor
+	free(watch_paths[wd]);
+	watch_paths[wd] = strdup(path);
+	pthread_mutex_unlock(&watch_lock);
+	return 0;
+}
+
+static void queue_push(walk_queue* queue, char* path)
+{
+	pthread_mutex_lock(&queue->lock);
+	if (queue->count == queue->capacity)
+	{
+		size_t capacity = queue->capacity > 0 ? 2 * queue->capacity : 64;
+		char** paths = (char**) realloc(queue->paths, capacity * sizeof(char*));
+		if (paths == NULL)
+		{
+			pthread_mutex_unlock(&queue->lock);
+			log_error("Out of memory walking %s, the catalog misses it", path);
+			free(path);
+			return;
+		}
+		queue->paths = paths;
+		queue->capacity = capacity;
+	}
+	queue->paths[queue->count++] = path;
+	pthread_cond_signal(&queue->changed);
+	pthread_mutex_unlock(&queue->lock);
+}
+
+/*
+ *	Watches and reads the directory path, recording it and its entries in the current epoch.
+ *	Pushes the subdirectories new to the catalog, or all of them with every_directory, on queue.
+ */
+static void scan_directory(const char* path, walk_queue* queue)
+{
+	// watched before it is read: nothing can change unnoticed in between
+	watch_directory(path);
+	DIR* dir = opendir(dir_name(path));
+	struct stat self;
+	if (dir == NULL || fstat(dirfd(dir), &self) == -1)
+	{
+		if (dir != NULL)
+		{
+			closedir(dir);
+		}
+		return;
+	}
+
+	// the entries are gathered first, the table is locked once per directory
+	size_t count = 0, capacity = 64;
+	char** names = (char**) malloc(capacity * sizeof(char*));
+	struct stat* stats = (struct stat*) malloc(capacity * sizeof(struct stat));
+	struct dirent* item;
+	while (names != NULL && stats != NULL && (item = readdir(dir)) != NULL)
+	{
+		char child[PATH_MAX];
+		if (strcmp(item->d_name, ".") == 0 || strcmp(item->d_name, "..") == 0
+			|| fstatat(dirfd(dir), item->d_name, &stats[count], AT_SYMLINK_NOFOLLOW) == -1
+			|| !(S_ISREG(stats[count].st_mode) || S_ISDIR(stats[count].st_mode))
+			|| join_path(child, path, item->d_name) == -1 || (names[count] = strdup(child)) == NULL)
+		{
+			continue;
+		}
+		if (++count == capacity)
+		{
+			capacity *= 2;
+			char** grown_names = (char**) realloc(names, capacity * sizeof(char*));
+			names = grown_names != NULL ? grown_names : names;
+			struct stat* grown_stats = (struct stat*) realloc(stats, capacity * sizeof(struct stat));
+			stats = grown_stats != NULL ? grown_stats : stats;
+			if (grown_names == NULL || grown_stats == NULL)
+			{
+				log_error("Out of memory reading %s, the catalog misses part of it", dir_name(path));
+				break;
+			}
+		}
+	}
+	closedir(dir);
+
+	bool* descend = (bool*) calloc(count + 1, sizeof(bool));
+	pthread_rwlock_wrlock(&table_lock);
+	bool added;
+	catalog_entry* entry = upsert_locked(path, &self, &added);
+	if (entry != NULL)
+	{
+		entry->scanned = epoch;
+	}
+	for (size_t i = 0; i < count && descend != NULL; i++)
+	{
+		entry = upsert_locked(names[i], &stats[i], &added);
+		descend[i] = entry != NULL && S_ISDIR(stats[i].st_mode) && (added || queue->every_directory);
+	}
+	pthread_rwlock_unlock(&table_lock);
+
+	for (size_t i = 0; i < count; i++)
+	{
+		if (descend != NULL && descend[i])
+		{
+			queue_push(queue, names[i]);
+		}
+		else
+		{
+			free(names[i]);
+		}
+	}
+	free(descend);
+	free(names);
+	free(stats);
+}
+
+static void* walk_main(void* arg)
+{
+	walk_queue* queue = (walk_queue*) arg;
+	pthread_mutex_lock(&queue->lock);
+	while (1)
+	{
+		while (queue->count == 0 && queue->busy > 0)
+		{
+			pthread_cond_wait(&queue->changed, &queue->lock);
+		}
+		if (queue->count == 0)
+		{
+			// nothing left, and no thread reading a directory that could add more
+			break;
+		}
+		char* path = queue->paths[--queue->count];
+		queue->busy++;
+		pthread_mutex_unlock(&queue->lock);
+
+		scan_directory(path, queue);
+		free(path);
+
+		pthread_mutex_lock(&queue->lock);
+		queue->busy--;
+	}
+	pthread_cond_broadcast(&queue->changed);
+	pthread_mutex_unlock(&queue->lock);
+	return NULL;
+}
+
+/*
+ *	Reads the directories of paths (count of them, taken over) and the tree below them,
+ *		on threads threads, the caller included.
+ */
+static void walk(char** paths, size_t count, bool every_directory, int threads)
+{
+	walk_queue queue = { paths, count, count, 0, every_directory };
+	pthread_mutex_init(&queue.lock, NULL);
+	pthread_cond_init(&queue.changed, NULL);
+
+	pthread_t* helpers = threads > 1 ? (pthread_t*) malloc((threads - 1) * sizeof(pthread_t)) : NULL;
+	int started = 0;
+	for (int i = 0; helpers != NULL && i < threads - 1; i++)
+	{
+		if (pthread_create(&helpers[i], NULL, walk_main, &queue) != 0)
+		{
+			break;
+		}
+		started++;
+	}
+	walk_main(&queue);
+	for (int i = 0; i < started; i++)
+	{
+		pthread_join(helpers[i], NULL);
+	}
+
+	free(helpers);
+	free(queue.paths);
+	pthread_mutex_destroy(&queue.lock);
+	pthread_cond_destroy(&queue.changed);
+}
+
+/*
+ *	Walks the whole tree again, forgetting what it does not find.
+ */
+static void walk_all(void)
+{
+	pthread_rwlock_wrlock(&table_lock);
+	epoch++;
+	pthread_rwlock_unlock(&table_lock);
+
+	char** roots = (char**) malloc(sizeof(char*));
+	if (roots == NULL || (roots[0] = strdup("")) == NULL)
+	{
+		free(roots);
+		log_error("Out of memory walking the document root");
+		return;
+	}
+	walk(roots, 1, true, walk_threads);
+
+	pthread_rwlock_wrlock(&table_lock);
+	sweep_locked(true);
+	pthread_rwlock_unlock(&table_lock);
+}
+
+static void clear_locked(void)
+{
+	for (uint64_t i = 0; i < bucket_count; i++)
+	{
+		while (buckets[i] != NULL)
+		{
+			catalog_entry* entry = buckets[i];
+			buckets[i] = entry->next;
+			free(entry);
+		}
+	}
+	for (size_t i = tombstone_first; i < tombstone_end; i++)
+	{
+		free(tombstones[i].path);
+	}
+	tombstone_first = tombstone_end = 0;
+	entry_count = 0;
+	generation = 0;
+	log_floor = 0;
+}
+
+/*
+ *	Starts a new change log, for a catalog walked from scratch.
+ */
+static void new_log(void)
+{
+	uint64_t id = 0;
+	if (getrandom(&id, sizeof(id), 0) != (ssize_t) sizeof(id))
+	{
+		id = metrics_now_ns() ^ ((uint64_t) getpid() << 32);
+	}
+	pthread_rwlock_wrlock(&table_lock);
+	log_id = id != 0 ? id : 1;
+	pthread_rwlock_unlock(&table_lock);
+}
+
+/*
+ *	Loads the catalog file, if it holds the catalog of this tree.
+ *	Returns 0 on success, -1 if the tree has to be walked instead.
+ */
+static int load(void)
+{
+	int fd = open(catalog_file, O_RDONLY | O_CLOEXEC);
+	struct stat file_st, root_st;
+	if (fd == -1 || fstat(fd, &file_st) == -1 || stat(".", &root_st) == -1 || (size_t) file_st.st_size < sizeof(stored_header))
+	{
+		if (fd != -1 || errno != ENOENT)
+		{
+			log_warn("Could not load the catalog %s, walking the tree", catalog_file);
+		}
+		if (fd != -1)
+		{
+			close(fd);
+		}
+		return -1;
+	}
+	char* data = (char*) mmap(NULL, file_st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (data == MAP_FAILED)
+	{
+		return -1;
+	}
+	madvise(data, file_st.st_size, MADV_SEQUENTIAL);
+
+	stored_header header;
+	memcpy(&header, data, sizeof(stored_header));
+	bool valid = memcmp(header.magic, CATALOG_MAGIC, sizeof(header.magic)) == 0
+		&& header.root_dev == (uint64_t) root_st.st_dev && header.root_ino == (uint64_t) root_st.st_ino;
+	const char* next = data + sizeof(stored_header);
+	const char* end = data + file_st.st_size;
+
+	pthread_rwlock_wrlock(&table_lock);
+	for (uint64_t i = 0; valid && i < header.count; i++)
+	{
+		stored_entry stored;
+		if ((size_t) (end - next) < sizeof(stored_entry))
+		{
+			valid = false;
+			break;
+		}
+		memcpy(&stored, next, sizeof(stored_entry));
+		next += sizeof(stored_entry);
+		size_t padded = (stored.path_len + 7) & ~(size_t) 7;
+		catalog_entry* entry = NULL;
+		if (stored.path_len >= PATH_MAX || (size_t) (end - next) < padded || memchr(next, '\0', stored.path_len) != NULL
+			|| (entry = insert_locked(next, stored.path_len, hash_path_len(next, stored.path_len))) == NULL)
+		{
+			valid = false;
+			break;
+		}
+		entry->dev = stored.dev;
+		entry->ino = stored.ino;
+		entry->size = stored.size;
+		entry->mode = stored.mode;
+		entry->mtime = (struct timespec) { stored.mtime_sec, stored.mtime_nsec };
+		entry->ctime = (struct timespec) { stored.ctime_sec, stored.ctime_nsec };
+		entry->digest = stored.digest;
+		entry->has_digest = stored.has_digest != 0;
+		entry->generation = stored.generation;
+		next += padded;
+	}
+	for (uint64_t i = 0; valid && i < header.tombstone_count; i++)
+	{
+		stored_tombstone stored;
+		if ((size_t) (end - next) < sizeof(stored_tombstone))
+		{
+			valid = false;
+			break;
+		}
+		memcpy(&stored, next, sizeof(stored_tombstone));
+		next += sizeof(stored_tombstone);
+		size_t padded = (stored.path_len + 7) & ~(size_t) 7;
+		char path[PATH_MAX];
+		if (stored.path_len >= PATH_MAX || (size_t) (end - next) < padded || memchr(next, '\0', stored.path_len) != NULL)
+		{
+			valid = false;
+			break;
+		}
+		memcpy(path, next, stored.path_len);
+		path[stored.path_len] = '\0';
+		add_tombstone(path, stored.directory != 0, stored.generation);
+		next += padded;
+	}
+	if (valid)
+	{
+		generation = header.generation + CATALOG_GENERATION_GAP;
+		log_id = header.log_id;
+		log_floor = header.log_floor > log_floor ? header.log_floor : log_floor;
+	}
+	else
+	{
+		clear_locked();
+	}
+	pthread_rwlock_unlock(&table_lock);
+	munmap(data, file_st.st_size);
+
+	if (!valid)
+	{
+		log_warn("Catalog %s is not the catalog of this tree, walking it", catalog_file);
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ *	Watches every directory of a loaded catalog and reads the ones whose times moved
+ *		since it was saved, with the tree below their new subdirectories.
+ */
+static void validate(void)
+{
+	pthread_rwlock_wrlock(&table_lock);
+	epoch++;
+	size_t count = 0;
+	char** paths = (char**) malloc((entry_count + 1) * sizeof(char*));
+	for (uint64_t i = 0; paths != NULL && i < bucket_count; i++)
+	{
+		for (catalog_entry* entry = buckets[i]; entry != NULL; entry = entry->next)
+		{
+			if (S_ISDIR(entry->mode) && (paths[count] = strdup(entry->path)) != NULL)
+			{
+				count++;
+			}
+		}
+	}
+	pthread_rwlock_unlock(&table_lock);
+	if (paths == NULL)
+	{
+		walk_all();
+		return;
+	}
+
+	size_t changed = 0;
+	for (size_t i = 0; i < count; i++)
+	{
+		struct stat st;
+		bool same = false;
+		if (watch_directory(paths[i]) == 0 && stat(dir_name(paths[i]), &st) == 0)
+		{
+			pthread_rwlock_rdlock(&table_lock);
+			catalog_entry* entry = find_locked(paths[i], hash_path(paths[i]));
+			same = entry != NULL && same_metadata(entry, &st);
+			pthread_rwlock_unlock(&table_lock);
+		}
+		if (same)
+		{
+			free(paths[i]);
+		}
+		else
+		{
+			// gone directories are swept with their parent, which changed too
+			paths[changed++] = paths[i];
+		}
+	}
+	walk(paths, changed, false, walk_threads);
+
+	pthread_rwlock_wrlock(&table_lock);
+	sweep_locked(false);
+	pthread_rwlock_unlock(&table_lock);
+}
+
+/*
+ *	Applies one inotify event: the path it names is read again.
+ */
+static void handle_event(const struct inotify_event* event)
+{
+	metrics_add(M_CATALOG_EVENTS, 1);
+	if (event->mask & IN_Q_OVERFLOW)
+	{
+		log_warn("Missed file system events, walking the document root again");
+		flush_removed();
+		walk_all();
+		return;
+	}
+
+	pthread_mutex_lock(&watch_lock);
+	char* directory = event->wd >= 0 && event->wd < watch_size && watch_paths[event->wd] != NULL ? strdup(watch_paths[event->wd]) : NULL;
+	if ((event->mask & IN_IGNORED) && directory != NULL)
+	{
+		free(watch_paths[event->wd]);
+		watch_paths[event->wd] = NULL;
+	}
+	pthread_mutex_unlock(&watch_lock);
+
+	char path[PATH_MAX];
+	if (directory == NULL || (event->mask & IN_IGNORED) || event->len == 0 || join_path(path, directory, event->name) == -1)
+	{
+		free(directory);
+		return;
+	}
+
+	struct stat st;
+	bool added = false;
+	pthread_rwlock_wrlock(&table_lock);
+	if ((event->mask & (IN_DELETE | IN_MOVED_FROM)) || lstat(path, &st) == -1 || !(S_ISREG(st.st_mode) || S_ISDIR(st.st_mode)))
+	{
+		remove_locked(path);
+	}
+	else
+	{
+		upsert_locked(path, &st, &added);
+	}
+	// the times of the directory moved too
+	if (stat(dir_name(directory), &st) == 0)
+	{
+		bool directory_added;
+		upsert_locked(directory, &st, &directory_added);
+	}
+	pthread_rwlock_unlock(&table_lock);
+
+	// a directory created or moved in comes with its tree
+	char** roots = NULL;
+	if (added && lstat(path, &st) == 0 && S_ISDIR(st.st_mode) && (roots = (char**) malloc(sizeof(char*))) != NULL)
+	{
+		// it may take the place of one removed earlier in the batch, whose tree goes first
+		flush_removed();
+		if ((roots[0] = strdup(path)) != NULL)
+		{
+			walk(roots, 1, false, 1);
+		}
+		else
+		{
+			free(roots);
+		}
+	}
+	dirindex_invalidate(dir_name(directory));
+	free(directory);
+}
+
+/*
+ *	Builds the catalog, then keeps it current until catalog_stop().
+ */
+static void* catalog_main(void* arg)
+{
+	(void) arg;
+	uint64_t start = metrics_now_ns();
+	bool loaded = catalog_file != NULL && load() == 0;
+	if (loaded)
+	{
+		validate();
+	}
+	else
+	{
+		new_log();
+		walk_all();
+	}
+	// the events queued meanwhile are replayed on top of it
+	if (!atomic_load(&watch_failed))
+	{
+		atomic_store(&ready, true);
+	}
+	log_info("Catalog %s: %llu entries in %.3f s", loaded ? "loaded" : "built", (unsigned long long) entry_count,
+		(metrics_now_ns() - start) / 1e9);
+
+	static char buffer[CATALOG_EVENT_BUFFER] __attribute__((aligned(__alignof__(struct inotify_event))));
+	uint64_t save_ns = metrics_now_ns() + (uint64_t) save_interval_s * 1000000000ull;
+	while (!atomic_load(&stopped))
+	{
+		uint64_t now = metrics_now_ns();
+		int timeout = save_interval_s == 0 ? -1 : save_ns > now ? (int) ((save_ns - now) / 1000000) + 1 : 0;
+		struct pollfd fds[2] = {
+			{ inotify_fd, POLLIN, 0 },
+			{ stop_fd, POLLIN, 0 }
+		};
+		if (poll(fds, 2, timeout) > 0 && (fds[0].revents & POLLIN))
+		{
+			ssize_t len = read(inotify_fd, buffer, sizeof(buffer));
+			for (char* next = buffer; len > 0 && next < buffer + len; )
+			{
+				const struct inotify_event* event = (const struct inotify_event*) next;
+				handle_event(event);
+				next += sizeof(struct inotify_event) + event->len;
+			}
+			flush_removed();
+		}
+		if (save_interval_s > 0 && metrics_now_ns() >= save_ns)
+		{
+			catalog_save();
+			save_ns = metrics_now_ns() + (uint64_t) save_interval_s * 1000000000ull;
+		}
+	}
+	return NULL;
+}
+
+int catalog_start(const char* path, int threads, int save_interval)
+{
+	catalog_file = path != NULL && path[0] != '\0' ? strdup(path) : NULL;
+	walk_threads = threads > 0 ? threads : 1;
+	save_interval_s = save_interval;
+	bucket_count = CATALOG_INITIAL_BUCKETS;
+	buckets = (catalog_entry**) calloc(bucket_count, sizeof(catalog_entry*));
+	inotify_fd = inotify_init1(IN_CLOEXEC);
+	stop_fd = eventfd(0, EFD_CLOEXEC);
+	if (buckets == NULL || inotify_fd == -1 || stop_fd == -1)
+	{
+		return -1;
+	}
+
+	pthread_t thread;
+	int err = pthread_create(&thread, NULL, catalog_main, NULL);
+	if (err != 0)
+	{
+		errno = err;
+		return -1;
+	}
+	pthread_detach(thread);
+	return 0;
+}
+
+int catalog_stat(const char* path, struct stat* st)
+{
+	if (!atomic_load_explicit(&ready, memory_order_acquire))
+	{
+		return -1;
+	}
+	pthread_rwlock_rdlock(&table_lock);
+	catalog_entry* entry = find_locked(path, hash_path(path));
+	if (entry != NULL)
+	{
+		memset(st, 0, sizeof(struct stat));
+		st->st_dev = entry->dev;
+		st->st_ino = entry->ino;
+		st->st_mode = entry->mode;
+		st->st_nlink = 1;
+		st->st_size = entry->size;
+		st->st_mtim = entry->mtime;
+		st->st_ctim = entry->ctime;
+	}
+	pthread_rwlock_unlock(&table_lock);
+	metrics_add(entry != NULL ? M_CATALOG_HITS : M_CATALOG_MISSES, 1);
+	return entry != NULL ? 0 : -1;
+}
+
+int catalog_digest(const char* path, const struct stat* st, uint64_t* digest)
+{
+	if (!atomic_load_explicit(&ready, memory_order_acquire))
+	{
+		return -1;
+	}
+	pthread_rwlock_rdlock(&table_lock);
+	catalog_entry* entry = find_locked(path, hash_path(path));
+	bool known = entry != NULL && entry->has_digest && same_metadata(entry, st);
+	*digest = known ? entry->digest : 0;
+	pthread_rwlock_unlock(&table_lock);
+	return known ? 0 : -1;
+}
+
+void catalog_set_digest(const char* path, const struct stat* st, uint64_t digest)
+{
+	if (!atomic_load_explicit(&ready, memory_order_acquire))
+	{
+		return;
+	}
+	pthread_rwlock_wrlock(&table_lock);
+	catalog_entry* entry = find_locked(path, hash_path(path));
+	if (entry != NULL && same_metadata(entry, st))
+	{
+		entry->digest = digest;
+		entry->has_digest = true;
+	}
+	pthread_rwlock_unlock(&table_lock);
+}
+
+static int compare_changes(const void* a, const void* b, void* names)
+{
+	const catalog_change* first = (const catalog_change*) a;
+	const catalog_change* second = (const catalog_change*) b;
+	if (first->removed != second->removed)
+	{
+		return first->removed ? -1 : 1;
+	}
+	int order = strcmp((const char*) names + first->name, (const char*) names + second->name);
+	return first->removed ? -order : order;
+}
+
+int catalog_changes(uint64_t id, uint64_t since, catalog_changeset* set)
+{
+	memset(set, 0, sizeof(catalog_changeset));
+	if (!atomic_load_explicit(&ready, memory_order_acquire))
+	{
+		errno = EAGAIN;
+		return -1;
+	}
+
+	pthread_rwlock_rdlock(&table_lock);
+	set->log_id = log_id;
+	set->generation = generation;
+	set->complete = id == log_id && since >= log_floor && since <= generation;
+	uint64_t from = set->complete ? since : 0;
+
+	// the removals are in generation order
+	size_t low = tombstone_first, high = tombstone_end;
+	while (set->complete && low < high)
+	{
+		size_t middle = low + (high - low) / 2;
+		if (tombstones[middle].generation <= from)
+		{
+			low = middle + 1;
+		}
+		else
+		{
+			high = middle;
+		}
+	}
+	size_t first_removal = set->complete ? low : tombstone_end;
+
+	size_t count = tombstone_end - first_removal, names_size = 0;
+	for (size_t i = first_removal; i < tombstone_end; i++)
+	{
+		names_size += strlen(tombstones[i].path) + 1;
+	}
+	for (uint64_t i = 0; i < bucket_count; i++)
+	{
+		for (catalog_entry* entry = buckets[i]; entry != NULL; entry = entry->next)
+		{
+			if (entry->generation > from && entry->path[0] != '\0')
+			{
+				count++;
+				names_size += strlen(entry->path) + 1;
+			}
+		}
+	}
+	set->changes = (catalog_change*) malloc((count + 1) * sizeof(catalog_change));
+	set->names = (char*) malloc(names_size + 1);
+	if (set->changes == NULL || set->names == NULL)
+	{
+		pthread_rwlock_unlock(&table_lock);
+		catalog_changes_free(set);
+		errno = ENOMEM;
+		return -1;
+	}
+
+	size_t used = 0;
+	for (size_t i = first_removal; i < tombstone_end; i++)
+	{
+		size_t len = strlen(tombstones[i].path) + 1;
+		memcpy(set->names + used, tombstones[i].path, len);
+		set->changes[set->count++] = (catalog_change) { used, tombstones[i].generation, true, tombstones[i].directory };
+		used += len;
+	}
+	for (uint64_t i = 0; i < bucket_count; i++)
+	{
+		for (catalog_entry* entry = buckets[i]; entry != NULL; entry = entry->next)
+		{
+			if (entry->generation > from && entry->path[0] != '\0')
+			{
+				size_t len = strlen(entry->path) + 1;
+				memcpy(set->names + used, entry->path, len);
+				set->changes[set->count++] = (catalog_change) { used, entry->generation, false, S_ISDIR(entry->mode) };
+				used += len;
+			}
+		}
+	}
+	pthread_rwlock_unlock(&table_lock);
+
+	qsort_r(set->changes, set->count, sizeof(catalog_change), compare_changes, set->names);
+	return 0;
+}
+
+void catalog_changes_free(catalog_changeset* set)
+{
+	free(set->changes);
+	free(set->names);
+	set->changes = NULL;
+	set->names = NULL;
+	set->count = 0;
+}
+
+/*
+ *	Writes the catalog to catalog_file through a temporary file, under save_lock.
+ *	Returns 0 on success, -1 on error.
+ */
+static int save_locked(void)
+{
+	char temp[PATH_MAX];
+	struct stat root_st;
+	FILE* out = NULL;
+	if (snprintf(temp, sizeof(temp), "%s.tmp", catalog_file) >= (int) sizeof(temp) || stat(".", &root_st) == -1
+		|| (out = fopen(temp, "we")) == NULL)
+	{
+		log_errno("Could not save the catalog to %s", catalog_file);
+		return -1;
+	}
+
+	// readers go on, changes wait for the end of the save
+	pthread_rwlock_rdlock(&table_lock);
+	stored_header header = { .root_dev = root_st.st_dev, .root_ino = root_st.st_ino, .count = entry_count, .generation = generation,
+		.log_id = log_id, .log_floor = log_floor, .tombstone_count = tombstone_end - tombstone_first };
+	memcpy(header.magic, CATALOG_MAGIC, sizeof(header.magic));
+	bool ok = fwrite(&header, sizeof(header), 1, out) == 1;
+	static const char padding[8] = { 0 };
+	for (uint64_t i = 0; ok && i < bucket_count; i++)
+	{
+		for (catalog_entry* entry = buckets[i]; ok && entry != NULL; entry = entry->next)
+		{
+			uint32_t len = strlen(entry->path);
+			stored_entry stored = {
+				entry->dev, entry->ino, entry->size,
+				entry->mtime.tv_sec, entry->mtime.tv_nsec, entry->ctime.tv_sec, entry->ctime.tv_nsec,
+				entry->digest, entry->generation, entry->mode, entry->has_digest, len, 0
+			};
+			ok = fwrite(&stored, sizeof(stored), 1, out) == 1 && fwrite(entry->path, 1, len, out) == len
+				&& fwrite(padding, 1, ((len + 7) & ~7u) - len, out) == ((len + 7) & ~7u) - len;
+		}
+	}
+	for (size_t i = tombstone_first; ok && i < tombstone_end; i++)
+	{
+		uint32_t len = strlen(tombstones[i].path);
+		stored_tombstone stored = { tombstones[i].generation, len, tombstones[i].directory };
+		ok = fwrite(&stored, sizeof(stored), 1, out) == 1 && fwrite(tombstones[i].path, 1, len, out) == len
+			&& fwrite(padding, 1, ((len + 7) & ~7u) - len, out) == ((len + 7) & ~7u) - len;
+	}
+	pthread_rwlock_unlock(&table_lock);
+
+	ok = ok && fflush(out) == 0 && fsync(fileno(out)) == 0;
+	ok = fclose(out) == 0 && ok;
+	if (!ok || rename(temp, catalog_file) == -1)
+	{
+		log_errno("Could not save the catalog to %s", catalog_file);
+		unlink(temp);
+		return -1;
+	}
+	return 0;
+}
+
+int catalog_save(void)
+{
+	if (catalog_file == NULL || !atomic_load(&ready))
+	{
+		return 0;
+	}
+	pthread_mutex_lock(&save_lock);
+	int ret_val = save_locked();
+	pthread_mutex_unlock(&save_lock);
+	return ret_val;
+}
+
+void catalog_stop(void)
+{
+	atomic_store(&ready, false);
+	atomic_store(&stopped, true);
+	uint64_t one = 1;
+	if (stop_fd != -1 && write(stop_fd, &one, sizeof(one)) == -1)
+	{
+		log_errno("Could not stop the catalog thread");
+	}
+}
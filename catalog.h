@@ -0,0 +1,108 @@
+/**
+ *  catalog of the document root
+ *
+ *  every regular file and directory below the document root, by path, with
+ *  its identity (device, inode), size, times, digest (the Merkle root, see
+ *  merkle.h, once computed) and the generation of its last change. a lookup
+ *  is a hash table hit, not a stat().
+ *
+ *  the catalog is filled by a walk of the tree on walk_threads threads, in
+ *  the background: until it is complete every lookup misses, and the callers
+ *  fall back to the file system. it is then kept current with inotify: every
+ *  directory is watched, and an event re-reads the metadata of the path it
+ *  names, so replaying events late still ends up right. an overflowing event
+ *  queue means a new walk. symbolic links are left out, a lookup through one
+ *  misses.
+ *
+ *  the catalog can be saved to a file, every save_interval seconds and when
+ *  the listeners go to a replacement server, which loads it instead of
+ *  walking the tree: only the directories are checked again, and the ones
+ *  whose times moved are read again. a file rewritten in place between the
+ *  save and the start of the new watches, without its directory changing,
+ *  keeps its old metadata until its next event.
+ *
+ *  every change takes the next generation, and the removals are remembered
+ *  too (the latest million of them), so the catalog doubles as
+ *  a change log: catalog_changes() tells what changed after a generation. a
+ *  catalog walked from scratch starts a log with a new id, the generations of
+ *  the previous one mean nothing to it.
+ *
+ *  inotify is used rather than fanotify, which needs CAP_SYS_ADMIN. when the
+ *  kernel refuses a watch (fs.inotify.max_user_watches), the catalog turns
+ *  itself off and every lookup misses.
+ */
+
+#ifndef CATALOG_H
+#define CATALOG_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <sys/stat.h>
+
+// a change of the catalog, see catalog_changes()
+typedef struct
+{
+	size_t name; // < offset of the path in the names of the change set
+	uint64_t generation;
+	bool removed;
+	bool directory;
+} catalog_change;
+
+typedef struct
+{
+	catalog_change* changes; // < the removals first, children before their parent, then the rest by path
+	size_t count;
+	char* names;
+	uint64_t log_id;
+	uint64_t generation; // < of the catalog when the changes were collected
+	bool complete; // < false: the log cannot go back that far, every path is listed and no removal
+} catalog_changeset;
+
+/*
+ *	Starts building the catalog of the current directory in the background, loading
+ *		the file path (NULL: no persistence) if it holds the catalog of the same tree.
+ *	Returns 0 on success, -1 on error.
+ */
+int catalog_start(const char* path, int walk_threads, int save_interval);
+
+/*
+ *	Finds path (relative, without "." or ".." components) in the catalog, filling
+ *		the device, inode, mode, size and times of st.
+ *	Returns 0 on success, -1 if the catalog does not know path (not yet, or at all).
+ */
+int catalog_stat(const char* path, struct stat* st);
+
+/*
+ *	Returns 0 and the digest of path in *digest if it is known for the file described by st,
+ *		-1 otherwise.
+ */
+int catalog_digest(const char* path, const struct stat* st, uint64_t* digest);
+
+/*
+ *	Records the digest of path, if the catalog entry is still the file described by st.
+ */
+void catalog_set_digest(const char* path, const struct stat* st, uint64_t digest);
+
+/*
+ *	Collects the changes of the log id after generation since: the paths changed or added
+ *		since, and the paths removed since. Freed with catalog_changes_free().
+ *	Returns 0 on success, -1 on error (EAGAIN: the catalog is not complete).
+ */
+int catalog_changes(uint64_t id, uint64_t since, catalog_changeset* set);
+
+void catalog_changes_free(catalog_changeset* set);
+
+/*
+ *	Saves the catalog to its file, if it has one and is complete. Concurrent saves
+ *		(the periodic one and that of a handoff) run one after the other.
+ *	Returns 0 on success, -1 on error.
+ */
+int catalog_save(void);
+
+/*
+ *	Stops updating the catalog and answering lookups, once it was saved for a
+ *		replacement server, which owns the file from now on.
+ */
+void catalog_stop(void);
+
+#endif
@@ -8,10 +8,29 @@
  *		- if the file exists, a message header with size == filesize is received
  *  5. if it exists, receive it
  *      - check the checksum for each segment. If it does not match, delete the output file and exit.
+ *
+ *  with -T the file arrives as a raw stream announced with its Merkle root, checked
+ *  on -j cores once received (see merkle.h).
+ *
+ *  -q prints the size, modification time and digest of files instead, in a single
+ *  request, and -l lists directories, without downloading anything.
+ *
+ *  -C keeps -o DIR a mirror of the served tree: every run asks for the changes since
+ *  the generation of the previous one, kept in DIR/.pad-sync, in a single stream.
+ *
+ *  -R fetches byte ranges of one file into memory in a single request (fetch_ranges())
+ *  and writes them to stdout. a negative offset counts from the end: -R -8:8 is the
+ *  last 8 bytes, where columnar formats keep the length of their footer.
+ *
+ *  several files (arguments and -i manifests) are fetched in one process by -c parallel
+ *  connections, into -o DIR, without prompts (-y).
  */
 
 
+#define _GNU_SOURCE // copy_file_range, splice
 #include <stdio.h>
+#include <getopt.h>
+#include <sys/stat.h>
 #include <stdlib.h>
 #include <strings.h>
 #include <string.h>
@@ -24,53 +43,286 @@
 #include <sys/types.h>
 #include <stdint.h>
 #include <errno.h>
+#include <math.h>
+#include <time.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <sys/un.h>
+#include <sys/mman.h>
+#include <stdatomic.h>
+#include <limits.h>
 #include "message.h"
+#include "metrics.h"
+#include "netio.h"
+#include "pool.h"
+#include "digest.h"
+#include "writebehind.h"
+#include "outfile.h"
+#include "socktune.h"
+#include "merkle.h"
 
 #define SERVER_IP "127.0.0.1"
-#define SERVER_PORT 8080
+#define SERVER_PORT "8080"
+#define DEFAULT_PREFIX "received_"
+#define MANIFEST_LINE_SIZE 4096
 #define DIVISOR 32
+#define STREAM_PIPE_SIZE (1024 * 1024)
+#define SYNC_STATE_FILE ".pad-sync"
 
 #define PRINT_USAGE()   fprintf(stderr, "Incorrect usage.\n");    \
-                        fprintf(stderr, "client FILE\n");
+                        fprintf(stderr, "client [-y] [-o DIR] [--max-size SIZE] [-c THREADS] FILE...\n");         \
+                        fprintf(stderr, "client [-y] [-o DIR] [--max-size SIZE] [-c THREADS] -i MANIFEST\n");         \
+                        fprintf(stderr, "client -m (print server metrics)\n");  \
+                        fprintf(stderr, "client -q [-g] FILE... (print size, modification time and digest)\n");  \
+                        fprintf(stderr, "client -l [-g] DIR... (list directories, . for the root)\n");  \
+                        fprintf(stderr, "client -C -o DIR (mirror the served tree into DIR, only what changed since the last sync)\n");  \
+                        fprintf(stderr, "client -R OFFSET:LENGTH[,...] FILE (byte ranges to stdout, negative OFFSET from the end)\n");  \
+                        fprintf(stderr, "client -L [-P] [-c THREADS] [-r RATE] [-n REQUESTS] [-z ZIPF_S] FILE...\n");  \
+                        fprintf(stderr, "  -s, --server HOST:PORT  server address (default " SERVER_IP ":" SERVER_PORT ")\n");  \
+                        fprintf(stderr, "  -o, --output-dir DIR    where received files go (default .)\n");  \
+                        fprintf(stderr, "  -p, --prefix PREFIX     prepended to received file names\n");  \
+                        fprintf(stderr, "                          (default " DEFAULT_PREFIX " without -o, none with it)\n");  \
+                        fprintf(stderr, "  -y, --yes               never ask before writing a file, needed for several files\n");  \
+                        fprintf(stderr, "  --max-size SIZE         skip files larger than SIZE bytes (K/M/G suffixes)\n");  \
+                        fprintf(stderr, "  -i, --input MANIFEST    also fetch the files listed in MANIFEST, one per line\n");  \
+                        fprintf(stderr, "  -c THREADS              concurrent downloads (default 4)\n");  \
+                        fprintf(stderr, "  -g, --digest            with -q and -l, have the server compute missing digests\n");  \
+                        fprintf(stderr, "  -t, --profile NAME      socket profile: default, lan-bulk, wan-bulk or low-latency\n");  \
+                        fprintf(stderr, "  -u PATH    connect over the server Unix socket instead of TCP\n");  \
+                        fprintf(stderr, "  -F         with -u, receive the open file descriptor instead of the data\n");  \
+                        fprintf(stderr, "  -Z         receive a raw stream with splice() and check its digest trailer\n");  \
+                        fprintf(stderr, "  -T         receive a raw stream with splice() and check its Merkle root\n");  \
+                        fprintf(stderr, "  -j THREADS threads checking a Merkle root (default: one per core)\n");  \
+                        fprintf(stderr, "  -W         write the output on the receiving thread instead of behind it\n");  \
+                        fprintf(stderr, "  -S POLICY  fsync received files: none, end (default) or periodic\n");
 
 /*
- * Sets up the socket and connects to the server.
+ * Load generator settings (client -L).
+ * Closed loop (default): every thread sends its next request when the previous one is done,
+ *      paced at RATE requests/s overall if -r is given.
+ * Open loop (-P): requests arrive as a Poisson process of RATE requests/s, served by
+ *      at most THREADS concurrent connections.
+ * Files are picked with a Zipf distribution of exponent ZIPF_S over the order they are given in.
+ */
+typedef struct
+{
+    char** files;
+    int file_count;
+    double* zipf_cdf;
+    double zipf_exponent;
+    int concurrency;
+    double rate;
+    bool open_loop;
+    uint64_t requests;
+    _Atomic uint64_t issued;
+    pthread_mutex_t schedule_lock;
+    uint64_t next_arrival;
+    uint64_t schedule_rng;
+} load_config;
+
+typedef struct
+{
+    load_config* config;
+    uint64_t rng;
+    histogram service;
+    histogram corrected;
+    uint64_t bytes;
+    uint64_t errors;
+} load_worker;
+
+// connection messages are only printed for interactive downloads
+static bool verbose = true;
+
+// segment buffers, reused across downloads and load generator threads
+static buffer_pool* segment_pool = NULL;
+
+// same-host fast path: connect over this Unix socket instead of TCP (-u),
+// and optionally ask for the file descriptor instead of the contents (-F)
+static const char* unix_socket_path = NULL;
+static bool pass_fd = false;
+
+// socket options of TCP connections (-t), see socktune.h
+static socket_profile tcp_profile = { .name = "default" };
+
+// zero-copy receive: ask for a raw stream and splice it into the output file (-Z)
+static bool stream_mode = false;
+
+// like -Z, with the Merkle root sent up front and checked on verify_threads cores (-T, -j)
+static bool tree_mode = false;
+static int verify_threads = 1;
+
+// disk writes on a writer thread, behind the network reads (-W turns it off)
+static bool write_behind_enabled = true;
+
+// when received files are made durable (-S)
+static enum fsync_policy fsync_policy = FSYNC_END;
+
+// TCP address of the server, resolved once (-s)
+static struct sockaddr_storage server_addr;
+static socklen_t server_addr_len = 0;
+
+// where received files go and what they are called (-o, -p)
+static const char* output_dir = ".";
+static const char* output_prefix = NULL;
+
+// non-interactive downloads (-y) and the largest file accepted (--max-size, 0 = any)
+static bool assume_yes = false;
+static uint64_t max_size = 0;
+
+// several files in one run: directory syncs wait for the end of the batch
+static bool batch_mode = false;
+
+enum download_result
+{
+    DOWNLOAD_OK,
+    DOWNLOAD_SKIPPED,
+    DOWNLOAD_FAILED
+};
+
+/*
+ * Batch downloads (several files or -i): THREADS threads take the next file of the list
+ * until there is none left.
+ */
+typedef struct
+{
+    char** files;
+    int file_count;
+    _Atomic int next;
+    _Atomic uint64_t bytes;
+    _Atomic int received;
+    _Atomic int skipped;
+    _Atomic int failed;
+} batch;
+
+/*
+ * Resolves HOST:PORT, [HOST]:PORT or HOST into the server address.
  * Returns 0 on success, -1 on error.
  */
+int resolve_server(const char* spec)
+{
+    char host[256];
+    const char* port = SERVER_PORT;
+    const char* colon = strrchr(spec, ':');
+    size_t host_len = strlen(spec);
+    if (spec[0] == '[')
+    {
+        // IPv6 literal, the port follows the closing bracket
+        const char* close_bracket = strchr(spec, ']');
+        if (close_bracket == NULL || (close_bracket[1] != '\0' && close_bracket[1] != ':'))
+        {
+            fprintf(stderr, "Invalid server address: %s\n", spec);
+            return -1;
+        }
+        host_len = close_bracket - spec - 1;
+        spec++;
+        port = close_bracket[1] == ':' ? close_bracket + 2 : port;
+    }
+    else if (colon != NULL && strchr(spec, ':') == colon)
+    {
+        host_len = colon - spec;
+        port = colon + 1;
+    }
+    if (host_len == 0 || host_len >= sizeof(host) || *port == '\0')
+    {
+        fprintf(stderr, "Invalid server address: %s\n", spec);
+        return -1;
+    }
+    memcpy(host, spec, host_len);
+    host[host_len] = '\0';
+
+    struct addrinfo hints;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    struct addrinfo* result = NULL;
+    int err = getaddrinfo(host, port, &hints, &result);
+    if (err != 0)
+    {
+        fprintf(stderr, "Could not resolve %s: %s\n", spec, gai_strerror(err));
+        return -1;
+    }
+    memcpy(&server_addr, result->ai_addr, result->ai_addrlen);
+    server_addr_len = result->ai_addrlen;
+    freeaddrinfo(result);
+    return 0;
+}
+
+/*
+ * Connects to the server over its Unix domain socket.
+ * Returns the socket file descriptor on success, -1 on error.
+ */
+int connect_unix(const char* path)
+{
+    struct sockaddr_un server_addr;
+    bzero(&server_addr, sizeof(struct sockaddr_un));
+    if (strlen(path) >= sizeof(server_addr.sun_path))
+    {
+        fprintf(stderr, "Unix socket path too long\n");
+        return -1;
+    }
+    server_addr.sun_family = AF_UNIX;
+    strcpy(server_addr.sun_path, path);
+
+    int socket_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (socket_fd == -1)
+    {
+        perror("Error opening socket");
+        return -1;
+    }
+    if (connect(socket_fd, (struct sockaddr*) &server_addr, sizeof(server_addr)) == -1)
+    {
+        perror("Failed to connect to server");
+        close(socket_fd);
+        return -1;
+    }
+    return socket_fd;
+}
+
+/*
+ * Sets up the socket and connects to the server.
+ * Returns the socket file descriptor on success, -1 on error.
+ */
 int init_and_connect()
 {
-    // sockaddr_in is used for ipv4 sockets
-    // zero all bytes of server_addr
-	struct sockaddr_in server_addr;
-	bzero(&server_addr, sizeof(struct sockaddr_in));
+    if (unix_socket_path != NULL)
+    {
+        int socket_fd = connect_unix(unix_socket_path);
+        if (socket_fd != -1 && verbose)
+        {
+            printf("Connection established!\n");
+        }
+        return socket_fd;
+    }
 
-    // open socket
-	int socket_fd = socket(AF_INET, SOCK_STREAM, 0);
+    // open a socket of the family the server address resolved to
+	int socket_fd = socket(server_addr.ss_family, SOCK_STREAM, 0);
 	if (socket_fd == -1)
 	{
 		perror("Error opening socket");
 		return -1;
 	}
 
-    // set server port and ip address
-	server_addr.sin_family = AF_INET;
-	server_addr.sin_port = htons(SERVER_PORT);
-	if(inet_aton(SERVER_IP, &server_addr.sin_addr) == 0)
-	{
-		fprintf(stderr, "Error interpreting ip address");
-		close(socket_fd);
-		return -1;
-	}
+    // before connect(), the receive buffer decides the window scale
+    const char* failed = NULL;
+    static _Atomic bool warned = false;
+    if (socket_tune(socket_fd, &tcp_profile, &failed) == -1 && !atomic_exchange(&warned, true))
+    {
+        fprintf(stderr, "Could not set %s of socket profile %s: %s\n", failed, tcp_profile.name, strerror(errno));
+    }
 
     // connecting client to server
-    socklen_t server_addr_len = sizeof(server_addr);
     if (connect(socket_fd, (struct sockaddr*) &server_addr, server_addr_len) == -1)
     {
         perror("Failed to connect to server");
         close(socket_fd);
         return -1;
     }
-    printf("Connection established!\n");
+    if (verbose)
+    {
+        printf("Connection established!\n");
+    }
 
     return socket_fd;
 }
@@ -84,7 +336,7 @@ int request_file(int socket_fd, const char* filename)
 {
     // build header for request message
     message_header header;
-    header.message_type = 'f';
+    header.message_type = pass_fd ? MSG_FD : tree_mode ? MSG_TREE : stream_mode ? MSG_STREAM : MSG_FILE;
     header.message_size = strlen(filename) + 1;
 
     // send header
@@ -110,11 +362,11 @@ int request_file(int socket_fd, const char* filename)
  * Any other value can be interpreted as the size of the requested file, in bytes.
  * A return value of -1 may signal an error, or an inappropriate reply (not file transfer).
  */
-int await_initial_server_reply(int socket_fd)
+int64_t await_initial_server_reply(int socket_fd)
 {
     // reading server reply
     message_header header;
-	if (read(socket_fd, (void*) &header, sizeof(message_header)) == -1)
+	if (read_full(socket_fd, (void*) &header, sizeof(message_header)) <= 0)
 	{
 		perror("Error receiving reply from server");
 		return -1;
@@ -131,169 +383,1739 @@ int await_initial_server_reply(int socket_fd)
 }
 
 /*
- * Receives the file segments from the socket and copies them in an output file
- * Message format: <header><payload><1 byte checksum>.
- * Returns 0 on success, -1 on error.
+ * Reads the reply to a file descriptor request.
+ * Returns the received descriptor (its file size in *filesize), -2 if the file
+ * doesn't exist on the server machine, or -1 on error.
  */
-int receive_file(int socket_fd, const char* filename, size_t filesize)
+int await_file_descriptor(int socket_fd, size_t* filesize)
 {
-    size_t received_size = 0;
     message_header header;
-    char* buffer = NULL; 
-    char* aux = NULL;
+    struct iovec iov = { &header, sizeof(message_header) };
+    union
+    {
+        char buffer[CMSG_SPACE(sizeof(int))];
+        struct cmsghdr align;
+    } control;
+    struct msghdr msg;
+    bzero(&msg, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buffer;
+    msg.msg_controllen = sizeof(control.buffer);
 
-    // creating an appropiate name for the received file (strlen())
-    size_t filename_len = strlen("received_") + strlen(filename) + 1;
-    char* filename_buffer = (char*) malloc(filename_len * sizeof(char));
-    if (filename_buffer == NULL)
+    if (recvmsg(socket_fd, &msg, MSG_CMSG_CLOEXEC) != sizeof(message_header) || header.message_type != MSG_FD)
     {
-        errno = ENOMEM;
-        perror("Could not create buffer for filename");
+        fprintf(stderr, "Invalid file descriptor reply\n");
         return -1;
     }
-    sprintf(filename_buffer, "received_%s", filename);
+    if (header.message_size == 0)
+    {
+        return -2;
+    }
 
-    // open output file
-    FILE* file = fopen(filename_buffer, "w");
-    if (file == NULL)
+    struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+    if (cmsg == NULL || cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
     {
-        perror("Could not open output file");
-        free(filename_buffer);
+        fprintf(stderr, "No file descriptor in the reply\n");
         return -1;
     }
+    int file_fd;
+    memcpy(&file_fd, CMSG_DATA(cmsg), sizeof(int));
+    *filesize = header.message_size;
+    return file_fd;
+}
 
-    // read file segments from the socket until I will have read the size of the entire file
-    while (received_size < filesize)
+/*
+ * Copies filesize bytes from a descriptor passed by the server into out_fd,
+ * in the kernel when possible (copy_file_range), or discards them if out_fd is -1.
+ * Returns 0 on success, -1 on error.
+ */
+int copy_passed_file(int file_fd, int out_fd, size_t filesize)
+{
+    size_t copied = 0;
+    while (out_fd != -1 && copied < filesize)
     {
-        // read the header for the current message
-        if (read(socket_fd, &header, sizeof(message_header)) == -1)
+        ssize_t ret = copy_file_range(file_fd, NULL, out_fd, NULL, filesize - copied, 0);
+        if (ret <= 0)
         {
-            perror("Error reading header");
-            fclose(file);
-            free(buffer);
-            free(filename_buffer);
-            return -1;
+            // not supported between these files, fall back to read/write below
+            break;
         }
+        copied += ret;
+    }
 
-        // adjust buffer for storing file segment based on the size of the current message
-        aux = (char*) realloc(buffer, header.message_size * sizeof(char));
-        if (aux == NULL)
+    char* buffer = NULL;
+    while (copied < filesize)
+    {
+        if (buffer == NULL && (buffer = (char*) pool_get(segment_pool)) == NULL)
         {
             errno = ENOMEM;
-            perror("Failed to adjust buffer");
-            fclose(file);
-            free(buffer);
-            free(filename_buffer);
+            perror("Could not get a copy buffer");
             return -1;
         }
-        buffer = aux;
-
-        // read the file segment from the socket into the buffer
-        ssize_t read_size = 0;
-        if ((read_size = read(socket_fd, buffer, header.message_size+1)) == -1)
+        size_t len = filesize - copied < MAX_SEGMENT_SIZE ? filesize - copied : MAX_SEGMENT_SIZE;
+        ssize_t read_size = read(file_fd, buffer, len);
+        if (read_size <= 0 || (out_fd != -1 && write_full(out_fd, buffer, read_size) == -1))
         {
-            perror("Error reading file segment from socket");
-            fclose(file);
-            free(buffer);
-            free(filename_buffer);
+            perror("Error copying the passed file");
+            pool_put(segment_pool, buffer);
             return -1;
         }
+        copied += read_size;
+    }
 
-        // compute the checksum on the received segment
-        int checksum = 0;
-		for(int i=0; i<read_size-1; i++){
-			checksum += (int) buffer[i];
-		}
-		checksum = checksum % DIVISOR;
+    pool_put(segment_pool, buffer);
+    return 0;
+}
 
-        // check your checksum against the received one
-		if(checksum != (int) buffer[read_size-1]){
-            fprintf(stderr, "Wrong checksum!\n");
-            fclose(file);
-            free(buffer);
-            remove(filename_buffer);
-            free(filename_buffer);
+/*
+ * Reads the Merkle root that follows the initial reply of a tree request.
+ * Returns 0 on success, -1 on error.
+ */
+int await_tree_root(int socket_fd, uint64_t* root)
+{
+    message_header header;
+    if (read_full(socket_fd, &header, sizeof(message_header)) <= 0
+        || header.message_type != MSG_TREE || header.message_size != MERKLE_ROOT_SIZE
+        || read_full(socket_fd, root, MERKLE_ROOT_SIZE) <= 0)
+    {
+        fprintf(stderr, "Missing Merkle root\n");
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Reads the initial reply for the current transfer mode.
+ * Same return values as await_initial_server_reply(); with fd passing,
+ * *passed_fd receives the file descriptor of an existing file (-1 otherwise),
+ * in tree mode *root receives the Merkle root of an existing file.
+ */
+int64_t await_reply(int socket_fd, int* passed_fd, uint64_t* root)
+{
+    *passed_fd = -1;
+    if (!pass_fd)
+    {
+        int64_t filesize = await_initial_server_reply(socket_fd);
+        if (tree_mode && filesize > 0 && await_tree_root(socket_fd, root) == -1)
+        {
             return -1;
         }
-        
-        // write the file segment in the output file
-        if (fwrite(buffer, sizeof(char), read_size-1, file) != read_size-1)
+        return filesize;
+    }
+
+    size_t filesize = 0;
+    int file_fd = await_file_descriptor(socket_fd, &filesize);
+    if (file_fd == -2)
+    {
+        return 0;
+    }
+    if (file_fd == -1)
+    {
+        return -1;
+    }
+    *passed_fd = file_fd;
+    return filesize;
+}
+
+/*
+ * Asks the server for its metrics and prints them to stdout.
+ * Returns 0 on success, -1 on error.
+ */
+int request_metrics(int socket_fd)
+{
+    message_header header;
+    header.message_type = MSG_METRICS;
+    header.message_size = 0;
+    if (write_full(socket_fd, &header, sizeof(message_header)) == -1)
+    {
+        perror("Error sending metrics request");
+        return -1;
+    }
+
+    if (read_full(socket_fd, &header, sizeof(message_header)) <= 0 || header.message_type != MSG_METRICS)
+    {
+        fprintf(stderr, "Invalid metrics reply\n");
+        return -1;
+    }
+
+    // the text can span several socket reads
+    char buffer[4096];
+    size_t remaining = header.message_size;
+    while (remaining > 0)
+    {
+        ssize_t read_size = read(socket_fd, buffer, remaining < sizeof(buffer) ? remaining : sizeof(buffer));
+        if (read_size <= 0)
         {
-            fprintf(stderr, "Not enough bytes were written in the output file.\n");
-            fclose(file);
-            free(buffer);
-            remove(filename_buffer);
-            free(filename_buffer);
+            perror("Error reading metrics");
             return -1;
         }
-
-        // increment number of transferred bytes
-        received_size += read_size - 1;
+        fwrite(buffer, sizeof(char), read_size, stdout);
+        remaining -= read_size;
     }
 
-    fclose(file);
-    free(buffer);
-    free(filename_buffer);
     return 0;
 }
 
-int main(int argc, char* argv[])
+/*
+ * Sends a metadata query: the header, the query_request and the names, each NUL terminated.
+ * Returns 0 on success, -1 on error.
+ */
+int send_query(int socket_fd, char type, const query_request* query, char** names, int name_count)
 {
-    // parse requested file name from command line arguments
-    if (argc < 2)
+    size_t size = sizeof(query_request);
+    for (int i = 0; i < name_count; i++)
     {
-        PRINT_USAGE();
-        exit(EXIT_FAILURE);
+        size += strlen(names[i]) + 1;
+    }
+    char* message = (char*) malloc(sizeof(message_header) + size);
+    if (message == NULL)
+    {
+        perror("Could not build the query");
+        return -1;
     }
-    char* requested_filename = argv[1];
 
-    // init the socket and connect to the server
-    int socket_fd = init_and_connect();
-    if (socket_fd == -1)
+    message_header header;
+    header.message_type = type;
+    header.message_size = size;
+    memcpy(message, &header, sizeof(message_header));
+    memcpy(message + sizeof(message_header), query, sizeof(query_request));
+    char* next = message + sizeof(message_header) + sizeof(query_request);
+    for (int i = 0; i < name_count; i++)
     {
-        exit(EXIT_FAILURE);
+        size_t len = strlen(names[i]) + 1;
+        memcpy(next, names[i], len);
+        next += len;
     }
 
-    // request the file from the server
-    if (request_file(socket_fd, requested_filename) == -1)
+    int ret_val = write_full(socket_fd, message, sizeof(message_header) + size);
+    if (ret_val == -1)
     {
-        close(socket_fd);
-        exit(EXIT_FAILURE);
+        perror("Error sending query");
     }
+    free(message);
+    return ret_val;
+}
 
-    // receive reply from server. does the file exist or not? if yes, receive it
-    int filesize = await_initial_server_reply(socket_fd);
-    if (filesize == -1)
+/*
+ * Reads the reply to a query of type, *size bytes after the header.
+ * Returns the reply, to be freed, or NULL on error.
+ */
+char* await_query_reply(int socket_fd, char type, size_t* size)
+{
+    message_header header;
+    if (read_full(socket_fd, &header, sizeof(message_header)) <= 0 || header.message_type != type)
     {
-        // error
-        close(socket_fd);
-        exit(EXIT_FAILURE);
+        fprintf(stderr, "Invalid query reply\n");
+        return NULL;
     }
-    else if (filesize == 0)
+    char* reply = (char*) malloc(header.message_size + 1);
+    if (reply == NULL)
     {
-        // file does not exist
-        printf("File does not exist on server machine.\n");
+        perror("Could not receive the query reply");
+        return NULL;
     }
-    else
+    if (header.message_size > 0 && read_full(socket_fd, reply, header.message_size) <= 0)
     {
-        // ask for permission to allocate memory
-        printf("After this operation, %d bytes of additional disk space will be used.\nDo you want to continue? [y/n]", filesize);
-        char response;
-        scanf("%c", &response);
+        perror("Error reading query reply");
+        free(reply);
+        return NULL;
+    }
+    *size = header.message_size;
+    return reply;
+}
 
-        if(response == 'Y' || response == 'y'){
-            // file exists, proceed with receiving it
-            if (receive_file(socket_fd, requested_filename, filesize) == -1)
+/*
+ * Prints one line: type, size, modification time, digest and name.
+ */
+static void print_info(const file_info* info, const char* name)
+{
+    if (info->type == INFO_MISSING)
+    {
+        printf("- %12s %20s %16s %s\n", "-", "-", "-", name);
+        return;
+    }
+    char digest[17] = "-";
+    if (info->has_digest)
+    {
+        snprintf(digest, sizeof(digest), "%016llx", (unsigned long long) info->digest);
+    }
+    printf("%c %12llu %10lld.%09lld %16s %s\n", (char) info->type, (unsigned long long) info->size,
+        (long long) (info->mtime_ns / 1000000000), (long long) (info->mtime_ns % 1000000000), digest, name);
+}
+
+/*
+ * Prints the metadata of the files, up to MAX_BULK_NAMES of them per request.
+ * Returns 0 if every file exists, -1 otherwise or on error.
+ */
+int run_stat(char** files, int file_count, uint32_t flags)
+{
+    int ret_val = 0;
+    for (int first = 0; first < file_count; first += MAX_BULK_NAMES)
+    {
+        int count = file_count - first < MAX_BULK_NAMES ? file_count - first : MAX_BULK_NAMES;
+        char type = count == 1 ? MSG_STAT : MSG_BULK_STAT;
+        query_request query = { flags, 0, (uint32_t) count };
+        size_t size = 0;
+        char* reply = NULL;
+        int socket_fd = init_and_connect();
+        if (socket_fd == -1 || send_query(socket_fd, type, &query, files + first, count) == -1
+            || (reply = await_query_reply(socket_fd, type, &size)) == NULL || size != count * sizeof(file_info))
+        {
+            if (socket_fd != -1)
             {
-                fprintf(stderr, "File not transmitted properly.\n");
+                close(socket_fd);
             }
-            else
+            free(reply);
+            return -1;
+        }
+        close(socket_fd);
+
+        for (int i = 0; i < count; i++)
+        {
+            file_info info;
+            memcpy(&info, reply + i * sizeof(file_info), sizeof(file_info));
+            print_info(&info, files[first + i]);
+            ret_val = info.type == INFO_MISSING ? -1 : ret_val;
+        }
+        free(reply);
+    }
+    return ret_val;
+}
+
+/*
+ * Prints every entry of the directory, "." for the document root, a page per request.
+ * Returns 0 on success, -1 on error or if there is no such directory.
+ */
+int run_list(const char* directory, uint32_t flags)
+{
+    char* name = strcmp(directory, ".") == 0 ? "" : (char*) directory;
+    uint32_t offset = 0;
+    while (1)
+    {
+        // count 0: pages as long as the server allows
+        query_request query = { flags, offset, 0 };
+        size_t size = 0;
+        char* reply = NULL;
+        int socket_fd = init_and_connect();
+        if (socket_fd == -1 || send_query(socket_fd, MSG_LIST, &query, &name, 1) == -1
+            || (reply = await_query_reply(socket_fd, MSG_LIST, &size)) == NULL)
+        {
+            if (socket_fd != -1)
+            {
+                close(socket_fd);
+            }
+            return -1;
+        }
+        close(socket_fd);
+        if (size == 0)
+        {
+            fprintf(stderr, "No such directory on the server: %s\n", directory);
+            free(reply);
+            return -1;
+        }
+
+        list_reply head;
+        memcpy(&head, reply, sizeof(list_reply));
+        size_t position = sizeof(list_reply);
+        for (uint32_t i = 0; i < head.count; i++)
+        {
+            file_info info;
+            if (position + sizeof(file_info) >= size || memchr(reply + position + sizeof(file_info), '\0', size - position - sizeof(file_info)) == NULL)
             {
-                printf("File received!\n");
+                fprintf(stderr, "Invalid listing reply\n");
+                free(reply);
+                return -1;
             }
+            memcpy(&info, reply + position, sizeof(file_info));
+            const char* entry_name = reply + position + sizeof(file_info);
+            print_info(&info, entry_name);
+            position += sizeof(file_info) + strlen(entry_name) + 1;
+        }
+        free(reply);
+
+        offset += head.count;
+        if (head.count == 0 || offset >= head.total)
+        {
+            return 0;
         }
     }
+}
 
-	close(socket_fd);
-	return 0;
+/*
+ * Reads count byte ranges of the served file filename straight into memory, in a single
+ * request, nothing is written to disk. buffers[i] receives at most ranges[i].length bytes;
+ * served[i] tells where they start in the file and how many there were (fewer at its end).
+ * A NULL buffers[i] is allocated with malloc() for the served length, so a range past the
+ * end of a small file costs no more memory than the file; the caller frees it.
+ * info describes the file, type INFO_MISSING if there is no such file.
+ * Returns 0 on success (also for a missing file), -1 on error.
+ */
+int fetch_ranges(const char* filename, const byte_range* ranges, int count, char** buffers, byte_range* served, file_info* info)
+{
+    if (count < 1 || count > MAX_RANGES)
+    {
+        fprintf(stderr, "Between 1 and %d ranges per request\n", MAX_RANGES);
+        return -1;
+    }
+    size_t ranges_size = count * sizeof(byte_range);
+    size_t name_size = strlen(filename) + 1;
+    message_header header;
+    header.message_type = MSG_RANGE;
+    header.message_size = sizeof(range_request) + ranges_size + name_size;
+    range_request request = { (uint32_t) count, 0 };
+    struct iovec iov[4] = {
+        { &header, sizeof(message_header) },
+        { &request, sizeof(range_request) },
+        { (void*) ranges, ranges_size },
+        { (void*) filename, name_size }
+    };
+
+    int socket_fd = init_and_connect();
+    if (socket_fd == -1)
+    {
+        return -1;
+    }
+    if (writev_full(socket_fd, iov, 4) == -1)
+    {
+        perror("Error sending range request");
+        close(socket_fd);
+        return -1;
+    }
+
+    range_reply reply;
+    if (read_full(socket_fd, &header, sizeof(message_header)) <= 0 || header.message_type != MSG_RANGE
+        || (header.message_size != 0 && header.message_size != sizeof(range_reply))
+        || (header.message_size != 0 && (read_full(socket_fd, &reply, sizeof(range_reply)) <= 0 || reply.count != (uint32_t) count)))
+    {
+        fprintf(stderr, "Invalid range reply\n");
+        close(socket_fd);
+        return -1;
+    }
+    if (header.message_size == 0)
+    {
+        memset(info, 0, sizeof(file_info));
+        info->type = INFO_MISSING;
+        close(socket_fd);
+        return 0;
+    }
+
+    *info = reply.info;
+    for (int i = 0; i < count; i++)
+    {
+        if (read_full(socket_fd, &served[i], sizeof(byte_range)) <= 0 || served[i].length > ranges[i].length)
+        {
+            fprintf(stderr, "Error reading range %d of %s\n", i, filename);
+            close(socket_fd);
+            return -1;
+        }
+        // at least one byte, so an empty range still has a buffer
+        if (buffers[i] == NULL && (buffers[i] = (char*) malloc(served[i].length > 0 ? served[i].length : 1)) == NULL)
+        {
+            perror("Could not allocate a range buffer");
+            close(socket_fd);
+            return -1;
+        }
+        if (served[i].length > 0 && read_full(socket_fd, buffers[i], served[i].length) <= 0)
+        {
+            fprintf(stderr, "Error reading range %d of %s\n", i, filename);
+            close(socket_fd);
+            return -1;
+        }
+    }
+    close(socket_fd);
+    return 0;
+}
+
+/*
+ * Writes the ranges of filename to stdout, one after the other.
+ * Returns 0 on success, -1 on error or if there is no such file.
+ */
+int run_ranges(const char* filename, const byte_range* ranges, int count)
+{
+    char** buffers = (char**) calloc(count, sizeof(char*));
+    byte_range* served = (byte_range*) calloc(count, sizeof(byte_range));
+    int ret_val = buffers != NULL && served != NULL ? 0 : -1;
+    if (ret_val == -1)
+    {
+        perror("Could not allocate the range buffers");
+    }
+
+    file_info info;
+    if (ret_val == 0 && (ret_val = fetch_ranges(filename, ranges, count, buffers, served, &info)) == 0 && info.type == INFO_MISSING)
+    {
+        fprintf(stderr, "No such file on the server: %s\n", filename);
+        ret_val = -1;
+    }
+    for (int i = 0; ret_val == 0 && i < count; i++)
+    {
+        if (served[i].length < ranges[i].length)
+        {
+            fprintf(stderr, "Range %d: %llu bytes at %lld, the file has %llu\n", i, (unsigned long long) served[i].length,
+                (long long) served[i].offset, (unsigned long long) info.size);
+        }
+        if (fwrite(buffers[i], 1, served[i].length, stdout) != served[i].length)
+        {
+            perror("Error writing the ranges");
+            ret_val = -1;
+        }
+    }
+
+    for (int i = 0; buffers != NULL && i < count; i++)
+    {
+        free(buffers[i]);
+    }
+    free(buffers);
+    free(served);
+    return ret_val;
+}
+
+/*
+ * Receives the file segments from the socket, checks them and hands them to the writer.
+ * A NULL writer discards the data after the checksum is verified (load generator mode).
+ * Segments are read straight into the writer's blocks, so they are never copied in userspace.
+ * Message format: <header><payload><1 byte checksum>.
+ * Returns 0 on success, -1 on error.
+ */
+int receive_segments(int socket_fd, write_behind* writer, size_t filesize)
+{
+    size_t received_size = 0;
+    message_header header;
+
+    // one buffer fits any segment, so it is taken once instead of resized per segment
+    char* scratch = NULL;
+    if (writer == NULL && (scratch = (char*) pool_get(segment_pool)) == NULL)
+    {
+        errno = ENOMEM;
+        perror("Could not get a segment buffer");
+        return -1;
+    }
+
+    // read file segments from the socket until I will have read the size of the entire file
+    while (received_size < filesize)
+    {
+        // read the header for the current message
+        ssize_t header_size = read_full(socket_fd, &header, sizeof(message_header));
+        if (header_size <= 0 || header.message_size == 0 || header.message_size > MAX_SEGMENT_SIZE)
+        {
+            // the server closes the connection when it cannot send the rest of the file
+            errno = header_size == 0 ? ECONNRESET : header_size > 0 ? EPROTO : errno;
+            perror("Error reading header");
+            pool_put(segment_pool, scratch);
+            return -1;
+        }
+
+        // the segment and its checksum byte land at the end of the writer's current block
+        char* buffer = writer != NULL ? wb_reserve(writer, header.message_size + 1) : scratch;
+        if (buffer == NULL)
+        {
+            perror("Error writing the output file");
+            return -1;
+        }
+
+        // read the file segment from the socket into the buffer
+        // a segment can arrive in several pieces, so read until it is complete
+        ssize_t read_size = 0;
+        if ((read_size = read_full(socket_fd, buffer, header.message_size+1)) <= 0)
+        {
+            errno = read_size == 0 ? ECONNRESET : errno;
+            perror("Error reading file segment from socket");
+            pool_put(segment_pool, scratch);
+            return -1;
+        }
+
+        // compute the checksum on the received segment
+        int checksum = 0;
+		for(int i=0; i<read_size-1; i++){
+			checksum += (int) buffer[i];
+		}
+		checksum = checksum % DIVISOR;
+
+        // check your checksum against the received one
+		if(checksum != (int) buffer[read_size-1]){
+            fprintf(stderr, "Wrong checksum!\n");
+            pool_put(segment_pool, scratch);
+            return -1;
+        }
+
+        // only the payload goes to the file, the checksum byte is overwritten by the next segment
+        if (writer != NULL)
+        {
+            wb_commit(writer, read_size-1);
+        }
+
+        // increment number of transferred bytes
+        received_size += read_size - 1;
+    }
+
+    pool_put(segment_pool, scratch);
+    return 0;
+}
+
+/*
+ * Moves filesize bytes of a raw stream from the socket into out_fd through a pipe
+ * with splice(), so the data is never copied to userspace, then reads the digest trailer
+ * into *digest. A tree mode stream has no trailer, digest is NULL then.
+ * Returns 0 on success, -1 on error.
+ */
+int splice_stream(int socket_fd, int out_fd, size_t filesize, uint64_t* digest)
+{
+    int pipe_fds[2];
+    if (pipe2(pipe_fds, O_CLOEXEC) == -1)
+    {
+        perror("Could not create pipe");
+        return -1;
+    }
+    // a bigger pipe means fewer splice calls, the default is only 64 KB
+    fcntl(pipe_fds[1], F_SETPIPE_SZ, STREAM_PIPE_SIZE);
+
+    size_t moved = 0;
+    while (moved < filesize)
+    {
+        size_t len = filesize - moved < STREAM_PIPE_SIZE ? filesize - moved : STREAM_PIPE_SIZE;
+        ssize_t in = splice(socket_fd, NULL, pipe_fds[1], NULL, len, SPLICE_F_MOVE | SPLICE_F_MORE);
+        if (in <= 0)
+        {
+            perror("Error splicing from socket");
+            close(pipe_fds[0]);
+            close(pipe_fds[1]);
+            return -1;
+        }
+        while (in > 0)
+        {
+            ssize_t out = splice(pipe_fds[0], NULL, out_fd, NULL, in, SPLICE_F_MOVE | SPLICE_F_MORE);
+            if (out <= 0)
+            {
+                perror("Error splicing to output file");
+                close(pipe_fds[0]);
+                close(pipe_fds[1]);
+                return -1;
+            }
+            in -= out;
+            moved += out;
+        }
+    }
+    close(pipe_fds[0]);
+    close(pipe_fds[1]);
+    if (digest == NULL)
+    {
+        return 0;
+    }
+
+    message_header header;
+    if (read_full(socket_fd, &header, sizeof(message_header)) <= 0
+        || header.message_type != MSG_STREAM || header.message_size != DIGEST_TRAILER_SIZE
+        || read_full(socket_fd, digest, DIGEST_TRAILER_SIZE) <= 0)
+    {
+        fprintf(stderr, "Missing digest trailer\n");
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Checks the digest of the first filesize bytes of fd against the expected one.
+ * The file is mapped, so it is hashed straight from the page cache.
+ * Returns 0 if they match, -1 otherwise.
+ */
+int verify_digest(int fd, size_t filesize, uint64_t expected)
+{
+    void* data = mmap(NULL, filesize, PROT_READ, MAP_SHARED, fd, 0);
+    if (data == MAP_FAILED)
+    {
+        perror("Could not map the output file");
+        return -1;
+    }
+    madvise(data, filesize, MADV_SEQUENTIAL);
+    uint64_t actual = digest_buffer(data, filesize, 0);
+    munmap(data, filesize);
+
+    if (actual != expected)
+    {
+        fprintf(stderr, "Wrong digest!\n");
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Checks the Merkle root of the first filesize bytes of fd against the expected one,
+ * hashing the leaves on verify_threads threads straight from the page cache.
+ * Returns 0 if they match, -1 otherwise.
+ */
+int verify_root(int fd, size_t filesize, uint64_t expected)
+{
+    void* data = mmap(NULL, filesize, PROT_READ, MAP_SHARED, fd, 0);
+    if (data == MAP_FAILED)
+    {
+        perror("Could not map the output file");
+        return -1;
+    }
+    uint64_t actual = 0;
+    int ret_val = merkle_root_parallel(data, filesize, verify_threads, &actual);
+    munmap(data, filesize);
+
+    if (ret_val == -1)
+    {
+        perror("Could not check the Merkle root");
+        return -1;
+    }
+    if (actual != expected)
+    {
+        fprintf(stderr, "Wrong Merkle root!\n");
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Returns true if a requested name can be written below the output directory:
+ * relative, without empty, "." or ".." components.
+ */
+static bool safe_output_name(const char* filename)
+{
+    if (filename[0] == '\0' || filename[0] == '/')
+    {
+        return false;
+    }
+    for (const char* part = filename; part != NULL; part = strchr(part, '/') != NULL ? strchr(part, '/') + 1 : NULL)
+    {
+        size_t len = strcspn(part, "/");
+        if (len == 0 || (len == 1 && part[0] == '.') || (len == 2 && part[0] == '.' && part[1] == '.'))
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+/*
+ * Creates path and its missing parents, like mkdir -p.
+ * Returns 0 on success, -1 on error.
+ */
+static int make_directories(char* path)
+{
+    for (char* slash = strchr(path + 1, '/'); slash != NULL; slash = strchr(slash + 1, '/'))
+    {
+        *slash = '\0';
+        int ret = mkdir(path, 0755);
+        *slash = '/';
+        if (ret == -1 && errno != EEXIST)
+        {
+            return -1;
+        }
+    }
+    return mkdir(path, 0755) == -1 && errno != EEXIST ? -1 : 0;
+}
+
+/*
+ * Receives the file from the socket in the output directory, as <prefix><filename>.
+ * With a passed_fd (not -1) the data is copied from that descriptor instead.
+ * In tree mode the received file must have the Merkle root root.
+ * The output is preallocated to filesize and segments are written behind the network reads.
+ * The data goes to an unnamed file that replaces the output only once it is
+ * complete and verified (see outfile.h), so a failed transfer leaves nothing behind.
+ * In a batch the directories are synced once at the end instead of after every file.
+ * Returns 0 on success, -1 on error.
+ */
+int receive_file(int socket_fd, const char* filename, size_t filesize, int passed_fd, uint64_t root)
+{
+    // the output keeps the directories of the requested name, below the output directory
+    char output_path[PATH_MAX];
+    const char* base = strrchr(filename, '/');
+    base = base != NULL ? base + 1 : filename;
+    int dir_len = (int) (base - filename);
+    char output_name[NAME_MAX + 1];
+    if (snprintf(output_path, sizeof(output_path), "%s/%.*s", output_dir, dir_len, filename) >= (int) sizeof(output_path)
+        || snprintf(output_name, sizeof(output_name), "%s%s", output_prefix, base) >= (int) sizeof(output_name))
+    {
+        fprintf(stderr, "File name too long: %s\n", filename);
+        return -1;
+    }
+    if (dir_len > 0 && make_directories(output_path) == -1)
+    {
+        perror("Could not create the output directory");
+        return -1;
+    }
+
+    // readable too so a streamed file can be mapped for its digest check
+    output_file out;
+    if (output_open(&out, output_path, output_name) == -1)
+    {
+        perror("Could not open output file");
+        return -1;
+    }
+
+    // the writer also preallocates the file, for every transfer mode
+    write_behind* writer = wb_open(out.fd, filesize, segment_pool, write_behind_enabled,
+        fsync_policy == FSYNC_PERIODIC ? FSYNC_PERIOD : 0);
+    if (writer == NULL)
+    {
+        perror("Could not prepare the output file");
+        output_discard(&out);
+        return -1;
+    }
+
+    int ret_val;
+    uint64_t digest = 0;
+    if (passed_fd != -1)
+    {
+        ret_val = copy_passed_file(passed_fd, out.fd, filesize);
+    }
+    else if (tree_mode)
+    {
+        ret_val = splice_stream(socket_fd, out.fd, filesize, NULL);
+        if (ret_val == 0)
+        {
+            ret_val = verify_root(out.fd, filesize, root);
+        }
+    }
+    else if (stream_mode)
+    {
+        ret_val = splice_stream(socket_fd, out.fd, filesize, &digest);
+        if (ret_val == 0)
+        {
+            ret_val = verify_digest(out.fd, filesize, digest);
+        }
+    }
+    else
+    {
+        ret_val = receive_segments(socket_fd, writer, filesize);
+    }
+    if (wb_close(writer, NULL) == -1 && ret_val == 0)
+    {
+        perror("Error writing the output file");
+        ret_val = -1;
+    }
+    if (ret_val == -1)
+    {
+        output_discard(&out);
+        return -1;
+    }
+
+    if (output_publish(&out, fsync_policy, !batch_mode) == -1)
+    {
+        perror("Could not publish the output file");
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Applies one record of a changes reply below the output directory: removes the path,
+ * creates the directory or receives the file (checked against its Merkle root when the
+ * server sent one).
+ * Returns 0 on success, -1 on error.
+ */
+static int apply_change(int socket_fd, const change_record* record, const char* name)
+{
+    char path[PATH_MAX];
+    if (!safe_output_name(name) || strcmp(name, SYNC_STATE_FILE) == 0
+        || snprintf(path, sizeof(path), "%s/%s", output_dir, name) >= (int) sizeof(path))
+    {
+        fprintf(stderr, "Refusing to sync %s\n", name);
+        return -1;
+    }
+
+    if (record->info.type == INFO_MISSING)
+    {
+        // the children of a removed directory were removed before it
+        if (unlink(path) == -1 && (errno == EISDIR ? rmdir(path) == -1 && errno != ENOENT : errno != ENOENT))
+        {
+            fprintf(stderr, "Could not remove %s: %s\n", path, strerror(errno));
+            return -1;
+        }
+        return 0;
+    }
+    if (record->info.type == INFO_DIRECTORY)
+    {
+        if (make_directories(path) == -1)
+        {
+            perror("Could not create the directory");
+            return -1;
+        }
+        return 0;
+    }
+
+    char* slash = strrchr(path, '/');
+    *slash = '\0';
+    if (make_directories(path) == -1)
+    {
+        perror("Could not create the output directory");
+        return -1;
+    }
+    output_file out;
+    if (output_open(&out, path, slash + 1) == -1)
+    {
+        perror("Could not open output file");
+        return -1;
+    }
+    size_t filesize = record->info.size;
+    if (filesize > 0 && (splice_stream(socket_fd, out.fd, filesize, NULL) == -1
+        || (record->info.has_digest && verify_root(out.fd, filesize, record->info.digest) == -1)))
+    {
+        output_discard(&out);
+        return -1;
+    }
+    if (output_publish(&out, fsync_policy, false) == -1)
+    {
+        perror("Could not publish the output file");
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Brings the output directory up to date with the served tree: asks for the changes since
+ * the generation of the last sync, recorded in SYNC_STATE_FILE, applies them and records
+ * the new generation. A sync that fails halfway is done again from the old generation.
+ * Returns 0 on success, -1 on error.
+ */
+int run_sync(void)
+{
+    char state_path[PATH_MAX], temp_path[PATH_MAX];
+    snprintf(state_path, sizeof(state_path), "%s/" SYNC_STATE_FILE, output_dir);
+    snprintf(temp_path, sizeof(temp_path), "%s/" SYNC_STATE_FILE ".tmp", output_dir);
+    changes_request query = { 0, 0 };
+    FILE* state = fopen(state_path, "r");
+    if (state != NULL)
+    {
+        unsigned long long id, since;
+        if (fscanf(state, "%llx %llu", &id, &since) == 2)
+        {
+            query.log_id = id;
+            query.since = since;
+        }
+        fclose(state);
+    }
+
+    message_header header;
+    header.message_type = MSG_CHANGES;
+    header.message_size = sizeof(changes_request);
+    struct iovec iov[2] = {
+        { &header, sizeof(message_header) },
+        { &query, sizeof(changes_request) }
+    };
+    changes_reply reply;
+    int socket_fd = init_and_connect();
+    if (socket_fd == -1 || writev_full(socket_fd, iov, 2) == -1
+        || read_full(socket_fd, &header, sizeof(message_header)) <= 0 || header.message_type != MSG_CHANGES
+        || (header.message_size != 0 && (header.message_size != sizeof(changes_reply) || read_full(socket_fd, &reply, sizeof(changes_reply)) <= 0)))
+    {
+        fprintf(stderr, "Changes request failed\n");
+        if (socket_fd != -1)
+        {
+            close(socket_fd);
+        }
+        return -1;
+    }
+    if (header.message_size == 0)
+    {
+        fprintf(stderr, "The server has no catalog (yet), see catalog.enabled\n");
+        close(socket_fd);
+        return -1;
+    }
+    if ((reply.flags & CHANGES_RESET) && query.log_id != 0)
+    {
+        fprintf(stderr, "The server cannot tell the changes since generation %llu, receiving the whole tree;"
+            " files it removed before are not removed here\n", (unsigned long long) query.since);
+    }
+
+    uint64_t counts[3] = { 0 }, bytes = 0;
+    uint64_t start = metrics_now_ns();
+    char name[PATH_MAX];
+    for (uint32_t i = 0; i < reply.count; i++)
+    {
+        change_record record;
+        if (read_full(socket_fd, &record, sizeof(change_record)) <= 0 || record.name_size == 0 || record.name_size > sizeof(name)
+            || read_full(socket_fd, name, record.name_size) <= 0 || name[record.name_size - 1] != '\0'
+            || apply_change(socket_fd, &record, name) == -1)
+        {
+            fprintf(stderr, "Sync interrupted after %u of %u changes\n", i, reply.count);
+            close(socket_fd);
+            return -1;
+        }
+        counts[record.info.type == INFO_FILE ? 0 : record.info.type == INFO_DIRECTORY ? 1 : 2]++;
+        bytes += record.info.type == INFO_FILE ? record.info.size : 0;
+    }
+    close(socket_fd);
+
+    // the new generation is only recorded once everything up to it is on disk
+    state = fopen(temp_path, "w");
+    if (output_sync_dir(output_dir) == -1 || state == NULL
+        || fprintf(state, "%016llx %llu\n", (unsigned long long) reply.log_id, (unsigned long long) reply.generation) < 0
+        || fclose(state) != 0 || rename(temp_path, state_path) == -1)
+    {
+        perror("Could not record the sync generation");
+        return -1;
+    }
+    printf("Synced to generation %llu: %llu files (%llu bytes), %llu directories, %llu removals in %.3f s\n",
+        (unsigned long long) reply.generation, (unsigned long long) counts[0], (unsigned long long) bytes,
+        (unsigned long long) counts[1], (unsigned long long) counts[2], (metrics_now_ns() - start) / 1e9);
+    return 0;
+}
+
+/*
+ * Receives the file data of the current transfer mode and throws it away.
+ * Streams are spliced into /dev/null, so their digest or root is not checked.
+ * Returns 0 on success, -1 on error.
+ */
+int discard_file(int socket_fd, int passed_fd, size_t filesize)
+{
+    if (passed_fd != -1)
+    {
+        return copy_passed_file(passed_fd, -1, filesize);
+    }
+    if (!stream_mode && !tree_mode)
+    {
+        return receive_segments(socket_fd, NULL, filesize);
+    }
+
+    int devnull = open("/dev/null", O_WRONLY | O_CLOEXEC);
+    if (devnull == -1)
+    {
+        perror("Could not open /dev/null");
+        return -1;
+    }
+    uint64_t digest;
+    int ret_val = splice_stream(socket_fd, devnull, filesize, tree_mode ? NULL : &digest);
+    close(devnull);
+    return ret_val;
+}
+
+/*
+ * Downloads one file and throws the data away.
+ * Returns the number of bytes received, or -1 on error.
+ */
+int64_t fetch_and_discard(const char* filename)
+{
+    int socket_fd = init_and_connect();
+    if (socket_fd == -1)
+    {
+        return -1;
+    }
+
+    int64_t filesize = -1;
+    int passed_fd = -1;
+    uint64_t root = 0;
+    if (request_file(socket_fd, filename) == -1
+        || (filesize = await_reply(socket_fd, &passed_fd, &root)) <= 0
+        || discard_file(socket_fd, passed_fd, filesize) == -1)
+    {
+        if (passed_fd != -1)
+        {
+            close(passed_fd);
+        }
+        close(socket_fd);
+        return -1;
+    }
+
+    if (passed_fd != -1)
+    {
+        close(passed_fd);
+    }
+    close(socket_fd);
+    return filesize;
+}
+
+/*
+ * Returns a uniformly distributed double in [0, 1) from a per-thread xorshift state.
+ */
+static double next_uniform(uint64_t* state)
+{
+    *state ^= *state << 13;
+    *state ^= *state >> 7;
+    *state ^= *state << 17;
+    return (*state >> 11) * (1.0 / 9007199254740992.0);
+}
+
+/*
+ * Picks a file index from the Zipf cumulative distribution.
+ */
+static int pick_file(const load_config* config, uint64_t* state)
+{
+    double u = next_uniform(state);
+    int low = 0, high = config->file_count - 1;
+    while (low < high)
+    {
+        int mid = (low + high) / 2;
+        if (config->zipf_cdf[mid] < u)
+        {
+            low = mid + 1;
+        }
+        else
+        {
+            high = mid;
+        }
+    }
+    return low;
+}
+
+/*
+ * Returns the time at which the next request of this worker is meant to start.
+ * Open loop: the next arrival of a Poisson process shared by all workers.
+ * Closed loop: back to back, or at a fixed interval per worker if a rate was given.
+ */
+static uint64_t next_intended_start(load_worker* self, uint64_t previous)
+{
+    load_config* config = self->config;
+    if (config->open_loop)
+    {
+        pthread_mutex_lock(&config->schedule_lock);
+        double gap = -log(1.0 - next_uniform(&config->schedule_rng)) / config->rate;
+        config->next_arrival += (uint64_t) (gap * 1e9);
+        uint64_t intended = config->next_arrival;
+        pthread_mutex_unlock(&config->schedule_lock);
+        return intended;
+    }
+    if (config->rate > 0 && previous != 0)
+    {
+        return previous + (uint64_t) (config->concurrency / config->rate * 1e9);
+    }
+    return metrics_now_ns();
+}
+
+static void* run_load_worker(void* arg)
+{
+    load_worker* self = (load_worker*) arg;
+    load_config* config = self->config;
+    uint64_t intended = 0;
+
+    while (atomic_fetch_add(&config->issued, 1) < config->requests)
+    {
+        intended = next_intended_start(self, intended);
+        uint64_t now = metrics_now_ns();
+        if (intended > now)
+        {
+            struct timespec until = { intended / 1000000000ull, intended % 1000000000ull };
+            while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &until, NULL) == EINTR);
+        }
+
+        // service time is measured from the actual send, corrected latency from the
+        // intended start, so a stalled server is not hidden by requests that were never sent
+        uint64_t start = metrics_now_ns();
+        int64_t received = fetch_and_discard(config->files[pick_file(config, &self->rng)]);
+        uint64_t end = metrics_now_ns();
+        if (received == -1)
+        {
+            self->errors++;
+            continue;
+        }
+        hist_record(&self->service, end - start);
+        hist_record(&self->corrected, end - (intended < start ? intended : start));
+        self->bytes += received;
+    }
+    return NULL;
+}
+
+static void print_latency_row(const char* name, const histogram* hist)
+{
+    printf("  %-10s %12.1f %12.1f %12.1f %12.1f %12.1f\n", name,
+        hist_percentile(hist, 50) / 1e3, hist_percentile(hist, 90) / 1e3,
+        hist_percentile(hist, 99) / 1e3, hist_percentile(hist, 99.9) / 1e3,
+        atomic_load(&hist->max) / 1e3);
+}
+
+/*
+ * Drives the server with config->requests downloads from config->concurrency threads
+ * and prints throughput and latency percentiles.
+ * Returns 0 on success, -1 on error.
+ */
+int run_load(load_config* config)
+{
+    // Zipf popularity: the k-th file (1-based) is requested with weight 1 / k^s
+    config->zipf_cdf = (double*) malloc(config->file_count * sizeof(double));
+    load_worker* workers = (load_worker*) calloc(config->concurrency, sizeof(load_worker));
+    pthread_t* threads = (pthread_t*) calloc(config->concurrency, sizeof(pthread_t));
+    if (config->zipf_cdf == NULL || workers == NULL || threads == NULL)
+    {
+        errno = ENOMEM;
+        perror("Could not set up the load generator");
+        free(config->zipf_cdf);
+        free(workers);
+        free(threads);
+        return -1;
+    }
+    double total_weight = 0;
+    for (int i = 0; i < config->file_count; i++)
+    {
+        total_weight += 1.0 / pow(i + 1, config->zipf_exponent);
+        config->zipf_cdf[i] = total_weight;
+    }
+    for (int i = 0; i < config->file_count; i++)
+    {
+        config->zipf_cdf[i] /= total_weight;
+    }
+
+    uint64_t start = metrics_now_ns();
+    config->next_arrival = start;
+    config->schedule_rng = start | 1;
+
+    int started = 0;
+    for (int i = 0; i < config->concurrency; i++)
+    {
+        workers[i].config = config;
+        workers[i].rng = (start + i * 0x9E3779B97F4A7C15ull) | 1;
+        if (pthread_create(&threads[i], NULL, run_load_worker, &workers[i]) != 0)
+        {
+            perror("Could not start load generator thread");
+            break;
+        }
+        started++;
+    }
+
+    histogram* service = (histogram*) calloc(1, sizeof(histogram));
+    histogram* corrected = (histogram*) calloc(1, sizeof(histogram));
+    uint64_t bytes = 0, errors = 0;
+    for (int i = 0; i < started; i++)
+    {
+        pthread_join(threads[i], NULL);
+        if (service != NULL && corrected != NULL)
+        {
+            hist_merge(service, &workers[i].service);
+            hist_merge(corrected, &workers[i].corrected);
+        }
+        bytes += workers[i].bytes;
+        errors += workers[i].errors;
+    }
+    double seconds = (metrics_now_ns() - start) / 1e9;
+
+    if (service != NULL && corrected != NULL)
+    {
+        uint64_t completed = atomic_load(&service->count);
+        printf("%s loop, %d threads, %llu requests ok, %llu errors in %.3f s\n",
+            config->open_loop ? "open" : "closed", started,
+            (unsigned long long) completed, (unsigned long long) errors, seconds);
+        printf("throughput: %.1f requests/s, %.3f MB/s\n", completed / seconds, bytes / 1e6 / seconds);
+        printf("latency (us) %12s %12s %12s %12s %12s\n", "p50", "p90", "p99", "p99.9", "max");
+        print_latency_row("service", service);
+        print_latency_row("corrected", corrected);
+    }
+
+    free(service);
+    free(corrected);
+    free(config->zipf_cdf);
+    free(workers);
+    free(threads);
+    return started == config->concurrency && errors == 0 ? 0 : -1;
+}
+
+/*
+ * Downloads one file into the output directory.
+ * Unless -y was given, asks for permission before writing it.
+ * Files larger than --max-size are skipped without receiving their data.
+ * The number of bytes written is added to *bytes.
+ */
+enum download_result download_file(const char* requested_filename, uint64_t* bytes)
+{
+    if (!safe_output_name(requested_filename))
+    {
+        fprintf(stderr, "Refusing to write %s outside the output directory.\n", requested_filename);
+        return DOWNLOAD_FAILED;
+    }
+
+    // init the socket and connect to the server
+    int socket_fd = init_and_connect();
+    if (socket_fd == -1)
+    {
+        return DOWNLOAD_FAILED;
+    }
+
+    // request the file from the server
+    if (request_file(socket_fd, requested_filename) == -1)
+    {
+        close(socket_fd);
+        return DOWNLOAD_FAILED;
+    }
+
+    // receive reply from server. does the file exist or not? if yes, receive it
+    enum download_result result = DOWNLOAD_OK;
+    int passed_fd = -1;
+    uint64_t root = 0;
+    int64_t filesize = await_reply(socket_fd, &passed_fd, &root);
+    if (filesize == -1)
+    {
+        // error
+        result = DOWNLOAD_FAILED;
+    }
+    else if (filesize == 0)
+    {
+        // file does not exist
+        fprintf(stderr, "File does not exist on server machine: %s\n", requested_filename);
+        result = DOWNLOAD_FAILED;
+    }
+    else if (max_size > 0 && (uint64_t) filesize > max_size)
+    {
+        // closing the connection early is enough, the server stops on its own
+        fprintf(stderr, "Skipping %s: %lld bytes is over the size limit.\n", requested_filename, (long long) filesize);
+        result = DOWNLOAD_SKIPPED;
+    }
+    else
+    {
+        char response = 'y';
+        if (!assume_yes)
+        {
+            // ask for permission to allocate memory
+            printf("After this operation, %lld bytes of additional disk space will be used.\nDo you want to continue? [y/n]", (long long) filesize);
+            if (scanf(" %c", &response) != 1)
+            {
+                response = 'n';
+            }
+        }
+
+        if(response == 'Y' || response == 'y'){
+            // file exists, proceed with receiving it
+            if (receive_file(socket_fd, requested_filename, filesize, passed_fd, root) == -1)
+            {
+                fprintf(stderr, "File not transmitted properly: %s\n", requested_filename);
+                result = DOWNLOAD_FAILED;
+            }
+            else
+            {
+                *bytes += filesize;
+                if (verbose)
+                {
+                    printf("File received!\n");
+                }
+            }
+        }
+        else
+        {
+            result = DOWNLOAD_SKIPPED;
+        }
+    }
+
+    if (passed_fd != -1)
+    {
+        close(passed_fd);
+    }
+	close(socket_fd);
+	return result;
+}
+
+static void* run_batch_worker(void* arg)
+{
+    batch* work = (batch*) arg;
+    int index;
+    while ((index = atomic_fetch_add(&work->next, 1)) < work->file_count)
+    {
+        uint64_t bytes = 0;
+        switch (download_file(work->files[index], &bytes))
+        {
+            case DOWNLOAD_OK: atomic_fetch_add(&work->received, 1); break;
+            case DOWNLOAD_SKIPPED: atomic_fetch_add(&work->skipped, 1); break;
+            case DOWNLOAD_FAILED: atomic_fetch_add(&work->failed, 1); break;
+        }
+        atomic_fetch_add(&work->bytes, bytes);
+    }
+    return NULL;
+}
+
+/*
+ * Downloads every file of the list with at most concurrency connections at a time,
+ * then syncs the output directories once and prints a summary.
+ * Returns 0 if no download failed, -1 otherwise.
+ */
+int run_batch(char** files, int file_count, int concurrency)
+{
+    batch work;
+    memset(&work, 0, sizeof(work));
+    work.files = files;
+    work.file_count = file_count;
+
+    concurrency = concurrency < file_count ? concurrency : file_count;
+    pthread_t* threads = (pthread_t*) calloc(concurrency, sizeof(pthread_t));
+    if (threads == NULL)
+    {
+        errno = ENOMEM;
+        perror("Could not start the downloads");
+        return -1;
+    }
+
+    uint64_t start = metrics_now_ns();
+    int started = 0;
+    for (int i = 0; i < concurrency; i++)
+    {
+        if (pthread_create(&threads[i], NULL, run_batch_worker, &work) != 0)
+        {
+            perror("Could not start download thread");
+            break;
+        }
+        started++;
+    }
+    if (started == 0)
+    {
+        // no thread at all, download from this one
+        run_batch_worker(&work);
+    }
+    for (int i = 0; i < started; i++)
+    {
+        pthread_join(threads[i], NULL);
+    }
+    free(threads);
+
+    if (fsync_policy != FSYNC_NONE && output_sync_dir(output_dir) == -1)
+    {
+        perror("Could not sync the output directory");
+        atomic_fetch_add(&work.failed, 1);
+    }
+
+    double seconds = (metrics_now_ns() - start) / 1e9;
+    printf("%d received, %d skipped, %d failed, %llu bytes in %.3f s (%.3f MB/s)\n",
+        atomic_load(&work.received), atomic_load(&work.skipped), atomic_load(&work.failed),
+        (unsigned long long) atomic_load(&work.bytes), seconds, atomic_load(&work.bytes) / 1e6 / seconds);
+    return atomic_load(&work.failed) == 0 ? 0 : -1;
+}
+
+/*
+ * Appends the file names listed in a manifest to *files, one per line.
+ * Blank lines and lines starting with '#' are ignored.
+ * Returns 0 on success, -1 on error.
+ */
+int read_manifest(const char* path, char*** files, int* file_count)
+{
+    FILE* manifest = strcmp(path, "-") == 0 ? stdin : fopen(path, "r");
+    if (manifest == NULL)
+    {
+        perror("Could not open the manifest");
+        return -1;
+    }
+
+    char line[MANIFEST_LINE_SIZE];
+    int capacity = *file_count;
+    int ret_val = 0;
+    while (fgets(line, sizeof(line), manifest) != NULL)
+    {
+        line[strcspn(line, "\r\n")] = '\0';
+        if (line[0] == '\0' || line[0] == '#')
+        {
+            continue;
+        }
+        if (*file_count == capacity)
+        {
+            capacity = capacity > 0 ? capacity * 2 : 64;
+            char** grown = (char**) realloc(*files, capacity * sizeof(char*));
+            if (grown == NULL)
+            {
+                ret_val = -1;
+                break;
+            }
+            *files = grown;
+        }
+        if (((*files)[*file_count] = strdup(line)) == NULL)
+        {
+            ret_val = -1;
+            break;
+        }
+        (*file_count)++;
+    }
+    if (ret_val == -1)
+    {
+        errno = ENOMEM;
+        perror("Could not read the manifest");
+    }
+
+    if (manifest != stdin)
+    {
+        fclose(manifest);
+    }
+    return ret_val;
+}
+
+/*
+ * Parses a byte count with an optional K/M/G suffix.
+ * Returns 0 on success, -1 on error.
+ */
+static int parse_size(const char* text, uint64_t* value)
+{
+    char* end = NULL;
+    errno = 0;
+    *value = strtoull(text, &end, 10);
+    if (errno != 0 || end == text)
+    {
+        return -1;
+    }
+    switch (*end)
+    {
+        case 'G': case 'g': *value <<= 10; // fall through
+        case 'M': case 'm': *value <<= 10; // fall through
+        case 'K': case 'k': *value <<= 10; end++; break;
+        default: break;
+    }
+    return *end == '\0' ? 0 : -1;
+}
+
+/*
+ * Parses a comma separated list of OFFSET:LENGTH ranges, each with optional K/M/G suffixes,
+ * a negative OFFSET counting from the end of the file, into at most MAX_RANGES ranges.
+ * Returns the number of ranges, -1 on error.
+ */
+static int parse_ranges(char* text, byte_range* ranges)
+{
+    int count = 0;
+    char* save = NULL;
+    for (char* token = strtok_r(text, ",", &save); token != NULL; token = strtok_r(NULL, ",", &save))
+    {
+        char* colon = strchr(token, ':');
+        bool from_end = token[0] == '-';
+        uint64_t offset, length;
+        if (count == MAX_RANGES || colon == NULL)
+        {
+            return -1;
+        }
+        *colon = '\0';
+        if (parse_size(token + from_end, &offset) == -1 || offset > INT64_MAX || parse_size(colon + 1, &length) == -1)
+        {
+            return -1;
+        }
+        ranges[count].offset = from_end ? -(int64_t) offset : (int64_t) offset;
+        ranges[count++].length = length;
+    }
+    return count > 0 ? count : -1;
+}
+
+int main(int argc, char* argv[])
+{
+    load_config config;
+    memset(&config, 0, sizeof(config));
+    config.concurrency = 4;
+    config.requests = 1000;
+    config.zipf_exponent = 1.0;
+    pthread_mutex_init(&config.schedule_lock, NULL);
+    bool load = false;
+    bool metrics = false;
+    bool stat_query = false;
+    bool list_query = false;
+    bool sync = false;
+    bool output_given = false;
+    uint32_t query_flags = 0;
+    byte_range ranges[MAX_RANGES];
+    int range_count = 0;
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    verify_threads = cores > 0 ? (int) cores : 1;
+
+    // segment plus its checksum byte, also the blocks of the write-behind pipeline
+    segment_pool = pool_create("segment", MAX_SEGMENT_SIZE + 1, 4);
+    if (segment_pool == NULL)
+    {
+        perror("Could not create the buffer pool");
+        exit(EXIT_FAILURE);
+    }
+
+    const char* server_spec = SERVER_IP ":" SERVER_PORT;
+    const char* manifest_path = NULL;
+    static const struct option long_options[] = {
+        { "server", required_argument, NULL, 's' },
+        { "output-dir", required_argument, NULL, 'o' },
+        { "prefix", required_argument, NULL, 'p' },
+        { "yes", no_argument, NULL, 'y' },
+        { "max-size", required_argument, NULL, 'M' },
+        { "input", required_argument, NULL, 'i' },
+        { "profile", required_argument, NULL, 't' },
+        { "stat", no_argument, NULL, 'q' },
+        { "list", no_argument, NULL, 'l' },
+        { "digest", no_argument, NULL, 'g' },
+        { "sync", no_argument, NULL, 'C' },
+        { "ranges", required_argument, NULL, 'R' },
+        { NULL, 0, NULL, 0 }
+    };
+
+    int opt, policy;
+    while ((opt = getopt_long(argc, argv, "mqlgCR:LPc:r:n:z:u:FZTj:WS:s:o:p:yi:t:", long_options, NULL)) != -1)
+    {
+        switch (opt)
+        {
+            case 's': server_spec = optarg; break;
+            case 'o': output_dir = optarg; output_given = true; break;
+            case 'p': output_prefix = optarg; break;
+            case 'y': assume_yes = true; break;
+            case 'i': manifest_path = optarg; break;
+            case 't':
+                if (socket_profile_load(&tcp_profile, optarg) == -1)
+                {
+                    PRINT_USAGE();
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'M':
+                if (parse_size(optarg, &max_size) == -1)
+                {
+                    PRINT_USAGE();
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'Z': stream_mode = true; break;
+            case 'T': tree_mode = true; break;
+            case 'j': verify_threads = atoi(optarg); break;
+            case 'W': write_behind_enabled = false; break;
+            case 'S':
+                policy = fsync_parse_policy(optarg);
+                if (policy == -1)
+                {
+                    PRINT_USAGE();
+                    exit(EXIT_FAILURE);
+                }
+                fsync_policy = policy;
+                break;
+            case 'u': unix_socket_path = optarg; break;
+            case 'F': pass_fd = true; break;
+            case 'm': metrics = true; break;
+            case 'q': stat_query = true; break;
+            case 'l': list_query = true; break;
+            case 'g': query_flags |= QUERY_DIGEST; break;
+            case 'C': sync = true; break;
+            case 'R':
+                if ((range_count = parse_ranges(optarg, ranges)) == -1)
+                {
+                    PRINT_USAGE();
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'L': load = true; break;
+            case 'P': config.open_loop = true; break;
+            case 'c': config.concurrency = atoi(optarg); break;
+            case 'r': config.rate = atof(optarg); break;
+            case 'n': config.requests = strtoull(optarg, NULL, 10); break;
+            case 'z': config.zipf_exponent = atof(optarg); break;
+            default:
+                PRINT_USAGE();
+                exit(EXIT_FAILURE);
+        }
+    }
+
+    if (unix_socket_path == NULL && resolve_server(server_spec) == -1)
+    {
+        exit(EXIT_FAILURE);
+    }
+
+    if (metrics)
+    {
+        int socket_fd = init_and_connect();
+        if (socket_fd == -1)
+        {
+            exit(EXIT_FAILURE);
+        }
+        int ret_val = request_metrics(socket_fd);
+        close(socket_fd);
+        exit(ret_val == -1 ? EXIT_FAILURE : EXIT_SUCCESS);
+    }
+
+    if (sync)
+    {
+        // a mirror of its own, never the working directory by default
+        char output_root[PATH_MAX];
+        snprintf(output_root, sizeof(output_root), "%s", output_dir);
+        if (!output_given || optind < argc)
+        {
+            PRINT_USAGE();
+            exit(EXIT_FAILURE);
+        }
+        if (make_directories(output_root) == -1)
+        {
+            perror("Could not create the output directory");
+            exit(EXIT_FAILURE);
+        }
+        verbose = false;
+        signal(SIGPIPE, SIG_IGN);
+        exit(run_sync() == -1 ? EXIT_FAILURE : EXIT_SUCCESS);
+    }
+
+    // parse requested file name(s) from command line arguments and the manifest
+    char** files = NULL;
+    int file_count = argc - optind;
+    if (file_count > 0 && (files = (char**) malloc(file_count * sizeof(char*))) == NULL)
+    {
+        perror("Could not allocate the file list");
+        exit(EXIT_FAILURE);
+    }
+    for (int i = 0; i < file_count; i++)
+    {
+        files[i] = argv[optind + i];
+    }
+    if (manifest_path != NULL && read_manifest(manifest_path, &files, &file_count) == -1)
+    {
+        exit(EXIT_FAILURE);
+    }
+
+    if (file_count == 0 || (load && manifest_path != NULL) || (pass_fd && unix_socket_path == NULL) || (pass_fd && stream_mode)
+        || (tree_mode && (pass_fd || stream_mode)) || verify_threads < 1)
+    {
+        PRINT_USAGE();
+        exit(EXIT_FAILURE);
+    }
+
+    if (stat_query || list_query)
+    {
+        if (stat_query && list_query)
+        {
+            PRINT_USAGE();
+            exit(EXIT_FAILURE);
+        }
+        verbose = false;
+        int ret_val = 0;
+        if (stat_query)
+        {
+            ret_val = run_stat(files, file_count, query_flags);
+        }
+        for (int i = 0; list_query && i < file_count; i++)
+        {
+            ret_val = run_list(files[i], query_flags) == -1 ? -1 : ret_val;
+        }
+        exit(ret_val == -1 ? EXIT_FAILURE : EXIT_SUCCESS);
+    }
+
+    if (range_count > 0)
+    {
+        if (file_count != 1 || manifest_path != NULL || load)
+        {
+            PRINT_USAGE();
+            exit(EXIT_FAILURE);
+        }
+        verbose = false;
+        exit(run_ranges(files[0], ranges, range_count) == -1 ? EXIT_FAILURE : EXIT_SUCCESS);
+    }
+
+    if (load)
+    {
+        config.files = files;
+        config.file_count = file_count;
+        if (config.concurrency < 1 || (config.open_loop && config.rate <= 0))
+        {
+            PRINT_USAGE();
+            exit(EXIT_FAILURE);
+        }
+        verbose = false;
+        signal(SIGPIPE, SIG_IGN);
+        exit(run_load(&config) == -1 ? EXIT_FAILURE : EXIT_SUCCESS);
+    }
+
+    // the received_ prefix keeps downloads apart from the sources in the working directory
+    if (output_prefix == NULL)
+    {
+        output_prefix = strcmp(output_dir, ".") == 0 ? DEFAULT_PREFIX : "";
+    }
+    char output_root[PATH_MAX];
+    snprintf(output_root, sizeof(output_root), "%s", output_dir);
+    if (make_directories(output_root) == -1)
+    {
+        perror("Could not create the output directory");
+        exit(EXIT_FAILURE);
+    }
+
+    if (file_count == 1 && manifest_path == NULL)
+    {
+        uint64_t bytes = 0;
+        exit(download_file(files[0], &bytes) == DOWNLOAD_FAILED ? EXIT_FAILURE : EXIT_SUCCESS);
+    }
+
+    // prompts cannot be answered for files downloaded in parallel
+    if (!assume_yes || config.concurrency < 1)
+    {
+        fprintf(stderr, "Several files need --yes (and a positive -c).\n");
+        exit(EXIT_FAILURE);
+    }
+    verbose = false;
+    batch_mode = true;
+    signal(SIGPIPE, SIG_IGN);
+    exit(run_batch(files, file_count, config.concurrency) == -1 ? EXIT_FAILURE : EXIT_SUCCESS);
 }
@@ -0,0 +1,507 @@
+/**
+ *  configuration file and command line settings, see config.h
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <ctype.h>
+#include <errno.h>
+#include <unistd.h>
+#include <stdatomic.h>
+#include "config.h"
+#include "logger.h"
+#include "message.h"
+
+#define CONFIG_LINE_SIZE 1024
+
+const char* serve_mode_names[] = { "read", "mmap", "sendfile" };
+
+enum option_type
+{
+	OPT_INT,
+	OPT_SIZE,
+	OPT_BOOL,
+	OPT_STRING,
+	OPT_BINDS,
+	OPT_MODE,
+	OPT_LEVEL,
+	OPT_PROFILE
+};
+
+typedef struct
+{
+	const char* section;
+	const char* key;
+	enum option_type type;
+	size_t offset;
+	size_t size;
+	bool restart; // < only read at startup
+} config_option;
+
+#define OPTION(section, key, type, field, restart) \
+	{ section, key, type, offsetof(server_config, field), sizeof(((server_config*) 0)->field), restart }
+
+static const config_option options[] = {
+	OPTION("listen", "bind", OPT_BINDS, binds, true),
+	OPTION("listen", "unix_socket", OPT_STRING, unix_socket, true),
+	OPTION("listen", "backlog", OPT_INT, backlog, true),
+	OPTION("listen", "handoff_socket", OPT_STRING, handoff_socket, true),
+	OPTION("server", "workers", OPT_INT, workers, true),
+	OPTION("server", "root", OPT_STRING, root, true),
+	OPTION("server", "log_level", OPT_LEVEL, log_level, false),
+	OPTION("server", "drain_timeout", OPT_INT, drain_timeout, false),
+	OPTION("transfer", "mode", OPT_MODE, mode, false),
+	OPTION("transfer", "block_size", OPT_SIZE, block_size, false),
+	OPTION("transfer", "max_name_size", OPT_SIZE, max_name_size, false),
+	OPTION("transfer", "rate_limit", OPT_SIZE, rate_limit, false),
+	OPTION("transfer", "io_buffer_size", OPT_SIZE, io_buffer_size, true),
+	OPTION("transfer", "direct_buffer_size", OPT_SIZE, direct_buffer_size, true),
+	OPTION("transfer", "checksum_threads", OPT_INT, checksum_threads, true),
+	OPTION("cache", "readahead_max", OPT_SIZE, readahead_max, false),
+	OPTION("cache", "drop_threshold", OPT_SIZE, drop_threshold, false),
+	OPTION("cache", "direct_threshold", OPT_SIZE, direct_threshold, false),
+	OPTION("cache", "map_budget", OPT_SIZE, map_budget, false),
+	OPTION("limits", "max_connections", OPT_INT, max_connections, false),
+	OPTION("limits", "per_ip", OPT_INT, per_ip, false),
+	OPTION("limits", "header_timeout", OPT_INT, header_timeout, false),
+	OPTION("limits", "request_timeout", OPT_INT, request_timeout, false),
+	OPTION("limits", "progress_timeout", OPT_INT, progress_timeout, false),
+	OPTION("limits", "min_rate", OPT_SIZE, min_rate, false),
+	OPTION("index", "ttl_ms", OPT_INT, index_ttl_ms, false),
+	OPTION("index", "max_directories", OPT_INT, index_max_directories, false),
+	OPTION("index", "page_size", OPT_INT, index_page_size, false),
+	OPTION("catalog", "enabled", OPT_BOOL, catalog_enabled, true),
+	OPTION("catalog", "file", OPT_STRING, catalog_file, true),
+	OPTION("catalog", "walk_threads", OPT_INT, catalog_walk_threads, true),
+	OPTION("catalog", "save_interval", OPT_INT, catalog_save_interval, true),
+	OPTION("pack", "files", OPT_STRING, pack_files, true),
+	OPTION("socket", "profile", OPT_PROFILE, socket, false),
+	OPTION("socket", "send_buffer", OPT_SIZE, socket.send_buffer, false),
+	OPTION("socket", "receive_buffer", OPT_SIZE, socket.receive_buffer, false),
+	OPTION("socket", "notsent_lowat", OPT_SIZE, socket.notsent_lowat, false),
+	OPTION("socket", "congestion", OPT_STRING, socket.congestion, false),
+	OPTION("socket", "busy_poll", OPT_INT, socket.busy_poll, false),
+	OPTION("socket", "nodelay", OPT_BOOL, socket.nodelay, false),
+	OPTION("socket", "cork", OPT_BOOL, socket.cork, false),
+};
+
+#define OPTION_COUNT ((int) (sizeof(options) / sizeof(options[0])))
+
+static _Atomic(const server_config*) current = NULL;
+
+static void config_defaults(server_config* config)
+{
+	memset(config, 0, sizeof(server_config));
+	config->backlog = 128;
+	config->workers = 4;
+	strcpy(config->root, ".");
+	config->log_level = L_INFO;
+	config->drain_timeout = 60;
+	config->mode = SERVE_READ;
+	config->block_size = 512;
+	config->max_name_size = 1024;
+	config->io_buffer_size = 64 * 1024;
+	config->direct_buffer_size = 1024 * 1024;
+	config->readahead_max = 16 * 1024 * 1024;
+	config->drop_threshold = 1024ull * 1024 * 1024;
+	config->direct_threshold = 1024ull * 1024 * 1024;
+	config->header_timeout = 10;
+	config->request_timeout = 30;
+	config->progress_timeout = 60;
+	config->index_ttl_ms = 1000;
+	config->index_max_directories = 1024;
+	config->index_page_size = 1000;
+	config->catalog_walk_threads = 4;
+	config->catalog_save_interval = 300;
+	socket_profile_load(&config->socket, "default");
+}
+
+int config_parse_size(const char* text, uint64_t* value)
+{
+	char* end = NULL;
+	errno = 0;
+	*value = strtoull(text, &end, 10);
+	if (errno != 0 || end == text || *text == '-')
+	{
+		return -1;
+	}
+	switch (*end)
+	{
+		case 'G': case 'g': *value <<= 10; // fall through
+		case 'M': case 'm': *value <<= 10; // fall through
+		case 'K': case 'k': *value <<= 10; end++; break;
+		default: break;
+	}
+	return *end == '\0' ? 0 : -1;
+}
+
+/*
+ *	Removes leading and trailing blanks and a pair of surrounding double quotes.
+ *	Returns the start of the trimmed text, inside text.
+ */
+static char* trim(char* text)
+{
+	while (isspace((unsigned char) *text))
+	{
+		text++;
+	}
+	size_t len = strlen(text);
+	while (len > 0 && isspace((unsigned char) text[len - 1]))
+	{
+		text[--len] = '\0';
+	}
+	if (len >= 2 && text[0] == '"' && text[len - 1] == '"')
+	{
+		text[len - 1] = '\0';
+		text++;
+	}
+	return text;
+}
+
+static const config_option* find_option(const char* section, const char* key)
+{
+	for (int i = 0; i < OPTION_COUNT; i++)
+	{
+		if (strcmp(options[i].key, key) == 0 && (section == NULL || strcmp(options[i].section, section) == 0))
+		{
+			return &options[i];
+		}
+	}
+	return NULL;
+}
+
+/*
+ *	Stores the text value of option in config.
+ *	Returns 0 on success, -1 if the value is not valid for the option.
+ */
+static int set_option(server_config* config, const config_option* option, char* value)
+{
+	char* field = (char*) config + option->offset;
+	uint64_t number;
+	switch (option->type)
+	{
+		case OPT_INT:
+			if (config_parse_size(value, &number) == -1 || number > INT_MAX)
+			{
+				return -1;
+			}
+			*(int*) field = (int) number;
+			return 0;
+		case OPT_SIZE:
+			return config_parse_size(value, (uint64_t*) field);
+		case OPT_BOOL:
+			if (strcmp(value, "true") == 0 || strcmp(value, "yes") == 0 || strcmp(value, "on") == 0 || strcmp(value, "1") == 0)
+			{
+				*(bool*) field = true;
+				return 0;
+			}
+			if (strcmp(value, "false") == 0 || strcmp(value, "no") == 0 || strcmp(value, "off") == 0 || strcmp(value, "0") == 0)
+			{
+				*(bool*) field = false;
+				return 0;
+			}
+			return -1;
+		case OPT_STRING:
+			if (strlen(value) >= option->size)
+			{
+				return -1;
+			}
+			strcpy(field, value);
+			return 0;
+		case OPT_MODE:
+			for (int mode = SERVE_READ; mode <= SERVE_SENDFILE; mode++)
+			{
+				if (strcmp(value, serve_mode_names[mode]) == 0)
+				{
+					config->mode = (enum serve_mode) mode;
+					return 0;
+				}
+			}
+			return -1;
+		case OPT_LEVEL:
+			return (config->log_level = log_parse_level(value)) == -1 ? -1 : 0;
+		case OPT_PROFILE:
+			// replaces every [socket] option set before it
+			return socket_profile_load((socket_profile*) field, value);
+		case OPT_BINDS:
+		{
+			// a comma separated list, which replaces the previous one
+			config->bind_count = 0;
+			char* save = NULL;
+			for (char* address = strtok_r(value, ",", &save); address != NULL; address = strtok_r(NULL, ",", &save))
+			{
+				address = trim(address);
+				if (*address == '\0' || config->bind_count == CONFIG_MAX_BINDS || strlen(address) >= CONFIG_ADDRESS_SIZE)
+				{
+					return -1;
+				}
+				strcpy(config->binds[config->bind_count++], address);
+			}
+			return config->bind_count > 0 ? 0 : -1;
+		}
+	}
+	return -1;
+}
+
+/*
+ *	Applies the settings of the file at path to config.
+ *	Returns 0 on success, -1 on error.
+ */
+static int load_file(server_config* config, const char* path)
+{
+	FILE* file = fopen(path, "r");
+	if (file == NULL)
+	{
+		log_errno("Could not open the configuration file %s", path);
+		return -1;
+	}
+
+	char line[CONFIG_LINE_SIZE];
+	char section[64] = "";
+	int line_number = 0;
+	int ret_val = 0;
+	while (fgets(line, sizeof(line), file) != NULL)
+	{
+		line_number++;
+		char* text = trim(line);
+		if (*text == '\0' || *text == '#' || *text == ';')
+		{
+			continue;
+		}
+
+		if (*text == '[')
+		{
+			char* end = strchr(text, ']');
+			if (end == NULL || end - text - 1 >= (int) sizeof(section))
+			{
+				log_error("%s:%d: invalid section", path, line_number);
+				ret_val = -1;
+				continue;
+			}
+			*end = '\0';
+			snprintf(section, sizeof(section), "%s", trim(text + 1));
+			continue;
+		}
+
+		char* equals = strchr(text, '=');
+		if (equals == NULL)
+		{
+			log_error("%s:%d: expected key = value", path, line_number);
+			ret_val = -1;
+			continue;
+		}
+		*equals = '\0';
+		char* key = trim(text);
+		char* value = equals + 1;
+		while (isspace((unsigned char) *value))
+		{
+			value++;
+		}
+		// comments may follow unquoted values
+		if (*value != '"')
+		{
+			value[strcspn(value, "#;")] = '\0';
+		}
+		value = trim(value);
+
+		const config_option* option = find_option(section, key);
+		if (option == NULL)
+		{
+			log_error("%s:%d: unknown setting %s in [%s]", path, line_number, key, section);
+			ret_val = -1;
+		}
+		else if (set_option(config, option, value) == -1)
+		{
+			log_error("%s:%d: invalid value for %s: %s", path, line_number, key, value);
+			ret_val = -1;
+		}
+	}
+
+	fclose(file);
+	return ret_val;
+}
+
+/*
+ *	Checks the ranges of the settings that have one.
+ *	Returns 0 on success, -1 on error.
+ */
+static int check_config(server_config* config)
+{
+	if (config->bind_count == 0)
+	{
+		strcpy(config->binds[config->bind_count++], CONFIG_DEFAULT_BIND);
+	}
+
+	long page = sysconf(_SC_PAGESIZE);
+	const char* invalid = NULL;
+	if (config->backlog < 1)
+	{
+		invalid = "listen.backlog";
+	}
+	else if (config->workers < 1 || config->workers > 1024)
+	{
+		invalid = "server.workers (1 to 1024)";
+	}
+	else if (config->block_size < 1 || config->block_size > MAX_SEGMENT_SIZE)
+	{
+		invalid = "transfer.block_size (1 to 1M)";
+	}
+	else if (config->max_name_size < 1 || config->max_name_size >= PATH_MAX)
+	{
+		invalid = "transfer.max_name_size";
+	}
+	else if (config->io_buffer_size < 4096 || config->io_buffer_size > 64 * 1024 * 1024)
+	{
+		invalid = "transfer.io_buffer_size (4K to 64M)";
+	}
+	else if (config->direct_buffer_size < (uint64_t) page || config->direct_buffer_size % page != 0)
+	{
+		invalid = "transfer.direct_buffer_size (a multiple of the page size)";
+	}
+	else if (config->checksum_threads < 0 || config->checksum_threads > 1024)
+	{
+		invalid = "transfer.checksum_threads (0 to 1024)";
+	}
+	else if (config->max_connections < 0 || config->max_connections > config->workers)
+	{
+		invalid = "limits.max_connections (0 to server.workers, a worker only accepts once it is free)";
+	}
+	else if (config->per_ip < 0 || config->per_ip > config->workers)
+	{
+		invalid = "limits.per_ip (0 to server.workers)";
+	}
+	else if (config->rate_limit > 0 && config->min_rate > config->rate_limit)
+	{
+		invalid = "limits.min_rate (above transfer.rate_limit, every transfer would be evicted)";
+	}
+	else if (config->index_max_directories < 1)
+	{
+		invalid = "index.max_directories (at least 1)";
+	}
+	else if (config->index_page_size < 1 || config->index_page_size > 65536)
+	{
+		invalid = "index.page_size (1 to 65536)";
+	}
+	else if (config->catalog_file[0] != '\0' && config->catalog_file[0] != '/')
+	{
+		invalid = "catalog.file (an absolute path, the server runs in its root)";
+	}
+	else if (config->catalog_walk_threads < 1 || config->catalog_walk_threads > 256)
+	{
+		invalid = "catalog.walk_threads (1 to 256)";
+	}
+	else if (config->catalog_save_interval < 0)
+	{
+		invalid = "catalog.save_interval";
+	}
+	else if (config->socket.send_buffer > INT_MAX || config->socket.receive_buffer > INT_MAX || config->socket.notsent_lowat > INT_MAX)
+	{
+		invalid = "socket buffer size";
+	}
+
+	if (invalid != NULL)
+	{
+		log_error("Invalid %s", invalid);
+		return -1;
+	}
+	return 0;
+}
+
+int config_load(server_config* config, const char* path, const config_override* overrides, int override_count)
+{
+	config_defaults(config);
+	if (path != NULL && load_file(config, path) == -1)
+	{
+		return -1;
+	}
+
+	for (int i = 0; i < override_count; i++)
+	{
+		// section.key or just key, the keys are unique
+		char key[128];
+		snprintf(key, sizeof(key), "%s", overrides[i].key);
+		char* dot = strchr(key, '.');
+		if (dot != NULL)
+		{
+			*dot = '\0';
+		}
+		const config_option* option = dot != NULL ? find_option(key, dot + 1) : find_option(NULL, key);
+
+		char value[PATH_MAX];
+		snprintf(value, sizeof(value), "%s", overrides[i].value);
+		if (option == NULL)
+		{
+			log_error("Unknown setting %s", overrides[i].key);
+			return -1;
+		}
+		if (set_option(config, option, value) == -1)
+		{
+			log_error("Invalid value for %s: %s", overrides[i].key, overrides[i].value);
+			return -1;
+		}
+	}
+
+	return check_config(config);
+}
+
+/*
+ *	Returns true if option has different values in a and b.
+ *	Text is compared as strings, the bytes after the terminator are not part of the value.
+ */
+static bool option_changed(const config_option* option, const server_config* a, const server_config* b)
+{
+	const char* a_field = (const char*) a + option->offset;
+	const char* b_field = (const char*) b + option->offset;
+	switch (option->type)
+	{
+		case OPT_STRING:
+			return strcmp(a_field, b_field) != 0;
+		case OPT_BINDS:
+			if (a->bind_count != b->bind_count)
+			{
+				return true;
+			}
+			for (int i = 0; i < a->bind_count; i++)
+			{
+				if (strcmp(a->binds[i], b->binds[i]) != 0)
+				{
+					return true;
+				}
+			}
+			return false;
+		default:
+			return memcmp(a_field, b_field, option->size) != 0;
+	}
+}
+
+void config_keep_restart_values(server_config* next, const server_config* current)
+{
+	for (int i = 0; i < OPTION_COUNT; i++)
+	{
+		const config_option* option = &options[i];
+		char* next_field = (char*) next + option->offset;
+		const char* current_field = (const char*) current + option->offset;
+		if (!option->restart || !option_changed(option, next, current))
+		{
+			continue;
+		}
+		log_warn("%s.%s only changes with a restart, keeping the current value", option->section, option->key);
+		memcpy(next_field, current_field, option->size);
+		if (option->type == OPT_BINDS)
+		{
+			next->bind_count = current->bind_count;
+		}
+	}
+}
+
+const server_config* config_current(void)
+{
+	return atomic_load_explicit(&current, memory_order_acquire);
+}
+
+void config_publish(const server_config* config)
+{
+	atomic_store_explicit(&current, config, memory_order_release);
+}
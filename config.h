@@ -0,0 +1,120 @@
+/**
+ *  runtime configuration of the server
+ *
+ *  every setting has a default, can be set in an INI file (sections and
+ *  key = value lines, '#' or ';' comments, so simple TOML files work too)
+ *  and can be overridden on the command line. the file is read again on
+ *  SIGHUP: the values marked reloadable below take effect for the next
+ *  request, the others need a restart and keep their startup value.
+ *
+ *  a loaded configuration is never modified. a reload builds a new one and
+ *  publishes it, requests keep the snapshot they started with.
+ */
+
+#ifndef CONFIG_H
+#define CONFIG_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <limits.h>
+#include "socktune.h"
+
+#define CONFIG_MAX_BINDS 8
+#define CONFIG_ADDRESS_SIZE 128
+#define CONFIG_DEFAULT_BIND "127.0.0.1:8080"
+
+// how file contents reach the socket
+enum serve_mode
+{
+	SERVE_READ,
+	SERVE_MMAP,
+	SERVE_SENDFILE
+};
+
+extern const char* serve_mode_names[];
+
+typedef struct
+{
+	// [listen], restart only
+	char binds[CONFIG_MAX_BINDS][CONFIG_ADDRESS_SIZE]; // < host:port, [v6 host]:port
+	int bind_count;
+	char unix_socket[PATH_MAX]; // < empty: no Unix domain socket
+	int backlog;
+	char handoff_socket[PATH_MAX]; // < control socket for replacements, empty: none (see handoff.h)
+	// [server]
+	int workers; // < restart only
+	char root[PATH_MAX]; // < restart only
+	int log_level;
+	int drain_timeout; // < seconds given to running transfers after a handoff
+	// [transfer]
+	enum serve_mode mode;
+	uint64_t block_size; // < payload of a framed segment
+	uint64_t max_name_size;
+	uint64_t rate_limit; // < bytes per second and connection, 0 = unlimited
+	uint64_t io_buffer_size; // < restart only, also the streamed chunk size
+	uint64_t direct_buffer_size; // < restart only
+	int checksum_threads; // < restart only, helpers for segment checksums and Merkle roots, 0 = the workers do (see taskpool.h)
+	// [cache]
+	uint64_t readahead_max;
+	uint64_t drop_threshold;
+	uint64_t direct_threshold;
+	uint64_t map_budget; // < bytes mapped at once in the mmap modes, 0 = unlimited
+	// [limits], see admission.h
+	int max_connections; // < served at once, at most workers, 0 = one per worker
+	int per_ip; // < connections from one address, at most workers, 0 = unlimited
+	int header_timeout; // < seconds, 0 = none (also TCP_DEFER_ACCEPT, restart only)
+	int request_timeout; // < seconds from accept to the whole request, 0 = none
+	int progress_timeout; // < seconds a transfer may send nothing, 0 = none
+	uint64_t min_rate; // < bytes per second a transfer must average, 0 = none
+	// [index], the directory index of the metadata queries, see dirindex.h
+	int index_ttl_ms; // < how long an index is trusted
+	int index_max_directories;
+	int index_page_size; // < most entries of a listing page
+	// [catalog], restart only, see catalog.h
+	bool catalog_enabled;
+	char catalog_file[PATH_MAX]; // < empty: the catalog is walked at every start
+	int catalog_walk_threads;
+	int catalog_save_interval; // < seconds, 0 = only for handoffs
+	// [pack], see pack.h
+	char pack_files[PATH_MAX]; // < restart only, comma separated archives below the root, NAME.pack serves NAME/...
+	// [socket], applied to accepted connections. profile = name loads a built-in
+	//	profile (see socktune.h), the keys after it change single options
+	socket_profile socket;
+} server_config;
+
+// a section.key = value given on the command line
+typedef struct
+{
+	const char* key;
+	const char* value;
+} config_override;
+
+/*
+ *	Fills config with the defaults, then the settings of the file at path (if not NULL),
+ *		then the overrides, and checks the result.
+ *	Errors are logged with their file and line.
+ *	Returns 0 on success, -1 on error.
+ */
+int config_load(server_config* config, const char* path, const config_override* overrides, int override_count);
+
+/*
+ *	Keeps the startup value of every restart only setting that next changes,
+ *		with a warning for each.
+ */
+void config_keep_restart_values(server_config* next, const server_config* current);
+
+/*
+ *	Parses a byte count with an optional K/M/G suffix.
+ *	Returns 0 on success, -1 on error.
+ */
+int config_parse_size(const char* text, uint64_t* value);
+
+/*
+ *	The configuration requests should use, and its replacement.
+ *	Published configurations are never freed: a request may still be using an older
+ *		one, and a reload only costs a few kilobytes.
+ */
+const server_config* config_current(void);
+void config_publish(const server_config* config);
+
+#endif
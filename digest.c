@@ -0,0 +1,150 @@
+/**
+ *  XXH64, see digest.h
+ */
+
+#include <string.h>
+#include "digest.h"
+
+#define P1 11400714785074694791ull
+#define P2 14029467366897019727ull
+#define P3 1609587929392839161ull
+#define P4 9650029242287828579ull
+#define P5 2870177450012600261ull
+
+static inline uint64_t rotl(uint64_t x, int r)
+{
+	return (x << r) | (x >> (64 - r));
+}
+
+static inline uint64_t read64(const uint8_t* p)
+{
+	uint64_t v;
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+static inline uint32_t read32(const uint8_t* p)
+{
+	uint32_t v;
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+static inline uint64_t round64(uint64_t acc, uint64_t input)
+{
+	acc += input * P2;
+	acc = rotl(acc, 31);
+	return acc * P1;
+}
+
+static inline uint64_t merge64(uint64_t acc, uint64_t val)
+{
+	acc ^= round64(0, val);
+	return acc * P1 + P4;
+}
+
+void digest_init(digest_state* state, uint64_t seed)
+{
+	memset(state, 0, sizeof(*state));
+	state->seed = seed;
+	state->v[0] = seed + P1 + P2;
+	state->v[1] = seed + P2;
+	state->v[2] = seed;
+	state->v[3] = seed - P1;
+}
+
+void digest_update(digest_state* state, const void* data, size_t len)
+{
+	const uint8_t* p = (const uint8_t*) data;
+	const uint8_t* end = p + len;
+	state->total_len += len;
+
+	// complete a stripe left over from the previous call
+	if (state->buffered + len < 32)
+	{
+		memcpy(state->buffer + state->buffered, p, len);
+		state->buffered += len;
+		return;
+	}
+	if (state->buffered > 0)
+	{
+		size_t fill = 32 - state->buffered;
+		memcpy(state->buffer + state->buffered, p, fill);
+		for (int i = 0; i < 4; i++)
+		{
+			state->v[i] = round64(state->v[i], read64(state->buffer + i * 8));
+		}
+		p += fill;
+		state->buffered = 0;
+	}
+
+	// whole 32 byte stripes straight from the input
+	uint64_t v0 = state->v[0], v1 = state->v[1], v2 = state->v[2], v3 = state->v[3];
+	while (end - p >= 32)
+	{
+		v0 = round64(v0, read64(p));
+		v1 = round64(v1, read64(p + 8));
+		v2 = round64(v2, read64(p + 16));
+		v3 = round64(v3, read64(p + 24));
+		p += 32;
+	}
+	state->v[0] = v0;
+	state->v[1] = v1;
+	state->v[2] = v2;
+	state->v[3] = v3;
+
+	state->buffered = end - p;
+	memcpy(state->buffer, p, state->buffered);
+}
+
+uint64_t digest_final(const digest_state* state)
+{
+	uint64_t h;
+	if (state->total_len >= 32)
+	{
+		h = rotl(state->v[0], 1) + rotl(state->v[1], 7) + rotl(state->v[2], 12) + rotl(state->v[3], 18);
+		for (int i = 0; i < 4; i++)
+		{
+			h = merge64(h, state->v[i]);
+		}
+	}
+	else
+	{
+		h = state->seed + P5;
+	}
+	h += state->total_len;
+
+	const uint8_t* p = state->buffer;
+	const uint8_t* end = p + state->buffered;
+	for (; end - p >= 8; p += 8)
+	{
+		h ^= round64(0, read64(p));
+		h = rotl(h, 27) * P1 + P4;
+	}
+	if (end - p >= 4)
+	{
+		h ^= (uint64_t) read32(p) * P1;
+		h = rotl(h, 23) * P2 + P3;
+		p += 4;
+	}
+	for (; p < end; p++)
+	{
+		h ^= *p * P5;
+		h = rotl(h, 11) * P1;
+	}
+
+	h ^= h >> 33;
+	h *= P2;
+	h ^= h >> 29;
+	h *= P3;
+	h ^= h >> 32;
+	return h;
+}
+
+uint64_t digest_buffer(const void* data, size_t len, uint64_t seed)
+{
+	digest_state state;
+	digest_init(&state, seed);
+	digest_update(&state, data, len);
+	return digest_final(&state);
+}
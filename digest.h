@@ -0,0 +1,31 @@
+/**
+ *  64-bit content digest (the XXH64 algorithm), streaming interface
+ *  used for the digest trailer of streamed transfers: fast enough to run at
+ *  memory bandwidth, not meant to resist a malicious sender.
+ */
+
+#ifndef DIGEST_H
+#define DIGEST_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+typedef struct
+{
+	uint64_t v[4];
+	uint64_t total_len;
+	uint8_t buffer[32];
+	size_t buffered;
+	uint64_t seed;
+} digest_state;
+
+void digest_init(digest_state* state, uint64_t seed);
+void digest_update(digest_state* state, const void* data, size_t len);
+uint64_t digest_final(const digest_state* state);
+
+/*
+ *	One-shot digest of a buffer.
+ */
+uint64_t digest_buffer(const void* data, size_t len, uint64_t seed);
+
+#endif
@@ -0,0 +1,431 @@
+/**
+ *  cached directory index, see dirindex.h
+ */
+
+#define _GNU_SOURCE // qsort_r
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include "dirindex.h"
+#include "metrics.h"
+
+#define DIRINDEX_BUCKETS 1024
+#define DIRINDEX_INITIAL_ENTRIES 64
+#define DIRINDEX_INITIAL_NAMES 4096
+
+static pthread_mutex_t table_lock = PTHREAD_MUTEX_INITIALIZER;
+static dir_index* table[DIRINDEX_BUCKETS];
+static dir_index* newest = NULL;
+static dir_index* oldest = NULL;
+static int table_count = 0;
+
+// a directory being read, the other readers of it wait for the result instead of reading it too
+typedef struct index_fill index_fill;
+
+struct index_fill
+{
+	const char* path;
+	bool done;
+	int error; // < errno of the read, 0 if the index is in the table
+	int refs; // < the reader and the threads waiting for it
+	index_fill* next;
+};
+
+static index_fill* fills = NULL;
+static pthread_cond_t fill_done = PTHREAD_COND_INITIALIZER;
+
+static uint32_t path_bucket(const char* path)
+{
+	// FNV-1a
+	uint32_t hash = 2166136261u;
+	for (const unsigned char* c = (const unsigned char*) path; *c != '\0'; c++)
+	{
+		hash = (hash ^ *c) * 16777619u;
+	}
+	return hash % DIRINDEX_BUCKETS;
+}
+
+static void free_index(dir_index* index)
+{
+	free(index->path);
+	free(index->names);
+	free(index->entries);
+	free(index);
+}
+
+static int compare_entries(const void* a, const void* b, void* names)
+{
+	return strcmp((const char*) names + ((const dir_entry*) a)->name, (const char*) names + ((const dir_entry*) b)->name);
+}
+
+/*
+ *	Reads the directory path into a new index.
+ *	Returns the index, NULL on error.
+ */
+static dir_index* read_index(const char* path)
+{
+	DIR* dir = opendir(path);
+	if (dir == NULL)
+	{
+		return NULL;
+	}
+	dir_index* index = (dir_index*) calloc(1, sizeof(dir_index));
+	size_t entries_size = DIRINDEX_INITIAL_ENTRIES, names_size = DIRINDEX_INITIAL_NAMES, names_used = 0;
+	if (index == NULL || (index->path = strdup(path)) == NULL
+		|| (index->entries = (dir_entry*) malloc(entries_size * sizeof(dir_entry))) == NULL
+		|| (index->names = (char*) malloc(names_size)) == NULL)
+	{
+		goto fail;
+	}
+
+	struct dirent* item;
+	errno = 0;
+	while ((item = readdir(dir)) != NULL)
+	{
+		dir_entry entry;
+		if (strcmp(item->d_name, ".") == 0 || strcmp(item->d_name, "..") == 0
+			|| fstatat(dirfd(dir), item->d_name, &entry.st, 0) == -1
+			|| !(S_ISREG(entry.st.st_mode) || S_ISDIR(entry.st.st_mode)))
+		{
+			// gone since readdir(), a dangling link or not a file
+			errno = 0;
+			continue;
+		}
+
+		size_t len = strlen(item->d_name) + 1;
+		if ((size_t) index->count == entries_size)
+		{
+			dir_entry* entries = (dir_entry*) realloc(index->entries, 2 * entries_size * sizeof(dir_entry));
+			if (entries == NULL)
+			{
+				goto fail;
+			}
+			index->entries = entries;
+			entries_size *= 2;
+		}
+		if (names_used + len > names_size)
+		{
+			size_t size = 2 * names_size > names_used + len ? 2 * names_size : names_used + len;
+			char* names = (char*) realloc(index->names, size);
+			if (names == NULL)
+			{
+				goto fail;
+			}
+			index->names = names;
+			names_size = size;
+		}
+		memcpy(index->names + names_used, item->d_name, len);
+		entry.name = (uint32_t) names_used;
+		index->entries[index->count++] = entry;
+		names_used += len;
+	}
+	if (errno != 0)
+	{
+		goto fail;
+	}
+	closedir(dir);
+
+	qsort_r(index->entries, index->count, sizeof(dir_entry), compare_entries, index->names);
+	index->read_ns = metrics_now_ns();
+	index->refs = 1;
+	return index;
+
+fail:
+	{
+		int saved = errno != 0 ? errno : ENOMEM;
+		closedir(dir);
+		if (index != NULL)
+		{
+			free_index(index);
+		}
+		errno = saved;
+		return NULL;
+	}
+}
+
+static void unlink_recent(dir_index* index)
+{
+	if (index->newer != NULL)
+	{
+		index->newer->older = index->older;
+	}
+	else
+	{
+		newest = index->older;
+	}
+	if (index->older != NULL)
+	{
+		index->older->newer = index->newer;
+	}
+	else
+	{
+		oldest = index->newer;
+	}
+	index->newer = index->older = NULL;
+}
+
+/*
+ *	Takes index out of the table and the recently used list. Called with the lock held.
+ */
+static void unlink_index(dir_index* index)
+{
+	for (dir_index** link = &table[path_bucket(index->path)]; *link != NULL; link = &(*link)->next)
+	{
+		if (*link == index)
+		{
+			*link = index->next;
+			break;
+		}
+	}
+	unlink_recent(index);
+	table_count--;
+}
+
+static void push_newest(dir_index* index)
+{
+	index->older = newest;
+	index->newer = NULL;
+	if (newest != NULL)
+	{
+		newest->newer = index;
+	}
+	newest = index;
+	if (oldest == NULL)
+	{
+		oldest = index;
+	}
+}
+
+/*
+ *	Drops the reference of the table on index. Called with the lock held.
+ */
+static void release_locked(dir_index* index)
+{
+	if (--index->refs == 0)
+	{
+		free_index(index);
+	}
+}
+
+/*
+ *	Returns the index of path in the table if it is younger than ttl_ns, with a reference taken.
+ *	Called with the lock held.
+ */
+static dir_index* find_fresh_locked(const char* path, uint32_t bucket, uint64_t ttl_ns)
+{
+	dir_index* index = table[bucket];
+	while (index != NULL && strcmp(index->path, path) != 0)
+	{
+		index = index->next;
+	}
+	if (index == NULL || metrics_now_ns() - index->read_ns >= ttl_ns)
+	{
+		return NULL;
+	}
+	if (index != newest)
+	{
+		unlink_recent(index);
+		push_newest(index);
+	}
+	index->refs++;
+	return index;
+}
+
+dir_index* dirindex_get(const char* path, uint64_t ttl_ns, int max_dirs)
+{
+	uint32_t bucket = path_bucket(path);
+	pthread_mutex_lock(&table_lock);
+	dir_index* index;
+	index_fill* fill;
+	bool waited = false;
+	// an index read while waiting for it is recent enough, whatever ttl_ns
+	while ((index = find_fresh_locked(path, bucket, waited ? UINT64_MAX : ttl_ns)) == NULL)
+	{
+		fill = fills;
+		while (fill != NULL && strcmp(fill->path, path) != 0)
+		{
+			fill = fill->next;
+		}
+		if (fill == NULL)
+		{
+			break;
+		}
+		// another thread reads it: its index, or its error, is this one's too
+		fill->refs++;
+		while (!fill->done)
+		{
+			pthread_cond_wait(&fill_done, &table_lock);
+		}
+		int error = fill->error;
+		waited = true;
+		if (--fill->refs == 0)
+		{
+			free(fill);
+		}
+		if (error != 0)
+		{
+			pthread_mutex_unlock(&table_lock);
+			errno = error;
+			return NULL;
+		}
+	}
+	if (index != NULL)
+	{
+		pthread_mutex_unlock(&table_lock);
+		metrics_add(M_INDEX_HITS, 1);
+		return index;
+	}
+	// announced, so only this thread reads the directory; without memory the others may read it too
+	if ((fill = (index_fill*) calloc(1, sizeof(index_fill))) != NULL)
+	{
+		fill->path = path;
+		fill->refs = 1;
+		fill->next = fills;
+		fills = fill;
+	}
+	pthread_mutex_unlock(&table_lock);
+
+	dir_index* fresh = read_index(path);
+	int error = fresh == NULL ? errno : 0;
+
+	pthread_mutex_lock(&table_lock);
+	if (fill != NULL)
+	{
+		for (index_fill** link = &fills; *link != NULL; link = &(*link)->next)
+		{
+			if (*link == fill)
+			{
+				*link = fill->next;
+				break;
+			}
+		}
+		fill->done = true;
+		fill->error = error;
+		pthread_cond_broadcast(&fill_done);
+		if (--fill->refs == 0)
+		{
+			free(fill);
+		}
+	}
+	if (fresh == NULL)
+	{
+		pthread_mutex_unlock(&table_lock);
+		errno = error;
+		return NULL;
+	}
+	metrics_add(M_INDEX_READS, 1);
+
+	index = table[bucket];
+	while (index != NULL && strcmp(index->path, path) != 0)
+	{
+		index = index->next;
+	}
+	if (index != NULL)
+	{
+		unlink_index(index);
+		release_locked(index);
+	}
+	while (table_count >= max_dirs && oldest != NULL)
+	{
+		dir_index* evicted = oldest;
+		unlink_index(evicted);
+		release_locked(evicted);
+	}
+	fresh->next = table[bucket];
+	table[bucket] = fresh;
+	push_newest(fresh);
+	table_count++;
+	fresh->refs++;
+	pthread_mutex_unlock(&table_lock);
+	return fresh;
+}
+
+void dirindex_invalidate(const char* path)
+{
+	pthread_mutex_lock(&table_lock);
+	dir_index* index = table[path_bucket(path)];
+	while (index != NULL && strcmp(index->path, path) != 0)
+	{
+		index = index->next;
+	}
+	if (index != NULL)
+	{
+		unlink_index(index);
+		release_locked(index);
+	}
+	pthread_mutex_unlock(&table_lock);
+}
+
+void dirindex_put(dir_index* index)
+{
+	pthread_mutex_lock(&table_lock);
+	release_locked(index);
+	pthread_mutex_unlock(&table_lock);
+}
+
+const dir_entry* dirindex_find(const dir_index* index, const char* name)
+{
+	int low = 0, high = index->count - 1;
+	while (low <= high)
+	{
+		int middle = low + (high - low) / 2;
+		int order = strcmp(index->names + index->entries[middle].name, name);
+		if (order == 0)
+		{
+			return &index->entries[middle];
+		}
+		if (order < 0)
+		{
+			low = middle + 1;
+		}
+		else
+		{
+			high = middle - 1;
+		}
+	}
+	return NULL;
+}
+
+int dirindex_stat(const char* path, uint64_t ttl_ns, int max_dirs, struct stat* st)
+{
+	char parent[PATH_MAX];
+	const char* slash = strrchr(path, '/');
+	const char* name = slash != NULL ? slash + 1 : path;
+	if (slash == NULL)
+	{
+		strcpy(parent, ".");
+	}
+	else if ((size_t) (slash - path) < sizeof(parent))
+	{
+		memcpy(parent, path, slash - path);
+		parent[slash - path] = '\0';
+	}
+	else
+	{
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+
+	dir_index* index = dirindex_get(parent, ttl_ns, max_dirs);
+	if (index == NULL)
+	{
+		return -1;
+	}
+	const dir_entry* entry = dirindex_find(index, name);
+	if (entry != NULL)
+	{
+		*st = entry->st;
+	}
+	dirindex_put(index);
+	if (entry == NULL)
+	{
+		errno = ENOENT;
+		return -1;
+	}
+	return 0;
+}
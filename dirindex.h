@@ -0,0 +1,73 @@
+/**
+ *  cached directory index
+ *
+ *  the metadata requests (stat, listing and bulk stat, see message.h) are
+ *  answered from an index of each directory instead of a stat() per path:
+ *  one pass over the directory reads every entry with its metadata, sorted
+ *  by name, so a listing page is a slice of it and a stat a binary search.
+ *
+ *  an index is trusted for ttl_ns after it was read, then read again: a file
+ *  growing in place does not change its directory, so only reading the
+ *  entries again catches it. at most max_dirs indexes are kept, the least
+ *  recently used go first. an index that is replaced or evicted stays valid
+ *  until its last user puts it back. a directory is read by one thread at a
+ *  time: the others asking for it meanwhile wait and share its index, or
+ *  its error.
+ *
+ *  only regular files and directories are indexed, symbolic links count as
+ *  what they point to.
+ */
+
+#ifndef DIRINDEX_H
+#define DIRINDEX_H
+
+#include <stdint.h>
+#include <sys/stat.h>
+
+typedef struct
+{
+	uint32_t name; // < offset of the name in the names of the index
+	struct stat st;
+} dir_entry;
+
+typedef struct dir_index dir_index;
+
+struct dir_index
+{
+	char* path;
+	char* names;
+	dir_entry* entries; // < sorted by name
+	int count;
+	uint64_t read_ns; // < when the directory was read
+	int refs; // < the table holds one while the index is in it
+	dir_index* next; // < hash chain
+	dir_index* newer; // < recently used list
+	dir_index* older;
+};
+
+/*
+ *	Returns the index of the directory path, read again if older than ttl_ns.
+ *	The index must be given back with dirindex_put().
+ *	Returns NULL on error, with errno set (ENOENT, ENOTDIR...).
+ */
+dir_index* dirindex_get(const char* path, uint64_t ttl_ns, int max_dirs);
+
+void dirindex_put(dir_index* index);
+
+/*
+ *	Drops the index of the directory path, if any: the next dirindex_get() reads it again.
+ */
+void dirindex_invalidate(const char* path);
+
+/*
+ *	Returns the entry called name, or NULL.
+ */
+const dir_entry* dirindex_find(const dir_index* index, const char* name);
+
+/*
+ *	Looks path up in the index of its directory, "." for a name without '/'.
+ *	Returns 0 on success, -1 on error, with errno ENOENT if path is not indexed.
+ */
+int dirindex_stat(const char* path, uint64_t ttl_ns, int max_dirs, struct stat* st);
+
+#endif
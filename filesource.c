@@ -0,0 +1,538 @@
+/**
+ *  file sources and the shared mapping cache, see filesource.h
+ */
+
+#define _GNU_SOURCE // O_DIRECT
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "filesource.h"
+#include "mapguard.h"
+#include "metrics.h"
+
+#define MAPCACHE_BUCKETS 256
+
+/*
+ *	One mapping per file version (device, inode, size, mtime), reference counted.
+ *	It is unmapped when its last reader is done; the pages stay in the page cache.
+ */
+struct mapped_file
+{
+	void* data;
+	size_t size;
+	dev_t dev;
+	ino_t ino;
+	struct timespec mtime;
+	int guard; // < its mapguard slot
+	int refs;
+	struct mapped_file* next;
+};
+
+static mapped_file* mapcache[MAPCACHE_BUCKETS];
+static pthread_mutex_t mapcache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ *	Ring of DIRECT_BUFFERS buffers between the reader thread and the sender.
+ *	filled and consumed count buffers since the start, the lock only guards
+ *		the hand over of whole buffers.
+ */
+struct direct_reader
+{
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t changed;
+	int fd;
+	buffer_pool* pool;
+	char* buffers[DIRECT_BUFFERS];
+	size_t lengths[DIRECT_BUFFERS];
+	uint64_t filled;
+	uint64_t consumed;
+	bool done; // < the reader hit the end of the file or an error
+	bool stop;
+	int error;
+	// owned by the sender
+	bool holding;
+	size_t pos;
+};
+
+// changed by configuration reloads while files are served, each open reads them once
+static _Atomic uint64_t readahead_max = READAHEAD_DEFAULT_MAX;
+static _Atomic uint64_t drop_threshold = DROP_DEFAULT_THRESHOLD;
+static _Atomic uint64_t direct_threshold = DIRECT_DEFAULT_THRESHOLD;
+static _Atomic uint64_t map_budget = 0;
+static buffer_pool* _Atomic direct_pool = NULL;
+
+// bytes mapped by the cache, guarded by mapcache_lock
+static uint64_t mapped_bytes = 0;
+
+void source_set_readahead(uint64_t max_window)
+{
+	atomic_store_explicit(&readahead_max, max_window, memory_order_relaxed);
+}
+
+void source_set_drop_threshold(uint64_t threshold)
+{
+	atomic_store_explicit(&drop_threshold, threshold, memory_order_relaxed);
+}
+
+void source_set_direct(uint64_t threshold, buffer_pool* pool)
+{
+	atomic_store_explicit(&direct_threshold, threshold, memory_order_relaxed);
+	atomic_store(&direct_pool, pool);
+}
+
+void source_set_map_budget(uint64_t budget)
+{
+	atomic_store_explicit(&map_budget, budget, memory_order_relaxed);
+}
+
+static void* direct_reader_main(void* arg)
+{
+	direct_reader* reader = (direct_reader*) arg;
+	size_t buffer_size = pool_buffer_size(reader->pool);
+	off_t offset = 0;
+
+	pthread_mutex_lock(&reader->lock);
+	while (!reader->stop)
+	{
+		if (reader->filled - reader->consumed == DIRECT_BUFFERS)
+		{
+			pthread_cond_wait(&reader->changed, &reader->lock);
+			continue;
+		}
+		int index = reader->filled % DIRECT_BUFFERS;
+		pthread_mutex_unlock(&reader->lock);
+
+		ssize_t read_size;
+		do
+		{
+			read_size = pread(reader->fd, reader->buffers[index], buffer_size, offset);
+		} while (read_size == -1 && errno == EINTR);
+
+		pthread_mutex_lock(&reader->lock);
+		if (read_size == -1)
+		{
+			reader->error = errno;
+			break;
+		}
+		if (read_size == 0)
+		{
+			break;
+		}
+		reader->lengths[index] = read_size;
+		reader->filled++;
+		offset += read_size;
+		pthread_cond_signal(&reader->changed);
+		if ((size_t) read_size < buffer_size)
+		{
+			// only the last read of the file comes back short
+			break;
+		}
+	}
+	reader->done = true;
+	pthread_cond_signal(&reader->changed);
+	pthread_mutex_unlock(&reader->lock);
+	return NULL;
+}
+
+static void direct_reader_destroy(direct_reader* reader)
+{
+	for (int i = 0; i < DIRECT_BUFFERS; i++)
+	{
+		pool_put(reader->pool, reader->buffers[i]);
+	}
+	pthread_cond_destroy(&reader->changed);
+	pthread_mutex_destroy(&reader->lock);
+	free(reader);
+}
+
+/*
+ *	Starts the reader thread of an O_DIRECT file.
+ *	Returns the reader, or NULL on error (errno is set).
+ */
+static direct_reader* direct_reader_start(int fd, buffer_pool* pool)
+{
+	direct_reader* reader = (direct_reader*) calloc(1, sizeof(direct_reader));
+	if (reader == NULL)
+	{
+		errno = ENOMEM;
+		return NULL;
+	}
+	reader->fd = fd;
+	reader->pool = pool;
+	pthread_mutex_init(&reader->lock, NULL);
+	pthread_cond_init(&reader->changed, NULL);
+
+	for (int i = 0; i < DIRECT_BUFFERS; i++)
+	{
+		reader->buffers[i] = (char*) pool_get(pool);
+		if (reader->buffers[i] == NULL)
+		{
+			direct_reader_destroy(reader);
+			errno = ENOMEM;
+			return NULL;
+		}
+	}
+
+	int err = pthread_create(&reader->thread, NULL, direct_reader_main, reader);
+	if (err != 0)
+	{
+		direct_reader_destroy(reader);
+		errno = err;
+		return NULL;
+	}
+	return reader;
+}
+
+static ssize_t direct_reader_next(direct_reader* reader, size_t max, const char** data)
+{
+	int index = reader->consumed % DIRECT_BUFFERS;
+	if (!reader->holding || reader->pos == reader->lengths[index])
+	{
+		// hand the finished buffer back and wait for the next one
+		pthread_mutex_lock(&reader->lock);
+		if (reader->holding)
+		{
+			reader->consumed++;
+			reader->holding = false;
+			reader->pos = 0;
+			pthread_cond_signal(&reader->changed);
+		}
+		while (reader->filled == reader->consumed && !reader->done)
+		{
+			pthread_cond_wait(&reader->changed, &reader->lock);
+		}
+		if (reader->filled == reader->consumed)
+		{
+			int error = reader->error;
+			pthread_mutex_unlock(&reader->lock);
+			errno = error;
+			return error != 0 ? -1 : 0;
+		}
+		pthread_mutex_unlock(&reader->lock);
+		reader->holding = true;
+		index = reader->consumed % DIRECT_BUFFERS;
+	}
+
+	size_t len = reader->lengths[index] - reader->pos < max ? reader->lengths[index] - reader->pos : max;
+	*data = reader->buffers[index] + reader->pos;
+	reader->pos += len;
+	return len;
+}
+
+static void direct_reader_stop(direct_reader* reader)
+{
+	pthread_mutex_lock(&reader->lock);
+	reader->stop = true;
+	pthread_cond_signal(&reader->changed);
+	pthread_mutex_unlock(&reader->lock);
+	pthread_join(reader->thread, NULL);
+	direct_reader_destroy(reader);
+}
+
+static mapped_file* mapcache_acquire(int fd, const struct stat* st)
+{
+	unsigned int bucket = (unsigned int) ((st->st_ino * 31 + st->st_dev) % MAPCACHE_BUCKETS);
+
+	pthread_mutex_lock(&mapcache_lock);
+	for (mapped_file* entry = mapcache[bucket]; entry != NULL; entry = entry->next)
+	{
+		if (entry->ino == st->st_ino && entry->dev == st->st_dev && entry->size == (size_t) st->st_size
+			&& entry->mtime.tv_sec == st->st_mtim.tv_sec && entry->mtime.tv_nsec == st->st_mtim.tv_nsec
+			&& !mapguard_faulted(entry->guard))
+		{
+			entry->refs++;
+			pthread_mutex_unlock(&mapcache_lock);
+			return entry;
+		}
+	}
+
+	// the budget is reserved before mapping, so concurrent misses cannot overshoot it
+	uint64_t budget = atomic_load_explicit(&map_budget, memory_order_relaxed);
+	if (budget > 0 && mapped_bytes + st->st_size > budget)
+	{
+		pthread_mutex_unlock(&mapcache_lock);
+		errno = ENOBUFS;
+		return NULL;
+	}
+	mapped_bytes += st->st_size;
+	pthread_mutex_unlock(&mapcache_lock);
+
+	// map outside the lock, a racing reader of the same file just gets its own mapping
+	mapped_file* entry = (mapped_file*) calloc(1, sizeof(mapped_file));
+	if (entry != NULL)
+	{
+		entry->data = mmap(NULL, st->st_size, PROT_READ, MAP_SHARED, fd, 0);
+	}
+	if (entry != NULL && entry->data != MAP_FAILED && (entry->guard = mapguard_add(entry->data, st->st_size)) == -1)
+	{
+		// without a guard a truncation would kill the server, read this one instead
+		munmap(entry->data, st->st_size);
+		entry->data = MAP_FAILED;
+		errno = ENOBUFS;
+	}
+	if (entry == NULL || entry->data == MAP_FAILED)
+	{
+		int saved = entry == NULL ? ENOMEM : errno;
+		free(entry);
+		pthread_mutex_lock(&mapcache_lock);
+		mapped_bytes -= st->st_size;
+		pthread_mutex_unlock(&mapcache_lock);
+		errno = saved;
+		return NULL;
+	}
+	madvise(entry->data, st->st_size, MADV_SEQUENTIAL);
+	entry->size = st->st_size;
+	entry->dev = st->st_dev;
+	entry->ino = st->st_ino;
+	entry->mtime = st->st_mtim;
+	entry->refs = 1;
+
+	pthread_mutex_lock(&mapcache_lock);
+	entry->next = mapcache[bucket];
+	mapcache[bucket] = entry;
+	pthread_mutex_unlock(&mapcache_lock);
+	return entry;
+}
+
+/*
+ *	Drops a reference to mapping, unmapping it with the last one.
+ *	Returns 1 if that was the last reference, 0 otherwise.
+ */
+static int mapcache_release(mapped_file* mapping)
+{
+	unsigned int bucket = (unsigned int) ((mapping->ino * 31 + mapping->dev) % MAPCACHE_BUCKETS);
+
+	pthread_mutex_lock(&mapcache_lock);
+	if (--mapping->refs > 0)
+	{
+		pthread_mutex_unlock(&mapcache_lock);
+		return 0;
+	}
+	for (mapped_file** link = &mapcache[bucket]; *link != NULL; link = &(*link)->next)
+	{
+		if (*link == mapping)
+		{
+			*link = mapping->next;
+			break;
+		}
+	}
+	mapped_bytes -= mapping->size;
+	pthread_mutex_unlock(&mapcache_lock);
+
+	mapguard_remove(mapping->guard);
+	munmap(mapping->data, mapping->size);
+	free(mapping);
+	return 1;
+}
+
+/*
+ *	Makes sure the range up to needed_to plus the readahead window is on its way into
+ *		the page cache, once less than half a window is left in flight.
+ *	The window is resized to the rate the cursor moved since the previous advice.
+ */
+static void source_prefetch(file_source* source, uint64_t needed_to)
+{
+	uint64_t max_window = atomic_load_explicit(&readahead_max, memory_order_relaxed);
+	if (max_window == 0 || source->mode == SOURCE_DIRECT || source->prefetched >= source->size
+		|| source->prefetched >= needed_to + source->window / 2)
+	{
+		return;
+	}
+
+	uint64_t now = metrics_now_ns();
+	if (source->window_start_ns != 0 && now > source->window_start_ns)
+	{
+		double rate = (double) (source->offset - source->window_start_offset) / (now - source->window_start_ns);
+		uint64_t target = (uint64_t) (rate * READAHEAD_LEAD_NS);
+		// at most halve or double per step, so one stall does not swing it
+		target = target < source->window / 2 ? source->window / 2 : target;
+		target = target > source->window * 2 ? source->window * 2 : target;
+		target = target < READAHEAD_MIN ? READAHEAD_MIN : target;
+		source->window = target > max_window ? max_window : target;
+	}
+	source->window_start_ns = now;
+	source->window_start_offset = source->offset;
+
+	uint64_t page = sysconf(_SC_PAGESIZE);
+	uint64_t from = (source->prefetched > source->offset ? source->prefetched : source->offset) & ~(page - 1);
+	uint64_t to = needed_to + source->window < source->size ? needed_to + source->window : source->size;
+	if (source->mapping != NULL)
+	{
+		madvise((char*) source->mapping->data + from, to - from, MADV_WILLNEED);
+	}
+	else
+	{
+		posix_fadvise(source->fd, from, to - from, POSIX_FADV_WILLNEED);
+	}
+	metrics_add(M_BYTES_PREFETCHED, to - from);
+	source->prefetched = to;
+}
+
+int source_open(file_source* source, const char* filename, enum source_mode mode, buffer_pool* pool)
+{
+	memset(source, 0, sizeof(file_source));
+	source->mode = mode;
+	source->pool = pool;
+
+	source->fd = open(filename, O_RDONLY | O_CLOEXEC);
+	if (source->fd == -1)
+	{
+		return -1;
+	}
+
+	struct stat statbuf;
+	if (fstat(source->fd, &statbuf) == -1)
+	{
+		close(source->fd);
+		return -1;
+	}
+	source->size = statbuf.st_size;
+	uint64_t max_window = atomic_load_explicit(&readahead_max, memory_order_relaxed);
+	source->window = max_window < READAHEAD_MIN ? max_window : READAHEAD_MIN;
+
+	// huge files bypass the page cache, if the file system lets them
+	uint64_t threshold = atomic_load_explicit(&direct_threshold, memory_order_relaxed);
+	buffer_pool* readers_pool = atomic_load(&direct_pool);
+	if (threshold > 0 && readers_pool != NULL && source->size >= threshold
+		&& fcntl(source->fd, F_SETFL, fcntl(source->fd, F_GETFL) | O_DIRECT) == 0)
+	{
+		source->reader = direct_reader_start(source->fd, readers_pool);
+		if (source->reader == NULL)
+		{
+			int saved = errno;
+			close(source->fd);
+			errno = saved;
+			return -1;
+		}
+		source->mode = SOURCE_DIRECT;
+		metrics_add(M_FILES_DIRECT, 1);
+		return 0;
+	}
+
+	if (mode == SOURCE_MMAP && source->size > 0)
+	{
+		source->mapping = mapcache_acquire(source->fd, &statbuf);
+		if (source->mapping == NULL && errno == ENOBUFS)
+		{
+			// over the mapping budget or out of guard slots, read this one instead
+			source->mode = mode = SOURCE_READ;
+		}
+		else if (source->mapping == NULL)
+		{
+			int saved = errno;
+			close(source->fd);
+			errno = saved;
+			return -1;
+		}
+	}
+	if (mode == SOURCE_READ)
+	{
+		source->buffer = (char*) pool_get(pool);
+		if (source->buffer == NULL)
+		{
+			close(source->fd);
+			errno = ENOMEM;
+			return -1;
+		}
+		posix_fadvise(source->fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+	}
+
+	source_prefetch(source, 0);
+	return 0;
+}
+
+ssize_t source_next(file_source* source, size_t max, const char** data)
+{
+	if (source->mode == SOURCE_DIRECT)
+	{
+		ssize_t len = direct_reader_next(source->reader, max, data);
+		source->offset += len > 0 ? len : 0;
+		return len;
+	}
+
+	if (source->mode == SOURCE_MMAP)
+	{
+		if (source_check(source) == -1)
+		{
+			return -1;
+		}
+		if (source->offset >= source->size)
+		{
+			return 0;
+		}
+		size_t len = source->size - source->offset < max ? source->size - source->offset : max;
+		source_prefetch(source, source->offset + len);
+		*data = (const char*) source->mapping->data + source->offset;
+		source->offset += len;
+		return len;
+	}
+
+	if (source->buffer_pos == source->buffer_len)
+	{
+		source_prefetch(source, source->offset + pool_buffer_size(source->pool));
+		ssize_t read_size;
+		do
+		{
+			read_size = read(source->fd, source->buffer, pool_buffer_size(source->pool));
+		} while (read_size == -1 && errno == EINTR);
+		if (read_size <= 0)
+		{
+			return read_size;
+		}
+		source->buffer_len = read_size;
+		source->buffer_pos = 0;
+	}
+
+	size_t len = source->buffer_len - source->buffer_pos < max ? source->buffer_len - source->buffer_pos : max;
+	*data = source->buffer + source->buffer_pos;
+	source->buffer_pos += len;
+	source->offset += len;
+	return len;
+}
+
+int source_check(const file_source* source)
+{
+	if (source->mapping != NULL && mapguard_faulted(source->mapping->guard))
+	{
+		errno = EIO;
+		return -1;
+	}
+	return 0;
+}
+
+void source_close(file_source* source)
+{
+	if (source->reader != NULL)
+	{
+		direct_reader_stop(source->reader);
+	}
+
+	// one-shot sized files leave the page cache, unless someone else is still mapping them
+	uint64_t threshold = atomic_load_explicit(&drop_threshold, memory_order_relaxed);
+	int drop = threshold > 0 && source->size >= threshold && source->mode != SOURCE_DIRECT;
+	if (source->mapping != NULL)
+	{
+		drop = mapcache_release(source->mapping) && drop;
+	}
+	if (drop)
+	{
+		posix_fadvise(source->fd, 0, 0, POSIX_FADV_DONTNEED);
+		metrics_add(M_FILES_DROPPED, 1);
+	}
+	if (source->buffer != NULL)
+	{
+		pool_put(source->pool, source->buffer);
+	}
+	close(source->fd);
+	memset(source, 0, sizeof(file_source));
+	source->fd = -1;
+}
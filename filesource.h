@@ -0,0 +1,114 @@
+/**
+ *  where the bytes of a served file come from
+ *
+ *  SOURCE_READ reads the file with read() into a pooled buffer and hands out
+ *  slices of it, so small protocol segments cost no extra copy or syscall.
+ *  SOURCE_MMAP hands out slices of a shared mapping of the file instead: no
+ *  copy at all, and concurrent readers of the same (unchanged) file share one
+ *  mapping. a file truncated under it fails the transfer, see source_check().
+ *
+ *  both modes prefetch a window ahead of the cursor (posix_fadvise or
+ *  madvise WILLNEED), so the disk keeps reading while the socket drains.
+ *  the window follows the drain rate: it covers READAHEAD_LEAD_NS worth of
+ *  sending, between READAHEAD_MIN and the configured maximum. large files
+ *  are dropped from the page cache once sent, they are unlikely to be asked
+ *  for again and would only evict the small hot ones.
+ */
+
+#ifndef FILESOURCE_H
+#define FILESOURCE_H
+
+#include <stdint.h>
+#include <sys/types.h>
+#include "pool.h"
+
+#define READAHEAD_MIN (256 * 1024)
+#define READAHEAD_DEFAULT_MAX (16 * 1024 * 1024)
+#define READAHEAD_LEAD_NS 200000000ull
+#define DROP_DEFAULT_THRESHOLD (1024ull * 1024 * 1024)
+#define DIRECT_DEFAULT_THRESHOLD (4096ull * 1024 * 1024)
+#define DIRECT_BUFFERS 3
+
+enum source_mode
+{
+	SOURCE_READ,
+	SOURCE_MMAP,
+	SOURCE_DIRECT
+};
+
+typedef struct mapped_file mapped_file;
+typedef struct direct_reader direct_reader;
+
+typedef struct
+{
+	enum source_mode mode;
+	int fd;
+	uint64_t size;
+	uint64_t offset; // < next byte handed out
+	// SOURCE_READ
+	buffer_pool* pool;
+	char* buffer;
+	size_t buffer_len;
+	size_t buffer_pos;
+	// SOURCE_MMAP
+	mapped_file* mapping;
+	// SOURCE_DIRECT
+	direct_reader* reader;
+	// readahead
+	uint64_t prefetched; // < end of the range already advised
+	uint64_t window;
+	uint64_t window_start_ns;
+	uint64_t window_start_offset;
+} file_source;
+
+/*
+ *	Caps the readahead window at max_window bytes, 0 disables the prefetching.
+ */
+void source_set_readahead(uint64_t max_window);
+
+/*
+ *	Files of at least threshold bytes are dropped from the page cache when closed,
+ *		0 never drops anything.
+ */
+void source_set_drop_threshold(uint64_t threshold);
+
+/*
+ *	Files of at least threshold bytes are read with O_DIRECT into buffers of pool,
+ *		whose size must be a multiple of the page size. 0 disables it.
+ */
+void source_set_direct(uint64_t threshold, buffer_pool* pool);
+
+/*
+ *	Caps the bytes mapped at once by SOURCE_MMAP readers at budget, 0 is unlimited.
+ *	Files that do not fit are read with SOURCE_READ instead.
+ */
+void source_set_map_budget(uint64_t budget);
+
+/*
+ *	Opens filename for sequential reading. pool provides the read buffers of SOURCE_READ.
+ *	mode is replaced by SOURCE_DIRECT for files above the direct threshold,
+ *		when their file system supports it, and by SOURCE_READ over the mapping budget.
+ *	Returns 0 on success, -1 on error (errno is set).
+ */
+int source_open(file_source* source, const char* filename, enum source_mode mode, buffer_pool* pool);
+
+/*
+ *	Points *data at up to max next bytes of the file.
+ *	Returns the number of bytes available, 0 at the end of the file, -1 on error.
+ */
+ssize_t source_next(file_source* source, size_t max, const char** data);
+
+/*
+ *	Tells whether the bytes handed out so far are those of the file: a SOURCE_MMAP
+ *		file truncated under its mapping reads as zeros past its new end (see mapguard.h).
+ *	Call it after reading the data and before sending it.
+ *	Returns 0 if they are, -1 otherwise (errno EIO).
+ */
+int source_check(const file_source* source);
+
+/*
+ *	Releases the buffer or the mapping and closes the file.
+ */
+void source_close(file_source* source);
+
+#endif
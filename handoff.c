@@ -0,0 +1,172 @@
+/**
+ *  listening socket handoff, see handoff.h
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "handoff.h"
+#include "netio.h"
+
+#define HANDOFF_READY 'r'
+
+/*
+ *	Fills addr with the Unix domain address of path.
+ *	Returns 0 on success, -1 if path does not fit.
+ */
+static int control_address(const char* path, struct sockaddr_un* addr)
+{
+	bzero(addr, sizeof(struct sockaddr_un));
+	if (strlen(path) >= sizeof(addr->sun_path))
+	{
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+	addr->sun_family = AF_UNIX;
+	strcpy(addr->sun_path, path);
+	return 0;
+}
+
+int handoff_listen(const char* path)
+{
+	struct sockaddr_un addr;
+	if (control_address(path, &addr) == -1)
+	{
+		return -1;
+	}
+
+	int sd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (sd == -1)
+	{
+		return -1;
+	}
+	unlink(path);
+	if (bind(sd, (struct sockaddr*) &addr, sizeof(addr)) == -1 || listen(sd, 1) == -1)
+	{
+		int saved = errno;
+		close(sd);
+		errno = saved;
+		return -1;
+	}
+	return sd;
+}
+
+int handoff_send(int connection_fd, const listener_set* listeners)
+{
+	// the names travel as the payload, the descriptors as ancillary data
+	struct iovec iov = { (void*) listeners->names, sizeof(listeners->names[0]) * listeners->count };
+	union
+	{
+		char buffer[CMSG_SPACE(sizeof(int) * HANDOFF_MAX_SOCKETS)];
+		struct cmsghdr align;
+	} control;
+	struct msghdr msg;
+	bzero(&msg, sizeof(msg));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control.buffer;
+	msg.msg_controllen = CMSG_SPACE(sizeof(int) * listeners->count);
+	struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(sizeof(int) * listeners->count);
+	memcpy(CMSG_DATA(cmsg), listeners->fds, sizeof(int) * listeners->count);
+
+	if (sendmsg(connection_fd, &msg, 0) == -1)
+	{
+		return -1;
+	}
+
+	// the replacement confirms once it accepts, or goes away
+	struct pollfd pfd = { connection_fd, POLLIN, 0 };
+	char reply = 0;
+	int ready;
+	while ((ready = poll(&pfd, 1, HANDOFF_CONFIRM_TIMEOUT_MS)) == -1 && errno == EINTR)
+	{
+	}
+	if (ready <= 0 || read(connection_fd, &reply, 1) != 1 || reply != HANDOFF_READY)
+	{
+		errno = ready == 0 ? ETIMEDOUT : ECONNRESET;
+		return -1;
+	}
+	return 0;
+}
+
+int handoff_request(const char* path, listener_set* listeners)
+{
+	struct sockaddr_un addr;
+	if (control_address(path, &addr) == -1)
+	{
+		return -1;
+	}
+	int sd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (sd == -1)
+	{
+		return -1;
+	}
+	if (connect(sd, (struct sockaddr*) &addr, sizeof(addr)) == -1)
+	{
+		int saved = errno;
+		close(sd);
+		errno = saved;
+		return -1;
+	}
+
+	struct iovec iov = { listeners->names, sizeof(listeners->names) };
+	union
+	{
+		char buffer[CMSG_SPACE(sizeof(int) * HANDOFF_MAX_SOCKETS)];
+		struct cmsghdr align;
+	} control;
+	struct msghdr msg;
+	bzero(&msg, sizeof(msg));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control.buffer;
+	msg.msg_controllen = sizeof(control.buffer);
+
+	ssize_t received;
+	while ((received = recvmsg(sd, &msg, MSG_CMSG_CLOEXEC)) == -1 && errno == EINTR)
+	{
+	}
+	struct cmsghdr* cmsg = received > 0 ? CMSG_FIRSTHDR(&msg) : NULL;
+	if (cmsg == NULL || cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
+	{
+		close(sd);
+		errno = EPROTO;
+		return -1;
+	}
+
+	// the whole message arrives at once, it is far below the socket buffer size
+	listeners->count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+	memcpy(listeners->fds, CMSG_DATA(cmsg), sizeof(int) * listeners->count);
+	if ((size_t) received != sizeof(listeners->names[0]) * listeners->count)
+	{
+		for (int i = 0; i < listeners->count; i++)
+		{
+			close(listeners->fds[i]);
+		}
+		listeners->count = 0;
+		close(sd);
+		errno = EPROTO;
+		return -1;
+	}
+	for (int i = 0; i < listeners->count; i++)
+	{
+		listeners->names[i][HANDOFF_NAME_SIZE - 1] = '\0';
+	}
+	return sd;
+}
+
+int handoff_confirm(int connection_fd)
+{
+	char ready = HANDOFF_READY;
+	int ret_val = write_full(connection_fd, &ready, 1);
+	close(connection_fd);
+	return ret_val;
+}
@@ -0,0 +1,57 @@
+/**
+ *  listening socket handoff between an old and a new server process
+ *
+ *  the running server listens on a Unix domain control socket. a new server
+ *  started to replace it connects there and receives every listening socket
+ *  (SCM_RIGHTS) together with the address each one is bound to, so it can
+ *  accept from the very same sockets: connections queued in their backlog
+ *  are not lost and there is no moment without a listener.
+ *
+ *  once its workers are accepting, the new server confirms with one byte.
+ *  only then does the old one stop accepting and drain its transfers; if
+ *  the new one dies before confirming, the old one just keeps serving.
+ */
+
+#ifndef HANDOFF_H
+#define HANDOFF_H
+
+#define HANDOFF_MAX_SOCKETS 16
+#define HANDOFF_NAME_SIZE 128
+#define HANDOFF_CONFIRM_TIMEOUT_MS 30000
+
+typedef struct
+{
+	int fds[HANDOFF_MAX_SOCKETS];
+	char names[HANDOFF_MAX_SOCKETS][HANDOFF_NAME_SIZE]; // < the address each socket is bound to
+	int count;
+} listener_set;
+
+/*
+ *	Listens for a replacement process on the control socket at path,
+ *		replacing the one of the previous process, if any. A replacement calls it
+ *		only after handoff_confirm(), until then the path is the previous one's.
+ *	Returns the socket file descriptor on success, -1 on error.
+ */
+int handoff_listen(const char* path);
+
+/*
+ *	Connects to the control socket at path and receives the listening sockets
+ *		of the running server into listeners.
+ *	Returns the connection to confirm on with handoff_confirm(), -1 on error.
+ */
+int handoff_request(const char* path, listener_set* listeners);
+
+/*
+ *	Tells the previous process its listeners are in use, then closes connection_fd.
+ *	Returns 0 on success, -1 on error.
+ */
+int handoff_confirm(int connection_fd);
+
+/*
+ *	Sends the listeners to a replacement process accepted on the control socket and
+ *		waits up to HANDOFF_CONFIRM_TIMEOUT_MS for its confirmation.
+ *	Returns 0 once confirmed, -1 otherwise (the caller keeps serving).
+ */
+int handoff_send(int connection_fd, const listener_set* listeners);
+
+#endif
@@ -0,0 +1,339 @@
+/**
+ *  per-thread log rings and the background flusher, see logger.h
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include "logger.h"
+#include "netio.h"
+
+#define LOG_BATCH_SIZE (64 * 1024)
+#define LOG_IDLE_NS 5000000
+
+typedef struct
+{
+	uint64_t realtime_ns;
+	int level;
+	int errnum;
+	char message[LOG_MESSAGE_SIZE];
+} log_record;
+
+typedef struct log_ring
+{
+	_Atomic uint32_t head; // < written by the owning thread
+	_Atomic uint32_t tail; // < written by the flusher
+	_Atomic uint64_t dropped;
+	uint64_t reported_dropped;
+	int thread_id;
+	struct log_ring* next;
+	log_record records[LOG_RING_SIZE];
+} log_ring;
+
+static __thread log_ring* log_tls = NULL;
+static log_ring* rings = NULL;
+static int ring_count = 0;
+static pthread_mutex_t rings_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static _Atomic int min_level = L_INFO;
+static enum log_format output_format = LOG_TEXT;
+static int output_fd = 2;
+static pthread_t flusher_thread;
+static _Atomic bool running = false;
+
+static const char* level_names[] = { "debug", "info", "warn", "error" };
+
+static log_ring* log_register_thread(void)
+{
+	log_ring* ring = (log_ring*) calloc(1, sizeof(log_ring));
+	if (ring == NULL)
+	{
+		return NULL;
+	}
+
+	pthread_mutex_lock(&rings_lock);
+	ring->thread_id = ring_count++;
+	ring->next = rings;
+	rings = ring;
+	pthread_mutex_unlock(&rings_lock);
+
+	log_tls = ring;
+	return ring;
+}
+
+static void log_vwrite(enum log_level level, int errnum, const char* fmt, va_list args)
+{
+	log_ring* ring = log_tls != NULL ? log_tls : log_register_thread();
+	if (ring == NULL)
+	{
+		return;
+	}
+
+	uint32_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+	uint32_t tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+	if (head - tail >= LOG_RING_SIZE)
+	{
+		// the flusher is behind, losing a record is better than stalling the caller
+		atomic_fetch_add_explicit(&ring->dropped, 1, memory_order_relaxed);
+		return;
+	}
+
+	log_record* record = &ring->records[head % LOG_RING_SIZE];
+	struct timespec ts;
+	clock_gettime(CLOCK_REALTIME, &ts);
+	record->realtime_ns = (uint64_t) ts.tv_sec * 1000000000ull + ts.tv_nsec;
+	record->level = level;
+	record->errnum = errnum;
+	vsnprintf(record->message, LOG_MESSAGE_SIZE, fmt, args);
+
+	atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+}
+
+void log_write(enum log_level level, int errnum, const char* fmt, ...)
+{
+	if ((int) level < atomic_load_explicit(&min_level, memory_order_relaxed))
+	{
+		return;
+	}
+	va_list args;
+	va_start(args, fmt);
+	log_vwrite(level, errnum, fmt, args);
+	va_end(args);
+}
+
+void log_write_limited(log_ratelimit* limit, enum log_level level, int errnum, const char* fmt, ...)
+{
+	if ((int) level < atomic_load_explicit(&min_level, memory_order_relaxed))
+	{
+		return;
+	}
+
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+	uint64_t window = ts.tv_sec;
+	uint64_t current = atomic_load_explicit(&limit->window, memory_order_relaxed);
+	if (current != window && atomic_compare_exchange_strong(&limit->window, &current, window))
+	{
+		// first record of a new second, report what the previous ones swallowed
+		atomic_store_explicit(&limit->count, 0, memory_order_relaxed);
+		uint32_t suppressed = atomic_exchange(&limit->suppressed, 0);
+		if (suppressed > 0)
+		{
+			log_write(level, 0, "%u similar messages suppressed", suppressed);
+		}
+	}
+
+	if (atomic_fetch_add_explicit(&limit->count, 1, memory_order_relaxed) >= LOG_RATELIMIT_BURST)
+	{
+		atomic_fetch_add_explicit(&limit->suppressed, 1, memory_order_relaxed);
+		return;
+	}
+
+	va_list args;
+	va_start(args, fmt);
+	log_vwrite(level, errnum, fmt, args);
+	va_end(args);
+}
+
+/*
+ *	Appends text to out with JSON string escaping.
+ *	Returns the number of bytes written, at most size.
+ */
+static size_t json_escape(char* out, size_t size, const char* text)
+{
+	size_t len = 0;
+	for (; *text != '\0' && len + 7 < size; text++)
+	{
+		unsigned char c = (unsigned char) *text;
+		if (c == '"' || c == '\\')
+		{
+			out[len++] = '\\';
+			out[len++] = c;
+		}
+		else if (c < 0x20)
+		{
+			len += snprintf(out + len, size - len, "\\u%04x", c);
+		}
+		else
+		{
+			out[len++] = c;
+		}
+	}
+	return len;
+}
+
+/*
+ *	Formats one record as a line at the end of batch.
+ *	Returns the number of bytes written.
+ */
+static size_t format_record(char* batch, size_t size, const log_record* record, int thread_id)
+{
+	time_t seconds = record->realtime_ns / 1000000000ull;
+	struct tm tm;
+	gmtime_r(&seconds, &tm);
+	char timestamp[40];
+	size_t ts_len = strftime(timestamp, sizeof(timestamp), "%Y-%m-%dT%H:%M:%S", &tm);
+	snprintf(timestamp + ts_len, sizeof(timestamp) - ts_len, ".%06uZ",
+		(unsigned int) (record->realtime_ns % 1000000000ull / 1000));
+
+	char error[128] = "";
+	if (record->errnum != 0)
+	{
+		snprintf(error, sizeof(error), "%s", strerror(record->errnum));
+	}
+
+	int len;
+	if (output_format == LOG_JSON)
+	{
+		char message[LOG_MESSAGE_SIZE * 2];
+		message[json_escape(message, sizeof(message), record->message)] = '\0';
+		len = snprintf(batch, size, "{\"ts\":\"%s\",\"level\":\"%s\",\"thread\":%d,\"msg\":\"%s\"%s%s%s}\n",
+			timestamp, level_names[record->level], thread_id, message,
+			error[0] != '\0' ? ",\"error\":\"" : "", error, error[0] != '\0' ? "\"" : "");
+	}
+	else
+	{
+		len = snprintf(batch, size, "%s %-5s [%d] %s%s%s\n", timestamp, level_names[record->level],
+			thread_id, record->message, error[0] != '\0' ? ": " : "", error);
+	}
+	return len < (int) size ? (size_t) len : size - 1;
+}
+
+/*
+ *	Moves every pending record of every ring to the output, in batches.
+ *	Returns the number of records written.
+ */
+static size_t drain_rings(char* batch)
+{
+	size_t used = 0, drained = 0;
+
+	pthread_mutex_lock(&rings_lock);
+	log_ring* first = rings;
+	pthread_mutex_unlock(&rings_lock);
+
+	// rings are only ever prepended, so the list after first is stable
+	for (log_ring* ring = first; ring != NULL; ring = ring->next)
+	{
+		uint32_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+		uint32_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+		for (; tail != head; tail++)
+		{
+			if (LOG_BATCH_SIZE - used < LOG_MESSAGE_SIZE * 3)
+			{
+				write_full(output_fd, batch, used);
+				used = 0;
+			}
+			used += format_record(batch + used, LOG_BATCH_SIZE - used, &ring->records[tail % LOG_RING_SIZE], ring->thread_id);
+			drained++;
+		}
+		atomic_store_explicit(&ring->tail, tail, memory_order_release);
+
+		uint64_t dropped = atomic_load_explicit(&ring->dropped, memory_order_relaxed);
+		if (dropped != ring->reported_dropped)
+		{
+			log_record note = { 0 };
+			note.level = L_WARN;
+			snprintf(note.message, LOG_MESSAGE_SIZE, "%llu log records dropped",
+				(unsigned long long) (dropped - ring->reported_dropped));
+			struct timespec ts;
+			clock_gettime(CLOCK_REALTIME, &ts);
+			note.realtime_ns = (uint64_t) ts.tv_sec * 1000000000ull + ts.tv_nsec;
+			if (LOG_BATCH_SIZE - used < LOG_MESSAGE_SIZE * 3)
+			{
+				write_full(output_fd, batch, used);
+				used = 0;
+			}
+			used += format_record(batch + used, LOG_BATCH_SIZE - used, &note, ring->thread_id);
+			ring->reported_dropped = dropped;
+		}
+	}
+
+	if (used > 0)
+	{
+		write_full(output_fd, batch, used);
+	}
+	return drained;
+}
+
+static void* flusher_main(void* arg)
+{
+	char* batch = (char*) arg;
+	while (atomic_load(&running))
+	{
+		if (drain_rings(batch) == 0)
+		{
+			struct timespec idle = { 0, LOG_IDLE_NS };
+			nanosleep(&idle, NULL);
+		}
+	}
+	drain_rings(batch);
+	free(batch);
+	return NULL;
+}
+
+int log_init(enum log_level level, enum log_format format, int fd)
+{
+	char* batch = (char*) malloc(LOG_BATCH_SIZE);
+	if (batch == NULL)
+	{
+		return -1;
+	}
+
+	atomic_store(&min_level, level);
+	output_format = format;
+	output_fd = fd;
+	atomic_store(&running, true);
+	if (pthread_create(&flusher_thread, NULL, flusher_main, batch) != 0)
+	{
+		atomic_store(&running, false);
+		free(batch);
+		return -1;
+	}
+
+	atexit(log_shutdown);
+	return 0;
+}
+
+void log_set_level(enum log_level level)
+{
+	atomic_store(&min_level, level);
+}
+
+int log_parse_level(const char* name)
+{
+	for (int i = L_DEBUG; i <= L_ERROR; i++)
+	{
+		if (strcmp(name, level_names[i]) == 0)
+		{
+			return i;
+		}
+	}
+	return -1;
+}
+
+int log_parse_format(const char* name)
+{
+	if (strcmp(name, "text") == 0)
+	{
+		return LOG_TEXT;
+	}
+	if (strcmp(name, "json") == 0)
+	{
+		return LOG_JSON;
+	}
+	return -1;
+}
+
+void log_shutdown(void)
+{
+	bool was_running = true;
+	if (atomic_compare_exchange_strong(&running, &was_running, false))
+	{
+		pthread_join(flusher_thread, NULL);
+	}
+}
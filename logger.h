@@ -0,0 +1,95 @@
+/**
+ *  asynchronous logging for the server
+ *  a logging thread only formats its message into a slot of its own ring
+ *  buffer (single producer, single consumer, no locks) and goes on. a
+ *  background flusher drains all the rings and writes the records in
+ *  batches, so serving threads never wait for the terminal, a pipe or a disk.
+ *  when a ring is full the record is dropped and counted instead of blocking.
+ *
+ *  output is one line per record, either plain text or JSON.
+ */
+
+#ifndef LOGGER_H
+#define LOGGER_H
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdatomic.h>
+
+#define LOG_RING_SIZE 256
+#define LOG_MESSAGE_SIZE 224
+#define LOG_RATELIMIT_BURST 10
+
+enum log_level
+{
+	L_DEBUG,
+	L_INFO,
+	L_WARN,
+	L_ERROR
+};
+
+enum log_format
+{
+	LOG_TEXT,
+	LOG_JSON
+};
+
+/*
+ *	Per call site state of the rate limited macros:
+ *	at most LOG_RATELIMIT_BURST records per second, the rest are counted.
+ */
+typedef struct
+{
+	_Atomic uint64_t window;
+	_Atomic uint32_t count;
+	_Atomic uint32_t suppressed;
+} log_ratelimit;
+
+/*
+ *	Starts the flusher thread writing to fd. Records below min_level are discarded.
+ *	Pending records are flushed at exit.
+ *	Returns 0 on success, -1 on error.
+ */
+int log_init(enum log_level min_level, enum log_format format, int fd);
+
+/*
+ *	Changes the minimum level at runtime.
+ */
+void log_set_level(enum log_level min_level);
+
+/*
+ *	Parse level ("debug", "info", "warn", "error") and format ("text", "json") names.
+ *	Return -1 for unknown names.
+ */
+int log_parse_level(const char* name);
+int log_parse_format(const char* name);
+
+/*
+ *	Stops the flusher after writing every pending record.
+ */
+void log_shutdown(void);
+
+/*
+ *	Queues a record. errnum != 0 appends its description to the message.
+ *	Never blocks.
+ */
+void log_write(enum log_level level, int errnum, const char* fmt, ...)
+	__attribute__((format(printf, 3, 4)));
+
+/*
+ *	Same as log_write, subject to the rate limit of the call site.
+ */
+void log_write_limited(log_ratelimit* limit, enum log_level level, int errnum, const char* fmt, ...)
+	__attribute__((format(printf, 4, 5)));
+
+#define log_debug(...) log_write(L_DEBUG, 0, __VA_ARGS__)
+#define log_info(...) log_write(L_INFO, 0, __VA_ARGS__)
+#define log_warn(...) log_write(L_WARN, 0, __VA_ARGS__)
+#define log_error(...) log_write(L_ERROR, 0, __VA_ARGS__)
+#define log_errno(...) log_write(L_ERROR, errno, __VA_ARGS__)
+
+#define log_warn_limited(...) do { static log_ratelimit limit_; log_write_limited(&limit_, L_WARN, 0, __VA_ARGS__); } while (0)
+#define log_error_limited(...) do { static log_ratelimit limit_; log_write_limited(&limit_, L_ERROR, 0, __VA_ARGS__); } while (0)
+#define log_errno_limited(...) do { static log_ratelimit limit_; log_write_limited(&limit_, L_ERROR, errno, __VA_ARGS__); } while (0)
+
+#endif
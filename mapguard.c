@@ -0,0 +1,87 @@
+/**
+ *  SIGBUS recovery for file mappings, see mapguard.h
+ */
+
+#include <errno.h>
+#include <signal.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdatomic.h>
+#include <sys/mman.h>
+#include "mapguard.h"
+
+#define SLOT_CLAIMED 1 // < start of a slot being filled in, matches no address
+
+typedef struct
+{
+	_Atomic uintptr_t start; // < 0: free
+	_Atomic uintptr_t end;
+	atomic_bool faulted;
+} guarded_range;
+
+static guarded_range ranges[MAPGUARD_MAX_RANGES];
+static uintptr_t page_size = 4096; // < read by the handler, sysconf() is not async-signal-safe
+
+static void on_sigbus(int signum, siginfo_t* info, void* context)
+{
+	(void) context;
+	uintptr_t address = (uintptr_t) info->si_addr;
+	for (int i = 0; info->si_code == BUS_ADRERR && i < MAPGUARD_MAX_RANGES; i++)
+	{
+		uintptr_t start = atomic_load(&ranges[i].start);
+		if (start <= SLOT_CLAIMED || address < start || address >= atomic_load(&ranges[i].end))
+		{
+			continue;
+		}
+		// the page past the end of the file reads as zeros from now on
+		void* page = (void*) (address & ~(page_size - 1));
+		if (mmap(page, page_size, PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0) != MAP_FAILED)
+		{
+			atomic_store(&ranges[i].faulted, true);
+			return;
+		}
+		break;
+	}
+	// not ours: the access faults again, with the default action
+	signal(signum, SIG_DFL);
+}
+
+int mapguard_init(void)
+{
+	page_size = sysconf(_SC_PAGESIZE);
+	struct sigaction action;
+	memset(&action, 0, sizeof(action));
+	action.sa_sigaction = on_sigbus;
+	action.sa_flags = SA_SIGINFO | SA_NODEFER;
+	sigemptyset(&action.sa_mask);
+	return sigaction(SIGBUS, &action, NULL);
+}
+
+int mapguard_add(const void* data, size_t size)
+{
+	for (int i = 0; i < MAPGUARD_MAX_RANGES; i++)
+	{
+		uintptr_t free_slot = 0;
+		if (atomic_load_explicit(&ranges[i].start, memory_order_relaxed) == 0
+			&& atomic_compare_exchange_strong(&ranges[i].start, &free_slot, SLOT_CLAIMED))
+		{
+			atomic_store(&ranges[i].faulted, false);
+			atomic_store(&ranges[i].end, (uintptr_t) data + size);
+			atomic_store(&ranges[i].start, (uintptr_t) data);
+			return i;
+		}
+	}
+	errno = ENOBUFS;
+	return -1;
+}
+
+bool mapguard_faulted(int slot)
+{
+	return atomic_load(&ranges[slot].faulted);
+}
+
+void mapguard_remove(int slot)
+{
+	atomic_store(&ranges[slot].start, 0);
+}
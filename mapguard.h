@@ -0,0 +1,46 @@
+/**
+ *  surviving files truncated under a shared mapping
+ *
+ *  touching a page of a MAP_SHARED file mapping past the current end of the
+ *  file raises SIGBUS, which kills the whole server for one file shrinking
+ *  under one transfer. every mapping the server reads is registered here.
+ *  the SIGBUS handler looks the faulting address up in the registered
+ *  ranges, maps a zero page over the faulting one, marks the range faulted
+ *  and returns, so the reader (a worker or a checksum helper) carries on
+ *  with zeros. the owner checks mapguard_faulted() before any byte read
+ *  from the mapping leaves the server, and fails the request instead.
+ *
+ *  a fault outside every registered range gets the default action.
+ */
+
+#ifndef MAPGUARD_H
+#define MAPGUARD_H
+
+#include <stddef.h>
+#include <stdbool.h>
+
+#define MAPGUARD_MAX_RANGES 4096
+
+/*
+ *	Installs the SIGBUS handler, before any mapping is registered.
+ *	Returns 0 on success, -1 on error.
+ */
+int mapguard_init(void);
+
+/*
+ *	Registers the mapping of size bytes at data.
+ *	Returns its slot, -1 if MAPGUARD_MAX_RANGES are registered (errno ENOBUFS).
+ */
+int mapguard_add(const void* data, size_t size);
+
+/*
+ *	Returns true if a read of the mapping of slot went past the end of its file.
+ */
+bool mapguard_faulted(int slot);
+
+/*
+ *	Forgets the mapping of slot, before it is unmapped.
+ */
+void mapguard_remove(int slot);
+
+#endif
@@ -0,0 +1,96 @@
+/**
+ *  Merkle tree, see merkle.h
+ */
+
+#include <stdlib.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include "merkle.h"
+#include "digest.h"
+
+#define MERKLE_LEAF_SEED 0x6c656166ull // < "leaf"
+#define MERKLE_NODE_SEED 0x6e6f6465ull // < "node"
+
+// shared by the threads of merkle_root_parallel()
+typedef struct
+{
+	const char* data;
+	uint64_t size;
+	uint64_t* leaves;
+	uint64_t count;
+	_Atomic uint64_t next; // < next leaf to hash
+} leaf_work;
+
+uint64_t merkle_leaf_count(uint64_t size)
+{
+	return size == 0 ? 1 : (size + MERKLE_LEAF_SIZE - 1) / MERKLE_LEAF_SIZE;
+}
+
+uint64_t merkle_leaf(const void* data, uint64_t size, uint64_t index)
+{
+	uint64_t offset = index * MERKLE_LEAF_SIZE;
+	uint64_t len = size - offset < MERKLE_LEAF_SIZE ? size - offset : MERKLE_LEAF_SIZE;
+	return digest_buffer((const char*) data + offset, len, MERKLE_LEAF_SEED);
+}
+
+uint64_t merkle_root(uint64_t* leaves, uint64_t count)
+{
+	while (count > 1)
+	{
+		uint64_t parents = 0;
+		for (uint64_t i = 0; i < count; i += 2)
+		{
+			leaves[parents++] = i + 1 < count ? digest_buffer(&leaves[i], 2 * sizeof(uint64_t), MERKLE_NODE_SEED) : leaves[i];
+		}
+		count = parents;
+	}
+	return leaves[0];
+}
+
+static void* hash_leaves(void* arg)
+{
+	leaf_work* work = (leaf_work*) arg;
+	uint64_t index;
+	while ((index = atomic_fetch_add_explicit(&work->next, 1, memory_order_relaxed)) < work->count)
+	{
+		work->leaves[index] = merkle_leaf(work->data, work->size, index);
+	}
+	return NULL;
+}
+
+int merkle_root_parallel(const void* data, uint64_t size, int threads, uint64_t* root)
+{
+	leaf_work work = { (const char*) data, size, NULL, merkle_leaf_count(size) };
+	atomic_init(&work.next, 0);
+	work.leaves = (uint64_t*) malloc(work.count * sizeof(uint64_t));
+	pthread_t* helpers = threads > 1 ? (pthread_t*) malloc((threads - 1) * sizeof(pthread_t)) : NULL;
+	if (work.leaves == NULL || (threads > 1 && helpers == NULL))
+	{
+		free(work.leaves);
+		free(helpers);
+		errno = ENOMEM;
+		return -1;
+	}
+
+	// fewer helpers than asked for only means less parallelism
+	int started = 0;
+	for (int i = 0; i < threads - 1 && (uint64_t) i + 1 < work.count; i++)
+	{
+		if (pthread_create(&helpers[i], NULL, hash_leaves, &work) != 0)
+		{
+			break;
+		}
+		started++;
+	}
+	hash_leaves(&work);
+	for (int i = 0; i < started; i++)
+	{
+		pthread_join(helpers[i], NULL);
+	}
+
+	*root = merkle_root(work.leaves, work.count);
+	free(work.leaves);
+	free(helpers);
+	return 0;
+}
@@ -0,0 +1,49 @@
+/**
+ *  Merkle tree of a file, for verification on every core
+ *
+ *  the file is cut into MERKLE_LEAF_SIZE leaves (the last one shorter), each
+ *  hashed on its own with XXH64 (see digest.h). pairs of hashes are hashed
+ *  together level by level, an odd hash at the end of a level going up
+ *  unchanged, down to the root. the root of an empty file is the hash of an
+ *  empty leaf.
+ *
+ *  since the leaves do not depend on each other, any thread can hash any
+ *  leaf in any order, as soon as its bytes are there: a receiver fills an
+ *  array of leaf hashes from several threads, or as the ranges of a
+ *  segmented download land, and combines them with merkle_root() at the end.
+ *  leaves and inner nodes use different seeds, so neither passes for the
+ *  other. like the digest trailer, this catches corruption, not a
+ *  malicious sender.
+ */
+
+#ifndef MERKLE_H
+#define MERKLE_H
+
+#include <stdint.h>
+
+#define MERKLE_LEAF_SIZE (1024 * 1024)
+#define MERKLE_ROOT_SIZE 8
+
+/*
+ *	Returns the number of leaves of a file of size bytes, at least 1.
+ */
+uint64_t merkle_leaf_count(uint64_t size);
+
+/*
+ *	Returns the hash of leaf index of the size bytes of data.
+ */
+uint64_t merkle_leaf(const void* data, uint64_t size, uint64_t index);
+
+/*
+ *	Combines the count leaf hashes, overwriting them.
+ *	Returns the root.
+ */
+uint64_t merkle_root(uint64_t* leaves, uint64_t count);
+
+/*
+ *	Computes the root of the size bytes of data with threads threads, the caller included.
+ *	Returns 0 on success, -1 on error.
+ */
+int merkle_root_parallel(const void* data, uint64_t size, int threads, uint64_t* root);
+
+#endif
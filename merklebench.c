@@ -0,0 +1,136 @@
+/**
+ *  Merkle verification microbenchmark
+ *  hashes a SIZE bytes buffer of random data as one serial XXH64 digest
+ *  (the digest trailer of streamed transfers) and as a Merkle tree (merkle.h)
+ *  on 1, 2, 4... up to THREADS threads, the best of REPEAT runs each.
+ *  the roots of every thread count must match.
+ *
+ *  prints one JSON object per run, in GB/s, with the speedup over one thread.
+ *
+ *  usage: merklebench [-s SIZE] [-j THREADS] [-r REPEAT]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include "merkle.h"
+#include "digest.h"
+#include "metrics.h"
+
+/*
+ *	Returns the best time of repeat Merkle roots of data with threads threads, the root in *root.
+ */
+static uint64_t time_root(const char* data, uint64_t size, int threads, int repeat, uint64_t* root)
+{
+	uint64_t best = UINT64_MAX;
+	for (int i = 0; i < repeat; i++)
+	{
+		uint64_t start = metrics_now_ns();
+		if (merkle_root_parallel(data, size, threads, root) == -1)
+		{
+			perror("Could not compute the root");
+			exit(EXIT_FAILURE);
+		}
+		uint64_t elapsed = metrics_now_ns() - start;
+		best = elapsed < best ? elapsed : best;
+	}
+	return best;
+}
+
+static uint64_t parse_size(const char* text)
+{
+	char* end = NULL;
+	uint64_t value = strtoull(text, &end, 10);
+	switch (*end)
+	{
+		case 'K': case 'k': return value << 10;
+		case 'M': case 'm': return value << 20;
+		case 'G': case 'g': return value << 30;
+		default: return value;
+	}
+}
+
+int main(int argc, char* argv[])
+{
+	uint64_t size = 1ull << 30;
+	long cores = sysconf(_SC_NPROCESSORS_ONLN);
+	int max_threads = cores > 0 ? (int) cores : 1;
+	int repeat = 3;
+
+	int opt;
+	while ((opt = getopt(argc, argv, "s:j:r:")) != -1)
+	{
+		switch (opt)
+		{
+			case 's': size = parse_size(optarg); break;
+			case 'j': max_threads = atoi(optarg); break;
+			case 'r': repeat = atoi(optarg); break;
+			default:
+				fprintf(stderr, "usage: merklebench [-s SIZE] [-j THREADS] [-r REPEAT]\n");
+				exit(EXIT_FAILURE);
+		}
+	}
+	if (size == 0 || max_threads < 1 || repeat < 1)
+	{
+		fprintf(stderr, "SIZE, THREADS and REPEAT must be positive\n");
+		exit(EXIT_FAILURE);
+	}
+
+	char* data = (char*) malloc(size);
+	if (data == NULL)
+	{
+		perror("Could not allocate the data");
+		exit(EXIT_FAILURE);
+	}
+	// xorshift64*, written once so the buffer is resident before the timed part
+	uint64_t state = 0x9e3779b97f4a7c15ull;
+	for (uint64_t i = 0; i + sizeof(uint64_t) <= size; i += sizeof(uint64_t))
+	{
+		state ^= state >> 12;
+		state ^= state << 25;
+		state ^= state >> 27;
+		uint64_t value = state * 2685821657736338717ull;
+		memcpy(data + i, &value, sizeof(value));
+	}
+
+	uint64_t best = UINT64_MAX;
+	for (int i = 0; i < repeat; i++)
+	{
+		uint64_t start = metrics_now_ns();
+		volatile uint64_t digest = digest_buffer(data, size, 0);
+		(void) digest;
+		uint64_t elapsed = metrics_now_ns() - start;
+		best = elapsed < best ? elapsed : best;
+	}
+	printf("{\"size\": %llu, \"leaf_size\": %d, \"results\": [\n", (unsigned long long) size, MERKLE_LEAF_SIZE);
+	printf("    {\"hash\": \"xxh64\", \"threads\": 1, \"seconds\": %.4f, \"gb_per_s\": %.2f}",
+		best / 1e9, size / (double) best);
+
+	bool ok = true;
+	uint64_t first_root = 0, single_ns = 0;
+	for (int threads = 1; ; threads = threads * 2 < max_threads ? threads * 2 : max_threads)
+	{
+		uint64_t root = 0;
+		uint64_t elapsed = time_root(data, size, threads, repeat, &root);
+		if (threads == 1)
+		{
+			first_root = root;
+			single_ns = elapsed;
+		}
+		ok = ok && root == first_root;
+		printf(",\n    {\"hash\": \"merkle\", \"threads\": %d, \"seconds\": %.4f, \"gb_per_s\": %.2f, \"speedup\": %.2f}",
+			threads, elapsed / 1e9, size / (double) elapsed, (double) single_ns / elapsed);
+		if (threads == max_threads)
+		{
+			break;
+		}
+	}
+	printf("\n]}\n");
+	free(data);
+
+	// every thread count must find the same root
+	return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
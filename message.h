@@ -1,15 +1,164 @@
 /**
  *  header for received messages
- *  message_type can be f (for file transfer) or chat (for chat - not our business)
- *  message_size is the size of the next read from the socket
+ *  message_type can be f (for file transfer), z (for streamed file transfer),
+ *  t (for streamed file transfer with a Merkle root), d (for file descriptor
+ *  passing), m (for metrics), s, l and b (for metadata queries), c (for changes),
+ *  r (for byte ranges) or chat (for chat - not our business)
+ *  message_size is the size of the next read from the socket, so a file sent
+ *  whole has at most UINT32_MAX bytes, servers refuse larger ones
+ *
+ *  a metrics request is a header with message_type == 'm' and message_size == 0,
+ *  the reply is a header with message_type == 'm' followed by message_size bytes
+ *  of Prometheus text
+ *
+ *  a file descriptor request ('d', Unix domain sockets only) looks like a file request;
+ *  the reply is a single header with message_type == 'd' and message_size == filesize,
+ *  sent with the open file descriptor attached as SCM_RIGHTS ancillary data
+ *  (no descriptor when message_size == 0, the file does not exist)
+ *
+ *  a stream request ('z') looks like a file request and gets the same initial reply,
+ *  but the file follows as filesize raw bytes (no per-segment headers or checksums),
+ *  then a trailer header with message_type == 'z' and message_size == DIGEST_TRAILER_SIZE
+ *  and the XXH64 digest (seed 0) of the whole file, see digest.h
+ *
+ *  a tree request ('t') looks like a stream request. when the file exists, the
+ *  initial reply is followed by a header with message_type == 't' and
+ *  message_size == MERKLE_ROOT_SIZE and the Merkle root of the file (see merkle.h),
+ *  then come the filesize raw bytes, without trailer: the receiver checks the
+ *  root on as many cores as it likes
+ *
+ *  the metadata queries carry a query_request and then their names (NUL terminated)
+ *  in the message_size bytes after the header, and are answered with the same
+ *  message_type, from the directory index of the server (see dirindex.h):
+ *  - stat ('s', one name): a file_info, type INFO_MISSING if there is no such file
+ *  - listing ('l', one directory name, "" for the document root): entries offset to
+ *    offset + count of the directory sorted by name (count 0: as many as the server
+ *    allows), as a list_reply then, for each entry, a file_info and the NUL terminated
+ *    name. message_size == 0 if there is no such directory
+ *  - bulk stat ('b', count names): count file_info, in the order of the names
+ *  digest is the Merkle root of a regular file (see merkle.h). with QUERY_DIGEST it is
+ *  computed if need be, otherwise only filled in if the server knows it already
+ *
+ *  a changes request ('c', message_size == sizeof(changes_request)) asks for what
+ *  changed in the served tree after generation since of the change log log_id (see
+ *  catalog.h). the reply is a header with message_type == 'c' and message_size ==
+ *  sizeof(changes_reply), or 0 when the server keeps no catalog, then count records:
+ *  a change_record, its NUL terminated name and, for a file, info.size raw bytes.
+ *  removals (INFO_MISSING) come first, children before their parents, then the
+ *  directories and files by name, parents first. CHANGES_RESET means the log did not
+ *  go back to since (or log_id is not the current one): every path is sent and no
+ *  removal. the next request asks for the changes after changes_reply.generation
+ *
+ *  a range request ('r') carries a range_request, count byte_range and the file name
+ *  (NUL terminated) in the message_size bytes after the header. a negative offset
+ *  counts from the end of the file (-8 is the last 8 bytes). the reply is a header
+ *  with message_type == 'r' and message_size == sizeof(range_reply), 0 if the file
+ *  does not exist, then for every range, in the order asked: a byte_range with the
+ *  offset from the start of the file and the length actually sent (cut at the end
+ *  of the file, 0 past it), and that many raw bytes. ranges may overlap, nothing
+ *  is merged. range_reply.info.mtime_ns tells whether the file changed between two
+ *  range requests
  *
  */
 
 
 #include <stdint.h>
 
+#define MSG_FILE 'f'
+#define MSG_METRICS 'm'
+#define MSG_FD 'd'
+#define MSG_STREAM 'z'
+#define MSG_TREE 't'
+#define MSG_STAT 's'
+#define MSG_LIST 'l'
+#define MSG_BULK_STAT 'b'
+#define MSG_CHANGES 'c'
+#define MSG_RANGE 'r'
+
+// largest payload of a single file segment, receivers size their buffers with it
+#define MAX_SEGMENT_SIZE (1024 * 1024)
+
+#define DIGEST_TRAILER_SIZE 8
+
+// most names of a bulk stat
+#define MAX_BULK_NAMES 1024
+
+// most ranges of a range request
+#define MAX_RANGES 256
+
+#define QUERY_DIGEST 1 // < query_request.flags: compute the missing digests
+
+#define INFO_MISSING 0
+#define INFO_FILE 'f'
+#define INFO_DIRECTORY 'd'
+
+#define CHANGES_RESET 1 // < changes_reply.flags: a full listing, not the changes asked
+
 typedef struct
 {
     char message_type;
     uint32_t message_size;
 } message_header;
+
+typedef struct
+{
+    uint32_t flags;
+    uint32_t offset; // < listing only
+    uint32_t count; // < entries of a listing page, names of a bulk stat
+} query_request;
+
+typedef struct
+{
+    uint64_t size;
+    int64_t mtime_ns;
+    uint64_t digest;
+    uint32_t type; // < INFO_*
+    uint32_t has_digest;
+} file_info;
+
+typedef struct
+{
+    uint32_t total; // < entries in the directory
+    uint32_t count; // < entries that follow
+} list_reply;
+
+typedef struct
+{
+    uint64_t log_id; // < 0 for a first sync
+    uint64_t since;
+} changes_request;
+
+typedef struct
+{
+    uint64_t log_id;
+    uint64_t generation; // < the changes sent are all those up to it
+    uint32_t count; // < records that follow
+    uint32_t flags; // < CHANGES_*
+} changes_reply;
+
+typedef struct
+{
+    file_info info; // < type INFO_MISSING for a removal
+    uint64_t generation;
+    uint32_t name_size; // < with the NUL
+    uint32_t padding;
+} change_record;
+
+typedef struct
+{
+    uint32_t count; // < byte_range that follow
+    uint32_t flags; // < 0
+} range_request;
+
+typedef struct
+{
+    int64_t offset; // < negative: from the end of the file
+    uint64_t length;
+} byte_range;
+
+typedef struct
+{
+    file_info info;
+    uint32_t count; // < byte_range and their data that follow
+    uint32_t padding;
+} range_reply;
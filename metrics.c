@@ -0,0 +1,226 @@
+/**
+ *  shard registry and Prometheus rendering for metrics.h
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "metrics.h"
+
+#define MAX_COLLECTORS 8
+
+__thread metrics_shard* metrics_tls = NULL;
+
+static metrics_shard* shards = NULL;
+static metrics_shard fallback_shard;
+static metrics_collector collectors[MAX_COLLECTORS];
+static int collector_count = 0;
+static pthread_mutex_t shards_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static const char* counter_names[M_COUNTER_COUNT] = {
+	[M_CONNECTIONS] = "pad_connections_total",
+	[M_REQUESTS] = "pad_requests_total",
+	[M_FILES_SENT] = "pad_files_sent_total",
+	[M_BYTES_SENT] = "pad_bytes_sent_total",
+	[M_FDS_PASSED] = "pad_fds_passed_total",
+	[M_BYTES_PREFETCHED] = "pad_readahead_bytes_total",
+	[M_FILES_DROPPED] = "pad_cache_drops_total",
+	[M_FILES_DIRECT] = "pad_direct_transfers_total",
+	[M_REJECT_LIMIT] = "pad_rejected_connections_total{reason=\"limit\"}",
+	[M_REJECT_PER_IP] = "pad_rejected_connections_total{reason=\"per_ip\"}",
+	[M_EVICT_DEADLINE] = "pad_evicted_connections_total{reason=\"deadline\"}",
+	[M_EVICT_SLOW] = "pad_evicted_connections_total{reason=\"slow\"}",
+	[M_TASKS_HELPER] = "pad_tasks_total{ran_by=\"helper\"}",
+	[M_TASKS_SUBMITTER] = "pad_tasks_total{ran_by=\"submitter\"}",
+	[M_ROOTS_CACHED] = "pad_merkle_roots_total{source=\"cache\"}",
+	[M_ROOTS_COMPUTED] = "pad_merkle_roots_total{source=\"computed\"}",
+	[M_INDEX_HITS] = "pad_directory_index_total{result=\"hit\"}",
+	[M_INDEX_READS] = "pad_directory_index_total{result=\"read\"}",
+	[M_CATALOG_HITS] = "pad_catalog_lookups_total{result=\"hit\"}",
+	[M_CATALOG_MISSES] = "pad_catalog_lookups_total{result=\"miss\"}",
+	[M_CATALOG_EVENTS] = "pad_catalog_events_total",
+	[M_SYNC_FILES] = "pad_sync_changes_total{kind=\"file\"}",
+	[M_SYNC_DIRECTORIES] = "pad_sync_changes_total{kind=\"directory\"}",
+	[M_SYNC_REMOVALS] = "pad_sync_changes_total{kind=\"removal\"}",
+	[M_PACK_FILES] = "pad_pack_files_total",
+	[M_RANGES] = "pad_ranges_total",
+	[M_ERR_ACCEPT] = "pad_errors_total{type=\"accept\"}",
+	[M_ERR_BAD_REQUEST] = "pad_errors_total{type=\"bad_request\"}",
+	[M_ERR_NOT_FOUND] = "pad_errors_total{type=\"not_found\"}",
+	[M_ERR_STAT] = "pad_errors_total{type=\"stat\"}",
+	[M_ERR_TOO_LARGE] = "pad_errors_total{type=\"too_large\"}",
+	[M_ERR_FILE_IO] = "pad_errors_total{type=\"file_io\"}",
+	[M_ERR_SEND] = "pad_errors_total{type=\"send\"}",
+};
+
+static const char* histogram_names[M_HISTOGRAM_COUNT] = {
+	[M_TTFB] = "pad_time_to_first_byte_seconds",
+	[M_TRANSFER] = "pad_transfer_duration_seconds",
+	[M_CHECKSUM] = "pad_checksum_seconds",
+	[M_STAT] = "pad_stat_seconds",
+};
+
+static const double quantiles[] = { 0.5, 0.9, 0.99, 0.999 };
+
+metrics_shard* metrics_register_thread(void)
+{
+	metrics_shard* shard = (metrics_shard*) calloc(1, sizeof(metrics_shard));
+	if (shard == NULL)
+	{
+		metrics_tls = &fallback_shard;
+		return metrics_tls;
+	}
+
+	pthread_mutex_lock(&shards_lock);
+	shard->next = shards;
+	shards = shard;
+	pthread_mutex_unlock(&shards_lock);
+
+	metrics_tls = shard;
+	return shard;
+}
+
+int metrics_register_collector(metrics_collector collector)
+{
+	pthread_mutex_lock(&shards_lock);
+	int ret_val = -1;
+	if (collector_count < MAX_COLLECTORS)
+	{
+		collectors[collector_count++] = collector;
+		ret_val = 0;
+	}
+	pthread_mutex_unlock(&shards_lock);
+	return ret_val;
+}
+
+void hist_merge(histogram* dst, const histogram* src)
+{
+	for (int i = 0; i < HIST_BUCKETS; i++)
+	{
+		metrics_bump(&dst->buckets[i], atomic_load_explicit(&src->buckets[i], memory_order_relaxed));
+	}
+	metrics_bump(&dst->count, atomic_load_explicit(&src->count, memory_order_relaxed));
+	metrics_bump(&dst->sum, atomic_load_explicit(&src->sum, memory_order_relaxed));
+	uint64_t max = atomic_load_explicit(&src->max, memory_order_relaxed);
+	if (max > atomic_load_explicit(&dst->max, memory_order_relaxed))
+	{
+		atomic_store_explicit(&dst->max, max, memory_order_relaxed);
+	}
+}
+
+uint64_t hist_percentile(const histogram* hist, double p)
+{
+	uint64_t count = atomic_load_explicit(&hist->count, memory_order_relaxed);
+	if (count == 0)
+	{
+		return 0;
+	}
+
+	// rank of the requested sample, 1-based
+	uint64_t rank = (uint64_t) (p / 100.0 * count + 0.5);
+	if (rank < 1)
+	{
+		rank = 1;
+	}
+
+	uint64_t seen = 0;
+	for (int i = 0; i < HIST_BUCKETS; i++)
+	{
+		seen += atomic_load_explicit(&hist->buckets[i], memory_order_relaxed);
+		if (seen >= rank)
+		{
+			if (i < HIST_SUB_COUNT)
+			{
+				return i;
+			}
+			// upper bound of the bucket, but never above the largest recorded value
+			unsigned int shift = i / HIST_SUB_COUNT - 1;
+			uint64_t upper = (((uint64_t) (i % HIST_SUB_COUNT + HIST_SUB_COUNT + 1)) << shift) - 1;
+			uint64_t max = atomic_load_explicit(&hist->max, memory_order_relaxed);
+			return upper < max ? upper : max;
+		}
+	}
+	return atomic_load_explicit(&hist->max, memory_order_relaxed);
+}
+
+char* metrics_render(size_t* len)
+{
+	char* text = NULL;
+	FILE* out = open_memstream(&text, len);
+	if (out == NULL)
+	{
+		return NULL;
+	}
+
+	// merge every shard; the totals are allocated because a histogram is a few KB
+	uint64_t counters[M_COUNTER_COUNT] = { 0 };
+	histogram* totals = (histogram*) calloc(M_HISTOGRAM_COUNT, sizeof(histogram));
+	if (totals == NULL)
+	{
+		fclose(out);
+		free(text);
+		return NULL;
+	}
+
+	pthread_mutex_lock(&shards_lock);
+	for (metrics_shard* shard = shards; ; shard = shard->next)
+	{
+		if (shard == NULL)
+		{
+			shard = &fallback_shard;
+		}
+		for (int i = 0; i < M_COUNTER_COUNT; i++)
+		{
+			counters[i] += atomic_load_explicit(&shard->counters[i], memory_order_relaxed);
+		}
+		for (int i = 0; i < M_HISTOGRAM_COUNT; i++)
+		{
+			hist_merge(&totals[i], &shard->histograms[i]);
+		}
+		if (shard == &fallback_shard)
+		{
+			break;
+		}
+	}
+	pthread_mutex_unlock(&shards_lock);
+
+	for (int i = 0; i < M_COUNTER_COUNT; i++)
+	{
+		// one TYPE line per metric family, labelled counters share theirs
+		int family_len = (int) strcspn(counter_names[i], "{");
+		if (i == 0 || strncmp(counter_names[i], counter_names[i-1], family_len) != 0)
+		{
+			fprintf(out, "# TYPE %.*s counter\n", family_len, counter_names[i]);
+		}
+		fprintf(out, "%s %llu\n", counter_names[i], (unsigned long long) counters[i]);
+	}
+
+	for (int i = 0; i < M_HISTOGRAM_COUNT; i++)
+	{
+		fprintf(out, "# TYPE %s summary\n", histogram_names[i]);
+		for (size_t q = 0; q < sizeof(quantiles) / sizeof(quantiles[0]); q++)
+		{
+			fprintf(out, "%s{quantile=\"%g\"} %.9f\n", histogram_names[i], quantiles[q],
+				hist_percentile(&totals[i], quantiles[q] * 100.0) / 1e9);
+		}
+		fprintf(out, "%s_sum %.9f\n", histogram_names[i], atomic_load(&totals[i].sum) / 1e9);
+		fprintf(out, "%s_count %llu\n", histogram_names[i], (unsigned long long) atomic_load(&totals[i].count));
+	}
+
+	pthread_mutex_lock(&shards_lock);
+	int count = collector_count;
+	pthread_mutex_unlock(&shards_lock);
+	for (int i = 0; i < count; i++)
+	{
+		collectors[i](out);
+	}
+
+	free(totals);
+	if (fclose(out) != 0)
+	{
+		free(text);
+		return NULL;
+	}
+	return text;
+}
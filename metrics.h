@@ -0,0 +1,177 @@
+/**
+ *  instrumentation for the server
+ *  every thread records into its own shard, so the hot path is a plain
+ *  relaxed load + store on memory no other thread writes (no locks, no
+ *  contended cache lines). the shards are only merged when someone asks
+ *  for the metrics.
+ *
+ *  histograms are HDR-style: log-linear buckets with HIST_SUB_COUNT
+ *  sub-buckets per power of two, which keeps the relative error of any
+ *  percentile under 1/HIST_SUB_COUNT for the whole uint64_t range.
+ */
+
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdatomic.h>
+#include <time.h>
+
+#define HIST_SUB_BITS 4
+#define HIST_SUB_COUNT (1 << HIST_SUB_BITS)
+#define HIST_BUCKETS ((64 - HIST_SUB_BITS + 1) * HIST_SUB_COUNT)
+
+enum metrics_counter
+{
+	M_CONNECTIONS,
+	M_REQUESTS,
+	M_FILES_SENT,
+	M_BYTES_SENT,
+	M_FDS_PASSED,
+	M_BYTES_PREFETCHED,
+	M_FILES_DROPPED,
+	M_FILES_DIRECT,
+	M_REJECT_LIMIT,
+	M_REJECT_PER_IP,
+	M_EVICT_DEADLINE,
+	M_EVICT_SLOW,
+	M_TASKS_HELPER,
+	M_TASKS_SUBMITTER,
+	M_ROOTS_CACHED,
+	M_ROOTS_COMPUTED,
+	M_INDEX_HITS,
+	M_INDEX_READS,
+	M_CATALOG_HITS,
+	M_CATALOG_MISSES,
+	M_CATALOG_EVENTS,
+	M_SYNC_FILES,
+	M_SYNC_DIRECTORIES,
+	M_SYNC_REMOVALS,
+	M_PACK_FILES,
+	M_RANGES,
+	M_ERR_ACCEPT,
+	M_ERR_BAD_REQUEST,
+	M_ERR_NOT_FOUND,
+	M_ERR_STAT,
+	M_ERR_TOO_LARGE,
+	M_ERR_FILE_IO,
+	M_ERR_SEND,
+	M_COUNTER_COUNT
+};
+
+enum metrics_histogram
+{
+	M_TTFB,
+	M_TRANSFER,
+	M_CHECKSUM,
+	M_STAT,
+	M_HISTOGRAM_COUNT
+};
+
+typedef struct
+{
+	_Atomic uint64_t buckets[HIST_BUCKETS];
+	_Atomic uint64_t count;
+	_Atomic uint64_t sum;
+	_Atomic uint64_t max;
+} histogram;
+
+typedef struct metrics_shard
+{
+	_Atomic uint64_t counters[M_COUNTER_COUNT];
+	histogram histograms[M_HISTOGRAM_COUNT];
+	struct metrics_shard* next;
+} metrics_shard;
+
+extern __thread metrics_shard* metrics_tls;
+
+/*
+ *	Allocates the shard of the calling thread and links it in the global list.
+ *	Never fails: if there is no memory, the thread records into a shared fallback shard.
+ */
+metrics_shard* metrics_register_thread(void);
+
+/*
+ *	Collectors append metrics owned by other modules (gauges, pool statistics...)
+ *	to every rendering, in the Prometheus text format.
+ */
+typedef void (*metrics_collector)(FILE* out);
+
+/*
+ *	Adds a collector to every future rendering.
+ *	Returns 0 on success, -1 if there is no room left.
+ */
+int metrics_register_collector(metrics_collector collector);
+
+/*
+ *	Renders all the metrics in the Prometheus text exposition format.
+ *	Returns a malloc'd string (length stored in *len) or NULL on error.
+ */
+char* metrics_render(size_t* len);
+
+/*
+ *	Merges src into dst. dst must not be recorded into concurrently.
+ */
+void hist_merge(histogram* dst, const histogram* src);
+
+/*
+ *	Returns the value at percentile p (0-100) of the histogram,
+ *		as the upper bound of the bucket holding it.
+ */
+uint64_t hist_percentile(const histogram* hist, double p);
+
+static inline uint64_t metrics_now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+/*
+ *	Single-writer increments: only the owning thread stores into a shard,
+ *	so a relaxed load + store is enough and avoids the locked instruction.
+ */
+static inline void metrics_bump(_Atomic uint64_t* slot, uint64_t n)
+{
+	atomic_store_explicit(slot, atomic_load_explicit(slot, memory_order_relaxed) + n, memory_order_relaxed);
+}
+
+static inline unsigned int hist_bucket(uint64_t value)
+{
+	if (value < HIST_SUB_COUNT)
+	{
+		return (unsigned int) value;
+	}
+	unsigned int shift = 63 - __builtin_clzll(value) - HIST_SUB_BITS;
+	return (shift + 1) * HIST_SUB_COUNT + (unsigned int) ((value >> shift) - HIST_SUB_COUNT);
+}
+
+static inline void hist_record(histogram* hist, uint64_t value)
+{
+	metrics_bump(&hist->buckets[hist_bucket(value)], 1);
+	metrics_bump(&hist->count, 1);
+	metrics_bump(&hist->sum, value);
+	if (value > atomic_load_explicit(&hist->max, memory_order_relaxed))
+	{
+		atomic_store_explicit(&hist->max, value, memory_order_relaxed);
+	}
+}
+
+static inline metrics_shard* metrics_shard_get(void)
+{
+	return metrics_tls != NULL ? metrics_tls : metrics_register_thread();
+}
+
+static inline void metrics_add(enum metrics_counter counter, uint64_t n)
+{
+	metrics_bump(&metrics_shard_get()->counters[counter], n);
+}
+
+static inline void metrics_observe(enum metrics_histogram which, uint64_t ns)
+{
+	hist_record(&metrics_shard_get()->histograms[which], ns);
+}
+
+#endif
@@ -0,0 +1,101 @@
+/**
+ *  full-length socket reads and writes, see netio.h
+ */
+
+#include <errno.h>
+#include <unistd.h>
+#include <sys/sendfile.h>
+#include "netio.h"
+
+ssize_t read_full(int fd, void* buf, size_t len)
+{
+	size_t done = 0;
+	while (done < len)
+	{
+		ssize_t ret = read(fd, (char*) buf + done, len - done);
+		if (ret == -1 && errno == EINTR)
+		{
+			continue;
+		}
+		if (ret == -1)
+		{
+			return -1;
+		}
+		if (ret == 0)
+		{
+			return 0;
+		}
+		done += ret;
+	}
+	return done;
+}
+
+int write_full(int fd, const void* buf, size_t len)
+{
+	size_t done = 0;
+	while (done < len)
+	{
+		ssize_t ret = write(fd, (const char*) buf + done, len - done);
+		if (ret == -1 && errno == EINTR)
+		{
+			continue;
+		}
+		if (ret == -1)
+		{
+			return -1;
+		}
+		done += ret;
+	}
+	return 0;
+}
+
+int writev_full(int fd, struct iovec* iov, int iovcnt)
+{
+	while (iovcnt > 0)
+	{
+		ssize_t ret = writev(fd, iov, iovcnt);
+		if (ret == -1 && errno == EINTR)
+		{
+			continue;
+		}
+		if (ret == -1)
+		{
+			return -1;
+		}
+		// skip what was written, the rest goes in the next round
+		while (iovcnt > 0 && (size_t) ret >= iov->iov_len)
+		{
+			ret -= iov->iov_len;
+			iov++;
+			iovcnt--;
+		}
+		if (iovcnt > 0)
+		{
+			iov->iov_base = (char*) iov->iov_base + ret;
+			iov->iov_len -= ret;
+		}
+	}
+	return 0;
+}
+
+int sendfile_full(int out_fd, int in_fd, off_t offset, size_t len)
+{
+	while (len > 0)
+	{
+		ssize_t ret = sendfile(out_fd, in_fd, &offset, len);
+		if (ret == -1 && errno == EINTR)
+		{
+			continue;
+		}
+		if (ret == 0)
+		{
+			errno = EIO;
+		}
+		if (ret <= 0)
+		{
+			return -1;
+		}
+		len -= ret;
+	}
+	return 0;
+}
@@ -0,0 +1,39 @@
+/**
+ *  helpers for full-length socket reads and writes
+ *  a single read()/write() on a stream socket may transfer fewer bytes than
+ *  asked for, these loop until the whole buffer is done
+ */
+
+#ifndef NETIO_H
+#define NETIO_H
+
+#include <stddef.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+/*
+ *	Reads exactly len bytes from fd.
+ *	Returns len on success, 0 if the peer closed the connection before len bytes arrived,
+ *		-1 on error.
+ */
+ssize_t read_full(int fd, void* buf, size_t len);
+
+/*
+ *	Writes exactly len bytes to fd.
+ *	Returns 0 on success, -1 on error.
+ */
+int write_full(int fd, const void* buf, size_t len);
+
+/*
+ *	Writes every byte of the iovcnt buffers of iov to fd, in as few syscalls as possible.
+ *	iov is modified. Returns 0 on success, -1 on error.
+ */
+int writev_full(int fd, struct iovec* iov, int iovcnt);
+
+/*
+ *	Sends len bytes of in_fd starting at offset to out_fd with sendfile().
+ *	Returns 0 on success, -1 on error (errno EIO when in_fd ends early).
+ */
+int sendfile_full(int out_fd, int in_fd, off_t offset, size_t len);
+
+#endif
@@ -0,0 +1,150 @@
+/**
+ *  atomic publication of received files, see outfile.h
+ */
+
+#define _GNU_SOURCE // O_TMPFILE, mkostemp
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "outfile.h"
+
+static const char* policy_names[] = { "none", "end", "periodic" };
+static _Atomic unsigned int temp_counter = 0;
+
+int fsync_parse_policy(const char* name)
+{
+	for (int i = FSYNC_NONE; i <= FSYNC_PERIODIC; i++)
+	{
+		if (strcmp(name, policy_names[i]) == 0)
+		{
+			return i;
+		}
+	}
+	return -1;
+}
+
+int output_open(output_file* out, const char* dir, const char* name)
+{
+	memset(out, 0, sizeof(output_file));
+	if (snprintf(out->name, sizeof(out->name), "%s", name) >= (int) sizeof(out->name))
+	{
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+
+	out->dir_fd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (out->dir_fd == -1)
+	{
+		return -1;
+	}
+
+	out->fd = openat(out->dir_fd, ".", O_TMPFILE | O_RDWR | O_CLOEXEC, 0644);
+	if (out->fd != -1)
+	{
+		out->anonymous = true;
+		return 0;
+	}
+
+	// no O_TMPFILE here, a hidden name in the same directory keeps the rename atomic
+	char path[PATH_MAX];
+	if (snprintf(path, sizeof(path), "%s/.%.200s.XXXXXX", dir, name) >= (int) sizeof(path))
+	{
+		close(out->dir_fd);
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+	out->fd = mkostemp(path, O_CLOEXEC);
+	if (out->fd == -1)
+	{
+		int saved = errno;
+		close(out->dir_fd);
+		errno = saved;
+		return -1;
+	}
+	fchmod(out->fd, 0644);
+	snprintf(out->temp_name, sizeof(out->temp_name), "%s", strrchr(path, '/') + 1);
+	return 0;
+}
+
+/*
+ *	Gives the anonymous file a temporary name, since linkat() cannot replace the final one.
+ *	Returns 0 on success, -1 on error.
+ */
+static int link_anonymous(output_file* out)
+{
+	char proc_path[64];
+	snprintf(proc_path, sizeof(proc_path), "/proc/self/fd/%d", out->fd);
+	while (1)
+	{
+		snprintf(out->temp_name, sizeof(out->temp_name), ".%.200s.%d.%u", out->name, (int) getpid(),
+			atomic_fetch_add(&temp_counter, 1));
+		// AT_EMPTY_PATH needs CAP_DAC_READ_SEARCH, /proc does not
+		if (linkat(out->fd, "", out->dir_fd, out->temp_name, AT_EMPTY_PATH) == 0
+			|| linkat(AT_FDCWD, proc_path, out->dir_fd, out->temp_name, AT_SYMLINK_FOLLOW) == 0)
+		{
+			return 0;
+		}
+		if (errno != EEXIST)
+		{
+			return -1;
+		}
+	}
+}
+
+int output_publish(output_file* out, enum fsync_policy policy, bool sync_dir)
+{
+	int ret_val = 0;
+	if ((policy != FSYNC_NONE && fdatasync(out->fd) == -1)
+		|| (out->anonymous && link_anonymous(out) == -1)
+		|| renameat(out->dir_fd, out->temp_name, out->dir_fd, out->name) == -1)
+	{
+		ret_val = -1;
+	}
+	int saved = errno;
+
+	if (ret_val == -1 && out->temp_name[0] != '\0')
+	{
+		unlinkat(out->dir_fd, out->temp_name, 0);
+	}
+	else if (policy != FSYNC_NONE && sync_dir && fsync(out->dir_fd) == -1)
+	{
+		saved = errno;
+		ret_val = -1;
+	}
+
+	close(out->fd);
+	close(out->dir_fd);
+	out->fd = out->dir_fd = -1;
+	errno = saved;
+	return ret_val;
+}
+
+void output_discard(output_file* out)
+{
+	if (!out->anonymous)
+	{
+		unlinkat(out->dir_fd, out->temp_name, 0);
+	}
+	close(out->fd);
+	close(out->dir_fd);
+	out->fd = out->dir_fd = -1;
+}
+
+int output_sync_dir(const char* dir)
+{
+	int dir_fd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (dir_fd == -1)
+	{
+		return -1;
+	}
+	// syncfs covers the subdirectories created for the batch as well
+	int ret_val = syncfs(dir_fd);
+	close(dir_fd);
+	return ret_val;
+}
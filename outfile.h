@@ -0,0 +1,73 @@
+/**
+ *  received files are published atomically
+ *
+ *  the data is written to an anonymous O_TMPFILE in the destination directory
+ *  (or a hidden temporary name where the file system lacks it) and only linked
+ *  and renamed over the final name once complete and verified. readers see
+ *  either the previous file or the whole new one, and a failed transfer leaves
+ *  the previous file untouched.
+ *
+ *  fsync policies trade durability for throughput:
+ *      none      never fsync, a crash may lose recently published files
+ *      end       fdatasync every file once complete, before it is published
+ *      periodic  also fdatasync every FSYNC_PERIOD bytes while receiving, so
+ *                the final sync has little left to do
+ *  the directory entries are synced once, after the last file of a batch.
+ */
+
+#ifndef OUTFILE_H
+#define OUTFILE_H
+
+#include <limits.h>
+#include <stdbool.h>
+
+#define FSYNC_PERIOD (64 * 1024 * 1024)
+
+enum fsync_policy
+{
+	FSYNC_NONE,
+	FSYNC_END,
+	FSYNC_PERIODIC
+};
+
+typedef struct
+{
+	int fd;
+	int dir_fd;
+	bool anonymous;         // < O_TMPFILE, temp_name is only used while linking it
+	char name[NAME_MAX + 1];
+	char temp_name[NAME_MAX + 1];
+} output_file;
+
+/*
+ *	Parses a policy name ("none", "end", "periodic"). Returns -1 for unknown names.
+ */
+int fsync_parse_policy(const char* name);
+
+/*
+ *	Creates the unnamed output for the file name in directory dir.
+ *	Returns 0 on success, -1 on error (errno is set).
+ */
+int output_open(output_file* out, const char* dir, const char* name);
+
+/*
+ *	Syncs the data as the policy says and atomically replaces name with it.
+ *	sync_dir also syncs the directory entry now, instead of in output_sync_dir().
+ *	The output is closed in any case.
+ *	Returns 0 on success, -1 on error (errno is set).
+ */
+int output_publish(output_file* out, enum fsync_policy policy, bool sync_dir);
+
+/*
+ *	Throws the unfinished output away.
+ */
+void output_discard(output_file* out);
+
+/*
+ *	Syncs the filesystem holding dir (its entries and those of its subdirectories),
+ *	once per batch of published files.
+ *	Returns 0 on success, -1 on error.
+ */
+int output_sync_dir(const char* dir);
+
+#endif
@@ -0,0 +1,151 @@
+/**
+ *  pack archives, see pack.h
+ */
+
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "pack.h"
+#include "mapguard.h"
+
+/*
+ *	Checks that the index lies inside the archive before pointing archive->entries
+ *		and archive->names at it, then that every entry lies inside the archive and
+ *		the entries are sorted by name, so lookups never read outside the mapping.
+ */
+static bool valid_index(pack* archive, const pack_header* header)
+{
+	// offsets first, the subtractions below cannot wrap then; the bound on count
+	// keeps index_offset + count * sizeof(pack_entry) within the archive
+	if (header->index_offset > archive->size || header->names_offset > archive->size
+		|| header->index_offset < sizeof(pack_header) || header->index_offset % sizeof(uint64_t) != 0
+		|| header->count > (archive->size - header->index_offset) / sizeof(pack_entry)
+		|| header->names_offset < header->index_offset + header->count * sizeof(pack_entry)
+		|| header->names_size > archive->size - header->names_offset)
+	{
+		return false;
+	}
+	archive->entries = (const pack_entry*) (archive->data + header->index_offset);
+	archive->names = archive->data + header->names_offset;
+	archive->count = header->count;
+
+	for (uint64_t i = 0; i < header->count; i++)
+	{
+		const pack_entry* entry = &archive->entries[i];
+		if (entry->offset < sizeof(pack_header) || entry->offset > header->index_offset
+			|| entry->size > header->index_offset - entry->offset
+			|| (uint64_t) entry->name + entry->name_size >= header->names_size
+			|| archive->names[entry->name + entry->name_size] != '\0'
+			|| (i > 0 && strcmp(pack_name(archive, &archive->entries[i - 1]), pack_name(archive, entry)) >= 0))
+		{
+			return false;
+		}
+	}
+	return true;
+}
+
+pack* pack_open(const char* path)
+{
+	pack* archive = (pack*) calloc(1, sizeof(pack));
+	if (archive == NULL)
+	{
+		return NULL;
+	}
+	archive->guard = -1;
+	struct stat st;
+	archive->fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (archive->fd == -1 || fstat(archive->fd, &st) == -1)
+	{
+		goto fail;
+	}
+	archive->size = st.st_size;
+	if (archive->size < sizeof(pack_header))
+	{
+		errno = EINVAL;
+		goto fail;
+	}
+	archive->data = (const char*) mmap(NULL, archive->size, PROT_READ, MAP_SHARED, archive->fd, 0);
+	if (archive->data == MAP_FAILED)
+	{
+		archive->data = NULL;
+		goto fail;
+	}
+	if ((archive->guard = mapguard_add(archive->data, archive->size)) == -1)
+	{
+		goto fail;
+	}
+
+	pack_header header;
+	memcpy(&header, archive->data, sizeof(pack_header));
+	if (memcmp(header.magic, PACK_MAGIC, sizeof(header.magic)) != 0 || !valid_index(archive, &header))
+	{
+		errno = EINVAL;
+		goto fail;
+	}
+	// the index is read on every lookup, the data a small piece at a time
+	madvise((void*) archive->data, archive->size, MADV_RANDOM);
+	return archive;
+
+fail:
+	{
+		int saved = errno;
+		pack_close(archive);
+		errno = saved;
+		return NULL;
+	}
+}
+
+const pack_entry* pack_find(const pack* archive, const char* name)
+{
+	uint64_t low = 0, high = archive->count;
+	while (low < high)
+	{
+		uint64_t middle = low + (high - low) / 2;
+		int order = strcmp(pack_name(archive, &archive->entries[middle]), name);
+		if (order == 0)
+		{
+			return &archive->entries[middle];
+		}
+		if (order < 0)
+		{
+			low = middle + 1;
+		}
+		else
+		{
+			high = middle;
+		}
+	}
+	return NULL;
+}
+
+int pack_check(const pack* archive)
+{
+	if (mapguard_faulted(archive->guard))
+	{
+		errno = EIO;
+		return -1;
+	}
+	return 0;
+}
+
+void pack_close(pack* archive)
+{
+	if (archive->guard != -1)
+	{
+		mapguard_remove(archive->guard);
+	}
+	if (archive->data != NULL)
+	{
+		munmap((void*) archive->data, archive->size);
+	}
+	if (archive->fd != -1)
+	{
+		close(archive->fd);
+	}
+	free(archive);
+}
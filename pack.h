@@ -0,0 +1,83 @@
+/**
+ *  pack archives
+ *
+ *  a directory of many small files packed into one file (see packbuild.c), so
+ *  serving one of them is a binary search in a mapped index and a sendfile()
+ *  at an offset instead of an open(), a stat() and a close(). the archive is:
+ *
+ *      pack_header
+ *      the data of every file, one after the other
+ *      count pack_entry, sorted by name
+ *      the names, NUL terminated, relative to the packed directory
+ *
+ *  an entry also carries the Merkle root of its data (see merkle.h), so tree
+ *  requests cost no hashing. an archive is never changed in place: a new one
+ *  is built and renamed over it, and servers pick it up when they restart.
+ */
+
+#ifndef PACK_H
+#define PACK_H
+
+#include <stdint.h>
+
+#define PACK_MAGIC "PADPACK1"
+
+typedef struct
+{
+	char magic[8];
+	uint64_t count;
+	uint64_t index_offset; // < the entries, and the end of the data
+	uint64_t names_offset;
+	uint64_t names_size;
+} pack_header;
+
+typedef struct
+{
+	uint64_t offset; // < of the data, from the start of the archive
+	uint64_t size;
+	uint64_t root;
+	uint32_t name; // < offset of the name in the names
+	uint32_t name_size; // < without the NUL
+} pack_entry;
+
+typedef struct
+{
+	int fd;
+	const char* data; // < the whole archive, mapped
+	uint64_t size;
+	const pack_entry* entries;
+	uint64_t count;
+	const char* names;
+	int guard; // < mapguard slot of data
+} pack;
+
+/*
+ *	Maps the archive at path and checks its index.
+ *	Returns the archive, NULL on error (errno is set, EINVAL for a damaged archive).
+ */
+pack* pack_open(const char* path);
+
+/*
+ *	Returns the entry called name, or NULL.
+ */
+const pack_entry* pack_find(const pack* archive, const char* name);
+
+/*
+ *	Checks that nothing read from the mapping went past the end of the archive,
+ *		which is only shorter than its index says if it was truncated in place.
+ *	Framed replies copy the data out of the mapping, the checksum byte of a
+ *		segment needs its bytes in memory anyway, and so does the digest trailer
+ *		of a stream: both call this before sending what they read.
+ *		A truncated archive stays failed until the server restarts.
+ *	Returns 0 on success, -1 with errno EIO if a read faulted.
+ */
+int pack_check(const pack* archive);
+
+static inline const char* pack_name(const pack* archive, const pack_entry* entry)
+{
+	return archive->names + entry->name;
+}
+
+void pack_close(pack* archive);
+
+#endif
@@ -0,0 +1,223 @@
+/**
+ *  pack archive builder
+ *  packs every regular file below DIR of at most MAX_SIZE bytes into one
+ *  archive (see pack.h), named by its path relative to DIR, with its Merkle
+ *  root. symbolic links are not followed. the archive is written next to
+ *  OUTPUT and renamed over it once complete, a running server keeps serving
+ *  the previous one until it restarts.
+ *
+ *  a server with pack.files = NAME.pack serves the entries as NAME/path, in
+ *  place of the directory they were packed from.
+ *
+ *  usage: packbuild [-m MAX_SIZE] DIR OUTPUT
+ */
+
+#define _XOPEN_SOURCE 700 // nftw
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "pack.h"
+#include "merkle.h"
+#include "netio.h"
+#include "metrics.h"
+
+typedef struct
+{
+	char* name;
+	uint64_t size;
+} packed_file;
+
+static packed_file* files = NULL;
+static size_t file_count = 0;
+static size_t file_capacity = 0;
+static size_t prefix_len = 0; // < of DIR and its '/', cut from the names
+static uint64_t max_size = UINT64_MAX;
+static struct stat output_st; // < the previous archive, never packed into the new one
+
+static uint64_t parse_size(const char* text)
+{
+	char* end = NULL;
+	uint64_t value = strtoull(text, &end, 10);
+	switch (*end)
+	{
+		case 'K': case 'k': return value << 10;
+		case 'M': case 'm': return value << 20;
+		case 'G': case 'g': return value << 30;
+		default: return value;
+	}
+}
+
+static int add_file(const char* path, const struct stat* st, int type, struct FTW* ftw)
+{
+	(void) ftw;
+	if (type != FTW_F || !S_ISREG(st->st_mode) || (uint64_t) st->st_size > max_size
+		|| (st->st_dev == output_st.st_dev && st->st_ino == output_st.st_ino) || strlen(path) <= prefix_len)
+	{
+		return 0;
+	}
+	if (file_count == file_capacity)
+	{
+		size_t capacity = file_capacity > 0 ? 2 * file_capacity : 1024;
+		packed_file* grown = (packed_file*) realloc(files, capacity * sizeof(packed_file));
+		if (grown == NULL)
+		{
+			return -1;
+		}
+		files = grown;
+		file_capacity = capacity;
+	}
+	if ((files[file_count].name = strdup(path + prefix_len)) == NULL)
+	{
+		return -1;
+	}
+	files[file_count++].size = st->st_size;
+	return 0;
+}
+
+static int compare_files(const void* a, const void* b)
+{
+	return strcmp(((const packed_file*) a)->name, ((const packed_file*) b)->name);
+}
+
+/*
+ *	Appends the data of the file name (below dir) to out at *offset and fills entry.
+ *	Returns 0 on success, -1 on error.
+ */
+static int pack_file(int out_fd, const char* dir, const packed_file* file, uint64_t* offset, pack_entry* entry)
+{
+	char path[PATH_MAX];
+	snprintf(path, sizeof(path), "%s/%s", dir, file->name);
+	int fd = open(path, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+	if (fd == -1)
+	{
+		return -1;
+	}
+	void* data = MAP_FAILED;
+	if (file->size > 0 && (data = mmap(NULL, file->size, PROT_READ, MAP_PRIVATE, fd, 0)) == MAP_FAILED)
+	{
+		close(fd);
+		return -1;
+	}
+	close(fd);
+
+	const char* bytes = data != MAP_FAILED ? (const char*) data : "";
+	int ret_val = merkle_root_parallel(bytes, file->size, 1, &entry->root);
+	if (ret_val == 0)
+	{
+		ret_val = write_full(out_fd, bytes, file->size);
+	}
+	if (data != MAP_FAILED)
+	{
+		munmap(data, file->size);
+	}
+	entry->offset = *offset;
+	entry->size = file->size;
+	*offset += file->size;
+	return ret_val;
+}
+
+int main(int argc, char* argv[])
+{
+	int opt;
+	while ((opt = getopt(argc, argv, "m:")) != -1)
+	{
+		switch (opt)
+		{
+			case 'm': max_size = parse_size(optarg); break;
+			default:
+				fprintf(stderr, "usage: packbuild [-m MAX_SIZE] DIR OUTPUT\n");
+				exit(EXIT_FAILURE);
+		}
+	}
+	if (argc - optind != 2)
+	{
+		fprintf(stderr, "usage: packbuild [-m MAX_SIZE] DIR OUTPUT\n");
+		exit(EXIT_FAILURE);
+	}
+	const char* dir = argv[optind];
+	const char* output = argv[optind + 1];
+	char temp[PATH_MAX];
+	if (snprintf(temp, sizeof(temp), "%s.tmp", output) >= (int) sizeof(temp))
+	{
+		fprintf(stderr, "Output name too long\n");
+		exit(EXIT_FAILURE);
+	}
+	if (stat(output, &output_st) == -1)
+	{
+		memset(&output_st, 0, sizeof(output_st));
+	}
+
+	prefix_len = strlen(dir);
+	while (prefix_len > 1 && dir[prefix_len - 1] == '/')
+	{
+		prefix_len--;
+	}
+	prefix_len += dir[prefix_len - 1] != '/';
+	uint64_t start = metrics_now_ns();
+	if (nftw(dir, add_file, 64, FTW_PHYS) != 0)
+	{
+		perror("Could not walk the directory");
+		exit(EXIT_FAILURE);
+	}
+	qsort(files, file_count, sizeof(packed_file), compare_files);
+
+	pack_entry* entries = (pack_entry*) calloc(file_count + 1, sizeof(pack_entry));
+	int out_fd = open(temp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (entries == NULL || out_fd == -1)
+	{
+		perror("Could not create the archive");
+		exit(EXIT_FAILURE);
+	}
+
+	// the header goes last, once the offsets are known
+	pack_header header;
+	memset(&header, 0, sizeof(header));
+	uint64_t offset = sizeof(pack_header), names_size = 0;
+	bool ok = lseek(out_fd, offset, SEEK_SET) == (off_t) offset;
+	for (size_t i = 0; ok && i < file_count; i++)
+	{
+		size_t len = strlen(files[i].name);
+		entries[i].name = (uint32_t) names_size;
+		entries[i].name_size = (uint32_t) len;
+		names_size += len + 1;
+		if (names_size > UINT32_MAX || pack_file(out_fd, dir, &files[i], &offset, &entries[i]) == -1)
+		{
+			fprintf(stderr, "Could not pack %s: %s\n", files[i].name, strerror(errno));
+			ok = false;
+		}
+	}
+
+	static const char padding[8] = { 0 };
+	size_t pad = (8 - offset % 8) % 8;
+	memcpy(header.magic, PACK_MAGIC, sizeof(header.magic));
+	header.count = file_count;
+	header.index_offset = offset + pad;
+	header.names_offset = header.index_offset + file_count * sizeof(pack_entry);
+	header.names_size = names_size;
+	ok = ok && write_full(out_fd, padding, pad) == 0 && write_full(out_fd, entries, file_count * sizeof(pack_entry)) == 0;
+	for (size_t i = 0; ok && i < file_count; i++)
+	{
+		ok = write_full(out_fd, files[i].name, entries[i].name_size + 1) == 0;
+	}
+	ok = ok && pwrite(out_fd, &header, sizeof(header), 0) == (ssize_t) sizeof(header) && fsync(out_fd) == 0;
+	ok = close(out_fd) == 0 && ok;
+	if (!ok || rename(temp, output) == -1)
+	{
+		perror("Could not write the archive");
+		unlink(temp);
+		exit(EXIT_FAILURE);
+	}
+
+	printf("Packed %zu files, %llu bytes of data, in %.3f s\n", file_count,
+		(unsigned long long) (offset - sizeof(pack_header)), (metrics_now_ns() - start) / 1e9);
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,297 @@
+/**
+ *  buffer pools and arenas, see pool.h
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include "pool.h"
+
+#define ARENA_ALIGN 16
+#define MAX_POOLS 16
+
+typedef struct free_buffer
+{
+	struct free_buffer* next;
+} free_buffer;
+
+typedef struct slab
+{
+	struct slab* next;
+	void* memory;
+	size_t size;
+} slab;
+
+struct buffer_pool
+{
+	char name[32];
+	size_t buffer_size;
+	size_t buffers_per_slab;
+	pthread_mutex_t lock;
+	free_buffer* free_list;
+	slab* slabs;
+	// statistics, read without the lock by the metrics renderer
+	_Atomic uint64_t buffers;
+	_Atomic uint64_t in_use;
+	_Atomic uint64_t gets;
+	_Atomic uint64_t slab_bytes;
+	_Atomic uint64_t huge_slabs;
+};
+
+static buffer_pool* pools[MAX_POOLS];
+static int pool_count = 0;
+static pthread_mutex_t pools_lock = PTHREAD_MUTEX_INITIALIZER;
+
+buffer_pool* pool_create(const char* name, size_t buffer_size, size_t buffers_per_slab)
+{
+	buffer_pool* pool = (buffer_pool*) calloc(1, sizeof(buffer_pool));
+	if (pool == NULL)
+	{
+		return NULL;
+	}
+
+	snprintf(pool->name, sizeof(pool->name), "%s", name);
+	pool->buffer_size = (buffer_size + CACHE_LINE - 1) & ~((size_t) CACHE_LINE - 1);
+	pool->buffers_per_slab = buffers_per_slab > 0 ? buffers_per_slab : 1;
+	pthread_mutex_init(&pool->lock, NULL);
+
+	pthread_mutex_lock(&pools_lock);
+	if (pool_count < MAX_POOLS)
+	{
+		pools[pool_count++] = pool;
+	}
+	pthread_mutex_unlock(&pools_lock);
+
+	return pool;
+}
+
+void pool_destroy(buffer_pool* pool)
+{
+	if (pool == NULL)
+	{
+		return;
+	}
+
+	pthread_mutex_lock(&pools_lock);
+	for (int i = 0; i < pool_count; i++)
+	{
+		if (pools[i] == pool)
+		{
+			pools[i] = pools[--pool_count];
+			break;
+		}
+	}
+	pthread_mutex_unlock(&pools_lock);
+
+	while (pool->slabs != NULL)
+	{
+		slab* next = pool->slabs->next;
+		munmap(pool->slabs->memory, pool->slabs->size);
+		free(pool->slabs);
+		pool->slabs = next;
+	}
+	pthread_mutex_destroy(&pool->lock);
+	free(pool);
+}
+
+/*
+ *	Maps a new slab and threads its buffers on the free list. Called with the pool locked.
+ *	Returns 0 on success, -1 on error.
+ */
+static int pool_grow(buffer_pool* pool)
+{
+	slab* new_slab = (slab*) malloc(sizeof(slab));
+	if (new_slab == NULL)
+	{
+		return -1;
+	}
+
+	size_t size = pool->buffer_size * pool->buffers_per_slab;
+	void* memory = MAP_FAILED;
+	bool huge = false;
+	if (size >= HUGE_PAGE_SIZE)
+	{
+		// explicit huge pages first, then transparent ones, then plain pages
+		size = (size + HUGE_PAGE_SIZE - 1) & ~((size_t) HUGE_PAGE_SIZE - 1);
+		memory = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+		huge = memory != MAP_FAILED;
+	}
+	if (memory == MAP_FAILED)
+	{
+		memory = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (memory != MAP_FAILED && size >= HUGE_PAGE_SIZE)
+		{
+			huge = madvise(memory, size, MADV_HUGEPAGE) == 0;
+		}
+	}
+	if (memory == MAP_FAILED)
+	{
+		free(new_slab);
+		return -1;
+	}
+
+	new_slab->memory = memory;
+	new_slab->size = size;
+	new_slab->next = pool->slabs;
+	pool->slabs = new_slab;
+
+	size_t count = size / pool->buffer_size;
+	for (size_t i = 0; i < count; i++)
+	{
+		free_buffer* buffer = (free_buffer*) ((char*) memory + i * pool->buffer_size);
+		buffer->next = pool->free_list;
+		pool->free_list = buffer;
+	}
+
+	atomic_fetch_add(&pool->buffers, count);
+	atomic_fetch_add(&pool->slab_bytes, size);
+	if (huge)
+	{
+		atomic_fetch_add(&pool->huge_slabs, 1);
+	}
+	return 0;
+}
+
+void* pool_get(buffer_pool* pool)
+{
+	pthread_mutex_lock(&pool->lock);
+	if (pool->free_list == NULL && pool_grow(pool) == -1)
+	{
+		pthread_mutex_unlock(&pool->lock);
+		return NULL;
+	}
+	free_buffer* buffer = pool->free_list;
+	pool->free_list = buffer->next;
+	pthread_mutex_unlock(&pool->lock);
+
+	atomic_fetch_add_explicit(&pool->in_use, 1, memory_order_relaxed);
+	atomic_fetch_add_explicit(&pool->gets, 1, memory_order_relaxed);
+	return buffer;
+}
+
+void pool_put(buffer_pool* pool, void* buffer)
+{
+	if (buffer == NULL)
+	{
+		return;
+	}
+
+	pthread_mutex_lock(&pool->lock);
+	((free_buffer*) buffer)->next = pool->free_list;
+	pool->free_list = (free_buffer*) buffer;
+	pthread_mutex_unlock(&pool->lock);
+
+	atomic_fetch_sub_explicit(&pool->in_use, 1, memory_order_relaxed);
+}
+
+size_t pool_buffer_size(const buffer_pool* pool)
+{
+	return pool->buffer_size;
+}
+
+void pool_write_metrics(FILE* out)
+{
+	pthread_mutex_lock(&pools_lock);
+	fprintf(out, "# TYPE pad_pool_buffers gauge\n");
+	for (int i = 0; i < pool_count; i++)
+	{
+		uint64_t total = atomic_load(&pools[i]->buffers);
+		uint64_t in_use = atomic_load(&pools[i]->in_use);
+		fprintf(out, "pad_pool_buffers{pool=\"%s\",state=\"in_use\"} %llu\n", pools[i]->name, (unsigned long long) in_use);
+		fprintf(out, "pad_pool_buffers{pool=\"%s\",state=\"free\"} %llu\n", pools[i]->name, (unsigned long long) (total - in_use));
+	}
+	fprintf(out, "# TYPE pad_pool_gets_total counter\n");
+	for (int i = 0; i < pool_count; i++)
+	{
+		fprintf(out, "pad_pool_gets_total{pool=\"%s\"} %llu\n", pools[i]->name, (unsigned long long) atomic_load(&pools[i]->gets));
+	}
+	fprintf(out, "# TYPE pad_pool_bytes gauge\n");
+	for (int i = 0; i < pool_count; i++)
+	{
+		fprintf(out, "pad_pool_bytes{pool=\"%s\"} %llu\n", pools[i]->name, (unsigned long long) atomic_load(&pools[i]->slab_bytes));
+	}
+	fprintf(out, "# TYPE pad_pool_huge_slabs gauge\n");
+	for (int i = 0; i < pool_count; i++)
+	{
+		fprintf(out, "pad_pool_huge_slabs{pool=\"%s\"} %llu\n", pools[i]->name, (unsigned long long) atomic_load(&pools[i]->huge_slabs));
+	}
+	pthread_mutex_unlock(&pools_lock);
+}
+
+void arena_init(arena* arena, buffer_pool* chunks)
+{
+	arena->chunks = chunks;
+	arena->head = NULL;
+}
+
+void* arena_alloc(arena* arena, size_t size)
+{
+	size = (size + ARENA_ALIGN - 1) & ~((size_t) ARENA_ALIGN - 1);
+	size_t header = (sizeof(arena_chunk) + ARENA_ALIGN - 1) & ~((size_t) ARENA_ALIGN - 1);
+
+	arena_chunk* chunk = arena->head;
+	if (chunk == NULL || chunk->size - chunk->used < size)
+	{
+		size_t pooled_size = pool_buffer_size(arena->chunks);
+		if (header + size <= pooled_size)
+		{
+			chunk = (arena_chunk*) pool_get(arena->chunks);
+			if (chunk == NULL)
+			{
+				return NULL;
+			}
+			chunk->size = pooled_size;
+			chunk->pooled = 1;
+		}
+		else
+		{
+			chunk = (arena_chunk*) aligned_alloc(CACHE_LINE, (header + size + CACHE_LINE - 1) & ~((size_t) CACHE_LINE - 1));
+			if (chunk == NULL)
+			{
+				return NULL;
+			}
+			chunk->size = header + size;
+			chunk->pooled = 0;
+		}
+		chunk->used = header;
+
+		// keep the chunk with the most room in front, oversized chunks are full anyway
+		if (arena->head != NULL && !chunk->pooled)
+		{
+			chunk->next = arena->head->next;
+			arena->head->next = chunk;
+		}
+		else
+		{
+			chunk->next = arena->head;
+			arena->head = chunk;
+		}
+	}
+
+	void* memory = (char*) chunk + chunk->used;
+	chunk->used += size;
+	return memory;
+}
+
+void arena_release(arena* arena)
+{
+	arena_chunk* chunk = arena->head;
+	while (chunk != NULL)
+	{
+		arena_chunk* next = chunk->next;
+		if (chunk->pooled)
+		{
+			pool_put(arena->chunks, chunk);
+		}
+		else
+		{
+			free(chunk);
+		}
+		chunk = next;
+	}
+	arena->head = NULL;
+}
@@ -0,0 +1,89 @@
+/**
+ *  reusable I/O buffers and per-connection arenas
+ *
+ *  a buffer pool hands out fixed-size buffers carved from large slabs. buffers
+ *  start on a cache line boundary and go back on a free list when released,
+ *  so a steady stream of connections stops going through malloc. slabs of
+ *  2 MB or more are backed by huge pages when the system has them.
+ *
+ *  an arena is a bump allocator for everything a connection needs while it
+ *  lives (file name, request state...). its chunks come from a buffer pool
+ *  and are all returned at once by arena_release().
+ */
+
+#ifndef POOL_H
+#define POOL_H
+
+#include <stddef.h>
+#include <stdio.h>
+
+#define CACHE_LINE 64
+#define HUGE_PAGE_SIZE (2 * 1024 * 1024)
+
+typedef struct buffer_pool buffer_pool;
+
+typedef struct arena_chunk
+{
+	struct arena_chunk* next;
+	size_t size;
+	size_t used;
+	int pooled;
+} arena_chunk;
+
+typedef struct
+{
+	buffer_pool* chunks;
+	arena_chunk* head;
+} arena;
+
+/*
+ *	Creates a pool of buffer_size byte buffers (rounded up to a cache line),
+ *		growing buffers_per_slab buffers at a time.
+ *	name labels the pool in the metrics.
+ *	Returns NULL on error.
+ */
+buffer_pool* pool_create(const char* name, size_t buffer_size, size_t buffers_per_slab);
+
+/*
+ *	Unmaps every slab of the pool. No buffer of the pool may be in use.
+ */
+void pool_destroy(buffer_pool* pool);
+
+/*
+ *	Returns a buffer of the pool, or NULL if no memory is left.
+ */
+void* pool_get(buffer_pool* pool);
+
+/*
+ *	Gives a buffer obtained with pool_get back to the pool.
+ */
+void pool_put(buffer_pool* pool, void* buffer);
+
+/*
+ *	Returns the usable size of the buffers of the pool.
+ */
+size_t pool_buffer_size(const buffer_pool* pool);
+
+/*
+ *	Writes the statistics of every pool in the Prometheus text format.
+ *	Meant to be registered with metrics_register_collector().
+ */
+void pool_write_metrics(FILE* out);
+
+/*
+ *	Prepares an empty arena taking its chunks from the given pool.
+ */
+void arena_init(arena* arena, buffer_pool* chunks);
+
+/*
+ *	Returns size bytes aligned to 16 bytes, valid until arena_release(), or NULL on error.
+ *	Allocations larger than a pool chunk get a dedicated chunk.
+ */
+void* arena_alloc(arena* arena, size_t size);
+
+/*
+ *	Frees everything allocated from the arena in one go.
+ */
+void arena_release(arena* arena);
+
+#endif
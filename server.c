@@ -10,6 +10,20 @@
  *		- if the file exists, a message header with size == filesize is sent
  *  6. if it exists, send it
  * 		- compute checksum for each segment and attach it to the payload
+ *
+ *	A request with the leading 'm' is answered with the server metrics instead (see metrics.h).
+ *	A request with the leading 'z' gets the file as one raw stream followed by a digest trailer.
+ *	A request with the leading 't' gets the Merkle root of the file with the initial reply,
+ *		then the raw stream (see merkle.h).
+ *	A request with the leading 'd' (Unix socket only) is answered with the open file descriptor
+ *		instead of the file contents.
+ *	Requests with the leading 's', 'l' and 'b' query metadata: stat, directory listing and
+ *		bulk stat, answered from the directory index (see dirindex.h).
+ *
+ *	Settings come from the command line and an optional configuration file (see config.h).
+ *	Worker threads accept and serve connections; the main thread only waits for SIGHUP
+ *		to reload the configuration and for a replacement server to hand the listeners to
+ *		(see handoff.h), after which it drains the running transfers and exits.
  */
 
 
@@ -21,50 +35,175 @@
 #include <arpa/inet.h>
 #include <netinet/in.h>
 #include <netinet/ip.h>
+#include <netinet/tcp.h>
 #include <unistd.h>
 #include <sys/types.h>
 #include <errno.h>
 #include <sys/stat.h>
 #include <stdbool.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <string.h>
+#include <pthread.h>
+#include <limits.h>
+#include <time.h>
+#include <sys/un.h>
+#include <sys/eventfd.h>
+#include <sys/signalfd.h>
+#include <sys/mman.h>
 #include "message.h"
+#include "metrics.h"
+#include "logger.h"
+#include "pool.h"
+#include "digest.h"
+#include "netio.h"
+#include "filesource.h"
+#include "mapguard.h"
+#include "config.h"
+#include "handoff.h"
+#include "socktune.h"
+#include "admission.h"
+#include "taskpool.h"
+#include "merkle.h"
+#include "dirindex.h"
+#include "catalog.h"
+#include "pack.h"
 
-#define IP "127.0.0.1"
-#define PORT 8080
-#define BLKSIZE 512
-#define MAX_ALLOCATION_SIZE 1024
+#define DEFAULT_PORT "8080"
 #define DIVISOR 32
+#define ARENA_CHUNK_SIZE 4096
+#define CHECKSUM_BATCH (64 * 1024) // < bytes of segments checksummed by one task
+#define CHECKSUM_BATCH_SEGMENTS 256
+#define CHECKSUM_WINDOW 8 // < batches of a transfer in flight
+#define ROOT_TASK_LEAVES 8 // < Merkle leaves hashed by one task
+#define ROOT_CACHE_SIZE 256
+#define MAX_OVERRIDES 64
+#define MAX_PACKS 64
+#define DRAIN_POLL_NS 10000000
+
+// file read buffers, O_DIRECT read buffers and per-connection arena chunks, shared by every connection
+static buffer_pool* io_pool = NULL;
+static buffer_pool* direct_pool = NULL;
+static buffer_pool* arena_pool = NULL;
+// checksums of framed segments, off the network threads (transfer.checksum_threads)
+static task_pool* checksum_pool = NULL;
+
+// the sockets every worker accepts connections from, named by their address for handoffs
+static listener_set listeners;
+
+// pack archives and the directory each one stands for, see pack.h
+typedef struct
+{
+	pack* archive;
+	char mount[PATH_MAX];
+	size_t mount_len;
+} mounted_pack;
+
+static mounted_pack packs[MAX_PACKS];
+static int pack_count = 0;
+
+// once the listeners are handed over, stop_fd wakes the workers up so they stop accepting
+static int stop_fd = -1;
+static _Atomic bool draining = false;
+static _Atomic int running_workers = 0;
+static _Atomic int active_connections = 0;
 
 /*
- *	Creates a socket for the server and binds its IP and port.
+ *	Creates a socket for the server, binds it to address (host:port, [v6 host]:port,
+ *		or *:port for every interface) and starts listening.
+ *	Accepted connections inherit the buffer sizes of the socket profile of config,
+ *		and with them their window scale.
  *	Returns the socket file descriptor on success, -1 on error.
  */
-int init_server()
+int init_server(const char* address, const server_config* config)
 {
-	// sockaddr_in is used for ipv4 sockets
-	struct sockaddr_in addr;
-	bzero(&addr, sizeof(struct sockaddr_in)); // < guaranteed to work
+	char host[CONFIG_ADDRESS_SIZE];
+	const char* port = DEFAULT_PORT;
+	const char* colon = strrchr(address, ':');
+	snprintf(host, sizeof(host), "%s", address);
+	if (address[0] == '[')
+	{
+		// IPv6 literal, the port follows the closing bracket
+		char* close_bracket = strchr(host, ']');
+		if (close_bracket == NULL)
+		{
+			log_error("invalid listen address %s", address);
+			return -1;
+		}
+		*close_bracket = '\0';
+		memmove(host, host + 1, strlen(host));
+		port = close_bracket[1] == ':' ? address + (close_bracket - host) + 2 : port;
+	}
+	else if (colon != NULL)
+	{
+		host[colon - address] = '\0';
+		port = colon + 1;
+	}
+
+	struct addrinfo hints;
+	bzero(&hints, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_flags = AI_PASSIVE;
+	bool any = host[0] == '\0' || strcmp(host, "*") == 0;
+	struct addrinfo* result = NULL;
+	int err = getaddrinfo(any ? NULL : host, port, &hints, &result);
+	if (err != 0)
+	{
+		log_error("error resolving listen address %s: %s", address, gai_strerror(err));
+		return -1;
+	}
 
-	int sd = socket(AF_INET, SOCK_STREAM, 0);
+	int sd = socket(result->ai_family, SOCK_STREAM, 0);
 	if (sd == -1)
 	{
-		perror("error opening socket: ");
+		log_errno("error opening socket");
+		freeaddrinfo(result);
 		return -1;
 	}
 
-	// set server ip address and port
-	// need to convert these values from strings/ints to addresses in network byte order
-	addr.sin_family = AF_INET;
-	addr.sin_port = htons(PORT);
-	if(inet_aton(IP, &addr.sin_addr) == 0)
+	// allow restarting the server while old connections are still in TIME_WAIT
+	int reuse = 1;
+	if (setsockopt(sd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse)) == -1)
+	{
+		log_errno("error setting SO_REUSEADDR");
+	}
+
+	// an IPv6 address only takes IPv6 clients, so IPv4 can be bound separately
+	int v6only = 1;
+	if (result->ai_family == AF_INET6 && setsockopt(sd, IPPROTO_IPV6, IPV6_V6ONLY, &v6only, sizeof(v6only)) == -1)
+	{
+		log_errno("error setting IPV6_V6ONLY");
+	}
+
+	const char* failed = NULL;
+	if (socket_tune(sd, &config->socket, &failed) == -1)
+	{
+		log_errno("error setting %s on %s", failed, address);
+	}
+
+	// connections that send nothing never reach a worker, the kernel drops them
+	int defer = config->header_timeout;
+	if (defer > 0 && setsockopt(sd, IPPROTO_TCP, TCP_DEFER_ACCEPT, &defer, sizeof(defer)) == -1)
+	{
+		log_errno("error setting TCP_DEFER_ACCEPT");
+	}
+
+	if ((bind(sd, result->ai_addr, result->ai_addrlen)) != 0)
 	{
-		fprintf(stderr, "error converting address");
+		log_errno("bind failed for %s", address);
+		freeaddrinfo(result);
 		close(sd);
 		return -1;
 	}
+	freeaddrinfo(result);
 
-	if ((bind(sd, (struct sockaddr*) &addr, sizeof(struct sockaddr_in))) != 0)
+	// start the listening process for inbound connections
+	// non-blocking, since every worker polls it and only one of them gets each connection
+	if (listen(sd, config->backlog) == -1 || fcntl(sd, F_SETFL, O_NONBLOCK) == -1)
 	{
-		perror("bind failed: ");
+		log_errno("Error starting the listening on %s", address);
 		close(sd);
 		return -1;
 	}
@@ -73,98 +212,415 @@ int init_server()
 }
 
 /*
- *	Listens for inbound client connections.
- *	Returns the socket file descriptor for the first client that connects to the server,
- *  	or -1 on error.
+ *	Creates a Unix domain socket for same-host clients at path and starts listening.
+ *	A stale socket file left at path by a previous run is replaced.
+ *	Returns the socket file descriptor on success, -1 on error.
  */
-int await_client_connection(int socket_fd)
+int init_unix_server(const char* path, int backlog)
 {
-	struct sockaddr_in client_addr;
-	bzero(&client_addr, sizeof(struct sockaddr_in));
+	struct sockaddr_un addr;
+	bzero(&addr, sizeof(struct sockaddr_un));
+	if (strlen(path) >= sizeof(addr.sun_path))
+	{
+		log_error("Unix socket path too long: %s", path);
+		return -1;
+	}
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, path);
 
-	// start the listening process for inbound connections
-	if (listen(socket_fd, 5) == -1)
+	int sd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (sd == -1)
 	{
-		perror("Error starting the listening");
-		close(socket_fd);
+		log_errno("error opening unix socket");
 		return -1;
 	}
 
-	printf("Waiting...\n");
+	unlink(path);
+	if (bind(sd, (struct sockaddr*) &addr, sizeof(struct sockaddr_un)) != 0)
+	{
+		log_errno("bind failed for %s", path);
+		close(sd);
+		return -1;
+	}
 
-	// accept client connections
-	socklen_t client_addr_len = sizeof(client_addr_len);
-	int csd; // < client socket descriptor
-	csd = accept(socket_fd, (struct sockaddr*) &client_addr, &client_addr_len);
-	if (csd == -1)
+	if (listen(sd, backlog) == -1 || fcntl(sd, F_SETFL, O_NONBLOCK) == -1)
 	{
-		perror("Error establishing connection");
-		close(socket_fd);
+		log_errno("Error starting the listening on %s", path);
+		close(sd);
 		return -1;
 	}
-	printf("Connection established!\n");
+
+	return sd;
+}
+
+/*
+ *	Waits for an inbound client connection on any of the listening sockets.
+ *	Several workers wait on the same sockets, a connection another worker took first
+ *		just means waiting again.
+ *	Returns the socket file descriptor for the first client that connects to the server,
+ *  	or -1 on error and once the server stops accepting.
+ */
+int await_client_connection(const int* listen_fds, int count)
+{
+	log_debug("Waiting...");
+
+	// the stop event comes last, it is only looked at when no listener is ready
+	struct pollfd fds[count + 1];
+	for (int i = 0; i < count; i++)
+	{
+		fds[i].fd = listen_fds[i];
+		fds[i].events = POLLIN;
+	}
+	fds[count].fd = stop_fd;
+	fds[count].events = POLLIN;
+
+	int csd = -1; // < client socket descriptor
+	while (csd == -1)
+	{
+		while (poll(fds, count + 1, -1) == -1)
+		{
+			if (errno != EINTR)
+			{
+				log_errno("Error waiting for connections");
+				return -1;
+			}
+		}
+		if (atomic_load(&draining))
+		{
+			return -1;
+		}
+
+		int ready = 0;
+		while (ready < count - 1 && !(fds[ready].revents & POLLIN))
+		{
+			ready++;
+		}
+
+		// accept client connections, the peer address is not needed (TCP or Unix)
+		csd = accept(listen_fds[ready], NULL, NULL);
+		if (csd == -1 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR && errno != ECONNABORTED)
+		{
+			metrics_add(M_ERR_ACCEPT, 1);
+			log_errno("Error establishing connection");
+			return -1;
+		}
+	}
+	metrics_add(M_CONNECTIONS, 1);
+	log_debug("Connection established!");
 
 	// return the client socket file descriptor to the caller
 	return csd;
 }
 
 /*
- *	Reads the client request.
- *	Only acknowledges file transfer requests (first byte 'f'),
- *		with file name less than MAX_ALLOCATION_SIZE bytes,
- * 		to protect against unwanted requests and 
- * 		memory overflows in the server.
- * 	Returns a string with the name of the requested file on success, NULL on error.
+ *	Reads the header of the client request.
+ *	Returns 0 on success, -1 on error.
  */
-char* accept_file_request(int socket_fd)
+int read_request_header(int socket_fd, message_header* header)
 {
-	// read header
-	message_header header;
-	if (read(socket_fd, (void*) &header, sizeof(message_header)) == -1)
+	if (read(socket_fd, (void*) header, sizeof(message_header)) != sizeof(message_header))
 	{
-		perror("Error receiving file request header: ");
-		return NULL;
+		log_errno_limited("Error receiving request header");
+		return -1;
+	}
+	metrics_add(M_REQUESTS, 1);
+	return 0;
+}
+
+/*
+ *	Applies the socket profile of config to an accepted connection.
+ *	An option the kernel refuses (an unknown congestion control, say) is logged and skipped.
+ */
+void set_socket_options(int socket_fd, const server_config* config)
+{
+	const char* failed = NULL;
+	if (socket_tune(socket_fd, &config->socket, &failed) == -1)
+	{
+		log_errno_limited("Could not set %s of socket profile %s", failed, config->socket.name);
+	}
+}
+
+/*
+ *	Returns true if filename stays below the document root:
+ *		relative, without empty, "." or ".." components.
+ */
+static bool valid_file_name(const char* filename)
+{
+	if (filename[0] == '\0' || filename[0] == '/')
+	{
+		return false;
+	}
+	for (const char* part = filename; part != NULL; part = strchr(part, '/') != NULL ? strchr(part, '/') + 1 : NULL)
+	{
+		size_t len = strcspn(part, "/");
+		if (len == 0 || (len == 1 && part[0] == '.') || (len == 2 && part[0] == '.' && part[1] == '.'))
+		{
+			return false;
+		}
+	}
+	return true;
+}
+
+/*
+ *	Holds a transfer back to rate bytes per second (0 = unlimited):
+ *		sleeps until the sent bytes are due since start_ns.
+ */
+static void throttle(uint64_t rate, uint64_t start_ns, uint64_t sent)
+{
+	if (rate == 0)
+	{
+		return;
+	}
+	uint64_t due_ns = (uint64_t) ((double) sent * 1e9 / rate);
+	uint64_t elapsed_ns = metrics_now_ns() - start_ns;
+	if (due_ns > elapsed_ns)
+	{
+		struct timespec wait = { (due_ns - elapsed_ns) / 1000000000ull, (due_ns - elapsed_ns) % 1000000000ull };
+		nanosleep(&wait, NULL);
 	}
+}
 
+/*
+ *	Reads the file name that follows a file request header.
+ *	Only acknowledges file transfer requests (first byte 'f', 'z', 't' or 'd'),
+ *		with file name of at most max_name_size bytes, inside the document root,
+ * 		to protect against unwanted requests and 
+ * 		memory overflows in the server.
+ *	The name is allocated in the connection arena.
+ * 	Returns a string with the name of the requested file on success, NULL on error.
+ */
+char* accept_file_request(int socket_fd, const message_header* header, arena* conn_arena, uint64_t max_name_size)
+{
 	// check if the request is for file transferring
-	if (header.message_type != 'f')
+	if (header->message_type != MSG_FILE && header->message_type != MSG_FD && header->message_type != MSG_STREAM
+		&& header->message_type != MSG_TREE)
 	{
-		fprintf(stderr, "Request not for file transfer.\n");
+		log_error_limited("Request not for file transfer.");
 		return NULL;
 	}
 
 	// block requests with abnormally large file name sizes to protect the server machine from attacks
-	if (header.message_size > MAX_ALLOCATION_SIZE)
+	if (header->message_size > max_name_size)
 	{
-		fprintf(stderr, "Message size larger than allowed threshold.\n");
+		log_error_limited("Message size larger than allowed threshold.");
 		return NULL;
 	}
 
-	// make space for filename
-	char* filename = (char*) malloc(header.message_size * sizeof(char));
+	// make space for filename, plus a terminator in case the client did not send one
+	char* filename = (char*) arena_alloc(conn_arena, header->message_size + 1);
 	if (filename == NULL)
 	{
 		errno = ENOMEM;
-		perror("Error making space for file name:");
+		log_errno_limited("Error making space for file name");
 		return NULL;
 	}
 
-	// read filename
-	if (read(socket_fd, (void*) filename, header.message_size) == -1)
+	// read filename, a name split across several segments arrives in several reads
+	if (header->message_size > 0 && read_full(socket_fd, (void*) filename, header->message_size) <= 0)
 	{
-		perror("Error reading the filename from socket: ");
+		log_errno_limited("Error reading the filename from socket");
 		return NULL;
 	}
+	filename[header->message_size] = '\0';
 
+	if (!valid_file_name(filename))
+	{
+		log_error_limited("Requested name outside the document root: %s", filename);
+		return NULL;
+	}
 	return filename;
 }
 
+// Merkle roots of recently requested files, a file is known by its identity and change times
+typedef struct
+{
+	bool valid;
+	dev_t dev;
+	ino_t ino;
+	off_t size;
+	struct timespec mtime;
+	struct timespec ctime;
+	uint64_t root;
+} root_entry;
+
+static root_entry root_cache[ROOT_CACHE_SIZE];
+static pthread_mutex_t root_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// consecutive leaves of a file, hashed by one task of checksum_pool
+typedef struct
+{
+	task job;
+	const char* data;
+	uint64_t size;
+	uint64_t first;
+	uint64_t count;
+	uint64_t* leaves;
+} leaf_batch;
+
+static bool same_file(const root_entry* entry, const struct stat* statbuf)
+{
+	return entry->valid && entry->dev == statbuf->st_dev && entry->ino == statbuf->st_ino && entry->size == statbuf->st_size
+		&& entry->mtime.tv_sec == statbuf->st_mtim.tv_sec && entry->mtime.tv_nsec == statbuf->st_mtim.tv_nsec
+		&& entry->ctime.tv_sec == statbuf->st_ctim.tv_sec && entry->ctime.tv_nsec == statbuf->st_ctim.tv_nsec;
+}
+
+static void leaf_batch_run(task* job)
+{
+	leaf_batch* batch = (leaf_batch*) job;
+	for (uint64_t i = batch->first; i < batch->first + batch->count; i++)
+	{
+		batch->leaves[i] = merkle_leaf(batch->data, batch->size, i);
+	}
+}
+
+/*
+ *	Hashes the leaves of the size bytes of data, on checksum_pool if there is one.
+ *	Returns the root, in *root. Returns 0 on success, -1 on error.
+ */
+static int compute_root(const char* data, uint64_t size, uint64_t* root)
+{
+	uint64_t count = merkle_leaf_count(size);
+	uint64_t batch_count = (count + ROOT_TASK_LEAVES - 1) / ROOT_TASK_LEAVES;
+	uint64_t* leaves = (uint64_t*) malloc(count * sizeof(uint64_t));
+	leaf_batch* batches = (leaf_batch*) malloc(batch_count * sizeof(leaf_batch));
+	if (leaves == NULL || batches == NULL)
+	{
+		free(leaves);
+		free(batches);
+		errno = ENOMEM;
+		return -1;
+	}
+
+	for (uint64_t i = 0; i < batch_count; i++)
+	{
+		leaf_batch* batch = &batches[i];
+		batch->data = data;
+		batch->size = size;
+		batch->first = i * ROOT_TASK_LEAVES;
+		batch->count = count - batch->first < ROOT_TASK_LEAVES ? count - batch->first : ROOT_TASK_LEAVES;
+		batch->leaves = leaves;
+		task_init(&batch->job, leaf_batch_run);
+		if (checksum_pool != NULL)
+		{
+			taskpool_submit(checksum_pool, &batch->job);
+		}
+		else
+		{
+			leaf_batch_run(&batch->job);
+		}
+	}
+	for (uint64_t i = 0; i < batch_count && checksum_pool != NULL; i++)
+	{
+		taskpool_wait(checksum_pool, &batches[i].job);
+	}
+
+	*root = merkle_root(leaves, count);
+	free(leaves);
+	free(batches);
+	return 0;
+}
+
+static root_entry* root_slot(const struct stat* statbuf)
+{
+	return &root_cache[(statbuf->st_ino ^ statbuf->st_dev * 31) % ROOT_CACHE_SIZE];
+}
+
+/*
+ *	Looks the Merkle root of filename, known from statbuf, up in the cache, then in the catalog.
+ *	Returns true if it was there, in *root.
+ */
+static bool cached_root(const char* filename, const struct stat* statbuf, uint64_t* root)
+{
+	root_entry* entry = root_slot(statbuf);
+	pthread_mutex_lock(&root_cache_lock);
+	bool cached = same_file(entry, statbuf);
+	*root = entry->root;
+	pthread_mutex_unlock(&root_cache_lock);
+	cached = cached || catalog_digest(filename, statbuf, root) == 0;
+	if (cached)
+	{
+		metrics_add(M_ROOTS_CACHED, 1);
+	}
+	return cached;
+}
+
+/*
+ *	Finds the Merkle root of filename, known from statbuf, in the cache or by hashing the file.
+ *	A file that changed since statbuf is an error, its root would not match the size sent,
+ *		and so is one truncated while it is hashed (errno EIO).
+ *	Returns 0 on success, -1 on error.
+ */
+static int file_root(const char* filename, const struct stat* statbuf, uint64_t* root)
+{
+	if (cached_root(filename, statbuf, root))
+	{
+		return 0;
+	}
+
+	int fd = open(filename, O_RDONLY | O_CLOEXEC);
+	if (fd == -1)
+	{
+		return -1;
+	}
+	root_entry fresh = { true };
+	struct stat current;
+	void* data = MAP_FAILED;
+	if (fstat(fd, &current) == 0)
+	{
+		fresh = (root_entry) { true, current.st_dev, current.st_ino, current.st_size, current.st_mtim, current.st_ctim };
+	}
+	if (!same_file(&fresh, statbuf)
+		|| (statbuf->st_size > 0 && (data = mmap(NULL, statbuf->st_size, PROT_READ, MAP_SHARED, fd, 0)) == MAP_FAILED))
+	{
+		close(fd);
+		return -1;
+	}
+	close(fd);
+
+	// a file truncated while it is hashed would otherwise kill the server, see mapguard.h
+	int guard = data != MAP_FAILED ? mapguard_add(data, statbuf->st_size) : -1;
+	int ret_val = data != MAP_FAILED && guard == -1 ? -1 : 0;
+	uint64_t start = metrics_now_ns();
+	if (ret_val == 0)
+	{
+		ret_val = compute_root(data != MAP_FAILED ? (const char*) data : "", statbuf->st_size, &fresh.root);
+	}
+	metrics_observe(M_CHECKSUM, metrics_now_ns() - start);
+	if (guard != -1 && mapguard_faulted(guard))
+	{
+		errno = EIO;
+		ret_val = -1;
+	}
+	if (guard != -1)
+	{
+		mapguard_remove(guard);
+	}
+	if (data != MAP_FAILED)
+	{
+		munmap(data, statbuf->st_size);
+	}
+	if (ret_val == -1)
+	{
+		return -1;
+	}
+
+	metrics_add(M_ROOTS_COMPUTED, 1);
+	*root = fresh.root;
+	pthread_mutex_lock(&root_cache_lock);
+	*root_slot(statbuf) = fresh;
+	pthread_mutex_unlock(&root_cache_lock);
+	catalog_set_digest(filename, statbuf, fresh.root);
+	return 0;
+}
+
 /*
  *	Check if the requested file exists locally and inform the client.
+ *	With with_root, an existing file is announced with its Merkle root (see message.h).
+ *	The size travels in the 32-bit message_size, a larger file is refused without reply.
  * 	Returns -1 on error, 0 if the file does not exist,
  * 		and the size of the file in bytes, if it exists.
  */
-int check_if_file_exist(int socket_fd, const char* filename)
+int64_t check_if_file_exist(int socket_fd, const char* filename, bool with_root)
 {
 	message_header header;
 	header.message_type = 'f';
@@ -172,18 +628,28 @@ int check_if_file_exist(int socket_fd, const char* filename)
 	// checking if file exists with stat instead of access because we'll use
 	// the st_size member of the struct afterwards
 	struct stat statbuf;
-	int status = stat(filename, &statbuf);
+	uint64_t stat_start = metrics_now_ns();
+	int status = catalog_stat(filename, &statbuf) == 0 ? 0 : stat(filename, &statbuf);
+	metrics_observe(M_STAT, metrics_now_ns() - stat_start);
 	if (status == -1 && errno == ENOENT)
 	{
 		// file doesn't exist, inform client
 		// we send a header with message_type == 0 to signal that
 		// there is no file
 		header.message_size = 0;
-		printf("file does not exist\n");
+		metrics_add(M_ERR_NOT_FOUND, 1);
+		log_info("file does not exist: %s", filename);
 	}
 	else if (status == -1)
 	{
 		// another error occured, just exit and hope for the best
+		metrics_add(M_ERR_STAT, 1);
+		return -1;
+	}
+	else if ((uint64_t) statbuf.st_size > UINT32_MAX)
+	{
+		metrics_add(M_ERR_TOO_LARGE, 1);
+		log_error_limited("%s is too large to send (%lld bytes, at most %u)", filename, (long long) statbuf.st_size, UINT32_MAX);
 		return -1;
 	}
 	else
@@ -194,148 +660,1716 @@ int check_if_file_exist(int socket_fd, const char* filename)
 		header.message_size = statbuf.st_size;
 	}
 
+	// the root goes with the initial reply, the client knows it before the first byte
+	message_header root_header = { MSG_TREE, MERKLE_ROOT_SIZE };
+	uint64_t root = 0;
+	int iov_count = with_root && header.message_size > 0 ? 3 : 1;
+	if (iov_count == 3 && file_root(filename, &statbuf, &root) == -1)
+	{
+		metrics_add(M_ERR_FILE_IO, 1);
+		log_errno_limited("Could not compute the Merkle root of %s", filename);
+		return -1;
+	}
+
 	// send the 'initial reply' header to the client
-	if (write(socket_fd, (void*) &header, sizeof(message_header)) == -1)
+	struct iovec iov[3] = {
+		{ &header, sizeof(message_header) },
+		{ &root_header, sizeof(message_header) },
+		{ &root, MERKLE_ROOT_SIZE }
+	};
+	if (writev_full(socket_fd, iov, iov_count) == -1)
 	{
-		perror("Error informing client: ");
+		metrics_add(M_ERR_SEND, 1);
+		log_errno_limited("Error informing client");
 		return -1;
 	}
 	return header.message_size;
 }
 
 /*
- *	Sends the file to the client
- *	The file will be sent in BLKSIZE bytes wide segments.
- * 	For each segment, a checksum will be attached to the payload.
- *  Message format: <header><payload><1 byte checksum>.
- *	Returns 0 on success and -1 on error.
+ *	Returns the checksum byte of a segment.
  */
-int send_file(int socket_fd, const char* filename, uint32_t filesize)
+static char segment_checksum(const char* data, uint32_t len)
 {
-	uint32_t sent_size = 0;
-	message_header header;
-	char* buffer = NULL;
+	int checksum = 0;
+	for (uint32_t i = 0; i < len; i++)
+	{
+		checksum += (int) data[i];
+	}
+	return (char) (checksum % DIVISOR);
+}
 
-	// open the requested file
-	FILE* file = fopen(filename, "r");
-	if (file == NULL)
+// consecutive segments of a file, checksummed by one task of checksum_pool
+typedef struct
+{
+	task job;
+	const char* data;
+	char* copy; // < io_pool buffer holding data, NULL when data points into the mapping
+	uint32_t len;
+	uint32_t block_size;
+	char checksums[CHECKSUM_BATCH_SEGMENTS];
+} checksum_batch;
+
+static void checksum_batch_run(task* job)
+{
+	checksum_batch* batch = (checksum_batch*) job;
+	uint64_t start = metrics_now_ns();
+	for (uint32_t offset = 0, i = 0; offset < batch->len; offset += batch->block_size, i++)
 	{
-		fprintf(stderr, "Could not open requested file.\n");
+		uint32_t len = batch->len - offset < batch->block_size ? batch->len - offset : batch->block_size;
+		batch->checksums[i] = segment_checksum(batch->data + offset, len);
+	}
+	metrics_observe(M_CHECKSUM, metrics_now_ns() - start);
+}
+
+/*
+ *	Points batch at the next len bytes of source: into the mapping if it hands them out
+ *		in one piece, otherwise copied into an io_pool buffer, since read buffers are reused.
+ *	Returns 0 on success, -1 on error.
+ */
+static int fill_batch(checksum_batch* batch, file_source* source, uint32_t len)
+{
+	const char* data = NULL;
+	ssize_t read_size = source_next(source, len, &data);
+	batch->copy = NULL;
+	batch->len = len;
+	if (read_size <= 0)
+	{
+		// the end of the file before len bytes: it shrank since the initial reply
+		errno = read_size == 0 ? EIO : errno;
 		return -1;
 	}
+	if ((uint32_t) read_size == len && source->mode == SOURCE_MMAP)
+	{
+		batch->data = data;
+		return 0;
+	}
 
-	// allocate the output buffer
-	buffer = (char*) calloc(BLKSIZE+1, sizeof(char));
-	if (buffer == NULL)
+	batch->copy = (char*) pool_get(io_pool);
+	if (batch->copy == NULL)
 	{
 		errno = ENOMEM;
-		perror("Not enough memory for output buffer: ");
 		return -1;
 	}
-
-	// send the file in blocks
-	while (sent_size < filesize)
+	memcpy(batch->copy, data, read_size);
+	for (uint32_t filled = read_size; filled < len; filled += read_size)
 	{
-		// read a block from the file
-		ssize_t read_size = fread(buffer, sizeof(char), BLKSIZE, file);
-		if (read_size < BLKSIZE && !feof(file))
-		{
-			// filestream error
-			fclose(file);
-			free(buffer);
-			return -1;
-		}
-		header.message_type = 'f';
-		header.message_size = read_size;
-
-		// send the message header to the client
-		if (write(socket_fd, &header, sizeof(message_header)) == -1)
-		{
-			perror("eroare scriere header: ");
-			fclose(file);
-			free(buffer);
-			return -1;
-		}
-
-		// compute checksum for the current block
-		int checksum = 0;
-		for(int i=0; i<read_size; i++){
-			checksum += (int) buffer[i];
-		}
-		checksum = checksum % DIVISOR;
-
-		// append checksum to buffer
-		buffer[read_size] = (char) checksum;
-
-		// send the buffer to the client
-		if (write(socket_fd, buffer, read_size+1) == -1)
+		if ((read_size = source_next(source, len - filled, &data)) <= 0)
 		{
-			perror("eroare scriere continut fisier: ");
-			fclose(file);
-			free(buffer);
+			errno = read_size == 0 ? EIO : errno;
+			pool_put(io_pool, batch->copy);
+			batch->copy = NULL;
 			return -1;
 		}
-
-		sent_size += read_size;
+		memcpy(batch->copy + filled, data, read_size);
 	}
-
-	fclose(file);
-	free(buffer);
-
+	batch->data = batch->copy;
 	return 0;
 }
 
-int main(int argc, char* argv[])
+static void release_batch(checksum_batch* batch)
 {
-	
-	int socket_fd = init_server();
-	if (socket_fd == -1)
+	if (batch->copy != NULL)
 	{
-		exit(EXIT_FAILURE);
+		pool_put(io_pool, batch->copy);
+		batch->copy = NULL;
 	}
+}
 
-	while(1){
-		int client_socket_fd = await_client_connection(socket_fd);
-		if (client_socket_fd == -1)
+/*
+ *	The segment loop of send_file() with the checksums computed by checksum_pool:
+ *		up to CHECKSUM_WINDOW batches are queued ahead, any core may checksum them,
+ *		and they leave in file order, each batch in one writev().
+ *	The window bounds the memory and the work queued by one transfer.
+ *	Returns 0 on success and -1 on error.
+ */
+static int send_batches(int socket_fd, file_source* source, const char* filename, uint32_t filesize,
+	uint64_t request_ns, uint64_t start, const server_config* config, connection* conn)
+{
+	uint32_t block_size = (uint32_t) config->block_size;
+	uint32_t segments = CHECKSUM_BATCH / block_size;
+	segments = segments < 1 ? 1 : segments > CHECKSUM_BATCH_SEGMENTS ? CHECKSUM_BATCH_SEGMENTS : segments;
+	uint32_t batch_len = segments * block_size;
+
+	checksum_batch window[CHECKSUM_WINDOW];
+	message_header headers[CHECKSUM_BATCH_SEGMENTS];
+	struct iovec iov[3 * CHECKSUM_BATCH_SEGMENTS];
+	int oldest = 0, queued = 0, ret_val = 0;
+	uint32_t queued_size = 0, sent_size = 0;
+	while (sent_size < filesize && ret_val == 0)
+	{
+		// keep the window full, the helpers checksum ahead of the socket
+		while (queued < CHECKSUM_WINDOW && queued_size < filesize)
 		{
-			exit(EXIT_FAILURE);
+			checksum_batch* batch = &window[(oldest + queued) % CHECKSUM_WINDOW];
+			uint32_t len = filesize - queued_size < batch_len ? filesize - queued_size : batch_len;
+			if (fill_batch(batch, source, len) == -1)
+			{
+				// read error, or the file shrank since the initial reply
+				metrics_add(M_ERR_FILE_IO, 1);
+				log_errno_limited("Error reading %s", filename);
+				ret_val = -1;
+				break;
+			}
+			batch->block_size = block_size;
+			task_init(&batch->job, checksum_batch_run);
+			taskpool_submit(checksum_pool, &batch->job);
+			queued++;
+			queued_size += len;
 		}
-
-		// see what file the client needs
-		char* requested_filename = accept_file_request(client_socket_fd);
-		if (requested_filename == NULL)
+		if (queued == 0)
 		{
-			close(client_socket_fd);
-			close(socket_fd);
-			exit(EXIT_FAILURE);
+			break;
 		}
 
-		printf("Requested file: %s\n", requested_filename);
-
-		int ret_val = check_if_file_exist(client_socket_fd, requested_filename);
-		if (ret_val == -1)
+		checksum_batch* batch = &window[oldest];
+		taskpool_wait(checksum_pool, &batch->job);
+		if (ret_val == 0 && source_check(source) == -1)
 		{
-			free(requested_filename);
-			close(client_socket_fd);
-			close(socket_fd);
-			exit(EXIT_FAILURE);
+			// the file was truncated under its mapping, the batch holds zeros
+			metrics_add(M_ERR_FILE_IO, 1);
+			log_errno_limited("Error reading %s", filename);
+			ret_val = -1;
+		}
+		int count = 0;
+		for (uint32_t offset = 0; offset < batch->len; offset += block_size, count++)
+		{
+			uint32_t len = batch->len - offset < block_size ? batch->len - offset : block_size;
+			headers[count].message_type = 'f';
+			headers[count].message_size = len;
+			iov[3 * count] = (struct iovec) { &headers[count], sizeof(message_header) };
+			iov[3 * count + 1] = (struct iovec) { (void*) (batch->data + offset), len };
+			iov[3 * count + 2] = (struct iovec) { &batch->checksums[count], 1 };
+		}
+		if (ret_val == 0 && writev_full(socket_fd, iov, 3 * count) == -1)
+		{
+			metrics_add(M_ERR_SEND, 1);
+			log_errno_limited("eroare scriere continut fisier");
+			ret_val = -1;
+		}
+		else if (ret_val == 0)
+		{
+			if (sent_size == 0)
+			{
+				metrics_observe(M_TTFB, metrics_now_ns() - request_ns);
+			}
+			sent_size += batch->len;
+			metrics_add(M_BYTES_SENT, batch->len);
+			conn_progress(conn, batch->len);
+			throttle(config->rate_limit, start, sent_size);
 		}
+		release_batch(batch);
+		oldest = (oldest + 1) % CHECKSUM_WINDOW;
+		queued--;
+	}
+
+	// the helpers may still be working on the batches after an error
+	for (; queued > 0; queued--)
+	{
+		taskpool_wait(checksum_pool, &window[oldest].job);
+		release_batch(&window[oldest]);
+		oldest = (oldest + 1) % CHECKSUM_WINDOW;
+	}
+	return ret_val;
+}
+
+/*
+ *	Sends the file to the client
+ *	The file will be sent in config->block_size bytes wide segments.
+ * 	For each segment, a checksum will be attached to the payload.
+ *  Message format: <header><payload><1 byte checksum>.
+ *	Segments come from a read buffer or, in the mmap and sendfile modes, straight from
+ *		the shared mapping of the file, and each one leaves in a single writev().
+ *	With a checksum pool, files of more than one batch go through send_batches() instead.
+ *	request_ns is when the request was read, used for the time to first byte.
+ *	The progress is recorded in conn, for its deadlines.
+ *	Returns 0 on success and -1 on error.
+ */
+int send_file(int socket_fd, const char* filename, uint32_t filesize, uint64_t request_ns, const server_config* config, connection* conn)
+{
+	uint32_t sent_size = 0;
+	message_header header;
+	uint64_t start = metrics_now_ns();
+	uint32_t block_size = (uint32_t) config->block_size;
+
+	// open the requested file
+	file_source source;
+	if (source_open(&source, filename, config->mode == SERVE_READ ? SOURCE_READ : SOURCE_MMAP, io_pool) == -1)
+	{
+		metrics_add(M_ERR_FILE_IO, 1);
+		log_errno_limited("Could not open requested file %s", filename);
+		return -1;
+	}
+
+	if (checksum_pool != NULL && filesize > CHECKSUM_BATCH && block_size <= config->io_buffer_size)
+	{
+		int ret_val = send_batches(socket_fd, &source, filename, filesize, request_ns, start, config, conn);
+		source_close(&source);
 		if (ret_val == 0)
 		{
-			// file does not exist, do nothing?
+			metrics_add(M_FILES_SENT, 1);
+			metrics_observe(M_TRANSFER, metrics_now_ns() - start);
+		}
+		return ret_val;
+	}
+
+	// send the file in blocks
+	while (sent_size < filesize)
+	{
+		const char* data = NULL;
+		ssize_t read_size = source_next(&source, filesize - sent_size < block_size ? filesize - sent_size : block_size, &data);
+		if (read_size <= 0)
+		{
+			// read error, or the file shrank since the initial reply
+			errno = read_size == 0 ? EIO : errno;
+			metrics_add(M_ERR_FILE_IO, 1);
+			log_errno_limited("Error reading %s", filename);
+			source_close(&source);
+			return -1;
+		}
+		header.message_type = 'f';
+		header.message_size = read_size;
+
+		// compute checksum for the current block
+		uint64_t checksum_start = metrics_now_ns();
+		char checksum_byte = segment_checksum(data, read_size);
+		metrics_observe(M_CHECKSUM, metrics_now_ns() - checksum_start);
+		if (source_check(&source) == -1)
+		{
+			metrics_add(M_ERR_FILE_IO, 1);
+			log_errno_limited("Error reading %s", filename);
+			source_close(&source);
+			return -1;
+		}
+
+		// send header, payload and checksum to the client
+		struct iovec iov[3] = {
+			{ &header, sizeof(message_header) },
+			{ (void*) data, read_size },
+			{ &checksum_byte, 1 }
+		};
+		if (writev_full(socket_fd, iov, 3) == -1)
+		{
+			metrics_add(M_ERR_SEND, 1);
+			log_errno_limited("eroare scriere continut fisier");
+			source_close(&source);
+			return -1;
+		}
+
+		if (sent_size == 0)
+		{
+			metrics_observe(M_TTFB, metrics_now_ns() - request_ns);
+		}
+
+		sent_size += read_size;
+		metrics_add(M_BYTES_SENT, read_size);
+		conn_progress(conn, read_size);
+		throttle(config->rate_limit, start, sent_size);
+	}
+
+	source_close(&source);
+
+	metrics_add(M_FILES_SENT, 1);
+	metrics_observe(M_TRANSFER, metrics_now_ns() - start);
+	return 0;
+}
+
+/*
+ *	Streams the file to the client without per-segment framing,
+ *		so the client can splice it straight into its output file.
+ *	Integrity is covered by a digest of the whole file sent after the data, or without
+ *		trailer by the Merkle root sent with the initial reply.
+ *	In the sendfile mode the digest is computed from the mapping and the data
+ *		goes from the page cache to the socket without passing through the server.
+ *  Message format: <filesize bytes of file><header 'z', DIGEST_TRAILER_SIZE><digest>.
+ *	Returns 0 on success and -1 on error.
+ */
+int send_file_stream(int socket_fd, const char* filename, uint32_t filesize, uint64_t request_ns, bool trailer,
+	const server_config* config, connection* conn)
+{
+	uint32_t sent_size = 0;
+	uint64_t start = metrics_now_ns();
+
+	file_source source;
+	if (source_open(&source, filename, config->mode == SERVE_READ ? SOURCE_READ : SOURCE_MMAP, io_pool) == -1)
+	{
+		metrics_add(M_ERR_FILE_IO, 1);
+		log_errno_limited("Could not open requested file %s", filename);
+		return -1;
+	}
+
+	digest_state digest;
+	digest_init(&digest, 0);
+	while (sent_size < filesize)
+	{
+		const char* data = NULL;
+		size_t len = filesize - sent_size < config->io_buffer_size ? filesize - sent_size : config->io_buffer_size;
+		ssize_t read_size = source_next(&source, len, &data);
+		if (read_size <= 0)
+		{
+			// read error, or the file shrank since the initial reply
+			errno = read_size == 0 ? EIO : errno;
+			metrics_add(M_ERR_FILE_IO, 1);
+			log_errno_limited("Error reading %s", filename);
+			source_close(&source);
+			return -1;
+		}
+
+		if (trailer)
+		{
+			uint64_t checksum_start = metrics_now_ns();
+			digest_update(&digest, data, read_size);
+			metrics_observe(M_CHECKSUM, metrics_now_ns() - checksum_start);
+		}
+		if (source_check(&source) == -1)
+		{
+			metrics_add(M_ERR_FILE_IO, 1);
+			log_errno_limited("Error reading %s", filename);
+			source_close(&source);
+			return -1;
+		}
+
+		int written = config->mode == SERVE_SENDFILE && source.mode == SOURCE_MMAP
+			? sendfile_full(socket_fd, source.fd, sent_size, read_size)
+			: write_full(socket_fd, data, read_size);
+		if (written == -1)
+		{
+			// sendfile() ends early on a file that shrank, write() never fails with EIO on a socket
+			metrics_add(errno == EIO ? M_ERR_FILE_IO : M_ERR_SEND, 1);
+			log_errno_limited(errno == EIO ? "Error reading %s" : "Error streaming %s", filename);
+			source_close(&source);
+			return -1;
+		}
+
+		if (sent_size == 0)
+		{
+			metrics_observe(M_TTFB, metrics_now_ns() - request_ns);
+		}
+
+		sent_size += read_size;
+		metrics_add(M_BYTES_SENT, read_size);
+		conn_progress(conn, read_size);
+		throttle(config->rate_limit, start, sent_size);
+	}
+	source_close(&source);
+	if (!trailer)
+	{
+		metrics_add(M_FILES_SENT, 1);
+		metrics_observe(M_TRANSFER, metrics_now_ns() - start);
+		return 0;
+	}
+
+	message_header header;
+	header.message_type = MSG_STREAM;
+	header.message_size = DIGEST_TRAILER_SIZE;
+	uint64_t value = digest_final(&digest);
+	struct iovec iov[2] = {
+		{ &header, sizeof(message_header) },
+		{ &value, DIGEST_TRAILER_SIZE }
+	};
+	if (writev_full(socket_fd, iov, 2) == -1)
+	{
+		metrics_add(M_ERR_SEND, 1);
+		log_errno_limited("Error sending digest of %s", filename);
+		return -1;
+	}
+
+	metrics_add(M_FILES_SENT, 1);
+	metrics_observe(M_TRANSFER, metrics_now_ns() - start);
+	return 0;
+}
+
+/*
+ *	Opens the comma separated pack archives of list, each standing for the directory
+ *		of its name without ".pack".
+ *	Returns 0 on success, -1 on error.
+ */
+static int mount_packs(const char* list)
+{
+	char copy[PATH_MAX];
+	snprintf(copy, sizeof(copy), "%s", list);
+	char* save = NULL;
+	for (char* name = strtok_r(copy, ",", &save); name != NULL; name = strtok_r(NULL, ",", &save))
+	{
+		size_t len = strlen(name);
+		if (pack_count == MAX_PACKS || len <= 5 || strcmp(name + len - 5, ".pack") != 0 || !valid_file_name(name))
+		{
+			log_error("Invalid pack archive %s (at most %d, named NAME.pack below the root)", name, MAX_PACKS);
+			return -1;
+		}
+		mounted_pack* mounted = &packs[pack_count];
+		if ((mounted->archive = pack_open(name)) == NULL)
+		{
+			log_errno("Could not open the pack archive %s", name);
+			return -1;
+		}
+		mounted->mount_len = len - 5;
+		memcpy(mounted->mount, name, mounted->mount_len);
+		mounted->mount[mounted->mount_len] = '\0';
+		log_info("Serving %llu files of %s as %s/", (unsigned long long) mounted->archive->count, name, mounted->mount);
+		pack_count++;
+	}
+	return 0;
+}
+
+/*
+ *	Returns the pack entry filename stands for, with its archive in *archive, or NULL.
+ */
+static const pack_entry* find_packed(const char* filename, const pack** archive)
+{
+	for (int i = 0; i < pack_count; i++)
+	{
+		if (strncmp(filename, packs[i].mount, packs[i].mount_len) == 0 && filename[packs[i].mount_len] == '/')
+		{
+			*archive = packs[i].archive;
+			return pack_find(packs[i].archive, filename + packs[i].mount_len + 1);
+		}
+	}
+	return NULL;
+}
+
+/*
+ *	Answers a file request for an entry of a pack archive like one for a loose file
+ *		of the same contents: framed segments from the mapping, or streams sent from
+ *		the archive with sendfile() at the offset of the entry. No descriptor can be
+ *		passed for an entry, a descriptor request gets the reply of a missing file.
+ *		Errors name the requested file, the names of a truncated archive read as zeros.
+ *	Returns 0 on success and -1 on error.
+ */
+static int send_packed(int socket_fd, char type, const char* filename, const pack* archive, const pack_entry* entry,
+	uint64_t request_ns, const server_config* config, connection* conn)
+{
+	uint64_t start = metrics_now_ns();
+	const char* data = archive->data + entry->offset;
+	uint32_t filesize = entry->size <= UINT32_MAX && type != MSG_FD ? (uint32_t) entry->size : 0;
+	message_header header = { type == MSG_FD ? MSG_FD : MSG_FILE, filesize };
+	message_header root_header = { MSG_TREE, MERKLE_ROOT_SIZE };
+	uint64_t root = entry->root;
+	struct iovec iov[3] = {
+		{ &header, sizeof(message_header) },
+		{ &root_header, sizeof(message_header) },
+		{ &root, MERKLE_ROOT_SIZE }
+	};
+	if (writev_full(socket_fd, iov, type == MSG_TREE && filesize > 0 ? 3 : 1) == -1)
+	{
+		metrics_add(M_ERR_SEND, 1);
+		log_errno_limited("Error answering a request for %s", filename);
+		return -1;
+	}
+	if (filesize == 0)
+	{
+		return 0;
+	}
+	metrics_add(M_PACK_FILES, 1);
+
+	int ret_val = 0;
+	bool read_failed = false;
+	bool stream = type == MSG_STREAM || type == MSG_TREE;
+	uint32_t chunk_size = stream ? (uint32_t) config->io_buffer_size : (uint32_t) config->block_size;
+	for (uint32_t sent_size = 0; ret_val == 0 && sent_size < filesize; )
+	{
+		uint32_t len = filesize - sent_size < chunk_size ? filesize - sent_size : chunk_size;
+		if (stream)
+		{
+			ret_val = sendfile_full(socket_fd, archive->fd, entry->offset + sent_size, len);
+			read_failed = ret_val == -1 && errno == EIO;
 		}
 		else
 		{
-			// file exists, call sending function
-			if (send_file(client_socket_fd, requested_filename, ret_val) == -1)
+			char checksum_byte = segment_checksum(data + sent_size, len);
+			if (pack_check(archive) == -1)
 			{
-				fprintf(stderr, "File not properly sent.\n");
+				read_failed = true;
+				break;
 			}
+			header = (message_header) { MSG_FILE, len };
+			struct iovec segment[3] = {
+				{ &header, sizeof(message_header) },
+				{ (void*) (data + sent_size), len },
+				{ &checksum_byte, 1 }
+			};
+			ret_val = writev_full(socket_fd, segment, 3);
+		}
+		if (ret_val == -1)
+		{
+			break;
+		}
+		if (sent_size == 0)
+		{
+			metrics_observe(M_TTFB, metrics_now_ns() - request_ns);
 		}
+		sent_size += len;
+		metrics_add(M_BYTES_SENT, len);
+		conn_progress(conn, len);
+		throttle(config->rate_limit, start, sent_size);
+	}
+	if (ret_val == 0 && !read_failed && type == MSG_STREAM)
+	{
+		uint64_t checksum_start = metrics_now_ns();
+		uint64_t value = digest_buffer(data, filesize, 0);
+		metrics_observe(M_CHECKSUM, metrics_now_ns() - checksum_start);
+		header = (message_header) { MSG_STREAM, DIGEST_TRAILER_SIZE };
+		iov[1] = (struct iovec) { &value, DIGEST_TRAILER_SIZE };
+		read_failed = pack_check(archive) == -1;
+		ret_val = read_failed ? -1 : writev_full(socket_fd, iov, 2);
+	}
+	if (read_failed)
+	{
+		metrics_add(M_ERR_FILE_IO, 1);
+		log_errno_limited("Error reading %s", filename);
+		return -1;
+	}
+	if (ret_val == -1)
+	{
+		metrics_add(M_ERR_SEND, 1);
+		log_errno_limited("Error sending %s", filename);
+		return -1;
+	}
 
-		free(requested_filename);
-		close(client_socket_fd);
+	metrics_add(M_FILES_SENT, 1);
+	metrics_observe(M_TRANSFER, metrics_now_ns() - start);
+	return 0;
+}
+
+/*
+ *	Answers a file descriptor request from a same-host client.
+ *	The reply header carries the file size (0 if the file does not exist) and,
+ *		for an existing file, the open file descriptor as SCM_RIGHTS ancillary data,
+ *		so the client reads the file directly instead of through the socket.
+ *	A file over UINT32_MAX bytes is refused without reply, see check_if_file_exist().
+ *	Returns 0 on success and -1 on error.
+ */
+int send_file_descriptor(int socket_fd, const char* filename)
+{
+	message_header header;
+	header.message_type = MSG_FD;
+	header.message_size = 0;
+
+	struct stat statbuf;
+	uint64_t stat_start = metrics_now_ns();
+	int file_fd = open(filename, O_RDONLY | O_CLOEXEC);
+	if (file_fd != -1 && fstat(file_fd, &statbuf) == 0 && S_ISREG(statbuf.st_mode))
+	{
+		if ((uint64_t) statbuf.st_size > UINT32_MAX)
+		{
+			// the size would wrap in message_size, refused like a file request for it
+			metrics_add(M_ERR_TOO_LARGE, 1);
+			log_error_limited("%s is too large to pass (%lld bytes, at most %u)", filename, (long long) statbuf.st_size, UINT32_MAX);
+			close(file_fd);
+			return -1;
+		}
+		header.message_size = statbuf.st_size;
+	}
+	metrics_observe(M_STAT, metrics_now_ns() - stat_start);
+
+	struct iovec iov = { &header, sizeof(message_header) };
+	union
+	{
+		char buffer[CMSG_SPACE(sizeof(int))];
+		struct cmsghdr align;
+	} control;
+	struct msghdr msg;
+	bzero(&msg, sizeof(msg));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+
+	if (header.message_size > 0)
+	{
+		msg.msg_control = control.buffer;
+		msg.msg_controllen = sizeof(control.buffer);
+		struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+		cmsg->cmsg_level = SOL_SOCKET;
+		cmsg->cmsg_type = SCM_RIGHTS;
+		cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+		memcpy(CMSG_DATA(cmsg), &file_fd, sizeof(int));
+	}
+	else
+	{
+		metrics_add(M_ERR_NOT_FOUND, 1);
+		log_info("file does not exist: %s", filename);
+	}
+
+	int ret_val = 0;
+	if (sendmsg(socket_fd, &msg, 0) == -1)
+	{
+		metrics_add(M_ERR_SEND, 1);
+		log_errno_limited("Error passing file descriptor");
+		ret_val = -1;
+	}
+	else if (header.message_size > 0)
+	{
+		metrics_add(M_FDS_PASSED, 1);
+	}
+
+	// the client holds its own reference now
+	if (file_fd != -1)
+	{
+		close(file_fd);
+	}
+	return ret_val;
+}
+
+/*
+ *	Replies to a metrics request with the Prometheus text rendering of the metrics.
+ *	Returns 0 on success and -1 on error.
+ */
+int send_metrics(int socket_fd)
+{
+	size_t len = 0;
+	char* text = metrics_render(&len);
+	if (text == NULL)
+	{
+		log_error_limited("Could not render metrics.");
+		return -1;
+	}
+
+	message_header header;
+	header.message_type = MSG_METRICS;
+	header.message_size = len;
+	struct iovec iov[2] = {
+		{ &header, sizeof(message_header) },
+		{ text, len }
+	};
+	if (writev_full(socket_fd, iov, 2) == -1)
+	{
+		metrics_add(M_ERR_SEND, 1);
+		log_errno_limited("Error sending metrics");
+		free(text);
+		return -1;
+	}
+
+	free(text);
+	return 0;
+}
+
+/*
+ *	Reads the query_request and the names that follow a metadata query header
+ *		into the connection arena: one name of at most max_name_size bytes,
+ *		MAX_BULK_NAMES for a bulk stat.
+ *	Returns the names, one after the other, NULL on error.
+ */
+static char* read_query(int socket_fd, const message_header* header, arena* conn_arena, uint64_t max_name_size, query_request* query)
+{
+	uint64_t max_size = sizeof(query_request) + (header->message_type == MSG_BULK_STAT ? MAX_BULK_NAMES : 1) * (max_name_size + 1);
+	if (header->message_size < sizeof(query_request) || header->message_size > max_size)
+	{
+		log_error_limited("Query of invalid size.");
+		return NULL;
+	}
+
+	// plus a terminator in case the client did not send one
+	size_t names_size = header->message_size - sizeof(query_request);
+	char* names = (char*) arena_alloc(conn_arena, names_size + 1);
+	if (names == NULL)
+	{
+		errno = ENOMEM;
+		log_errno_limited("Error making space for the query");
+		return NULL;
+	}
+	if (read_full(socket_fd, query, sizeof(query_request)) <= 0 || (names_size > 0 && read_full(socket_fd, names, names_size) <= 0))
+	{
+		log_errno_limited("Error reading the query from socket");
+		return NULL;
+	}
+	names[names_size] = '\0';
+	return names;
+}
+
+/*
+ *	Describes the file name, known from st, in info. The digest of a regular file
+ *		comes from the root cache, or is computed on a miss with QUERY_DIGEST.
+ */
+static void fill_info(file_info* info, const char* name, const struct stat* st, uint32_t flags)
+{
+	memset(info, 0, sizeof(file_info));
+	info->type = S_ISDIR(st->st_mode) ? INFO_DIRECTORY : INFO_FILE;
+	info->size = S_ISREG(st->st_mode) ? st->st_size : 0;
+	info->mtime_ns = (int64_t) st->st_mtim.tv_sec * 1000000000 + st->st_mtim.tv_nsec;
+	uint64_t root;
+	if (S_ISREG(st->st_mode) && ((flags & QUERY_DIGEST) ? file_root(name, st, &root) == 0 : cached_root(name, st, &root)))
+	{
+		info->digest = root;
+		info->has_digest = 1;
+	}
+}
+
+/*
+ *	Describes the file name in info, INFO_MISSING if it is neither in the catalog nor in the directory index.
+ */
+static void stat_name(file_info* info, const char* name, uint32_t flags, const server_config* config)
+{
+	struct stat st;
+	memset(info, 0, sizeof(file_info));
+	if (valid_file_name(name) && (catalog_stat(name, &st) == 0
+		|| dirindex_stat(name, (uint64_t) config->index_ttl_ms * 1000000, config->index_max_directories, &st) == 0))
+	{
+		fill_info(info, name, &st, flags);
+	}
+}
+
+/*
+ *	Builds a page of the listing of the directory name, "" for the document root, in the arena.
+ *	Returns the reply (*size bytes, 0 if there is no such directory), NULL on error.
+ */
+static const char* list_directory(const char* name, const query_request* query, arena* conn_arena, const server_config* config, size_t* size)
+{
+	*size = 0;
+	const char* path = name[0] == '\0' ? "." : name;
+	if (name[0] != '\0' && !valid_file_name(name))
+	{
+		return "";
+	}
+	dir_index* index = dirindex_get(path, (uint64_t) config->index_ttl_ms * 1000000, config->index_max_directories);
+	if (index == NULL)
+	{
+		return errno == ENOENT || errno == ENOTDIR ? "" : NULL;
+	}
+
+	uint32_t first = query->offset < (uint32_t) index->count ? query->offset : (uint32_t) index->count;
+	uint32_t limit = query->count > 0 && query->count < (uint32_t) config->index_page_size ? query->count : (uint32_t) config->index_page_size;
+	uint32_t count = index->count - first < limit ? index->count - first : limit;
+	*size = sizeof(list_reply);
+	for (uint32_t i = first; i < first + count; i++)
+	{
+		*size += sizeof(file_info) + strlen(index->names + index->entries[i].name) + 1;
+	}
+	char* reply = (char*) arena_alloc(conn_arena, *size);
+	if (reply == NULL)
+	{
+		dirindex_put(index);
+		errno = ENOMEM;
+		return NULL;
+	}
+
+	list_reply head = { (uint32_t) index->count, count };
+	memcpy(reply, &head, sizeof(list_reply));
+	char* next = reply + sizeof(list_reply);
+	for (uint32_t i = first; i < first + count; i++)
+	{
+		const dir_entry* entry = &index->entries[i];
+		const char* entry_name = index->names + entry->name;
+		char entry_path[PATH_MAX];
+		snprintf(entry_path, sizeof(entry_path), "%s%s%s", name, name[0] != '\0' ? "/" : "", entry_name);
+		file_info info;
+		fill_info(&info, entry_path, &entry->st, query->flags);
+		memcpy(next, &info, sizeof(file_info));
+		next += sizeof(file_info);
+		size_t len = strlen(entry_name) + 1;
+		memcpy(next, entry_name, len);
+		next += len;
+	}
+	dirindex_put(index);
+	return reply;
+}
+
+/*
+ *	Answers a metadata query (stat, listing or bulk stat, see message.h).
+ *	Returns 0 on success and -1 on error.
+ */
+static int answer_query(int socket_fd, const message_header* request, const query_request* query, const char* names,
+	arena* conn_arena, const server_config* config)
+{
+	message_header header;
+	header.message_type = request->message_type;
+	const void* body = NULL;
+	size_t size = 0;
+	file_info single;
+	if (request->message_type == MSG_STAT)
+	{
+		stat_name(&single, names, query->flags, config);
+		body = &single;
+		size = sizeof(file_info);
+	}
+	else if (request->message_type == MSG_LIST)
+	{
+		if ((body = list_directory(names, query, conn_arena, config, &size)) == NULL)
+		{
+			metrics_add(M_ERR_STAT, 1);
+			log_errno_limited("Could not list %s", names);
+			return -1;
+		}
+	}
+	else
+	{
+		// the names follow each other, a name past the end of the query is an empty one
+		const char* end = names + request->message_size - sizeof(query_request);
+		file_info* infos = query->count <= MAX_BULK_NAMES ? (file_info*) arena_alloc(conn_arena, query->count * sizeof(file_info) + 1) : NULL;
+		if (infos == NULL)
+		{
+			metrics_add(M_ERR_BAD_REQUEST, 1);
+			log_error_limited("Bulk stat of %u names refused.", query->count);
+			return -1;
+		}
+		const char* name = names;
+		for (uint32_t i = 0; i < query->count; i++)
+		{
+			stat_name(&infos[i], name < end ? name : "", query->flags, config);
+			name += name < end ? strlen(name) + 1 : 0;
+		}
+		body = infos;
+		size = query->count * sizeof(file_info);
+	}
+
+	header.message_size = size;
+	struct iovec iov[2] = {
+		{ &header, sizeof(message_header) },
+		{ (void*) body, size }
+	};
+	if (writev_full(socket_fd, iov, size > 0 ? 2 : 1) == -1)
+	{
+		metrics_add(M_ERR_SEND, 1);
+		log_errno_limited("Error answering a query");
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ *	Sends one record of a changes reply: the change, its name and the data of a file.
+ *	A file that cannot be opened any more goes as a removal, its next change follows in a later sync.
+ *	Returns the bytes of file data sent, -1 on error.
+ */
+static int64_t send_change(int socket_fd, const catalog_change* change, const char* name)
+{
+	change_record record;
+	memset(&record, 0, sizeof(change_record));
+	record.generation = change->generation;
+	record.name_size = strlen(name) + 1;
+	struct stat st;
+	int fd = -1;
+	if (!change->removed && change->directory && catalog_stat(name, &st) == 0 && S_ISDIR(st.st_mode))
+	{
+		fill_info(&record.info, name, &st, 0);
+	}
+	else if (!change->removed && !change->directory
+		&& (fd = open(name, O_RDONLY | O_NOFOLLOW | O_CLOEXEC)) != -1 && fstat(fd, &st) == 0 && S_ISREG(st.st_mode))
+	{
+		// the size sent is the one of the file opened, its digest only if the catalog knows it already
+		uint64_t root;
+		record.info.type = INFO_FILE;
+		record.info.size = st.st_size;
+		record.info.mtime_ns = (int64_t) st.st_mtim.tv_sec * 1000000000 + st.st_mtim.tv_nsec;
+		record.info.has_digest = catalog_digest(name, &st, &root) == 0;
+		record.info.digest = record.info.has_digest ? root : 0;
+	}
+	metrics_add(record.info.type == INFO_FILE ? M_SYNC_FILES : record.info.type == INFO_DIRECTORY ? M_SYNC_DIRECTORIES : M_SYNC_REMOVALS, 1);
+
+	struct iovec iov[2] = {
+		{ &record, sizeof(change_record) },
+		{ (void*) name, record.name_size }
+	};
+	if (writev_full(socket_fd, iov, 2) == -1
+		|| (record.info.type == INFO_FILE && record.info.size > 0 && sendfile_full(socket_fd, fd, 0, record.info.size) == -1))
+	{
+		metrics_add(M_ERR_SEND, 1);
+		log_errno_limited("Error sending the change of %s", name);
+		if (fd != -1)
+		{
+			close(fd);
+		}
+		return -1;
+	}
+	if (fd != -1)
+	{
+		close(fd);
+	}
+	return record.info.type == INFO_FILE ? (int64_t) record.info.size : 0;
+}
+
+/*
+ *	Answers a changes request (see message.h) from the change log of the catalog.
+ *	Returns 0 on success and -1 on error.
+ */
+static int send_changes(int socket_fd, const message_header* request, const server_config* config, connection* conn)
+{
+	changes_request query;
+	if (request->message_size != sizeof(changes_request) || read_full(socket_fd, &query, sizeof(changes_request)) <= 0)
+	{
+		metrics_add(M_ERR_BAD_REQUEST, 1);
+		log_error_limited("Invalid changes request.");
+		return -1;
+	}
+	conn_enter(conn, CONN_TRANSFER);
+
+	message_header header;
+	header.message_type = MSG_CHANGES;
+	header.message_size = 0;
+	catalog_changeset set;
+	if (catalog_changes(query.log_id, query.since, &set) == -1)
+	{
+		// no catalog, or not complete yet: the client tries again later
+		return write_full(socket_fd, &header, sizeof(message_header));
+	}
+
+	header.message_size = sizeof(changes_reply);
+	changes_reply reply = { set.log_id, set.generation, (uint32_t) set.count, set.complete ? 0 : CHANGES_RESET };
+	struct iovec iov[2] = {
+		{ &header, sizeof(message_header) },
+		{ &reply, sizeof(changes_reply) }
+	};
+	int ret_val = set.count > UINT32_MAX ? -1 : writev_full(socket_fd, iov, 2);
+
+	uint64_t start = metrics_now_ns(), sent = 0;
+	for (size_t i = 0; ret_val == 0 && i < set.count; i++)
+	{
+		int64_t data = send_change(socket_fd, &set.changes[i], set.names + set.changes[i].name);
+		if (data == -1)
+		{
+			ret_val = -1;
+			break;
+		}
+		sent += data;
+		metrics_add(M_BYTES_SENT, data);
+		conn_progress(conn, data + sizeof(change_record));
+		throttle(config->rate_limit, start, sent);
+	}
+	catalog_changes_free(&set);
+	return ret_val;
+}
+
+/*
+ *	Reads the range_request, the ranges and the file name of a range request into
+ *		the connection arena: at most MAX_RANGES ranges, a name of at most max_name_size bytes.
+ *	Returns the name, with the ranges in *ranges, NULL on error.
+ */
+static char* read_ranges(int socket_fd, const message_header* header, arena* conn_arena, uint64_t max_name_size,
+	byte_range** ranges, uint32_t* count)
+{
+	range_request request;
+	if (header->message_size < sizeof(range_request) || read_full(socket_fd, &request, sizeof(range_request)) <= 0
+		|| request.count == 0 || request.count > MAX_RANGES)
+	{
+		log_error_limited("Invalid range request.");
+		return NULL;
+	}
+	uint64_t ranges_size = request.count * sizeof(byte_range);
+	if (header->message_size <= sizeof(range_request) + ranges_size
+		|| header->message_size > sizeof(range_request) + ranges_size + max_name_size + 1)
+	{
+		log_error_limited("Range request of invalid size.");
+		return NULL;
+	}
+
+	// plus a terminator in case the client did not send one
+	size_t name_size = header->message_size - sizeof(range_request) - ranges_size;
+	*ranges = (byte_range*) arena_alloc(conn_arena, ranges_size);
+	char* filename = (char*) arena_alloc(conn_arena, name_size + 1);
+	if (*ranges == NULL || filename == NULL)
+	{
+		errno = ENOMEM;
+		log_errno_limited("Error making space for the ranges");
+		return NULL;
+	}
+	if (read_full(socket_fd, *ranges, ranges_size) <= 0 || read_full(socket_fd, filename, name_size) <= 0)
+	{
+		log_errno_limited("Error reading the ranges from socket");
+		return NULL;
+	}
+	filename[name_size] = '\0';
+
+	if (!valid_file_name(filename))
+	{
+		log_error_limited("Requested name outside the document root: %s", filename);
+		return NULL;
+	}
+	*count = request.count;
+	return filename;
+}
+
+/*
+ *	Answers a range request for filename, loose or packed. Every range, cut at the end
+ *		of the file, goes out with sendfile() at its offset for a packed entry and in
+ *		sendfile mode, otherwise it is read with pread() into an io_pool buffer.
+ *	Returns 0 on success and -1 on error.
+ */
+static int send_ranges(int socket_fd, const char* filename, const byte_range* ranges, uint32_t count, uint64_t request_ns,
+	const server_config* config, connection* conn)
+{
+	message_header header = { MSG_RANGE, 0 };
+	range_reply reply;
+	memset(&reply, 0, sizeof(range_reply));
+	reply.count = count;
+
+	// a packed entry is a slice of its archive
+	struct stat st;
+	const pack* archive = NULL;
+	const pack_entry* packed = pack_count > 0 ? find_packed(filename, &archive) : NULL;
+	int fd = packed != NULL ? archive->fd : open(filename, O_RDONLY | O_CLOEXEC);
+	uint64_t base = packed != NULL ? packed->offset : 0;
+	if (fd == -1 || fstat(fd, &st) == -1 || !S_ISREG(st.st_mode))
+	{
+		if (fd != -1 && packed == NULL)
+		{
+			close(fd);
+		}
+		metrics_add(M_ERR_NOT_FOUND, 1);
+		log_info("file does not exist: %s", filename);
+		return write_full(socket_fd, &header, sizeof(message_header));
+	}
+	fill_info(&reply.info, filename, &st, 0);
+	if (packed != NULL)
+	{
+		reply.info.size = packed->size;
+		reply.info.digest = packed->root;
+		reply.info.has_digest = 1;
+	}
+
+	header.message_size = sizeof(range_reply);
+	struct iovec iov[2] = {
+		{ &header, sizeof(message_header) },
+		{ &reply, sizeof(range_reply) }
+	};
+	int ret_val = writev_full(socket_fd, iov, 2);
+	bool use_sendfile = packed != NULL || config->mode == SERVE_SENDFILE;
+	char* buffer = use_sendfile ? NULL : (char*) pool_get(io_pool);
+	size_t buffer_size = pool_buffer_size(io_pool);
+	if (!use_sendfile && buffer == NULL)
+	{
+		errno = ENOMEM;
+		ret_val = -1;
+	}
+
+	uint64_t size = reply.info.size, start = metrics_now_ns(), sent = 0;
+	bool read_failed = false;
+	for (uint32_t i = 0; ret_val == 0 && i < count; i++)
+	{
+		byte_range served;
+		if (ranges[i].offset < 0)
+		{
+			served.offset = (uint64_t) -(ranges[i].offset + 1) < size ? (int64_t) size + ranges[i].offset : 0;
+		}
+		else
+		{
+			served.offset = (uint64_t) ranges[i].offset < size ? ranges[i].offset : (int64_t) size;
+		}
+		served.length = ranges[i].length < size - served.offset ? ranges[i].length : size - served.offset;
+		ret_val = write_full(socket_fd, &served, sizeof(byte_range));
+
+		for (uint64_t done = 0; ret_val == 0 && done < served.length; )
+		{
+			uint64_t len = served.length - done < buffer_size ? served.length - done : buffer_size;
+			if (use_sendfile)
+			{
+				ret_val = sendfile_full(socket_fd, fd, base + served.offset + done, len);
+				if (ret_val == -1 && errno == EIO)
+				{
+					metrics_add(M_ERR_FILE_IO, 1);
+					log_errno_limited("Error reading ranges of %s", filename);
+					read_failed = true;
+				}
+			}
+			else
+			{
+				// a short read means the file shrank since the reply, the client sees the connection end
+				ssize_t read_size = pread(fd, buffer, len, served.offset + done);
+				if (read_size != (ssize_t) len)
+				{
+					if (read_size >= 0)
+					{
+						errno = EIO;
+					}
+					metrics_add(M_ERR_FILE_IO, 1);
+					log_errno_limited("Error reading ranges of %s", filename);
+					ret_val = -1;
+					read_failed = true;
+					break;
+				}
+				ret_val = write_full(socket_fd, buffer, len);
+			}
+			if (ret_val == -1)
+			{
+				break;
+			}
+			if (sent == 0)
+			{
+				metrics_observe(M_TTFB, metrics_now_ns() - request_ns);
+			}
+			done += len;
+			sent += len;
+			metrics_add(M_BYTES_SENT, len);
+			conn_progress(conn, len);
+			throttle(config->rate_limit, start, sent);
+		}
+		if (ret_val == 0)
+		{
+			metrics_add(M_RANGES, 1);
+		}
+	}
+
+	if (buffer != NULL)
+	{
+		pool_put(io_pool, buffer);
+	}
+	if (packed == NULL)
+	{
+		close(fd);
+	}
+	if (ret_val == -1 && !read_failed)
+	{
+		metrics_add(M_ERR_SEND, 1);
+		log_errno_limited("Error sending ranges of %s", filename);
+	}
+	return ret_val;
+}
+
+/*
+ *	Serves the request of an admitted client connection.
+ *	Errors only affect this client, the server keeps running.
+ */
+static void serve_request(int client_socket_fd, connection* conn, const server_config* config)
+{
+	message_header header;
+	if (read_request_header(client_socket_fd, &header) == -1)
+	{
+		metrics_add(M_ERR_BAD_REQUEST, 1);
+		return;
+	}
+	uint64_t request_ns = metrics_now_ns();
+
+	if (header.message_type == MSG_METRICS)
+	{
+		conn_enter(conn, CONN_TRANSFER);
+		send_metrics(client_socket_fd);
+		return;
+	}
+
+	// everything allocated for this connection goes away with it
+	arena conn_arena;
+	arena_init(&conn_arena, arena_pool);
+
+	if (header.message_type == MSG_STAT || header.message_type == MSG_LIST || header.message_type == MSG_BULK_STAT)
+	{
+		conn_enter(conn, CONN_REQUEST);
+		query_request query;
+		char* names = read_query(client_socket_fd, &header, &conn_arena, config->max_name_size, &query);
+		if (names == NULL)
+		{
+			metrics_add(M_ERR_BAD_REQUEST, 1);
+		}
+		else
+		{
+			conn_enter(conn, CONN_TRANSFER);
+			answer_query(client_socket_fd, &header, &query, names, &conn_arena, config);
+		}
+		arena_release(&conn_arena);
+		return;
+	}
+
+	if (header.message_type == MSG_CHANGES)
+	{
+		// many small records, sent in full segments
+		conn_enter(conn, CONN_REQUEST);
+		socket_cork(client_socket_fd, &config->socket, true);
+		send_changes(client_socket_fd, &header, config, conn);
+		socket_cork(client_socket_fd, &config->socket, false);
+		arena_release(&conn_arena);
+		return;
+	}
+
+	if (header.message_type == MSG_RANGE)
+	{
+		conn_enter(conn, CONN_REQUEST);
+		byte_range* ranges = NULL;
+		uint32_t count = 0;
+		char* filename = read_ranges(client_socket_fd, &header, &conn_arena, config->max_name_size, &ranges, &count);
+		if (filename == NULL)
+		{
+			metrics_add(M_ERR_BAD_REQUEST, 1);
+		}
+		else
+		{
+			conn_enter(conn, CONN_TRANSFER);
+			log_info("Requested %u ranges of %s", count, filename);
+			socket_cork(client_socket_fd, &config->socket, true);
+			send_ranges(client_socket_fd, filename, ranges, count, request_ns, config, conn);
+			socket_cork(client_socket_fd, &config->socket, false);
+		}
+		arena_release(&conn_arena);
+		return;
+	}
+
+	// see what file the client needs
+	conn_enter(conn, CONN_REQUEST);
+	char* requested_filename = accept_file_request(client_socket_fd, &header, &conn_arena, config->max_name_size);
+	if (requested_filename == NULL)
+	{
+		metrics_add(M_ERR_BAD_REQUEST, 1);
+		arena_release(&conn_arena);
+		return;
+	}
+	conn_enter(conn, CONN_TRANSFER);
+
+	log_info("Requested file: %s", requested_filename);
+
+	const pack* archive = NULL;
+	const pack_entry* packed = pack_count > 0 ? find_packed(requested_filename, &archive) : NULL;
+	if (packed != NULL)
+	{
+		socket_cork(client_socket_fd, &config->socket, true);
+		send_packed(client_socket_fd, header.message_type, requested_filename, archive, packed, request_ns, config, conn);
+		socket_cork(client_socket_fd, &config->socket, false);
+		arena_release(&conn_arena);
+		return;
+	}
+
+	if (header.message_type == MSG_FD)
+	{
+		// descriptors can only travel over a Unix domain socket
+		struct sockaddr_storage local;
+		socklen_t local_len = sizeof(local);
+		if (getsockname(client_socket_fd, (struct sockaddr*) &local, &local_len) == -1 || local.ss_family != AF_UNIX)
+		{
+			metrics_add(M_ERR_BAD_REQUEST, 1);
+			log_error_limited("File descriptor requested over a non Unix socket.");
+		}
+		else
+		{
+			send_file_descriptor(client_socket_fd, requested_filename);
+		}
+		arena_release(&conn_arena);
+		return;
+	}
+
+	// the reply header and the frames leave in full segments, see socket_cork()
+	socket_cork(client_socket_fd, &config->socket, true);
+	int64_t ret_val = check_if_file_exist(client_socket_fd, requested_filename, header.message_type == MSG_TREE);
+	if (ret_val > 0)
+	{
+		// file exists, call sending function
+		int sent = header.message_type == MSG_STREAM || header.message_type == MSG_TREE
+			? send_file_stream(client_socket_fd, requested_filename, (uint32_t) ret_val, request_ns, header.message_type == MSG_STREAM, config, conn)
+			: send_file(client_socket_fd, requested_filename, (uint32_t) ret_val, request_ns, config, conn);
+		if (sent == -1)
+		{
+			log_error_limited("File not properly sent: %s", requested_filename);
+		}
+	}
+	socket_cork(client_socket_fd, &config->socket, false);
+
+	arena_release(&conn_arena);
+}
+
+/*
+ *	Serves one request on an accepted client connection, then closes it.
+ *	The whole request uses the configuration current when it arrived.
+ *	A connection over the limits is closed right away, see admission.h.
+ */
+void handle_client(int client_socket_fd)
+{
+	const server_config* config = config_current();
+	connection conn;
+	if (conn_admit(&conn, client_socket_fd, config) == -1)
+	{
+		close(client_socket_fd);
+		return;
+	}
+	set_socket_options(client_socket_fd, config);
+
+	serve_request(client_socket_fd, &conn, config);
+
+	conn_release(&conn);
+	close(client_socket_fd);
+}
+
+static void* worker_main(void* arg)
+{
+	(void) arg;
+	if (checksum_pool != NULL && taskpool_attach(checksum_pool) == -1)
+	{
+		log_warn("Worker not attached to the checksum pool, it computes its checksums itself");
+	}
+	while (1)
+	{
+		int client_socket_fd = await_client_connection(listeners.fds, listeners.count);
+		if (client_socket_fd == -1 && atomic_load(&draining))
+		{
+			break;
+		}
+		if (client_socket_fd == -1)
+		{
+			exit(EXIT_FAILURE);
+		}
+
+		atomic_fetch_add(&active_connections, 1);
+		handle_client(client_socket_fd);
+		atomic_fetch_sub(&active_connections, 1);
+	}
+	atomic_fetch_sub(&running_workers, 1);
+	return NULL;
+}
+
+/*
+ *	Adds a listening socket to the set the workers accept from.
+ */
+static void add_listener(int socket_fd, const char* name)
+{
+	listeners.fds[listeners.count] = socket_fd;
+	snprintf(listeners.names[listeners.count], HANDOFF_NAME_SIZE, "%s", name);
+	listeners.count++;
+	log_info("Listening on %s", name);
+}
+
+/*
+ *	Takes the socket bound to name out of the set received from the previous process.
+ *	Returns its file descriptor, -1 if it did not have one.
+ */
+static int take_inherited(listener_set* inherited, const char* name)
+{
+	for (int i = 0; i < inherited->count; i++)
+	{
+		if (inherited->fds[i] != -1 && strcmp(inherited->names[i], name) == 0)
+		{
+			int socket_fd = inherited->fds[i];
+			inherited->fds[i] = -1;
+			return socket_fd;
+		}
+	}
+	return -1;
+}
+
+/*
+ *	Gives the listeners to the replacement server waiting on the control socket.
+ *	Returns true once it confirmed it accepts on them, false if this server goes on serving.
+ */
+static bool hand_over(int handoff_fd)
+{
+	int connection_fd = accept(handoff_fd, NULL, NULL);
+	if (connection_fd == -1)
+	{
+		log_errno("Error accepting a replacement server");
+		return false;
+	}
+
+	log_info("Replacement server connected, handing %d listeners over", listeners.count);
+	// saved first, the replacement loads it once it has the listeners
+	catalog_save();
+	int ret_val = handoff_send(connection_fd, &listeners);
+	close(connection_fd);
+	if (ret_val == -1)
+	{
+		log_errno("Handoff failed, still serving");
+		return false;
+	}
+	catalog_stop();
+	return true;
+}
+
+/*
+ *	Stops accepting, lets the transfers in progress finish (for at most
+ *		server.drain_timeout seconds) and exits.
+ *	The listeners stay open in the replacement, queued connections are not lost.
+ */
+static void drain_and_exit(void)
+{
+	atomic_store(&draining, true);
+	uint64_t one = 1;
+	if (write(stop_fd, &one, sizeof(one)) == -1)
+	{
+		log_errno("Could not stop the workers");
+	}
+
+	int timeout = config_current()->drain_timeout;
+	log_info("Listeners handed over, draining %d connections", atomic_load(&active_connections));
+	uint64_t deadline = metrics_now_ns() + (uint64_t) timeout * 1000000000ull;
+	while (atomic_load(&running_workers) > 0 && metrics_now_ns() < deadline)
+	{
+		struct timespec wait = { 0, DRAIN_POLL_NS };
+		nanosleep(&wait, NULL);
+	}
+
+	if (atomic_load(&running_workers) > 0)
+	{
+		log_warn("%d connections still running after %d s, closing them", atomic_load(&active_connections), timeout);
+	}
+	else
+	{
+		log_info("Drained, exiting");
+	}
+	exit(EXIT_SUCCESS);
+}
+
+/*
+ *	Hands the reloadable settings of config to the modules that keep their own copy.
+ */
+static void apply_config(const server_config* config)
+{
+	log_set_level(config->log_level);
+	source_set_readahead(config->readahead_max);
+	source_set_drop_threshold(config->drop_threshold);
+	source_set_direct(config->direct_threshold, direct_pool);
+	source_set_map_budget(config->map_budget);
+}
+
+/*
+ *	Reads the configuration again (SIGHUP) and publishes it for the next requests.
+ *	Transfers already running finish with the configuration they started with.
+ *	An invalid file changes nothing.
+ */
+static void reload_config(const char* path, const config_override* overrides, int override_count)
+{
+	server_config* next = (server_config*) malloc(sizeof(server_config));
+	if (next == NULL || config_load(next, path, overrides, override_count) == -1)
+	{
+		log_error("Configuration not reloaded, keeping the current one");
+		free(next);
+		return;
+	}
+	config_keep_restart_values(next, config_current());
+	apply_config(next);
+	config_publish(next);
+	log_info("Configuration reloaded, serving files with %s", serve_mode_names[next->mode]);
+}
+
+int main(int argc, char* argv[])
+{
+	// -c FILE reads the settings of a configuration file, the options below override them
+	// -b ADDRESSES listens on a comma separated list of host:port (listen.bind)
+	// -w WORKERS sets the number of worker threads (server.workers)
+	// -r DIR serves the files below DIR (server.root)
+	// -u PATH also listens on a Unix domain socket for same-host clients (listen.unix_socket)
+	// -M read|mmap|sendfile picks how file contents are sent (transfer.mode)
+	// -R SIZE caps the readahead window, 0 disables it (cache.readahead_max)
+	// -D SIZE drops files of at least SIZE from the page cache once sent, 0 never does (cache.drop_threshold)
+	// -O SIZE reads files of at least SIZE with O_DIRECT, 0 never does (cache.direct_threshold)
+	// -H PATH hands the listeners over to replacements connecting at PATH (listen.handoff_socket)
+	// -T takes the listeners over from the server running at listen.handoff_socket
+	// -o SECTION.KEY=VALUE sets any other setting
+	static const char* option_keys[128] = {
+		['b'] = "listen.bind", ['w'] = "server.workers", ['r'] = "server.root", ['u'] = "listen.unix_socket",
+		['M'] = "transfer.mode", ['R'] = "cache.readahead_max", ['D'] = "cache.drop_threshold", ['O'] = "cache.direct_threshold",
+		['H'] = "listen.handoff_socket"
+	};
+	const char* config_arg = NULL;
+	bool take_over = false;
+	config_override overrides[MAX_OVERRIDES];
+	int override_count = 0;
+
+	// log level and format come from the environment, e.g. PAD_LOG_LEVEL=debug PAD_LOG_FORMAT=json
+	const char* level_name = getenv("PAD_LOG_LEVEL");
+	if (level_name != NULL)
+	{
+		overrides[override_count++] = (config_override) { "server.log_level", level_name };
+	}
+
+	int opt;
+	while ((opt = getopt(argc, argv, "c:b:w:r:u:M:R:D:O:H:To:")) != -1)
+	{
+		if (opt == 'c' || opt == 'T')
+		{
+			config_arg = opt == 'c' ? optarg : config_arg;
+			take_over = take_over || opt == 'T';
+			continue;
+		}
+		char* equals = opt == 'o' ? strchr(optarg, '=') : NULL;
+		if (override_count == MAX_OVERRIDES || opt == '?' || (opt == 'o' && equals == NULL))
+		{
+			fprintf(stderr, "usage: server [-c CONFIG_FILE] [-b HOST:PORT,...] [-w WORKERS] [-r ROOT_DIR] [-u UNIX_SOCKET_PATH]\n"
+				"	[-M read|mmap|sendfile] [-R READAHEAD_MAX] [-D DROP_SIZE] [-O DIRECT_SIZE] [-H HANDOFF_SOCKET_PATH] [-T]\n"
+				"	[-o SECTION.KEY=VALUE]...\n");
+			exit(EXIT_FAILURE);
+		}
+		if (opt == 'o')
+		{
+			*equals = '\0';
+			overrides[override_count++] = (config_override) { optarg, equals + 1 };
+		}
+		else
+		{
+			overrides[override_count++] = (config_override) { option_keys[opt], optarg };
+		}
+	}
+
+	// SIGHUP is only read from a signalfd by the main thread, every other thread inherits the mask
+	sigset_t reload_signals;
+	sigemptyset(&reload_signals);
+	sigaddset(&reload_signals, SIGHUP);
+	pthread_sigmask(SIG_BLOCK, &reload_signals, NULL);
+
+	// a client that disconnects mid transfer must not kill the server
+	signal(SIGPIPE, SIG_IGN);
+	// nor a file truncated under its mapping
+	if (mapguard_init() == -1)
+	{
+		perror("Could not install the SIGBUS handler");
+		exit(EXIT_FAILURE);
+	}
+
+	const char* format_name = getenv("PAD_LOG_FORMAT");
+	int format = format_name != NULL ? log_parse_format(format_name) : LOG_TEXT;
+	if (format == -1)
+	{
+		fprintf(stderr, "Invalid PAD_LOG_FORMAT.\n");
+		exit(EXIT_FAILURE);
+	}
+	if (log_init(L_INFO, format, STDERR_FILENO) == -1)
+	{
+		fprintf(stderr, "Could not start the logger.\n");
+		exit(EXIT_FAILURE);
+	}
+
+	// reloads happen after the chdir to the document root
+	char config_path[PATH_MAX];
+	if (config_arg != NULL && realpath(config_arg, config_path) == NULL)
+	{
+		log_errno("Could not find the configuration file %s", config_arg);
+		exit(EXIT_FAILURE);
+	}
+	server_config* config = (server_config*) malloc(sizeof(server_config));
+	if (config == NULL || config_load(config, config_arg != NULL ? config_path : NULL, overrides, override_count) == -1)
+	{
+		exit(EXIT_FAILURE);
+	}
+
+	io_pool = pool_create("io", config->io_buffer_size, 32);
+	direct_pool = pool_create("direct", config->direct_buffer_size, DIRECT_BUFFERS);
+	arena_pool = pool_create("arena", ARENA_CHUNK_SIZE, 64);
+	if (io_pool == NULL || direct_pool == NULL || arena_pool == NULL)
+	{
+		log_error("Could not create the buffer pools.");
+		exit(EXIT_FAILURE);
+	}
+	metrics_register_collector(pool_write_metrics);
+	apply_config(config);
+	config_publish(config);
+
+	// a replacement accepts on the sockets of the running server, only new addresses are bound
+	listener_set inherited = { .count = 0 };
+	int handoff_connection = -1;
+	if (take_over && config->handoff_socket[0] == '\0')
+	{
+		log_error("-T needs listen.handoff_socket");
+		exit(EXIT_FAILURE);
+	}
+	if (take_over && (handoff_connection = handoff_request(config->handoff_socket, &inherited)) == -1)
+	{
+		log_errno("Could not take the listeners over from %s", config->handoff_socket);
+		exit(EXIT_FAILURE);
+	}
+
+	for (int i = 0; i < config->bind_count; i++)
+	{
+		int socket_fd = take_inherited(&inherited, config->binds[i]);
+		if (socket_fd == -1 && (socket_fd = init_server(config->binds[i], config)) == -1)
+		{
+			exit(EXIT_FAILURE);
+		}
+		add_listener(socket_fd, config->binds[i]);
+	}
+	if (config->unix_socket[0] != '\0')
+	{
+		int unix_fd = take_inherited(&inherited, config->unix_socket);
+		if (unix_fd == -1 && (unix_fd = init_unix_server(config->unix_socket, config->backlog)) == -1)
+		{
+			exit(EXIT_FAILURE);
+		}
+		add_listener(unix_fd, config->unix_socket);
+	}
+	for (int i = 0; i < inherited.count; i++)
+	{
+		if (inherited.fds[i] != -1)
+		{
+			log_warn("No longer listening on %s", inherited.names[i]);
+			close(inherited.fds[i]);
+		}
+	}
+
+	// a replacement binds the control socket once the handoff is confirmed, until then
+	// it is how the previous server gets handed over if this one fails to start
+	int handoff_fd = -1;
+	if (!take_over && config->handoff_socket[0] != '\0' && (handoff_fd = handoff_listen(config->handoff_socket)) == -1)
+	{
+		log_errno("Could not listen for replacements on %s", config->handoff_socket);
+		exit(EXIT_FAILURE);
+	}
+	int signal_fd = signalfd(-1, &reload_signals, SFD_CLOEXEC);
+	stop_fd = eventfd(0, EFD_CLOEXEC);
+	if (signal_fd == -1 || stop_fd == -1)
+	{
+		log_errno("Could not create the control descriptors");
+		exit(EXIT_FAILURE);
+	}
+
+	// requested names are resolved below the document root
+	if (chdir(config->root) == -1)
+	{
+		log_errno("Could not enter the document root %s", config->root);
+		exit(EXIT_FAILURE);
+	}
+	log_info("Serving files with %s, %d workers", serve_mode_names[config->mode], config->workers);
+
+	if (config->checksum_threads > 0)
+	{
+		checksum_pool = taskpool_create(config->checksum_threads, config->workers);
+		if (checksum_pool == NULL)
+		{
+			log_error("Could not start the checksum threads.");
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	if (config->pack_files[0] != '\0' && mount_packs(config->pack_files) == -1)
+	{
+		exit(EXIT_FAILURE);
+	}
+
+	if (config->catalog_enabled && catalog_start(config->catalog_file, config->catalog_walk_threads, config->catalog_save_interval) == -1)
+	{
+		log_errno("Could not start the catalog");
+		exit(EXIT_FAILURE);
+	}
+
+	if (admission_start() == -1)
+	{
+		log_errno("Could not start the connection timer thread");
+		exit(EXIT_FAILURE);
+	}
+
+	for (int i = 0; i < config->workers; i++)
+	{
+		pthread_t worker;
+		atomic_fetch_add(&running_workers, 1);
+		if (pthread_create(&worker, NULL, worker_main, NULL) != 0)
+		{
+			log_error("Could not start the worker threads.");
+			exit(EXIT_FAILURE);
+		}
+		pthread_detach(worker);
+	}
+
+	// the previous server stops accepting only now that the workers do
+	if (handoff_connection != -1)
+	{
+		if (handoff_confirm(handoff_connection) == -1)
+		{
+			log_errno("Could not confirm the handoff, the previous server keeps serving");
+			exit(EXIT_FAILURE);
+		}
+		log_info("Took %d listeners over from the previous server", inherited.count);
+		if ((handoff_fd = handoff_listen(config->handoff_socket)) == -1)
+		{
+			log_errno("Could not listen for replacements on %s", config->handoff_socket);
+		}
+	}
+
+	struct pollfd control[2] = {
+		{ signal_fd, POLLIN, 0 },
+		{ handoff_fd, POLLIN, 0 }
+	};
+	while(1){
+		if (poll(control, handoff_fd != -1 ? 2 : 1, -1) == -1)
+		{
+			continue;
+		}
+		struct signalfd_siginfo info;
+		if ((control[0].revents & POLLIN) && read(signal_fd, &info, sizeof(info)) == sizeof(info))
+		{
+			reload_config(config_arg != NULL ? config_path : NULL, overrides, override_count);
+		}
+		if ((control[1].revents & POLLIN) && hand_over(handoff_fd))
+		{
+			close(handoff_fd);
+			drain_and_exit();
+		}
 	}
-	close(socket_fd);
 	return 0;
 }
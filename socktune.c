@@ -0,0 +1,102 @@
+/**
+ *  socket tuning profiles, see socktune.h
+ */
+
+#include <string.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include "socktune.h"
+
+static const socket_profile profiles[] = {
+	{ .name = "default" },
+	{ .name = "lan-bulk", .send_buffer = 4 * 1024 * 1024, .receive_buffer = 4 * 1024 * 1024,
+		.congestion = "cubic", .cork = true },
+	{ .name = "wan-bulk", .notsent_lowat = 128 * 1024, .congestion = "bbr", .cork = true },
+	{ .name = "low-latency", .notsent_lowat = 16 * 1024, .busy_poll = 50, .nodelay = true },
+};
+
+#define PROFILE_COUNT ((int) (sizeof(profiles) / sizeof(profiles[0])))
+
+int socket_profile_load(socket_profile* profile, const char* name)
+{
+	for (int i = 0; i < PROFILE_COUNT; i++)
+	{
+		if (strcmp(profiles[i].name, name) == 0)
+		{
+			*profile = profiles[i];
+			return 0;
+		}
+	}
+	return -1;
+}
+
+/*
+ *	Sets one option, remembering the failure.
+ */
+static void set_option(int fd, int level, int name, const void* value, socklen_t len, const char* option, const char** failed, int* error)
+{
+	if (setsockopt(fd, level, name, value, len) == -1)
+	{
+		*failed = option;
+		*error = errno;
+	}
+}
+
+int socket_tune(int fd, const socket_profile* profile, const char** failed)
+{
+	int error = 0;
+	int value;
+	if (profile->send_buffer > 0)
+	{
+		value = (int) profile->send_buffer;
+		set_option(fd, SOL_SOCKET, SO_SNDBUF, &value, sizeof(value), "SO_SNDBUF", failed, &error);
+	}
+	if (profile->receive_buffer > 0)
+	{
+		value = (int) profile->receive_buffer;
+		set_option(fd, SOL_SOCKET, SO_RCVBUF, &value, sizeof(value), "SO_RCVBUF", failed, &error);
+	}
+
+	int domain = 0;
+	socklen_t len = sizeof(domain);
+	if (getsockopt(fd, SOL_SOCKET, SO_DOMAIN, &domain, &len) == -1 || (domain != AF_INET && domain != AF_INET6))
+	{
+		errno = error;
+		return error != 0 ? -1 : 0;
+	}
+
+	if (profile->busy_poll > 0)
+	{
+		set_option(fd, SOL_SOCKET, SO_BUSY_POLL, &profile->busy_poll, sizeof(int), "SO_BUSY_POLL", failed, &error);
+	}
+	if (profile->nodelay)
+	{
+		value = 1;
+		set_option(fd, IPPROTO_TCP, TCP_NODELAY, &value, sizeof(value), "TCP_NODELAY", failed, &error);
+	}
+	if (profile->notsent_lowat > 0)
+	{
+		value = (int) profile->notsent_lowat;
+		set_option(fd, IPPROTO_TCP, TCP_NOTSENT_LOWAT, &value, sizeof(value), "TCP_NOTSENT_LOWAT", failed, &error);
+	}
+	if (profile->congestion[0] != '\0')
+	{
+		// needs the algorithm loaded, and allowed in net.ipv4.tcp_allowed_congestion_control
+		set_option(fd, IPPROTO_TCP, TCP_CONGESTION, profile->congestion, strlen(profile->congestion), "TCP_CONGESTION", failed, &error);
+	}
+
+	errno = error;
+	return error != 0 ? -1 : 0;
+}
+
+void socket_cork(int fd, const socket_profile* profile, bool on)
+{
+	if (profile->cork)
+	{
+		// uncorking sends what is left right away; fails harmlessly on Unix domain sockets
+		int value = on;
+		setsockopt(fd, IPPROTO_TCP, TCP_CORK, &value, sizeof(value));
+	}
+}
@@ -0,0 +1,56 @@
+/**
+ *  socket tuning profiles
+ *
+ *  a profile is a named set of socket options for one kind of link:
+ *      default      kernel defaults, nothing is set
+ *      lan-bulk     large fixed buffers, cubic, frames corked into full segments
+ *      wan-bulk     buffers left to autotuning (a fixed size would cap the
+ *                   bandwidth-delay product), bbr, a small unsent queue so the
+ *                   pacing sees the real backlog, frames corked
+ *      low-latency  TCP_NODELAY, small unsent queue, busy polling, no corking
+ *  the server takes its profile from the [socket] section of its configuration
+ *  (see config.h), the client and the benchmark from --profile and -p.
+ */
+
+#ifndef SOCKTUNE_H
+#define SOCKTUNE_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#define SOCKET_PROFILE_NAME_SIZE 32
+#define SOCKET_CONGESTION_SIZE 16
+
+typedef struct
+{
+	char name[SOCKET_PROFILE_NAME_SIZE];
+	uint64_t send_buffer; // < SO_SNDBUF, 0 leaves it to autotuning
+	uint64_t receive_buffer; // < SO_RCVBUF, 0 leaves it to autotuning
+	uint64_t notsent_lowat; // < TCP_NOTSENT_LOWAT, 0 = kernel default
+	char congestion[SOCKET_CONGESTION_SIZE]; // < TCP_CONGESTION, empty = system default
+	int busy_poll; // < SO_BUSY_POLL microseconds, 0 = off
+	bool nodelay; // < TCP_NODELAY
+	bool cork; // < TCP_CORK around batches of frames, see socket_cork()
+} socket_profile;
+
+/*
+ *	Copies the built-in profile called name into profile.
+ *	Returns 0 on success, -1 if there is no such profile.
+ */
+int socket_profile_load(socket_profile* profile, const char* name);
+
+/*
+ *	Sets the options of profile on fd. TCP options are skipped on other sockets.
+ *	Buffer sizes must be set before connect() or listen() to affect the window scale.
+ *	Every option is tried; the name of the last one the kernel refused is stored in *failed.
+ *	Returns 0 on success, -1 if an option was refused (errno is set).
+ */
+int socket_tune(int fd, const socket_profile* profile, const char** failed);
+
+/*
+ *	Holds back partial segments (on) until the batch of frames is complete (off),
+ *		when the profile corks. No-op on other sockets.
+ */
+void socket_cork(int fd, const socket_profile* profile, bool on);
+
+#endif
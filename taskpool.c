@@ -0,0 +1,283 @@
+/**
+ *  work-stealing task pool, see taskpool.h
+ *
+ *  the deque follows "Correct and Efficient Work-Stealing for Weak Memory
+ *  Models" (Lê, Pop, Cohen, Zappa Nardelli), with a fixed size ring.
+ */
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <sched.h>
+#include "taskpool.h"
+#include "metrics.h"
+
+#define DEQUE_MASK (TASKPOOL_DEQUE_SIZE - 1)
+
+// steal() lost a race, another deque (or this one again) may still have work
+#define STEAL_ABORT ((task*) 1)
+
+typedef struct
+{
+	_Atomic int64_t top; // < stolen from here
+	char padding[64 - sizeof(int64_t)];
+	_Atomic int64_t bottom; // < the owner pushes and takes here
+	_Atomic(task*) tasks[TASKPOOL_DEQUE_SIZE];
+} task_deque;
+
+struct task_pool
+{
+	_Atomic(task_deque*)* deques;
+	int max_deques;
+	_Atomic int deque_count;
+	// sleeping helpers: a submitter bumps epoch, a helper only sleeps if it did not move
+	_Atomic uint64_t epoch;
+	_Atomic int sleepers;
+	pthread_mutex_t lock;
+	pthread_cond_t work;
+};
+
+// the deque of the calling thread
+static __thread task_deque* local_deque = NULL;
+
+/*
+ *	Owner only. Returns 0 on success, -1 if the deque is full.
+ */
+static int deque_push(task_deque* deque, task* job)
+{
+	int64_t bottom = atomic_load_explicit(&deque->bottom, memory_order_relaxed);
+	int64_t top = atomic_load_explicit(&deque->top, memory_order_acquire);
+	if (bottom - top >= TASKPOOL_DEQUE_SIZE)
+	{
+		return -1;
+	}
+	atomic_store_explicit(&deque->tasks[bottom & DEQUE_MASK], job, memory_order_relaxed);
+	atomic_thread_fence(memory_order_release);
+	atomic_store_explicit(&deque->bottom, bottom + 1, memory_order_relaxed);
+	return 0;
+}
+
+/*
+ *	Owner only. Returns the newest task, NULL if the deque is empty.
+ */
+static task* deque_take(task_deque* deque)
+{
+	int64_t bottom = atomic_load_explicit(&deque->bottom, memory_order_relaxed) - 1;
+	atomic_store_explicit(&deque->bottom, bottom, memory_order_relaxed);
+	atomic_thread_fence(memory_order_seq_cst);
+	int64_t top = atomic_load_explicit(&deque->top, memory_order_relaxed);
+	if (top > bottom)
+	{
+		atomic_store_explicit(&deque->bottom, bottom + 1, memory_order_relaxed);
+		return NULL;
+	}
+	task* job = atomic_load_explicit(&deque->tasks[bottom & DEQUE_MASK], memory_order_relaxed);
+	if (top == bottom)
+	{
+		// the last one: race the thieves for it
+		if (!atomic_compare_exchange_strong_explicit(&deque->top, &top, top + 1, memory_order_seq_cst, memory_order_relaxed))
+		{
+			job = NULL;
+		}
+		atomic_store_explicit(&deque->bottom, bottom + 1, memory_order_relaxed);
+	}
+	return job;
+}
+
+/*
+ *	Any thread. Returns the oldest task, NULL if the deque is empty, STEAL_ABORT on a lost race.
+ */
+static task* deque_steal(task_deque* deque)
+{
+	int64_t top = atomic_load_explicit(&deque->top, memory_order_acquire);
+	atomic_thread_fence(memory_order_seq_cst);
+	int64_t bottom = atomic_load_explicit(&deque->bottom, memory_order_acquire);
+	if (top >= bottom)
+	{
+		return NULL;
+	}
+	task* job = atomic_load_explicit(&deque->tasks[top & DEQUE_MASK], memory_order_relaxed);
+	if (!atomic_compare_exchange_strong_explicit(&deque->top, &top, top + 1, memory_order_seq_cst, memory_order_relaxed))
+	{
+		return STEAL_ABORT;
+	}
+	return job;
+}
+
+/*
+ *	Steals a task from any deque, starting at a random one.
+ *	Returns the task, NULL if every deque looked empty.
+ */
+static task* steal_any(task_pool* pool, uint64_t* rng)
+{
+	int count = atomic_load_explicit(&pool->deque_count, memory_order_acquire);
+	if (count > pool->max_deques)
+	{
+		count = pool->max_deques;
+	}
+	if (count == 0)
+	{
+		return NULL;
+	}
+	*rng = *rng * 6364136223846793005ull + 1442695040888963407ull;
+	int first = (int) ((*rng >> 33) % count);
+	bool lost = true;
+	while (lost)
+	{
+		lost = false;
+		for (int i = 0; i < count; i++)
+		{
+			task_deque* deque = atomic_load_explicit(&pool->deques[(first + i) % count], memory_order_acquire);
+			task* job = deque != NULL ? deque_steal(deque) : NULL;
+			if (job == STEAL_ABORT)
+			{
+				lost = true;
+			}
+			else if (job != NULL)
+			{
+				return job;
+			}
+		}
+	}
+	return NULL;
+}
+
+static void run_task(task* job)
+{
+	job->run(job);
+	atomic_store_explicit(&job->done, true, memory_order_release);
+}
+
+static void* helper_main(void* arg)
+{
+	task_pool* pool = (task_pool*) arg;
+	uint64_t rng = (uint64_t) (uintptr_t) &rng;
+	while (1)
+	{
+		uint64_t epoch = atomic_load(&pool->epoch);
+		task* job = NULL;
+		for (int spin = 0; spin < TASKPOOL_SPINS && job == NULL; spin++)
+		{
+			job = steal_any(pool, &rng);
+		}
+		if (job != NULL)
+		{
+			run_task(job);
+			metrics_add(M_TASKS_HELPER, 1);
+			continue;
+		}
+
+		pthread_mutex_lock(&pool->lock);
+		atomic_fetch_add(&pool->sleepers, 1);
+		if (atomic_load(&pool->epoch) == epoch)
+		{
+			pthread_cond_wait(&pool->work, &pool->lock);
+		}
+		atomic_fetch_sub(&pool->sleepers, 1);
+		pthread_mutex_unlock(&pool->lock);
+	}
+	return NULL;
+}
+
+task_pool* taskpool_create(int threads, int max_submitters)
+{
+	task_pool* pool = (task_pool*) calloc(1, sizeof(task_pool));
+	if (pool == NULL)
+	{
+		return NULL;
+	}
+	pool->deques = calloc(max_submitters, sizeof(*pool->deques));
+	if (pool->deques == NULL)
+	{
+		free(pool);
+		return NULL;
+	}
+	pool->max_deques = max_submitters;
+	pthread_mutex_init(&pool->lock, NULL);
+	pthread_cond_init(&pool->work, NULL);
+
+	for (int i = 0; i < threads; i++)
+	{
+		pthread_t thread;
+		if (pthread_create(&thread, NULL, helper_main, pool) != 0)
+		{
+			if (i > 0)
+			{
+				// the helpers already running keep the pool alive
+				return pool;
+			}
+			// no thread uses the pool and no submitter attached a deque yet
+			pthread_cond_destroy(&pool->work);
+			pthread_mutex_destroy(&pool->lock);
+			free(pool->deques);
+			free(pool);
+			return NULL;
+		}
+		pthread_detach(thread);
+	}
+	return pool;
+}
+
+int taskpool_attach(task_pool* pool)
+{
+	if (local_deque != NULL)
+	{
+		return 0;
+	}
+	task_deque* deque = NULL;
+	if (posix_memalign((void**) &deque, 64, sizeof(task_deque)) != 0)
+	{
+		return -1;
+	}
+	atomic_init(&deque->top, 0);
+	atomic_init(&deque->bottom, 0);
+	int index = atomic_fetch_add(&pool->deque_count, 1);
+	if (index >= pool->max_deques)
+	{
+		free(deque);
+		return -1;
+	}
+	atomic_store_explicit(&pool->deques[index], deque, memory_order_release);
+	local_deque = deque;
+	return 0;
+}
+
+void taskpool_submit(task_pool* pool, task* job)
+{
+	if (local_deque == NULL || deque_push(local_deque, job) == -1)
+	{
+		run_task(job);
+		metrics_add(M_TASKS_SUBMITTER, 1);
+		return;
+	}
+	atomic_fetch_add(&pool->epoch, 1);
+	if (atomic_load(&pool->sleepers) > 0)
+	{
+		pthread_mutex_lock(&pool->lock);
+		pthread_cond_signal(&pool->work);
+		pthread_mutex_unlock(&pool->lock);
+	}
+}
+
+void taskpool_wait(task_pool* pool, task* job)
+{
+	uint64_t rng = (uint64_t) (uintptr_t) job;
+	while (!atomic_load_explicit(&job->done, memory_order_acquire))
+	{
+		task* other = local_deque != NULL ? deque_take(local_deque) : NULL;
+		if (other == NULL)
+		{
+			other = steal_any(pool, &rng);
+		}
+		if (other != NULL)
+		{
+			run_task(other);
+			metrics_add(M_TASKS_SUBMITTER, 1);
+		}
+		else
+		{
+			// a helper is running it
+			sched_yield();
+		}
+	}
+}
@@ -0,0 +1,65 @@
+/**
+ *  work-stealing task pool
+ *
+ *  every thread that submits work (the network workers of the server)
+ *  attaches to the pool and gets its own Chase-Lev deque: it pushes and
+ *  takes back tasks at the bottom without any atomic read-modify-write,
+ *  while the helper threads of the pool steal from the top of any deque.
+ *  so a few busy submitters spread their work over every helper, and idle
+ *  submitters cost nothing.
+ *
+ *  a submitter waiting for one of its tasks runs its own queued tasks
+ *  meanwhile, then steals like a helper: waiting never leaves a core idle.
+ *  a full deque runs the task on the spot, which bounds the queued work.
+ *  the caller keeps the order of its results by waiting for its tasks in
+ *  the order it needs them.
+ */
+
+#ifndef TASKPOOL_H
+#define TASKPOOL_H
+
+#include <stdbool.h>
+#include <stdatomic.h>
+
+#define TASKPOOL_DEQUE_SIZE 256 // < tasks queued per submitter, a power of 2
+#define TASKPOOL_SPINS 2000 // < steal attempts before a helper sleeps
+
+typedef struct task task;
+typedef struct task_pool task_pool;
+
+struct task
+{
+	void (*run)(task* job);
+	_Atomic bool done;
+};
+
+static inline void task_init(task* job, void (*run)(task*))
+{
+	job->run = run;
+	atomic_store_explicit(&job->done, false, memory_order_relaxed);
+}
+
+/*
+ *	Starts a pool of threads helper threads, for at most max_submitters attached threads.
+ *	Returns the pool, or NULL on error.
+ */
+task_pool* taskpool_create(int threads, int max_submitters);
+
+/*
+ *	Gives the calling thread its deque. A thread that is not attached runs its tasks itself.
+ *	Returns 0 on success, -1 if the pool has no deque left.
+ */
+int taskpool_attach(task_pool* pool);
+
+/*
+ *	Queues job, or runs it right away if the deque of the calling thread is full.
+ *	job must stay valid until taskpool_wait() returned for it.
+ */
+void taskpool_submit(task_pool* pool, task* job);
+
+/*
+ *	Returns once job has run, running queued tasks meanwhile.
+ */
+void taskpool_wait(task_pool* pool, task* job);
+
+#endif
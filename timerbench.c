@@ -0,0 +1,281 @@
+/**
+ *  timer microbenchmark
+ *  schedules TIMERS timers with random deadlines over HORIZON seconds of
+ *  virtual time, moves every one of them to a new deadline (a connection
+ *  extending its deadline), cancels half of them, then runs the rest by
+ *  advancing the time in steps of STEP milliseconds, like an event loop.
+ *  the same workload runs on the hierarchical timing wheel (timerwheel.h)
+ *  and on a binary heap, the usual alternative, and every expiry is checked
+ *  against its deadline.
+ *
+ *  prints one JSON object per structure, nanoseconds per operation.
+ *
+ *  usage: timerbench [-n TIMERS] [-H HORIZON] [-s STEP]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include "timerwheel.h"
+#include "metrics.h"
+
+#define TICK_NS 1000000ull
+
+typedef struct
+{
+	wheel_timer timer; // < first, the callbacks cast back
+	uint64_t deadline_ns;
+	int heap_index;
+} bench_timer;
+
+typedef struct
+{
+	const char* structure;
+	double schedule_ns;
+	double reschedule_ns;
+	double cancel_ns;
+	double expire_ns;
+	uint64_t expired;
+	uint64_t early;
+	uint64_t max_late_ns;
+} bench_result;
+
+// checked by the expiry callbacks
+static uint64_t virtual_now_ns;
+static bench_result* current;
+
+static uint64_t next_random(uint64_t* state)
+{
+	// xorshift64*
+	*state ^= *state >> 12;
+	*state ^= *state << 25;
+	*state ^= *state >> 27;
+	return *state * 2685821657736338717ull;
+}
+
+static void record_expiry(bench_timer* timer)
+{
+	current->expired++;
+	if (virtual_now_ns < timer->deadline_ns)
+	{
+		current->early++;
+	}
+	else if (virtual_now_ns - timer->deadline_ns > current->max_late_ns)
+	{
+		current->max_late_ns = virtual_now_ns - timer->deadline_ns;
+	}
+}
+
+static void wheel_expired(wheel_timer* timer, uint64_t now_ns)
+{
+	(void) now_ns;
+	record_expiry((bench_timer*) timer);
+}
+
+static void run_wheel(bench_timer* timers, int count, uint64_t horizon_ns, uint64_t step_ns, bench_result* result)
+{
+	timer_wheel* wheel = (timer_wheel*) malloc(sizeof(timer_wheel));
+	wheel_init(wheel, TICK_NS, 0);
+	uint64_t rng = 0x9e3779b97f4a7c15ull;
+	virtual_now_ns = 0;
+
+	uint64_t start = metrics_now_ns();
+	for (int i = 0; i < count; i++)
+	{
+		wheel_timer_init(&timers[i].timer, wheel_expired);
+		timers[i].deadline_ns = next_random(&rng) % horizon_ns;
+		wheel_schedule(wheel, &timers[i].timer, timers[i].deadline_ns);
+	}
+	result->schedule_ns = (double) (metrics_now_ns() - start) / count;
+
+	start = metrics_now_ns();
+	for (int i = 0; i < count; i++)
+	{
+		timers[i].deadline_ns = next_random(&rng) % horizon_ns;
+		wheel_schedule(wheel, &timers[i].timer, timers[i].deadline_ns);
+	}
+	result->reschedule_ns = (double) (metrics_now_ns() - start) / count;
+
+	start = metrics_now_ns();
+	for (int i = 0; i < count; i += 2)
+	{
+		wheel_cancel(wheel, &timers[i].timer);
+	}
+	result->cancel_ns = (double) (metrics_now_ns() - start) / ((count + 1) / 2);
+
+	start = metrics_now_ns();
+	for (virtual_now_ns = 0; virtual_now_ns < horizon_ns + step_ns; virtual_now_ns += step_ns)
+	{
+		wheel_advance(wheel, virtual_now_ns);
+	}
+	result->expire_ns = result->expired > 0 ? (double) (metrics_now_ns() - start) / result->expired : 0.0;
+	free(wheel);
+}
+
+/*
+ *	Min-heap of timers on their deadline, each timer knowing its index so it can be cancelled.
+ */
+typedef struct
+{
+	bench_timer** items;
+	int count;
+} timer_heap;
+
+static void heap_swap(timer_heap* heap, int a, int b)
+{
+	bench_timer* t = heap->items[a];
+	heap->items[a] = heap->items[b];
+	heap->items[b] = t;
+	heap->items[a]->heap_index = a;
+	heap->items[b]->heap_index = b;
+}
+
+static void heap_fix(timer_heap* heap, int i)
+{
+	while (i > 0 && heap->items[(i - 1) / 2]->deadline_ns > heap->items[i]->deadline_ns)
+	{
+		heap_swap(heap, i, (i - 1) / 2);
+		i = (i - 1) / 2;
+	}
+	while (1)
+	{
+		int smallest = i;
+		int left = 2 * i + 1, right = 2 * i + 2;
+		if (left < heap->count && heap->items[left]->deadline_ns < heap->items[smallest]->deadline_ns)
+		{
+			smallest = left;
+		}
+		if (right < heap->count && heap->items[right]->deadline_ns < heap->items[smallest]->deadline_ns)
+		{
+			smallest = right;
+		}
+		if (smallest == i)
+		{
+			return;
+		}
+		heap_swap(heap, i, smallest);
+		i = smallest;
+	}
+}
+
+static void heap_push(timer_heap* heap, bench_timer* timer)
+{
+	timer->heap_index = heap->count;
+	heap->items[heap->count++] = timer;
+	heap_fix(heap, timer->heap_index);
+}
+
+static void heap_remove(timer_heap* heap, bench_timer* timer)
+{
+	int i = timer->heap_index;
+	heap_swap(heap, i, --heap->count);
+	timer->heap_index = -1;
+	if (i < heap->count)
+	{
+		heap_fix(heap, i);
+	}
+}
+
+static void run_heap(bench_timer* timers, int count, uint64_t horizon_ns, uint64_t step_ns, bench_result* result)
+{
+	timer_heap heap = { (bench_timer**) malloc(count * sizeof(bench_timer*)), 0 };
+	uint64_t rng = 0x9e3779b97f4a7c15ull;
+
+	uint64_t start = metrics_now_ns();
+	for (int i = 0; i < count; i++)
+	{
+		timers[i].deadline_ns = next_random(&rng) % horizon_ns;
+		heap_push(&heap, &timers[i]);
+	}
+	result->schedule_ns = (double) (metrics_now_ns() - start) / count;
+
+	start = metrics_now_ns();
+	for (int i = 0; i < count; i++)
+	{
+		timers[i].deadline_ns = next_random(&rng) % horizon_ns;
+		heap_fix(&heap, timers[i].heap_index);
+	}
+	result->reschedule_ns = (double) (metrics_now_ns() - start) / count;
+
+	start = metrics_now_ns();
+	for (int i = 0; i < count; i += 2)
+	{
+		heap_remove(&heap, &timers[i]);
+	}
+	result->cancel_ns = (double) (metrics_now_ns() - start) / ((count + 1) / 2);
+
+	start = metrics_now_ns();
+	for (virtual_now_ns = 0; virtual_now_ns < horizon_ns + step_ns; virtual_now_ns += step_ns)
+	{
+		while (heap.count > 0 && heap.items[0]->deadline_ns <= virtual_now_ns)
+		{
+			bench_timer* timer = heap.items[0];
+			heap_remove(&heap, timer);
+			record_expiry(timer);
+		}
+	}
+	result->expire_ns = result->expired > 0 ? (double) (metrics_now_ns() - start) / result->expired : 0.0;
+	free(heap.items);
+}
+
+static void print_result(const bench_result* result, int count, bool first)
+{
+	printf("%s    {\"structure\": \"%s\", \"timers\": %d, \"schedule_ns\": %.1f, \"reschedule_ns\": %.1f, \"cancel_ns\": %.1f,"
+		" \"expire_ns\": %.1f, \"expired\": %llu, \"early\": %llu, \"max_late_ms\": %.3f}",
+		first ? "" : ",\n", result->structure, count, result->schedule_ns, result->reschedule_ns, result->cancel_ns,
+		result->expire_ns, (unsigned long long) result->expired, (unsigned long long) result->early, result->max_late_ns / 1e6);
+}
+
+int main(int argc, char* argv[])
+{
+	int count = 1000000;
+	double horizon = 60;
+	double step_ms = 10;
+
+	int opt;
+	while ((opt = getopt(argc, argv, "n:H:s:")) != -1)
+	{
+		switch (opt)
+		{
+			case 'n': count = atoi(optarg); break;
+			case 'H': horizon = atof(optarg); break;
+			case 's': step_ms = atof(optarg); break;
+			default:
+				fprintf(stderr, "usage: timerbench [-n TIMERS] [-H HORIZON] [-s STEP]\n");
+				exit(EXIT_FAILURE);
+		}
+	}
+	if (count < 1 || horizon <= 0 || step_ms <= 0)
+	{
+		fprintf(stderr, "TIMERS, HORIZON and STEP must be positive\n");
+		exit(EXIT_FAILURE);
+	}
+	uint64_t horizon_ns = (uint64_t) (horizon * 1e9);
+	uint64_t step_ns = (uint64_t) (step_ms * 1e6);
+
+	bench_timer* timers = (bench_timer*) calloc(count, sizeof(bench_timer));
+	if (timers == NULL)
+	{
+		perror("Could not allocate the timers");
+		exit(EXIT_FAILURE);
+	}
+
+	bench_result wheel_result = { "wheel" }, heap_result = { "heap" };
+	current = &wheel_result;
+	run_wheel(timers, count, horizon_ns, step_ns, &wheel_result);
+	current = &heap_result;
+	run_heap(timers, count, horizon_ns, step_ns, &heap_result);
+
+	printf("{\"results\": [\n");
+	print_result(&wheel_result, count, true);
+	print_result(&heap_result, count, false);
+	printf("\n]}\n");
+	free(timers);
+
+	// half the timers were cancelled, the other half must all have run, none early
+	uint64_t expected = count / 2;
+	bool ok = wheel_result.expired == expected && heap_result.expired == expected && wheel_result.early == 0 && heap_result.early == 0;
+	return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
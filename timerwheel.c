@@ -0,0 +1,239 @@
+/**
+ *  hierarchical timing wheel, see timerwheel.h
+ */
+
+#include <stddef.h>
+#include "timerwheel.h"
+
+#define SLOT_MASK (WHEEL_SLOTS - 1)
+
+void wheel_init(timer_wheel* wheel, uint64_t tick_ns, uint64_t now_ns)
+{
+	for (int i = 0; i < WHEEL_LEVELS * WHEEL_SLOTS; i++)
+	{
+		wheel->slots[i].next = &wheel->slots[i];
+		wheel->slots[i].prev = &wheel->slots[i];
+	}
+	for (int level = 0; level < WHEEL_LEVELS; level++)
+	{
+		for (int i = 0; i < WHEEL_SLOTS / 64; i++)
+		{
+			wheel->occupied[level][i] = 0;
+		}
+	}
+	wheel->tick_ns = tick_ns;
+	wheel->start_ns = now_ns;
+	wheel->now = 0;
+	wheel->cascaded = 0;
+	wheel->pending = 0;
+}
+
+void wheel_timer_init(wheel_timer* timer, wheel_callback callback)
+{
+	timer->next = NULL;
+	timer->prev = NULL;
+	timer->expires = 0;
+	timer->slot = 0;
+	timer->callback = callback;
+}
+
+/*
+ *	Links timer into the slot of its expiry tick, in the level covering its distance from now.
+ */
+static void place(timer_wheel* wheel, wheel_timer* timer)
+{
+	uint64_t distance = timer->expires - wheel->now;
+	if (distance > WHEEL_MAX_TICKS)
+	{
+		timer->expires = wheel->now + WHEEL_MAX_TICKS;
+		distance = WHEEL_MAX_TICKS;
+	}
+	int level = 0;
+	while (level < WHEEL_LEVELS - 1 && distance >= 1ull << ((level + 1) * WHEEL_SLOT_BITS))
+	{
+		level++;
+	}
+	int index = (int) ((timer->expires >> (level * WHEEL_SLOT_BITS)) & SLOT_MASK);
+	timer->slot = (uint32_t) (level * WHEEL_SLOTS + index);
+
+	wheel_timer* head = &wheel->slots[timer->slot];
+	timer->next = head;
+	timer->prev = head->prev;
+	head->prev->next = timer;
+	head->prev = timer;
+	wheel->occupied[level][index / 64] |= 1ull << (index % 64);
+}
+
+/*
+ *	Unlinks timer from its slot, clearing the slot bit once it is empty.
+ */
+static void unlink_timer(timer_wheel* wheel, wheel_timer* timer)
+{
+	timer->prev->next = timer->next;
+	timer->next->prev = timer->prev;
+	timer->next = NULL;
+	timer->prev = NULL;
+	wheel_timer* head = &wheel->slots[timer->slot];
+	if (head->next == head)
+	{
+		int level = timer->slot / WHEEL_SLOTS;
+		int index = timer->slot % WHEEL_SLOTS;
+		wheel->occupied[level][index / 64] &= ~(1ull << (index % 64));
+	}
+}
+
+void wheel_cancel(timer_wheel* wheel, wheel_timer* timer)
+{
+	if (timer->next == NULL)
+	{
+		return;
+	}
+	unlink_timer(wheel, timer);
+	wheel->pending--;
+}
+
+void wheel_schedule(timer_wheel* wheel, wheel_timer* timer, uint64_t expires_ns)
+{
+	wheel_cancel(wheel, timer);
+
+	// rounded up, a timer never runs early; the past runs on the next tick
+	uint64_t tick = expires_ns > wheel->start_ns ? (expires_ns - wheel->start_ns + wheel->tick_ns - 1) / wheel->tick_ns : 0;
+	timer->expires = tick < wheel->now ? wheel->now : tick;
+	place(wheel, timer);
+	wheel->pending++;
+}
+
+/*
+ *	Detaches the whole list of slot into list (a list head), clearing its bit.
+ */
+static void take_slot(timer_wheel* wheel, int level, int index, wheel_timer* list)
+{
+	wheel_timer* head = &wheel->slots[level * WHEEL_SLOTS + index];
+	if (head->next == head)
+	{
+		list->next = list;
+		list->prev = list;
+		return;
+	}
+	list->next = head->next;
+	list->prev = head->prev;
+	list->next->prev = list;
+	list->prev->next = list;
+	head->next = head;
+	head->prev = head;
+	wheel->occupied[level][index / 64] &= ~(1ull << (index % 64));
+}
+
+/*
+ *	Moves the timers of the slots the levels above 0 reach at tick now down the wheel.
+ *	now is a multiple of WHEEL_SLOTS.
+ */
+static void cascade(timer_wheel* wheel, uint64_t now)
+{
+	for (int level = 1; level < WHEEL_LEVELS; level++)
+	{
+		int shift = level * WHEEL_SLOT_BITS;
+		wheel_timer list;
+		take_slot(wheel, level, (int) ((now >> shift) & SLOT_MASK), &list);
+		while (list.next != &list)
+		{
+			wheel_timer* timer = list.next;
+			list.next = timer->next;
+			place(wheel, timer);
+		}
+		// the next level only turns when this one wraps too
+		if (((now >> shift) & SLOT_MASK) != 0)
+		{
+			break;
+		}
+	}
+	wheel->cascaded = now;
+}
+
+/*
+ *	Returns the first occupied level 0 slot at index from or after it, before the wrap, -1 if none.
+ */
+static int next_occupied(const timer_wheel* wheel, int from)
+{
+	for (int word = from / 64; word < WHEEL_SLOTS / 64; word++)
+	{
+		uint64_t bits = wheel->occupied[0][word];
+		if (word == from / 64)
+		{
+			bits &= ~0ull << (from % 64);
+		}
+		if (bits != 0)
+		{
+			return word * 64 + __builtin_ctzll(bits);
+		}
+	}
+	return -1;
+}
+
+uint64_t wheel_advance(timer_wheel* wheel, uint64_t now_ns)
+{
+	uint64_t ran = 0;
+	if (now_ns < wheel->start_ns)
+	{
+		return 0;
+	}
+	uint64_t target = (now_ns - wheel->start_ns) / wheel->tick_ns;
+	while (wheel->now <= target)
+	{
+		uint64_t now = wheel->now;
+		if ((now & SLOT_MASK) == 0 && wheel->cascaded != now)
+		{
+			cascade(wheel, now);
+		}
+
+		// skip straight to the next occupied slot, or to the wrap
+		int index = next_occupied(wheel, (int) (now & SLOT_MASK));
+		uint64_t tick = index == -1 ? (now | SLOT_MASK) + 1 : (now & ~(uint64_t) SLOT_MASK) + index;
+		if (tick > target || index == -1)
+		{
+			wheel->now = tick > target ? target + 1 : tick;
+			continue;
+		}
+
+		// every timer of a level 0 slot expires on its tick: the list is the batch
+		wheel_timer expired;
+		take_slot(wheel, 0, index, &expired);
+		wheel->now = tick + 1;
+		while (expired.next != &expired)
+		{
+			wheel_timer* timer = expired.next;
+			expired.next = timer->next;
+			timer->next->prev = &expired;
+			timer->next = NULL;
+			timer->prev = NULL;
+			wheel->pending--;
+			timer->callback(timer, now_ns);
+			ran++;
+		}
+	}
+	return ran;
+}
+
+uint64_t wheel_next_expiry(const timer_wheel* wheel)
+{
+	if (wheel->pending == 0)
+	{
+		return UINT64_MAX;
+	}
+	uint64_t now = wheel->now;
+	uint64_t tick;
+	int index = next_occupied(wheel, (int) (now & SLOT_MASK));
+	if ((now & SLOT_MASK) == 0 && wheel->cascaded != now)
+	{
+		tick = now;
+	}
+	else if (index != -1)
+	{
+		tick = (now & ~(uint64_t) SLOT_MASK) + index;
+	}
+	else
+	{
+		tick = (now | SLOT_MASK) + 1;
+	}
+	return wheel->start_ns + tick * wheel->tick_ns;
+}
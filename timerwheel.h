@@ -0,0 +1,96 @@
+/**
+ *  hierarchical timing wheel
+ *
+ *  time is cut into ticks. the wheel has WHEEL_LEVELS levels of WHEEL_SLOTS
+ *  slots, level n covering WHEEL_SLOTS^(n+1) ticks with slots of
+ *  WHEEL_SLOTS^n ticks each. a timer goes into the level that covers its
+ *  distance from now, in the slot of its expiry tick, in an intrusive doubly
+ *  linked list. each time level 0 wraps, the next slot of level 1 is
+ *  cascaded: its timers move down to the level that now covers them, and
+ *  so on up the levels. the expired timers of a tick are then exactly the
+ *  whole list of one level 0 slot, detached at once and run as a batch.
+ *
+ *  scheduling and cancelling are O(1) whatever the number of timers, and a
+ *  timer is moved at most WHEEL_LEVELS - 1 times before it runs. a bitmap of
+ *  the occupied slots lets the owner skip idle ticks, and tells its event
+ *  loop how long it can sleep (wheel_next_expiry()).
+ *
+ *  a wheel is not thread-safe: its owner serializes every call.
+ */
+
+#ifndef TIMERWHEEL_H
+#define TIMERWHEEL_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#define WHEEL_LEVELS 4
+#define WHEEL_SLOT_BITS 8
+#define WHEEL_SLOTS (1 << WHEEL_SLOT_BITS)
+// timers further away wait at the far end of the top level
+#define WHEEL_MAX_TICKS ((1ull << (WHEEL_LEVELS * WHEEL_SLOT_BITS)) - 1)
+
+typedef struct wheel_timer wheel_timer;
+
+// runs on the thread advancing the wheel, may schedule timer again
+typedef void (*wheel_callback)(wheel_timer* timer, uint64_t now_ns);
+
+struct wheel_timer
+{
+	wheel_timer* next;
+	wheel_timer* prev;
+	uint64_t expires; // < tick
+	uint32_t slot; // < level * WHEEL_SLOTS + slot, while scheduled
+	wheel_callback callback;
+};
+
+typedef struct
+{
+	wheel_timer slots[WHEEL_LEVELS * WHEEL_SLOTS]; // < list heads
+	uint64_t occupied[WHEEL_LEVELS][WHEEL_SLOTS / 64]; // < slots with timers
+	uint64_t tick_ns;
+	uint64_t start_ns;
+	uint64_t now; // < every tick before this one has run
+	uint64_t cascaded; // < tick of the last cascade
+	uint64_t pending;
+} timer_wheel;
+
+/*
+ *	Sets up an empty wheel of tick_ns long ticks, starting at now_ns.
+ */
+void wheel_init(timer_wheel* wheel, uint64_t tick_ns, uint64_t now_ns);
+
+/*
+ *	Prepares a timer that runs callback. It is not scheduled.
+ */
+void wheel_timer_init(wheel_timer* timer, wheel_callback callback);
+
+/*
+ *	Schedules timer to run at the first tick at or after expires_ns,
+ *		moving it if it was already scheduled.
+ */
+void wheel_schedule(timer_wheel* wheel, wheel_timer* timer, uint64_t expires_ns);
+
+/*
+ *	Unschedules timer, if it is scheduled.
+ */
+void wheel_cancel(timer_wheel* wheel, wheel_timer* timer);
+
+static inline bool wheel_scheduled(const wheel_timer* timer)
+{
+	return timer->next != NULL;
+}
+
+/*
+ *	Runs the callbacks of every timer expired by now_ns, tick by tick, skipping idle ticks.
+ *	Returns the number of callbacks run.
+ */
+uint64_t wheel_advance(timer_wheel* wheel, uint64_t now_ns);
+
+/*
+ *	Returns when wheel_advance() next has work to do: a timer expiring or a cascade,
+ *		never later than the first expiry. UINT64_MAX if no timer is scheduled.
+ */
+uint64_t wheel_next_expiry(const timer_wheel* wheel);
+
+#endif
@@ -0,0 +1,299 @@
+/**
+ *  write-behind pipeline, see writebehind.h
+ */
+
+#define _GNU_SOURCE // sync_file_range
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include "writebehind.h"
+#include "metrics.h"
+
+#define WRITE_IDLE_NS 20000
+
+typedef struct
+{
+	char* block;
+	size_t len;
+} write_slot;
+
+struct write_behind
+{
+	int fd;
+	buffer_pool* pool;
+	bool threaded;
+	pthread_t writer;
+
+	// producer side
+	char* block;
+	size_t fill;
+
+	_Atomic uint32_t head; // < written by the receiver
+	_Atomic uint32_t tail; // < written by the writer
+	_Atomic bool closing;
+	_Atomic int error;
+	write_slot slots[WRITE_RING_SIZE];
+
+	// writer side
+	uint64_t written;
+	uint64_t flushed; // < end of the range whose writeback was started
+	uint64_t sync_every;
+	uint64_t synced;  // < end of the range made durable
+
+	uint64_t start_ns;
+	_Atomic uint64_t disk_ns;
+	uint64_t stall_ns;
+};
+
+static void idle(void)
+{
+	struct timespec pause = { 0, WRITE_IDLE_NS };
+	nanosleep(&pause, NULL);
+}
+
+/*
+ *	Writes one block at the end of the file and keeps the writeback moving:
+ *	every WRITE_BEHIND_CHUNK, writeback of the new chunk is started and the one
+ *		before it is waited for, so at most two chunks are dirty at any time.
+ *	Returns 0 on success, -1 on error.
+ */
+static int write_block(write_behind* wb, const char* block, size_t len)
+{
+	uint64_t start = metrics_now_ns();
+	size_t done = 0;
+	while (done < len)
+	{
+		ssize_t ret = pwrite(wb->fd, block + done, len - done, wb->written + done);
+		if (ret == -1 && errno == EINTR)
+		{
+			continue;
+		}
+		if (ret <= 0)
+		{
+			return -1;
+		}
+		done += ret;
+	}
+	wb->written += len;
+
+	if (wb->threaded && wb->written - wb->flushed >= WRITE_BEHIND_CHUNK)
+	{
+		sync_file_range(wb->fd, wb->flushed, wb->written - wb->flushed, SYNC_FILE_RANGE_WRITE);
+		if (wb->flushed >= WRITE_BEHIND_CHUNK)
+		{
+			sync_file_range(wb->fd, wb->flushed - WRITE_BEHIND_CHUNK, WRITE_BEHIND_CHUNK,
+				SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER);
+		}
+		wb->flushed = wb->written;
+	}
+
+	if (wb->sync_every > 0 && wb->written - wb->synced >= wb->sync_every)
+	{
+		if (fdatasync(wb->fd) == -1)
+		{
+			return -1;
+		}
+		wb->synced = wb->written;
+	}
+
+	atomic_fetch_add_explicit(&wb->disk_ns, metrics_now_ns() - start, memory_order_relaxed);
+	return 0;
+}
+
+static void* writer_main(void* arg)
+{
+	write_behind* wb = (write_behind*) arg;
+	uint32_t tail = atomic_load_explicit(&wb->tail, memory_order_relaxed);
+	while (1)
+	{
+		uint32_t head = atomic_load_explicit(&wb->head, memory_order_acquire);
+		if (tail == head)
+		{
+			if (atomic_load_explicit(&wb->closing, memory_order_acquire)
+				&& atomic_load_explicit(&wb->head, memory_order_acquire) == tail)
+			{
+				break;
+			}
+			idle();
+			continue;
+		}
+
+		write_slot* slot = &wb->slots[tail % WRITE_RING_SIZE];
+		// after an error the blocks are only recycled, so the receiver never blocks
+		if (atomic_load_explicit(&wb->error, memory_order_relaxed) == 0 && write_block(wb, slot->block, slot->len) == -1)
+		{
+			atomic_store(&wb->error, errno != 0 ? errno : EIO);
+		}
+		pool_put(wb->pool, slot->block);
+		atomic_store_explicit(&wb->tail, ++tail, memory_order_release);
+	}
+	return NULL;
+}
+
+write_behind* wb_open(int fd, uint64_t filesize, buffer_pool* pool, bool threaded, uint64_t sync_every)
+{
+	// reserving the blocks now means no surprise ENOSPC and less fragmentation later
+	if (filesize > 0 && fallocate(fd, 0, 0, filesize) == -1 && errno != EOPNOTSUPP && errno != ENOSYS)
+	{
+		return NULL;
+	}
+
+	write_behind* wb = (write_behind*) calloc(1, sizeof(write_behind));
+	if (wb == NULL)
+	{
+		errno = ENOMEM;
+		return NULL;
+	}
+	wb->fd = fd;
+	wb->pool = pool;
+	wb->threaded = threaded;
+	wb->sync_every = sync_every;
+	wb->start_ns = metrics_now_ns();
+
+	if (threaded)
+	{
+		int err = pthread_create(&wb->writer, NULL, writer_main, wb);
+		if (err != 0)
+		{
+			free(wb);
+			errno = err;
+			return NULL;
+		}
+	}
+	return wb;
+}
+
+/*
+ *	Hands the current block to the writer, or writes it now without a writer thread.
+ *	Returns 0 on success, -1 on error.
+ */
+static int submit_block(write_behind* wb)
+{
+	if (wb->block == NULL)
+	{
+		return 0;
+	}
+	if (wb->fill == 0)
+	{
+		pool_put(wb->pool, wb->block);
+		wb->block = NULL;
+		return 0;
+	}
+
+	if (!wb->threaded)
+	{
+		int ret = write_block(wb, wb->block, wb->fill);
+		pool_put(wb->pool, wb->block);
+		wb->block = NULL;
+		wb->fill = 0;
+		return ret;
+	}
+
+	uint32_t head = atomic_load_explicit(&wb->head, memory_order_relaxed);
+	if (head - atomic_load_explicit(&wb->tail, memory_order_acquire) >= WRITE_RING_SIZE)
+	{
+		// the disk is behind, this is the only place the network waits for it
+		uint64_t stall_start = metrics_now_ns();
+		while (head - atomic_load_explicit(&wb->tail, memory_order_acquire) >= WRITE_RING_SIZE)
+		{
+			idle();
+		}
+		wb->stall_ns += metrics_now_ns() - stall_start;
+	}
+
+	wb->slots[head % WRITE_RING_SIZE].block = wb->block;
+	wb->slots[head % WRITE_RING_SIZE].len = wb->fill;
+	atomic_store_explicit(&wb->head, head + 1, memory_order_release);
+	wb->block = NULL;
+	wb->fill = 0;
+	return 0;
+}
+
+char* wb_reserve(write_behind* wb, size_t len)
+{
+	if (atomic_load_explicit(&wb->error, memory_order_relaxed) != 0 || len > pool_buffer_size(wb->pool))
+	{
+		errno = atomic_load(&wb->error) != 0 ? atomic_load(&wb->error) : EINVAL;
+		return NULL;
+	}
+
+	if (wb->block != NULL && pool_buffer_size(wb->pool) - wb->fill < len)
+	{
+		if (submit_block(wb) == -1)
+		{
+			atomic_store(&wb->error, errno != 0 ? errno : EIO);
+			return NULL;
+		}
+	}
+	if (wb->block == NULL)
+	{
+		wb->block = (char*) pool_get(wb->pool);
+		if (wb->block == NULL)
+		{
+			errno = ENOMEM;
+			return NULL;
+		}
+	}
+	return wb->block + wb->fill;
+}
+
+void wb_commit(write_behind* wb, size_t len)
+{
+	wb->fill += len;
+}
+
+int wb_close(write_behind* wb, write_stats* stats)
+{
+	int ret_val = 0;
+	if (atomic_load(&wb->error) == 0 && submit_block(wb) == -1)
+	{
+		atomic_store(&wb->error, errno != 0 ? errno : EIO);
+	}
+	if (wb->block != NULL)
+	{
+		pool_put(wb->pool, wb->block);
+	}
+
+	uint64_t drain_start = metrics_now_ns();
+	if (wb->threaded)
+	{
+		atomic_store_explicit(&wb->closing, true, memory_order_release);
+		pthread_join(wb->writer, NULL);
+	}
+	uint64_t end = metrics_now_ns();
+
+	int error = atomic_load(&wb->error);
+	if (error != 0)
+	{
+		errno = error;
+		ret_val = -1;
+	}
+
+	if (stats != NULL)
+	{
+		stats->bytes = wb->written;
+		stats->wall_ns = end - wb->start_ns;
+		stats->disk_ns = atomic_load(&wb->disk_ns);
+		// without a writer every write is on the receiving path
+		stats->stall_ns = wb->threaded ? wb->stall_ns : stats->disk_ns;
+		stats->drain_ns = end - drain_start;
+	}
+	free(wb);
+	return ret_val;
+}
+
+double wb_overlap(const write_stats* stats)
+{
+	if (stats->disk_ns == 0)
+	{
+		return 0;
+	}
+	double hidden = (double) stats->disk_ns - stats->stall_ns - stats->drain_ns;
+	return hidden > 0 ? hidden / stats->disk_ns : 0;
+}
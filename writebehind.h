@@ -0,0 +1,68 @@
+/**
+ *  write-behind pipeline for received files
+ *
+ *  the receiving thread reads verified data straight into large blocks taken
+ *  from a buffer pool and hands every full block to a writer thread through a
+ *  lock-free single producer, single consumer ring. the writer does the disk
+ *  writes and keeps writeback going with sync_file_range(), so the dirty page
+ *  count stays bounded and a slow disk only stalls the network reads once the
+ *  ring is full, instead of on every block.
+ *
+ *  the output is preallocated to its final size up front, which also reports
+ *  a full disk before any byte is transferred.
+ */
+
+#ifndef WRITEBEHIND_H
+#define WRITEBEHIND_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include "pool.h"
+
+#define WRITE_RING_SIZE 8
+#define WRITE_BEHIND_CHUNK (8 * 1024 * 1024)
+
+typedef struct write_behind write_behind;
+
+typedef struct
+{
+	uint64_t bytes;
+	uint64_t wall_ns;  // < from open to close
+	uint64_t disk_ns;  // < spent in write() and sync_file_range()
+	uint64_t stall_ns; // < the receiver waited for room in the ring
+	uint64_t drain_ns; // < the receiver waited for the last writes at close
+} write_stats;
+
+/*
+ *	Starts a pipeline writing filesize bytes to fd, with blocks from pool.
+ *	threaded == false writes every block on the calling thread instead (no overlap).
+ *	sync_every > 0 also fdatasync()s the file every sync_every bytes.
+ *	Returns the pipeline, or NULL on error (errno is set, ENOSPC if the file does not fit).
+ */
+write_behind* wb_open(int fd, uint64_t filesize, buffer_pool* pool, bool threaded, uint64_t sync_every);
+
+/*
+ *	Returns room for len more bytes at the end of the current block,
+ *		moving on to a new block if needed, or NULL on error (including a failed write).
+ *	Only the bytes passed to wb_commit are written, the rest is scratch space.
+ */
+char* wb_reserve(write_behind* wb, size_t len);
+
+/*
+ *	Appends the first len bytes of the last reserved room to the file.
+ */
+void wb_commit(write_behind* wb, size_t len);
+
+/*
+ *	Writes what is left, stops the writer and frees the pipeline. stats may be NULL.
+ *	Returns 0 if every byte was written, -1 on error.
+ */
+int wb_close(write_behind* wb, write_stats* stats);
+
+/*
+ *	Returns the share of the disk time that overlapped with receiving, in [0, 1].
+ */
+double wb_overlap(const write_stats* stats);
+
+#endif